@@ -15,6 +15,14 @@ static inline uint64_t getcr3(void) { uint64_t val; asm volatile ("mov %%cr3, %%
 //Invalidates the given page by virtual address
 static inline void invlpg(uint64_t vaddr) { asm volatile ("invlpg (%%rax)": : "a" (vaddr)); }
 
+//Reads a model-specific register
+static inline uint64_t rdmsr(uint32_t msr)
+{
+	uint32_t lo, hi;
+	asm volatile ("rdmsr": "=a"(lo), "=d"(hi) : "c"(msr));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 //In/out instruction wrappers
 static inline void outb(uint16_t port, uint8_t byte)
 {
@@ -195,8 +195,10 @@ cpuinit_entry_all:
 	mov CR3, EAX
 	
 	;Enable paging, kicking us into long-mode.
+	;Also make the kernel respect read-only pages, so it can't write through copy-on-write mappings.
 	mov EAX, CR0
 	or EAX, 1<<31 ;PG
+	or EAX, 1<<16 ;WP
 	mov CR0, EAX
 	
 	;Our kernel is now accessible at its proper virtual addresses.
@@ -404,6 +406,10 @@ cpuinit_entry_all:
 	nop
 	je .waitcore0
 	
+	;Set up this core's timer, for preempting threads
+	extern lapic_init
+	call lapic_init
+	
 	extern entry_smp
 	call entry_smp
 	
@@ -647,6 +653,49 @@ cpuinit_isr_gp:
 
 ;ISR - page fault
 cpuinit_isr_pf:
+	;Page faults push an error code before the usual interrupt frame.
+	test qword [RSP + 16], 3 ;CS of interrupted code
+	jnz .user
+	
+		;Kernel faulted - probably touching a reserved or copy-on-write page on the user's behalf.
+		irq_save
+		mov RDI, CR2 ;Faulting address
+		mov RSI, [RSP + (9 * 8)] ;Error code, past the registers we saved
+		shr RSI, 1 ;Write access is bit 1
+		and RSI, 1
+		extern entry_kfault
+		call entry_kfault ;Panics if the access can't be retried
+		irq_restore
+		add RSP, 8 ;Discard error code
+		iretq
+	
+	.user:
+	
+	;User faulted. Copy the interrupt frame below the error code, so it looks like the syscall path.
+	push qword [RSP + 40] ;SS
+	push qword [RSP + 40] ;RSP
+	push qword [RSP + 40] ;RFLAGS
+	push qword [RSP + 40] ;CS
+	push qword [RSP + 40] ;RIP
+	
+	;Put the rest of the user's context, at entry, on the stack
+	call m_drop_putstack
+	mov RDX, [RSP + 40] ;Error code, now after the copied frame
+	shr RDX, 1 ;Write access is bit 1
+	and RDX, 1
+	sub RSP, 16
+	sub RSP, [RSP]
+	
+	;Swap back to kernel GS
+	swapgs
+	
+	;Let the kernel fix up the page or kill the thread
+	mov RDI, RSP ;Saved context
+	mov RSI, CR2 ;Faulting address
+	extern entry_fault
+	call entry_fault
+	
+	;Should never return here.
 	.spin:
 	jmp .spin
 
@@ -779,6 +828,53 @@ cpuinit_isr_irq15:
 	.spin:
 	jmp .spin
 
+;ISR - local APIC timer, for preempting user threads.
+cpuinit_isr_timer:
+	;If we interrupted the kernel, we were just waiting in the scheduler. Return to it.
+	test qword [RSP + 8], 3 ;CS of interrupted code
+	jnz .user
+		push RAX
+		mov RAX, 0xFFFFFF0000000000 + 0xFEE00000 + 0xB0
+		mov [RAX], dword 0
+		pop RAX
+		iretq
+	.user:
+	
+	;Interrupted a user thread. We're on the kernel stack from our task-state segment,
+	;with RIP, CS, RFLAGS, RSP, and SS already pushed - the same way the syscall path sets them up.
+	
+	;Put the rest of the user's context, at entry, on the stack
+	call m_drop_putstack
+	sub RSP, 16
+	sub RSP, [RSP]
+	
+	;Swap back to kernel GS
+	swapgs
+	
+	;APIC EOI - the thread might not come back here
+	mov RAX, 0xFFFFFF0000000000 + 0xFEE00000 + 0xB0
+	mov [RAX], dword 0
+	
+	;Let the kernel pick what to run next, with the saved context
+	mov RDI, RSP
+	extern entry_preempt
+	call entry_preempt
+	
+	;Should never return here.
+	.spin:
+	jmp .spin
+
+;ISR - another core changed a userspace that we might have active, and wants us to flush translations.
+cpuinit_isr_flush:
+	;Doesn't touch GS, so it's the same whether we interrupted the user or the kernel.
+	irq_save
+	extern m_uspc_flushpoll
+	call m_uspc_flushpoll
+	mov RAX, 0xFFFFFF0000000000 + 0xFEE00000 + 0xB0
+	mov [RAX], dword 0
+	irq_restore
+	iretq
+
 ;ISR - does nothing but returns, to take the CPU out of halt.
 cpuinit_isr_woke:
 	;APIC EOI
@@ -856,8 +952,14 @@ cpuinit_isrptrs:
 	;Next 64 - unused - 0x40...0x7F
 	times 64 dq cpuinit_isr_bad
 	
-	;Next 126 - unused - 0x80...0xFD
-	times 126 dq cpuinit_isr_bad
+	;Next 124 - unused - 0x80...0xFB
+	times 124 dq cpuinit_isr_bad
+	
+	;Userspace translation flush - see m_uspc_flush (0xFC)
+	dq cpuinit_isr_flush
+	
+	;Local APIC timer - preempts user threads (0xFD)
+	dq cpuinit_isr_timer
 	
 	;Wakeup - does nothing but brings the CPU out of halt (0xFE)
 	dq cpuinit_isr_woke
@@ -870,6 +972,7 @@ align 8
 global cpuinit_gdt
 global cpuinit_gdt.r3code64
 global cpuinit_gdt.r3data64
+global cpuinit_gdt.ktss_array
 cpuinit_gdt:
 	;Null descriptor (CPU requires this to be in index 0)
 	dq 0
@@ -962,6 +1065,7 @@ cpuinit_pt:
 	
 ;Number of cores that have started up. Used with an atomic to figure out "which core am I".
 alignb 8
+global cpuinit_ncores ;Referenced by m_cpu_count
 cpuinit_ncores:
 	resb 8
 
@@ -0,0 +1,98 @@
+//lapic.c
+//Local APIC timer on AMD64
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "lapic.h"
+#include "amd64.h"
+#include "pspace.h"
+#include "m_intr.h"
+#include "m_time.h"
+#include "m_cpu.h"
+
+//Local APIC registers, as offsets from its base address
+#define LAPIC_REG_EOI (0x0B0)
+#define LAPIC_REG_ICR_LOW (0x300)
+#define LAPIC_REG_LVT_TIMER (0x320)
+#define LAPIC_REG_TIMER_INITIAL (0x380)
+#define LAPIC_REG_TIMER_CURRENT (0x390)
+#define LAPIC_REG_TIMER_DIVIDE (0x3E0)
+
+//Interrupt vector used for the timer - see cpuinit_isrptrs
+#define LAPIC_TIMER_VECTOR (0xFD)
+
+//How long we spend measuring the timer against the TSC, in TSC ticks
+#define LAPIC_CAL_TSC (1l << 24)
+
+//Rate of the local APIC timer relative to the TSC - timer ticks per 2^16 TSC ticks.
+//Measured by each core during setup.
+static uint64_t lapic_timer_rate[256];
+
+//Returns the physical base address of the local APIC.
+static uint64_t lapic_base(void)
+{
+	return rdmsr(0x1B) & 0xFFFFFFFFFF000ul;
+}
+
+//Returns the index of the calling CPU in lapic_timer_rate.
+static int lapic_cpu(void)
+{
+	return m_cpu_num() % 256;
+}
+
+void lapic_init(void)
+{
+	uint64_t base = lapic_base();
+	
+	//Divide the bus clock by 16, one-shot mode, masked while we measure it
+	pspace_write32(base + LAPIC_REG_TIMER_DIVIDE, 0x3);
+	pspace_write32(base + LAPIC_REG_LVT_TIMER, (1u << 16) | LAPIC_TIMER_VECTOR);
+	
+	//Count down from the top while the TSC advances by a known amount
+	pspace_write32(base + LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFFu);
+	int64_t tsc_start = m_time_tsc();
+	while(m_time_tsc() - tsc_start < LAPIC_CAL_TSC)
+	{
+		asm volatile ("pause");
+	}
+	uint32_t remaining = pspace_read32(base + LAPIC_REG_TIMER_CURRENT);
+	pspace_write32(base + LAPIC_REG_TIMER_INITIAL, 0);
+	
+	uint64_t elapsed = 0xFFFFFFFFu - remaining;
+	lapic_timer_rate[lapic_cpu()] = (elapsed << 16) / LAPIC_CAL_TSC;
+	if(lapic_timer_rate[lapic_cpu()] == 0)
+		lapic_timer_rate[lapic_cpu()] = 1;
+	
+	//Unmask the timer interrupt. It's not counting until m_intr_timer is called.
+	pspace_write32(base + LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+}
+
+void m_intr_timer(int64_t tsc_deadline)
+{
+	uint64_t base = lapic_base();
+	
+	if(tsc_deadline == 0)
+	{
+		//Writing 0 to the initial count stops the timer.
+		pspace_write32(base + LAPIC_REG_TIMER_INITIAL, 0);
+		return;
+	}
+	
+	int64_t tsc_left = tsc_deadline - m_time_tsc();
+	if(tsc_left < 1)
+		tsc_left = 1;
+	if(tsc_left > LAPIC_CAL_TSC << 16)
+		tsc_left = LAPIC_CAL_TSC << 16;
+	
+	//Convert to timer ticks, rounding up so we don't fire before the deadline.
+	uint64_t count = (((uint64_t)tsc_left * lapic_timer_rate[lapic_cpu()]) >> 16) + 1;
+	if(count > 0xFFFFFFFFu)
+		count = 0xFFFFFFFFu;
+	
+	pspace_write32(base + LAPIC_REG_TIMER_INITIAL, count);
+}
+
+void lapic_ipi_others(int vector)
+{
+	//Fixed interrupt, positive edge-trigger, to all-except-self
+	pspace_write32(lapic_base() + LAPIC_REG_ICR_LOW, 0xC4000 | (vector & 0xFF));
+}
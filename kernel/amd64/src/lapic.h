@@ -0,0 +1,13 @@
+//lapic.h
+//Local APIC timer on AMD64
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef LAPIC_H
+#define LAPIC_H
+
+//Sets up the local APIC timer on the calling core. Called from cpuinit.
+void lapic_init(void);
+
+//Sends the given interrupt vector to all cores except the calling one.
+void lapic_ipi_others(int vector);
+
+#endif //LAPIC_H
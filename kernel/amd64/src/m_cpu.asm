@@ -0,0 +1,26 @@
+;m_cpu.asm
+;CPU core identification on AMD64
+;Bryan E. Topp <betopp@betopp.com> 2021
+
+section .text
+bits 64
+
+extern cpuinit_gdt
+extern cpuinit_gdt.ktss_array
+extern cpuinit_ncores
+
+global m_cpu_num ;int m_cpu_num(void);
+m_cpu_num:
+	;Each core loads its own TSS descriptor in the task register during cpuinit.
+	;So the task register tells us which core we are.
+	mov RAX, 0 ;STR doesn't clear high bits, I think
+	str AX ;Get our task register - index of task-state-segment descriptor
+	sub RAX, cpuinit_gdt.ktss_array - cpuinit_gdt ;Turn into offset from first TSS descriptor selector
+	shr RAX, 4 ;Each TSS descriptor is 16 bytes
+	ret
+
+global m_cpu_count ;int m_cpu_count(void);
+m_cpu_count:
+	;Each core increments this when it starts up.
+	mov RAX, [cpuinit_ncores]
+	ret
@@ -4,22 +4,240 @@
 
 #include "m_frame.h"
 #include "m_spl.h"
+#include "m_cpu.h"
 #include "m_panic.h"
 #include "pspace.h"
 
-//Spinlock protecting frame allocator
+//Spinlock protecting the global free-lists
 static m_spl_t m_frame_spl;
 
-//Head of free-list
-static uintptr_t m_frame_head;
+//Free frames are kept as buddy blocks. A block of order N is 2^N frames, aligned to its size.
+//The largest blocks are big enough to map as 2MB pages.
+#define M_FRAME_ORDER_MAX 10
 
-//Number of entries on free-list
+//Heads of the free-lists of blocks, per order. Blocks are linked through their first frame - next, then previous.
+static uintptr_t m_frame_heads[M_FRAME_ORDER_MAX];
+
+//Number of frames in free blocks
 static size_t m_frame_count;
 
-//Ranges of memory given by bootloader, not yet put on free-list.
+//Free frames cached for one CPU, moved to and from the global free-list in batches.
+#define M_FRAME_CACHE_MAX 64
+#define M_FRAME_CACHE_BATCH (M_FRAME_CACHE_MAX / 2)
+typedef struct m_frame_cache_s
+{
+	//Spinlock protecting the cache. Only contended if CPUs share caches.
+	m_spl_t spl;
+	
+	//Frames in the cache
+	size_t count;
+	uintptr_t frames[M_FRAME_CACHE_MAX];
+	
+} m_frame_cache_t;
+
+//Caches per CPU. CPUs beyond this number share them.
+#define M_FRAME_CPU_MAX 64
+static m_frame_cache_t m_frame_caches[M_FRAME_CPU_MAX];
+
+//Spinlocks protecting reference counts, each covering an interleaved subset of frames.
+#define M_FRAME_REFS_SPL_MAX 64
+static m_spl_t m_frame_refs_spl[M_FRAME_REFS_SPL_MAX];
+
+//Most ranges of usable memory we accept from the bootloader
 #define M_FRAME_RANGE_MAX 16
-static size_t m_frame_range_sizes[M_FRAME_RANGE_MAX];
-static uintptr_t m_frame_range_addrs[M_FRAME_RANGE_MAX];
+
+//Table of reference counts, one 32-bit entry per frame of physical space, carved out of the bootloader's ranges.
+//Each entry counts references beyond the first - so a frame with one owner has a 0 here.
+static uintptr_t m_frame_refs_table;
+
+//Number of frames covered by the reference-count table
+static size_t m_frame_refs_count;
+
+//Flag in the reference-count entry of a frame that heads a free block. The block's order is in the low bits.
+#define M_FRAME_REFS_FREE 0x80000000u
+
+//Returns the physical address of the reference count for the given frame.
+static uintptr_t m_frame_refs_entry(uintptr_t frame)
+{
+	if(frame / m_frame_size() >= m_frame_refs_count)
+		m_panic("m_frame_refs bad frame");
+	
+	return m_frame_refs_table + (4 * (frame / m_frame_size()));
+}
+
+//Returns the spinlock protecting the reference count of the given frame.
+static m_spl_t *m_frame_refs_lock(uintptr_t frame)
+{
+	return &(m_frame_refs_spl[(frame / m_frame_size()) % M_FRAME_REFS_SPL_MAX]);
+}
+
+//Returns the frame cache for the current CPU, locked.
+static m_frame_cache_t *m_frame_cache_lock(void)
+{
+	m_frame_cache_t *cache = &(m_frame_caches[(unsigned int)m_cpu_num() % M_FRAME_CPU_MAX]);
+	m_spl_acq(&(cache->spl));
+	return cache;
+}
+
+//Takes a frame from some other CPU's cache, when we're otherwise out of memory. Returns 0 if none are found.
+static uintptr_t m_frame_steal(m_frame_cache_t *ours)
+{
+	for(int cc = 0; cc < M_FRAME_CPU_MAX; cc++)
+	{
+		//Don't wait on other caches - we already hold our own, and they might be waiting on the global lock.
+		m_frame_cache_t *other = &(m_frame_caches[cc]);
+		if(other == ours || !m_spl_try(&(other->spl)))
+			continue;
+		
+		uintptr_t retval = 0;
+		if(other->count > 0)
+		{
+			other->count--;
+			retval = other->frames[other->count];
+		}
+		
+		m_spl_rel(&(other->spl));
+		if(retval != 0)
+			return retval;
+	}
+	
+	return 0;
+}
+
+//Returns the order of the free block headed by the given frame, or -1 if it doesn't head one.
+static int m_frame_block_order(uintptr_t frame)
+{
+	if(frame / m_frame_size() >= m_frame_refs_count)
+		return -1;
+	
+	uint32_t entry = pspace_read32(m_frame_refs_entry(frame));
+	if(!(entry & M_FRAME_REFS_FREE))
+		return -1;
+	
+	return entry & ~M_FRAME_REFS_FREE;
+}
+
+//Puts a free block on the list for its order. Call with the global lock held.
+static void m_frame_block_push(uintptr_t block, int order)
+{
+	uintptr_t head = m_frame_heads[order];
+	pspace_write(block + 0, head);
+	pspace_write(block + 8, 0);
+	if(head != 0)
+		pspace_write(head + 8, block);
+	
+	m_frame_heads[order] = block;
+	m_frame_count += (size_t)1 << order;
+	pspace_write32(m_frame_refs_entry(block), M_FRAME_REFS_FREE | order);
+}
+
+//Takes a free block off the list for its order. Call with the global lock held.
+static void m_frame_block_unlink(uintptr_t block, int order)
+{
+	uintptr_t next = pspace_read(block + 0);
+	uintptr_t prev = pspace_read(block + 8);
+	if(prev != 0)
+		pspace_write(prev + 0, next);
+	else
+		m_frame_heads[order] = next;
+	
+	if(next != 0)
+		pspace_write(next + 8, prev);
+	
+	if(m_frame_count < ((size_t)1 << order))
+		m_panic("m_frame_alloc corrupt freelist");
+	
+	m_frame_count -= (size_t)1 << order;
+	pspace_write32(m_frame_refs_entry(block), 0);
+}
+
+//Takes a free block of the given order, splitting a larger one if needed. Call with the global lock held.
+//Returns 0 if there's no block big enough.
+static uintptr_t m_frame_block_take(int order)
+{
+	int from = order;
+	while(from < M_FRAME_ORDER_MAX && m_frame_heads[from] == 0)
+	{
+		from++;
+	}
+	
+	if(from >= M_FRAME_ORDER_MAX)
+		return 0;
+	
+	uintptr_t block = m_frame_heads[from];
+	m_frame_block_unlink(block, from);
+	
+	//Give back upper halves until the block is the size we want
+	while(from > order)
+	{
+		from--;
+		m_frame_block_push(block + (m_frame_size() << from), from);
+	}
+	
+	return block;
+}
+
+//Frees a block of the given order, merging it with its buddy for as long as the buddy is free too.
+//Call with the global lock held.
+static void m_frame_block_give(uintptr_t block, int order)
+{
+	while(order < M_FRAME_ORDER_MAX - 1)
+	{
+		uintptr_t buddy = block ^ (m_frame_size() << order);
+		if(m_frame_block_order(buddy) != order)
+			break;
+		
+		m_frame_block_unlink(buddy, order);
+		if(buddy < block)
+			block = buddy;
+		
+		order++;
+	}
+	
+	m_frame_block_push(block, order);
+}
+
+//Takes up to the given number of frames from the global free-lists.
+//Returns how many were taken. Call with the global lock held.
+static size_t m_frame_take(uintptr_t *frames, size_t count)
+{
+	size_t taken = 0;
+	while(taken < count)
+	{
+		uintptr_t frame = m_frame_block_take(0);
+		if(frame == 0)
+			break;
+		
+		frames[taken] = frame;
+		taken++;
+	}
+	
+	return taken;
+}
+
+//Puts the given frames back on the global free-lists. Call with the global lock held.
+static void m_frame_give(const uintptr_t *frames, size_t count)
+{
+	for(size_t ff = 0; ff < count; ff++)
+	{
+		m_frame_block_give(frames[ff], 0);
+	}
+}
+
+//Puts all frames held in per-CPU caches back on the global free-lists.
+static void m_frame_drain(void)
+{
+	for(int cc = 0; cc < M_FRAME_CPU_MAX; cc++)
+	{
+		m_frame_cache_t *cache = &(m_frame_caches[cc]);
+		m_spl_acq(&(cache->spl));
+		m_spl_acq(&m_frame_spl);
+		m_frame_give(cache->frames, cache->count);
+		cache->count = 0;
+		m_spl_rel(&m_frame_spl);
+		m_spl_rel(&(cache->spl));
+	}
+}
 
 void m_frame_init(void)
 {
@@ -29,6 +247,10 @@ void m_frame_init(void)
 	
 	uint64_t pagesize = m_frame_size();
 	
+	//Ranges of memory given by bootloader
+	size_t range_sizes[M_FRAME_RANGE_MAX] = {0};
+	uintptr_t range_addrs[M_FRAME_RANGE_MAX] = {0};
+	
 	//Run through memory map looking for usable frames
 	int ranges_used = 0;
 	uint8_t *entry = multiboot_mmap_storage;
@@ -63,14 +285,69 @@ void m_frame_init(void)
 				if(ranges_used >= M_FRAME_RANGE_MAX)
 					m_panic("m_frame_init mmap crazy");
 				
-				m_frame_range_addrs[ranges_used] = start_idx * pagesize;
-				m_frame_range_sizes[ranges_used] = (end_idx - start_idx) * pagesize;
+				range_addrs[ranges_used] = start_idx * pagesize;
+				range_sizes[ranges_used] = (end_idx - start_idx) * pagesize;
 				ranges_used++;
 			}
 		}	
 		
 		entry += *(uint32_t*)(entry) + 4;
 	}
+	
+	//Make room for reference counts covering every frame we might hand out.
+	uint64_t top = 0;
+	for(int rr = 0; rr < ranges_used; rr++)
+	{
+		if(range_addrs[rr] + range_sizes[rr] > top)
+			top = range_addrs[rr] + range_sizes[rr];
+	}
+	
+	m_frame_refs_count = top / pagesize;
+	uint64_t refs_size = m_frame_refs_count * 4;
+	if(refs_size % pagesize)
+		refs_size += pagesize - (refs_size % pagesize);
+	
+	for(int rr = 0; rr < ranges_used; rr++)
+	{
+		if(range_sizes[rr] >= refs_size)
+		{
+			//Take the table from the beginning of this range
+			m_frame_refs_table = range_addrs[rr];
+			range_addrs[rr] += refs_size;
+			range_sizes[rr] -= refs_size;
+			break;
+		}
+	}
+	
+	if(m_frame_refs_table == 0)
+		m_panic("m_frame_init no room for refs");
+	
+	for(uint64_t cc = 0; cc < refs_size; cc += pagesize)
+	{
+		pspace_clrframe(m_frame_refs_table + cc);
+	}
+	
+	//Put the remaining memory on the free-lists, in the largest aligned blocks that fit.
+	for(int rr = 0; rr < ranges_used; rr++)
+	{
+		uintptr_t addr = range_addrs[rr];
+		uintptr_t end = addr + range_sizes[rr];
+		while(addr < end)
+		{
+			int order = 0;
+			while(order + 1 < M_FRAME_ORDER_MAX)
+			{
+				uintptr_t bigger = pagesize << (order + 1);
+				if((addr % bigger) != 0 || addr + bigger > end)
+					break;
+				
+				order++;
+			}
+			
+			m_frame_block_give(addr, order);
+			addr += pagesize << order;
+		}
+	}
 }
 
 size_t m_frame_size(void)
@@ -79,61 +356,169 @@ size_t m_frame_size(void)
 	return 4096;
 }
 
+size_t m_frame_large_size(void)
+{
+	//2MB pages, mapped by page-directory entries
+	return 4096 * 512;
+}
+
 uintptr_t m_frame_alloc(void)
 {
-	m_spl_acq(&m_frame_spl);
+	m_frame_cache_t *cache = m_frame_cache_lock();
 	
-	//Head of list, and count of items, should agree on whether we're empty.
-	if( (m_frame_head == 0) ^ (m_frame_count == 0) )
-		m_panic("m_frame_alloc corrupt freelist");
+	if(cache->count == 0)
+	{
+		//Cache is empty - refill half of it from the global free-list, so a following free doesn't send them right back.
+		m_spl_acq(&m_frame_spl);
+		cache->count = m_frame_take(cache->frames, M_FRAME_CACHE_BATCH);
+		m_spl_rel(&m_frame_spl);
+		
+		if(cache->count == 0)
+		{
+			//No frames on the free-lists.
+			//We're out of memory, unless other CPUs are holding on to some.
+			uintptr_t stolen = m_frame_steal(cache);
+			m_spl_rel(&(cache->spl));
+			return stolen;
+		}
+	}
+	
+	cache->count--;
+	uintptr_t retval = cache->frames[cache->count];
+	
+	m_spl_rel(&(cache->spl));
+	return retval;
+}
+
+bool m_frame_alloc_n(uintptr_t *frames, size_t count)
+{
+	m_frame_cache_t *cache = m_frame_cache_lock();
+	
+	//Take what we can from this CPU's cache
+	size_t got = 0;
+	while(got < count && cache->count > 0)
+	{
+		cache->count--;
+		frames[got] = cache->frames[cache->count];
+		got++;
+	}
 	
-	if(m_frame_head == 0)
+	//Take the rest from the global free-list all at once
+	if(got < count)
 	{
-		//No frames on free-list. See if we have any frames from the bootloader we have never used.
-		for(int rr = 0; rr < M_FRAME_RANGE_MAX; rr++)
+		m_spl_acq(&m_frame_spl);
+		got += m_frame_take(frames + got, count - got);
+		
+		if(got < count)
 		{
-			if(m_frame_range_sizes[rr] > 0)
-			{
-				//Hack off the last frame of the range and return it
-				m_frame_range_sizes[rr] -= m_frame_size();
-				uintptr_t retval = m_frame_range_addrs[rr] + m_frame_range_sizes[rr];
-				m_spl_rel(&m_frame_spl);
-				return retval;
-			}
+			//Not enough memory for all of them - put back what we got.
+			m_frame_give(frames, got);
+			m_spl_rel(&m_frame_spl);
+			m_spl_rel(&(cache->spl));
+			return false;
 		}
 		
-		//No frames on the free-list and no ranges from the bootloader yet unused.
-		//We're out of memory.
 		m_spl_rel(&m_frame_spl);
-		return 0;
 	}
 	
-	//We'll return the old head of the free-list.
-	uintptr_t retval = m_frame_head;
+	m_spl_rel(&(cache->spl));
+	return true;
+}
+
+uintptr_t m_frame_alloc_contig(size_t count)
+{
+	//Find the smallest block that holds the range
+	int order = 0;
+	while(((size_t)1 << order) < count)
+	{
+		order++;
+	}
 	
-	//The page to which the old head refers, is now the head.
-	m_frame_head = pspace_read(m_frame_head);
+	if(count == 0 || order >= M_FRAME_ORDER_MAX)
+		return 0;
 	
-	m_frame_count--;
+	m_spl_acq(&m_frame_spl);
+	uintptr_t block = m_frame_block_take(order);
+	if(block == 0)
+	{
+		//Frames held in per-CPU caches might be keeping blocks from merging. Put them back and try again.
+		m_spl_rel(&m_frame_spl);
+		m_frame_drain();
+		m_spl_acq(&m_frame_spl);
+		block = m_frame_block_take(order);
+	}
 	
+	if(block != 0)
+	{
+		//Give back whatever is past what was asked for
+		for(size_t ff = count; ff < ((size_t)1 << order); ff++)
+		{
+			m_frame_block_give(block + (ff * m_frame_size()), 0);
+		}
+	}
 	m_spl_rel(&m_frame_spl);
-	return retval;
+	
+	return block;
 }
 
 void m_frame_free(uintptr_t frame)
 {
-	m_spl_acq(&m_frame_spl);
+	//If the frame has other references, just drop ours
+	m_spl_t *refs_spl = m_frame_refs_lock(frame);
+	m_spl_acq(refs_spl);
+	uint32_t refs = pspace_read32(m_frame_refs_entry(frame));
+	if(refs & M_FRAME_REFS_FREE)
+		m_panic("m_frame_free already free");
 	
-	//Write the existing head into the frame being freed
-	pspace_write(frame, m_frame_head);
+	if(refs > 0)
+	{
+		pspace_write32(m_frame_refs_entry(frame), refs - 1);
+		m_spl_rel(refs_spl);
+		return;
+	}
+	m_spl_rel(refs_spl);
 	
-	//The frame being freed is now the head
-	m_frame_head = frame;
+	m_frame_cache_t *cache = m_frame_cache_lock();
 	
-	//Keep track
-	m_frame_count++;
+	if(cache->count == M_FRAME_CACHE_MAX)
+	{
+		//Cache is full - give half of it back to the global free-list.
+		m_spl_acq(&m_frame_spl);
+		cache->count -= M_FRAME_CACHE_BATCH;
+		m_frame_give(cache->frames + cache->count, M_FRAME_CACHE_BATCH);
+		m_spl_rel(&m_frame_spl);
+	}
 	
-	m_spl_rel(&m_frame_spl);
+	cache->frames[cache->count] = frame;
+	cache->count++;
+	
+	m_spl_rel(&(cache->spl));
+}
+
+void m_frame_ref(uintptr_t frame)
+{
+	m_spl_t *refs_spl = m_frame_refs_lock(frame);
+	m_spl_acq(refs_spl);
+	
+	//Counts have to stay below the free flag, or a busy frame would look like a free block.
+	uint32_t refs = pspace_read32(m_frame_refs_entry(frame));
+	if(refs & M_FRAME_REFS_FREE)
+		m_panic("m_frame_ref on free frame");
+	if(refs + 1 >= M_FRAME_REFS_FREE)
+		m_panic("m_frame_ref overflow");
+	
+	pspace_write32(m_frame_refs_entry(frame), refs + 1);
+	
+	m_spl_rel(refs_spl);
+}
+
+size_t m_frame_refs(uintptr_t frame)
+{
+	m_spl_t *refs_spl = m_frame_refs_lock(frame);
+	m_spl_acq(refs_spl);
+	size_t retval = pspace_read32(m_frame_refs_entry(frame)) + 1;
+	m_spl_rel(refs_spl);
+	return retval;
 }
 
 void m_frame_copy(uintptr_t newframe, uintptr_t oldframe)
@@ -143,3 +528,8 @@ void m_frame_copy(uintptr_t newframe, uintptr_t oldframe)
 		pspace_write(newframe + ff, pspace_read(oldframe + ff));
 	}
 }
+
+void m_frame_zero(uintptr_t frame)
+{
+	pspace_clrframe(frame);
+}
@@ -7,6 +7,7 @@
 #include "m_spl.h"
 #include "m_frame.h"
 #include "pspace.h"
+#include "amd64.h"
 
 //PDPT making up kernel-space, from cpuinit.asm
 extern uint64_t cpuinit_pdpt[];
@@ -14,6 +15,12 @@ extern uint64_t cpuinit_pdpt[];
 //Spinlock protecting kernel-space
 static m_spl_t m_kspc_spl;
 
+//Large-page flag in page-directory entries
+#define M_KSPC_PDE_PS (1ul << 7)
+
+//Bits of a large page-directory entry giving the address of the 2MB page
+#define M_KSPC_PDE_LARGE_ADDR 0x000FFFFFFFE00000ul
+
 static bool m_kspc_set_locked(uintptr_t vaddr, uintptr_t paddr)
 {
 	//Our kernel lives entirely in the top PML4 entry.
@@ -48,6 +55,9 @@ static bool m_kspc_set_locked(uintptr_t vaddr, uintptr_t paddr)
 	uint64_t pd_addr = pdpte & 0x00FFFFFFFFFFF000ul;
 	uint64_t pd_idx = (vaddr & 0x000000003FE00000ul) >> 21;
 	uint64_t pde = pspace_read(pd_addr + (8 * pd_idx));
+	if(pde & M_KSPC_PDE_PS)
+		m_panic("m_kspc_set in large page");
+	
 	if(!(pde & 1))
 	{
 		//No Page Table referenced by this Page Directory entry.
@@ -96,6 +106,54 @@ static bool m_kspc_set_locked(uintptr_t vaddr, uintptr_t paddr)
 	}
 }
 
+static bool m_kspc_set_large_locked(uintptr_t vaddr, uintptr_t paddr)
+{
+	if( (vaddr & 0xFFFFFF8000000000ul) != 0xFFFFFF8000000000ul )
+		m_panic("m_kspc_set_large outside top PML4e");
+	
+	if((vaddr & 0x1FFFFFul) || (paddr & 0x1FFFFFul))
+		m_panic("m_kspc_set_large misalign");
+	
+	uint64_t pdpt_idx = (vaddr & 0x0000007FC0000000ul) >> 30;
+	uint64_t pdpte = cpuinit_pdpt[pdpt_idx]; //Kernel PDPT is allocated at boot
+	if(!(pdpte & 1))
+	{
+		if(pdpte != 0)
+			m_panic("m_kspc_set_large corrupt pdpt");
+		
+		if(paddr == 0)
+			return false; //No large page to unmap
+		
+		uint64_t newpd = m_frame_alloc();
+		if(newpd == 0)
+			return false; //PDPTe is empty, but we can't allocate a PD to put there.
+		
+		pspace_clrframe(newpd);
+		pdpte = newpd | 0x3;
+		cpuinit_pdpt[pdpt_idx] = pdpte;
+	}
+	
+	uint64_t pd_addr = pdpte & 0x00FFFFFFFFFFF000ul;
+	uint64_t pd_idx = (vaddr & 0x000000003FE00000ul) >> 21;
+	uint64_t pde = pspace_read(pd_addr + (8 * pd_idx));
+	if(paddr == 0)
+	{
+		if(!(pde & 1) || !(pde & M_KSPC_PDE_PS))
+			return false; //No large page to unmap
+		
+		pspace_write(pd_addr + (8 * pd_idx), 0);
+		invlpg(vaddr);
+		return true;
+	}
+	
+	//Don't replace pagetables, even empty ones - other cores may still have them cached.
+	if(pde & 1)
+		return false;
+	
+	pspace_write(pd_addr + (8 * pd_idx), paddr | M_KSPC_PDE_PS | 0x3);
+	return true;
+}
+
 static uintptr_t m_kspc_get_locked(uintptr_t vaddr)
 {
 	//Our kernel lives entirely in the top PML4 entry.
@@ -129,6 +187,9 @@ static uintptr_t m_kspc_get_locked(uintptr_t vaddr)
 		return 0;
 	}
 	
+	if(pde & M_KSPC_PDE_PS)
+		return (pde & M_KSPC_PDE_LARGE_ADDR) + (vaddr & 0x00000000001FF000ul); //Part of a large page
+	
 	uint64_t pt_addr = pde & 0x00FFFFFFFFFFF000ul;
 	uint64_t pt_idx = (vaddr & 0x00000000001FF000ul) >> 12;
 	uint64_t pte = pspace_read(pt_addr + (8 * pt_idx));
@@ -166,6 +227,14 @@ bool m_kspc_set(uintptr_t vaddr, uintptr_t paddr)
 	return retval;
 }
 
+bool m_kspc_set_large(uintptr_t vaddr, uintptr_t paddr)
+{
+	m_spl_acq(&m_kspc_spl);
+	bool retval = m_kspc_set_large_locked(vaddr, paddr);
+	m_spl_rel(&m_kspc_spl);
+	return retval;
+}
+
 uintptr_t m_kspc_get(uintptr_t vaddr)
 {
 	m_spl_acq(&m_kspc_spl);
@@ -14,6 +14,12 @@ m_spl_acq:
 		ret
 	.wait:
 		;Didn't get the lock.
+		;The holder might be waiting for us to flush translations (see m_uspc_flush), so do that if asked.
+		push RDI
+		extern m_uspc_flushpoll
+		call m_uspc_flushpoll
+		pop RDI
+		
 		;Use non-locked accesses to wait until the lock seems to be 0. Then try again.
 		pause
 		cmp byte [RDI], 0
@@ -5,8 +5,10 @@
 #include "m_uspc.h"
 #include "m_frame.h"
 #include "m_panic.h"
+#include "m_cpu.h"
 #include "pspace.h"
 #include "amd64.h"
+#include "lapic.h"
 
 //Kernel PML4 (top-level paging)
 extern uint64_t cpuinit_pml4[];
@@ -14,6 +16,136 @@ extern uint64_t cpuinit_pml4[];
 //Difference between virtual and physical addresses in kernel as-linked, from linker script
 extern const uint8_t _KERNEL_VOFFS[];
 
+//Available bit in pagetable entries that we use to mark read-only pages as copy-on-write
+#define M_USPC_PTE_COW (1ul << 9)
+
+//Interrupt vector that asks other cores to flush their translations - see cpuinit_isrptrs
+#define M_USPC_FLUSH_VECTOR (0xFC)
+
+//Userspace last activated on each core.
+static volatile m_uspc_t m_uspc_active[256];
+
+//Whether each core has been asked to flush its userspace translations. Cleared by the core once it has.
+static volatile uint8_t m_uspc_flushreq[256];
+
+//Returns the index of the calling core in m_uspc_active and m_uspc_flushreq.
+static int m_uspc_cpu(void)
+{
+	return (unsigned int)m_cpu_num() % 256;
+}
+
+//Large-page flag in page-directory entries
+#define M_USPC_PDE_PS (1ul << 7)
+
+//Bits of a large page-directory entry giving the address of the 2MB page
+#define M_USPC_PDE_LARGE_ADDR 0x000FFFFFFFE00000ul
+
+//Returns the physical address of the page-directory entry for the given address, or 0 if there's no page-directory for it.
+//If alloc is set, allocates any missing levels above it, and returns 0 only if out of memory.
+static uint64_t m_uspc_pde_find(m_uspc_t uspc, uintptr_t vaddr, bool alloc)
+{
+	const uint64_t pml4_base = uspc;
+	const uint64_t pml4_idx = (vaddr >> 39) % 512;
+	uint64_t pml4e = pspace_read(pml4_base + (8 * pml4_idx));
+	if(!(pml4e & 1))
+	{
+		if(!alloc)
+			return 0;
+		
+		//PML4e is non-present - need to allocate a new PDPT and put it here.
+		uint64_t newpdpt = m_frame_alloc();
+		if(newpdpt == 0)
+			return 0; //No room for PDPT
+		
+		pspace_clrframe(newpdpt);
+		
+		pml4e = newpdpt | 0x7; //Present, writable, user-accessible
+		pspace_write(pml4_base + (8 * pml4_idx), pml4e);
+	}
+	
+	const uint64_t pdpt_base = pml4e & 0x00FFFFFFFFFFF000ul;
+	const uint64_t pdpt_idx = (vaddr >> 30) % 512;
+	uint64_t pdpte = pspace_read(pdpt_base + (8 * pdpt_idx));
+	if(!(pdpte & 1))
+	{
+		if(!alloc)
+			return 0;
+		
+		//PDPTe is non-present - need to allocate a new PD and put it here.
+		uint64_t newpd = m_frame_alloc();
+		if(newpd == 0)
+			return 0; //No room for PD
+		
+		pspace_clrframe(newpd);
+		
+		pdpte = newpd | 0x7; //Present, writable, user-accessible
+		pspace_write(pdpt_base + (8 * pdpt_idx), pdpte);
+	}
+	
+	const uint64_t pd_base = pdpte & 0x00FFFFFFFFFFF000ul;
+	const uint64_t pd_idx = (vaddr >> 21) % 512;
+	return pd_base + (8 * pd_idx);
+}
+
+//Returns the physical address of the pagetable entry for the given page, or 0 if there's no pagetable for it.
+static uint64_t m_uspc_pte_find(m_uspc_t uspc, uintptr_t vaddr)
+{
+	const uint64_t pde_addr = m_uspc_pde_find(uspc, vaddr, false);
+	if(pde_addr == 0)
+		return 0;
+	
+	const uint64_t pde = pspace_read(pde_addr);
+	if(!(pde & 1) || (pde & M_USPC_PDE_PS))
+		return 0;
+	
+	return (pde & 0x00FFFFFFFFFFF000ul) + (8 * ((vaddr >> 12) % 512));
+}
+
+//Returns the access bits of a page or large page entry, for the given protection.
+static uint64_t m_uspc_prot_bits(int prot)
+{
+	uint64_t bits = 0;
+	
+	//Writable, unless we're waiting to copy it on write
+	if(prot & M_USPC_PROT_COW)
+		bits |= M_USPC_PTE_COW;
+	else if(prot & M_USPC_PROT_W)
+		bits |= 0x2; //RW
+	
+	//No-execute
+	if(!(prot & M_USPC_PROT_X))
+		bits |= 0x8000000000000000ul; //NX
+	
+	//Any access - make usermode-visible
+	if(prot != 0)
+		bits |= 0x4; //US
+	
+	return bits;
+}
+
+//Replaces the large page at the given page-directory entry with a pagetable, mapping the same frames with the same access.
+//Returns false if out of memory.
+static bool m_uspc_split(uint64_t pde_addr)
+{
+	const uint64_t pde = pspace_read(pde_addr);
+	
+	uint64_t newpt = m_frame_alloc();
+	if(newpt == 0)
+		return false; //No room for PT
+	
+	//Keep the access bits, but not the large-page flag - that bit means something else in a pagetable entry.
+	const uint64_t base = pde & M_USPC_PDE_LARGE_ADDR;
+	const uint64_t bits = pde & 0x800000000000007Ful;
+	for(int pt_idx = 0; pt_idx < 512; pt_idx++)
+	{
+		pspace_write(newpt + (8 * pt_idx), (base + (4096ul * pt_idx)) | bits);
+	}
+	
+	//Translations are unchanged, so nothing needs flushing.
+	pspace_write(pde_addr, newpt | 0x7); //Present, writable, user-accessible
+	return true;
+}
+
 void m_uspc_range(uintptr_t *start_out, uintptr_t *end_out)
 {
 	//Start just above the zero-page
@@ -68,6 +200,9 @@ void m_uspc_delete(m_uspc_t uspc)
 				if(!(pde & 1))
 					continue;
 				
+				if(pde & M_USPC_PDE_PS)
+					m_panic("m_uspc_delete nonempty");
+				
 				uint64_t pt_base = pde & 0x00FFFFFFFFFFF000ul;
 				for(int pt_idx = 0; pt_idx < 512; pt_idx++)
 				{
@@ -96,41 +231,20 @@ bool m_uspc_set(m_uspc_t uspc, uintptr_t vaddr, uintptr_t paddr, int prot)
 	if(paddr & 0xFFFul)
 		m_panic("m_uspc_set bad paddr");
 	
-	const uint64_t pml4_base = uspc;
-	const uint64_t pml4_idx = (vaddr >> 39) % 512;
-	uint64_t pml4e = pspace_read(pml4_base + (8 * pml4_idx));
-	if(!(pml4e & 1))
-	{
-		//PML4e is non-present - need to allocate a new PDPT and put it here.
-		uint64_t newpdpt = m_frame_alloc();
-		if(newpdpt == 0)
-			return false; //No room for PDPT
-		
-		pspace_clrframe(newpdpt);
-		
-		pml4e = newpdpt | 0x7; //Present, writable, user-accessible
-		pspace_write(pml4_base + (8 * pml4_idx), pml4e);
-	}
+	const uint64_t pde_addr = m_uspc_pde_find(uspc, vaddr, true);
+	if(pde_addr == 0)
+		return false; //No room for PDPT or PD
 	
-	const uint64_t pdpt_base = pml4e & 0x00FFFFFFFFFFF000ul;
-	const uint64_t pdpt_idx = (vaddr >> 30) % 512;
-	uint64_t pdpte = pspace_read(pdpt_base + (8 * pdpt_idx));
-	if(!(pdpte & 1))
+	uint64_t pde = pspace_read(pde_addr);
+	if(pde & M_USPC_PDE_PS)
 	{
-		//PDPTe is non-present - need to allocate a new PD and put it here.
-		uint64_t newpd = m_frame_alloc();
-		if(newpd == 0)
-			return false; //No room for PD
+		//Page is part of a large page - need to break it up to change just this page.
+		if(!m_uspc_split(pde_addr))
+			return false;
 		
-		pspace_clrframe(newpd);
-		
-		pdpte = newpd | 0x7; //Present, writable, user-accessible
-		pspace_write(pdpt_base + (8 * pdpt_idx), pdpte);
+		pde = pspace_read(pde_addr);
 	}
 	
-	const uint64_t pd_base = pdpte & 0x00FFFFFFFFFFF000ul;
-	const uint64_t pd_idx = (vaddr >> 21) % 512;
-	uint64_t pde = pspace_read(pd_base + (8 * pd_idx));
 	if(!(pde & 1))
 	{
 		//PDe is non-present - need to allocate a new PT and put it here.
@@ -141,53 +255,30 @@ bool m_uspc_set(m_uspc_t uspc, uintptr_t vaddr, uintptr_t paddr, int prot)
 		pspace_clrframe(newpt);
 		
 		pde = newpt | 0x7; //Present, writable, user-accessible
-		pspace_write(pd_base + (8 * pd_idx), pde);
+		pspace_write(pde_addr, pde);
 	}
 	
 	const uint64_t pt_base = pde & 0x00FFFFFFFFFFF000ul;
 	const uint64_t pt_idx = (vaddr >> 12) % 512;
-	uint64_t pte = pspace_read(pt_base + (8 * pt_idx));
-	if(!(pte & 1))
-	{
-		//PTE not already present. Allow putting a page here.
-		if(paddr == 0)
-		{
-			pte = 0;
-		}
-		else
-		{
-			pte = paddr;
-			
-			//Present
-			pte |= 0x1; 
-			
-			//Writable
-			if(prot & M_USPC_PROT_W)
-				pte |= 0x2; //RW
-			
-			//No-execute
-			if(!(prot & M_USPC_PROT_X))
-				pte |= 0x8000000000000000ul; //NX
-			
-			//Any access - make usermode-visible
-			if(prot != 0)
-				pte |= 0x4; //US
-		}			
-	}
-	else
+	const uint64_t oldpte = pspace_read(pt_base + (8 * pt_idx));
+	
+	uint64_t pte = 0;
+	if(paddr != 0)
+		pte = paddr | 0x1 | m_uspc_prot_bits(prot); //Present, with access as requested
+	
+	if(oldpte & 1)
 	{
-		//PTE is already present. Only allow unmapping.
-		if(paddr == 0)
-		{
-			pte = 0;
-		}
-		else
-		{
+		//PTE is already present. Only allow unmapping, or changing access to the same frame.
+		if(paddr != 0 && paddr != (oldpte & 0x00FFFFFFFFFFF000ul))
 			m_panic("m_uspc_set reassign");
-		}
 	}
 	
 	pspace_write(pt_base + (8 * pt_idx), pte);
+	
+	//If we changed a live mapping, flush it from our TLB.
+	if((oldpte & 1) && (uspc == getcr3()))
+		invlpg(vaddr);
+	
 	return true;
 }
 
@@ -220,6 +311,9 @@ uintptr_t m_uspc_get(m_uspc_t uspc, uintptr_t vaddr)
 	if(!(pde & 1))
 		return 0; //PDe not present
 	
+	if(pde & M_USPC_PDE_PS)
+		return (pde & M_USPC_PDE_LARGE_ADDR) + (vaddr & 0x1FF000ul); //Part of a large page
+	
 	if(!(pde & 4))
 		m_panic("m_uspc_get pde not user");
 	
@@ -234,6 +328,126 @@ uintptr_t m_uspc_get(m_uspc_t uspc, uintptr_t vaddr)
 	return pte & 0x00FFFFFFFFFFF000ul;
 }
 
+bool m_uspc_large_ok(m_uspc_t uspc, uintptr_t vaddr)
+{
+	if(vaddr & 0xFFFF0000001FFFFFul)
+		m_panic("m_uspc_large_ok bad vaddr");
+	
+	//Only take over entries with no pagetable. A pagetable with nothing in it is left alone - likely it'll be used again.
+	const uint64_t pde_addr = m_uspc_pde_find(uspc, vaddr, false);
+	if(pde_addr == 0)
+		return true;
+	
+	return !(pspace_read(pde_addr) & 1);
+}
+
+bool m_uspc_set_large(m_uspc_t uspc, uintptr_t vaddr, uintptr_t paddr, int prot)
+{
+	if(vaddr & 0xFFFF0000001FFFFFul)
+		m_panic("m_uspc_set_large bad vaddr");
+	
+	if(paddr & 0x1FFFFFul)
+		m_panic("m_uspc_set_large bad paddr");
+	
+	//Copy-on-write is tracked per frame, so it's done with single pages.
+	if(prot & M_USPC_PROT_COW)
+		return false;
+	
+	const uint64_t pde_addr = m_uspc_pde_find(uspc, vaddr, paddr != 0);
+	if(pde_addr == 0)
+		return false; //No room for PDPT or PD, or nothing to unmap
+	
+	const uint64_t oldpde = pspace_read(pde_addr);
+	if((oldpde & 1) && !(oldpde & M_USPC_PDE_PS))
+		return false; //Pagetable in the way
+	
+	if(paddr == 0 && !(oldpde & 1))
+		return false; //No large page to unmap
+	
+	if((oldpde & 1) && paddr != 0 && paddr != (oldpde & M_USPC_PDE_LARGE_ADDR))
+		m_panic("m_uspc_set_large reassign");
+	
+	uint64_t pde = 0;
+	if(paddr != 0)
+		pde = paddr | 0x1 | M_USPC_PDE_PS | m_uspc_prot_bits(prot); //Present, large, with access as requested
+	
+	pspace_write(pde_addr, pde);
+	
+	//If we changed a live mapping, flush it from our TLB.
+	if((oldpde & 1) && (uspc == getcr3()))
+		invlpg(vaddr);
+	
+	return true;
+}
+
+bool m_uspc_fault(m_uspc_t uspc, uintptr_t vaddr, bool write)
+{
+	uintptr_t ustart = 0;
+	uintptr_t uend = 0;
+	m_uspc_range(&ustart, &uend);
+	if(uspc == 0 || vaddr < ustart || vaddr >= uend)
+		return false;
+	
+	//Only writes to copy-on-write pages are resolved here.
+	//Anything else that faults isn't mapped, or doesn't allow the access.
+	if(!write)
+		return false;
+	
+	vaddr -= vaddr % 4096;
+	const uint64_t pte_addr = m_uspc_pte_find(uspc, vaddr);
+	if(pte_addr == 0)
+		return false;
+	
+	while(1)
+	{
+		const uint64_t pte = pspace_read(pte_addr);
+		if(!(pte & 1) || !(pte & 4))
+			return false; //Not mapped for the user
+		
+		if(pte & 2)
+		{
+			//Already writable - somebody else copied it while we had a stale TLB entry.
+			invlpg(vaddr);
+			return true;
+		}
+		
+		if(!(pte & M_USPC_PTE_COW))
+			return false; //Really read-only
+		
+		//If the frame is still shared, the writer gets its own copy. Otherwise it can just have the frame.
+		const uint64_t oldframe = pte & 0x00FFFFFFFFFFF000ul;
+		uint64_t newframe = 0;
+		uint64_t newpte = (pte & ~M_USPC_PTE_COW) | 0x2;
+		if(m_frame_refs(oldframe) > 1)
+		{
+			newframe = m_frame_alloc();
+			if(newframe == 0)
+				return false; //No memory to copy into
+			
+			m_frame_copy(newframe, oldframe);
+			newpte = (newpte & ~0x00FFFFFFFFFFF000ul) | newframe;
+		}
+		
+		//Other threads in the process might be faulting on the same page - only one wins.
+		if(!pspace_cmpxchg(pte_addr, pte, newpte))
+		{
+			if(newframe != 0)
+				m_frame_free(newframe);
+			
+			continue;
+		}
+		
+		//Drop our reference to the shared frame, if we copied it.
+		if(newframe != 0)
+			m_frame_free(oldframe);
+		
+		if(uspc == getcr3())
+			invlpg(vaddr);
+		
+		return true;
+	}
+}
+
 m_uspc_t m_uspc_current()
 {
 	uintptr_t cr3 = getcr3();
@@ -249,9 +463,67 @@ void m_uspc_activate(m_uspc_t uspc)
 	if(uspc & 0xFFF)
 		m_panic("m_uspc_activate misalign");
 	
+	//Note which space we're using before loading it.
+	//Anybody who changes the space after we've loaded it, will see that they need to ask us to flush.
+	m_uspc_active[m_uspc_cpu()] = uspc;
+	__sync_synchronize();
+	
 	if(uspc == 0) //Indicates "no userspace"
 		setcr3((uintptr_t)cpuinit_pml4 - (uintptr_t)_KERNEL_VOFFS);
 	else
 		setcr3(uspc);
 }
 
+//Flushes the calling core's userspace translations, if another core has asked.
+//Called from the flush interrupt, and while spinning in the kernel, so cores that wait on each other still flush.
+void m_uspc_flushpoll(void)
+{
+	int cpu = m_uspc_cpu();
+	if(m_uspc_flushreq[cpu])
+	{
+		setcr3(getcr3());
+		__sync_synchronize();
+		m_uspc_flushreq[cpu] = 0;
+	}
+}
+
+void m_uspc_flush(m_uspc_t uspc)
+{
+	//Flush our own translations
+	if(uspc == getcr3())
+		setcr3(uspc);
+	
+	//Ask any other cores using the same space to do the same
+	int ncpus = m_cpu_count();
+	if(ncpus > 256)
+		ncpus = 256;
+	
+	int self = m_uspc_cpu();
+	bool asked = false;
+	__sync_synchronize();
+	for(int cc = 0; cc < ncpus; cc++)
+	{
+		if(cc != self && m_uspc_active[cc] == uspc)
+		{
+			m_uspc_flushreq[cc] = 1;
+			asked = true;
+		}
+	}
+	
+	if(!asked)
+		return;
+	
+	//Interrupt them in case they're running the user, and wait until they've all flushed.
+	//Cores spinning in the kernel don't take the interrupt, but notice the request as they spin.
+	__sync_synchronize();
+	lapic_ipi_others(M_USPC_FLUSH_VECTOR);
+	for(int cc = 0; cc < ncpus; cc++)
+	{
+		while(m_uspc_flushreq[cc])
+		{
+			m_uspc_flushpoll();
+			asm volatile ("pause");
+		}
+	}
+}
+
@@ -42,6 +42,14 @@ void pspace_write32(uint64_t addr, uint32_t data)
 	*((volatile uint32_t*)(PSPACE_BASE + addr)) = data;
 }
 
+bool pspace_cmpxchg(uint64_t addr, uint64_t oldv, uint64_t newv)
+{
+	if(addr > PSPACE_SIZE)
+		m_panic("pspace_cmpxchg bad addr");
+	
+	return __sync_bool_compare_and_swap((volatile uint64_t*)(PSPACE_BASE + addr), oldv, newv);
+}
+
 void pspace_clrframe(uint64_t addr)
 {
 	if(addr > PSPACE_SIZE)
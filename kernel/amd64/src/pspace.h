@@ -5,6 +5,7 @@
 #define PSPACE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 //Reads from physical space
 uint64_t pspace_read(uint64_t addr);
@@ -12,6 +13,15 @@ uint64_t pspace_read(uint64_t addr);
 //Writes to physical space
 void pspace_write(uint64_t addr, uint64_t data);
 
+//Reads 32 bits from physical space
+uint32_t pspace_read32(uint64_t addr);
+
+//Writes 32 bits to physical space
+void pspace_write32(uint64_t addr, uint32_t data);
+
+//Replaces 64 bits in physical space if they still hold the given old value. Returns true if replaced.
+bool pspace_cmpxchg(uint64_t addr, uint64_t oldv, uint64_t newv);
+
 //Clears a frame of physical space
 void pspace_clrframe(uint64_t addr);
 
@@ -0,0 +1,17 @@
+//m_cpu.s
+//CPU core identification on 32-bit ARM
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+.section .text
+
+//We're single-processor for now.
+
+.global m_cpu_num //int m_cpu_num(void);
+m_cpu_num:
+	mov r0, #0
+	bx lr
+
+.global m_cpu_count //int m_cpu_count(void);
+m_cpu_count:
+	mov r0, #1
+	bx lr
@@ -4,6 +4,7 @@
 
 #include "m_frame.h"
 #include "m_kspc.h"
+#include "m_panic.h"
 #include <string.h>
 
 //Window that we re-map to the head of our free-list.
@@ -32,6 +33,40 @@ uintptr_t m_frame_alloc(void)
 	return 0;
 }
 
+bool m_frame_alloc_n(uintptr_t *frames, size_t count)
+{
+	for(size_t ff = 0; ff < count; ff++)
+	{
+		frames[ff] = m_frame_alloc();
+		if(frames[ff] == 0)
+		{
+			//Out of memory - put back what we got
+			while(ff > 0)
+			{
+				ff--;
+				m_frame_free(frames[ff]);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t m_frame_large_size(void)
+{
+	//Sections aren't used for dynamic mappings
+	return 0;
+}
+
+uintptr_t m_frame_alloc_contig(size_t count)
+{
+	//Frames are kept on a simple list, so we can't find runs of them
+	if(count != 1)
+		return 0;
+	
+	return m_frame_alloc();
+}
+
 void m_frame_free(uintptr_t frame)
 {
 	uintptr_t old_head = m_kspc_get((uintptr_t)_frame_window);
@@ -39,6 +74,19 @@ void m_frame_free(uintptr_t frame)
 	_frame_window[0] = old_head;
 }
 
+void m_frame_ref(uintptr_t frame)
+{
+	//Frames aren't shared on this platform - see m_uspc_set.
+	(void)frame;
+	m_panic("m_frame_ref unsupported");
+}
+
+size_t m_frame_refs(uintptr_t frame)
+{
+	(void)frame;
+	return 1;
+}
+
 void m_frame_copy(uintptr_t newframe, uintptr_t oldframe)
 {
 	m_kspc_set((uintptr_t)_frame_dstbuf, newframe);
@@ -46,3 +94,9 @@ void m_frame_copy(uintptr_t newframe, uintptr_t oldframe)
 	memcpy(_frame_dstbuf, _frame_srcbuf, sizeof(_frame_dstbuf));
 }
 
+void m_frame_zero(uintptr_t frame)
+{
+	m_kspc_set((uintptr_t)_frame_dstbuf, frame);
+	memset(_frame_dstbuf, 0, sizeof(_frame_dstbuf));
+}
+
@@ -44,3 +44,9 @@ m_intr_wake:
 
 	//Stub because we're single-processor for now
 	bx lr
+
+.global m_intr_timer //void m_intr_timer(int64_t tsc_deadline);
+m_intr_timer:
+
+	//Stub because we don't preempt on this platform yet
+	bx lr
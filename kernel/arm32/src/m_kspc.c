@@ -54,6 +54,14 @@ bool m_kspc_set(uintptr_t vaddr, uintptr_t paddr)
 	return true;
 }
 
+bool m_kspc_set_large(uintptr_t vaddr, uintptr_t paddr)
+{
+	//No large pages on this platform.
+	(void)vaddr;
+	(void)paddr;
+	return false;
+}
+
 uintptr_t m_kspc_get(uintptr_t vaddr)
 {
 	if(vaddr % 16384)
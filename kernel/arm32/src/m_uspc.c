@@ -60,6 +60,10 @@ bool m_uspc_set(m_uspc_t uspc, uintptr_t vaddr, uintptr_t paddr, int prot)
 	if(vaddr % 16384)
 		m_panic("m_uspc_set misalign v");
 	
+	//We don't handle aborts from userspace yet, so we can't do copy-on-write.
+	if(prot & M_USPC_PROT_COW)
+		return false;
+	
 	//Examine the translation table and see if we need to allocate a set of pagetables.
 	//We allocate 16KByte frames, which are 16 coarse page tables, corresponding to 16 MBytes of space.
 	m_kspc_set((uintptr_t)_uspc_window, uspc);
@@ -159,3 +163,35 @@ uintptr_t m_uspc_get(m_uspc_t uspc, uintptr_t vaddr)
 	return _uspc_window[pt_idx] & 0xFFFFC000ul;	
 }
 
+bool m_uspc_large_ok(m_uspc_t uspc, uintptr_t vaddr)
+{
+	//No large pages on this platform.
+	(void)uspc;
+	(void)vaddr;
+	return false;
+}
+
+bool m_uspc_set_large(m_uspc_t uspc, uintptr_t vaddr, uintptr_t paddr, int prot)
+{
+	//No large pages on this platform.
+	(void)uspc;
+	(void)vaddr;
+	(void)paddr;
+	(void)prot;
+	return false;
+}
+
+bool m_uspc_fault(m_uspc_t uspc, uintptr_t vaddr, bool write)
+{
+	//Nothing is mapped lazily on this platform.
+	(void)uspc;
+	(void)vaddr;
+	(void)write;
+	return false;
+}
+
+void m_uspc_flush(m_uspc_t uspc)
+{
+	//Only one core here, and m_uspc_set already invalidates the pages it changes.
+	(void)uspc;
+}
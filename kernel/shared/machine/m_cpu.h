@@ -0,0 +1,13 @@
+//m_cpu.h
+//CPU core identification, per-machine functions
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef M_CPU_H
+#define M_CPU_H
+
+//Returns the index of the CPU core we're running on, counting from 0.
+int m_cpu_num(void);
+
+//Returns the number of CPU cores that have started up.
+int m_cpu_count(void);
+
+#endif //M_CPU_H
@@ -6,6 +6,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 //Returns the size of physical frame that this machine allocates.
 size_t m_frame_size(void);
@@ -13,11 +14,32 @@ size_t m_frame_size(void);
 //Allocates a frame and returns its physical address.
 uintptr_t m_frame_alloc(void);
 
+//Allocates the given number of frames and stores their physical addresses in the array.
+//Returns true if all were allocated. Returns false, and allocates none, if there isn't enough memory.
+bool m_frame_alloc_n(uintptr_t *frames, size_t count);
+
+//Returns the size of large page that this machine can map, or 0 if it can't map large pages.
+size_t m_frame_large_size(void);
+
+//Allocates physically-contiguous frames, aligned to the next power-of-two of their total size.
+//Returns the physical address of the first, or 0 if no such range is free. Each frame is freed separately.
+uintptr_t m_frame_alloc_contig(size_t count);
+
 //Frees a frame, returning it to the frames available to allocate.
+//If other references were added to the frame, drops one of them instead.
 void m_frame_free(uintptr_t frame);
 
+//Adds a reference to a frame, so it can be shared. Each reference is dropped by one call to m_frame_free.
+void m_frame_ref(uintptr_t frame);
+
+//Returns how many references there are to the given frame.
+size_t m_frame_refs(uintptr_t frame);
+
 //Copies contents from one frame to another.
 void m_frame_copy(uintptr_t newframe, uintptr_t oldframe);
 
+//Fills a frame with zeroes.
+void m_frame_zero(uintptr_t frame);
+
 #endif //M_FRAME_H
 
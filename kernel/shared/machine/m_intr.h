@@ -5,6 +5,7 @@
 #define M_INTR_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 //Enables or disables interrupt handling
 void m_intr_ei(bool enable);
@@ -15,4 +16,8 @@ void m_intr_halt(void);
 //Wakes halted processors.
 void m_intr_wake(void);
 
+//Arms the calling processor's timer to interrupt around the given m_time_tsc value, or stops it if 0.
+//If the timer fires during user execution, the machine calls entry_preempt.
+void m_intr_timer(int64_t tsc_deadline);
+
 #endif //M_INTR_H
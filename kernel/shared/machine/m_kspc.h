@@ -16,6 +16,12 @@ void m_kspc_range(uintptr_t *start_out, uintptr_t *end_out);
 //Returns true on success; returns false on failure (probably: out of room for pagetables).
 bool m_kspc_set(uintptr_t vaddr, uintptr_t paddr);
 
+//Maps a large page (of m_frame_large_size), backed by contiguous frames starting at the given aligned address.
+//Passing 0 for paddr unmaps a large page, returning false if there isn't one mapped there.
+//Single pages can't be set inside a large page - unmap it first.
+//Returns true on success; returns false on failure (probably: large pages unsupported, or smaller pages in the way).
+bool m_kspc_set_large(uintptr_t vaddr, uintptr_t paddr);
+
 //Returns the frame backing the given kernel-space page.
 //Returns 0 if the page is not mapped.
 uintptr_t m_kspc_get(uintptr_t vaddr);
@@ -26,13 +26,37 @@ void m_uspc_delete(m_uspc_t uspc);
 #define M_USPC_PROT_W 2
 #define M_USPC_PROT_X 1
 
+//Page is shared read-only until written. The machine copies it on the first write (see m_uspc_fault).
+#define M_USPC_PROT_COW 8
+
 //Changes the mapping of a page in userspace.
-//Returns true if the mapping was made; false otherwise (probably: out of physical RAM).
+//A page that's already mapped can only be unmapped, or changed to different access on the same frame.
+//Returns true if the mapping was made; false otherwise (probably: out of physical RAM, or unsupported access).
 bool m_uspc_set(m_uspc_t uspc, uintptr_t vaddr, uintptr_t paddr, int prot);
 
 //Returns the frame backing the given page in userspace.
 uintptr_t m_uspc_get(m_uspc_t uspc, uintptr_t vaddr);
 
+//Returns whether a large page (of m_frame_large_size) could be mapped at the given aligned address.
+//That requires no smaller pages to be mapped anywhere in its range.
+bool m_uspc_large_ok(m_uspc_t uspc, uintptr_t vaddr);
+
+//Maps a large page (of m_frame_large_size), backed by contiguous frames starting at the given aligned address.
+//A large page that's already mapped can only be unmapped, or changed to different access on the same frames.
+//Passing 0 for paddr unmaps a large page, returning false if there isn't one mapped there.
+//Setting single pages inside a large page splits it into single pages first.
+//Returns true if the mapping was made; false otherwise (probably: large pages unsupported, or smaller pages in the way).
+bool m_uspc_set_large(m_uspc_t uspc, uintptr_t vaddr, uintptr_t paddr, int prot);
+
+//Handles a fault accessing the given address, for mappings that the machine fills in lazily (copy-on-write).
+//Returns true if the access can be retried; false if the access isn't allowed.
+bool m_uspc_fault(m_uspc_t uspc, uintptr_t vaddr, bool write);
+
+//Removes stale translations of the given userspace from every core that might have it active.
+//Must be called after unmapping pages and before freeing their frames, as other cores may still reach them.
+//Returns once all cores have done so.
+void m_uspc_flush(m_uspc_t uspc);
+
 
 //Returns the currently-active userspace.
 m_uspc_t m_uspc_current();
@@ -16,6 +16,9 @@ static volatile m_atomic_t con_inbuf_w;
 //Which thread gets unpaused when console input occurs
 static id_t con_tid;
 
+//Whether the console changed hands, and the new holder hasn't looked yet.
+static m_atomic_t con_handover;
+
 //Whether the System modifier key is pressed or not, for triggering console return-to-init.
 static bool con_syskey_modifier;
 
@@ -27,6 +30,7 @@ void con_settid(id_t tid)
 	if(tid != con_tid)
 	{
 		con_tid = tid;
+		m_atomic_cmpxchg(&con_handover, 0, 1);
 		thread_unpause(con_tid); //Kick them now that they've become the console thread
 	}
 }
@@ -67,6 +71,15 @@ ssize_t con_input(void *buf, ssize_t buflen)
 	return retval;
 }
 
+bool con_ready(void)
+{
+	//Having just been handed the console counts, too, so the new holder can draw.
+	if(m_atomic_cmpxchg(&con_handover, 1, 0))
+		return true;
+	
+	return con_inbuf_r != con_inbuf_w;
+}
+
 bool con_steal_check(void)
 {
 	return m_atomic_cmpxchg(&con_syskey_trigger, 1, 0);
@@ -14,6 +14,9 @@ void con_settid(id_t tid);
 //Outputs pending keyboard/mouse input.
 ssize_t con_input(void *buf, ssize_t buflen);
 
+//Returns whether the console holder has anything to look at - input waiting, or the console just handed to them.
+bool con_ready(void);
+
 //Returns true if the console can return to the init process.
 bool con_steal_check(void);
 
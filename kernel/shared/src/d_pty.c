@@ -7,6 +7,7 @@
 #include "pipe.h"
 #include "kassert.h"
 #include "process.h"
+#include "slab.h"
 #include <string.h>
 #include <errno.h>
 #include <stddef.h>
@@ -36,8 +37,12 @@ typedef struct d_pty_s
 	char name[D_PTY_NAME_BUFLEN];
 	
 } d_pty_t;
-#define D_PTY_MAX 16
-d_pty_t d_pty_table[D_PTY_MAX];
+
+//All pseudoterminals, by minor number. Grows in chunks as higher numbers are opened.
+#define D_PTY_CHUNK 8
+#define D_PTY_MAX 256
+static void *d_pty_chunks[D_PTY_MAX / D_PTY_CHUNK];
+static slab_table_t d_pty_table = SLAB_TABLE_INIT("pty", d_pty_t, D_PTY_CHUNK, D_PTY_MAX, d_pty_chunks);
 
 
 //Handler for ioctls on pseudoterminals once locked
@@ -120,7 +125,19 @@ static d_pty_t *d_pty_lock(int minor, bool checkready)
 		return NULL;
 	}
 	
-	d_pty_t *tptr = &(d_pty_table[minor]);
+	if(!checkready && slab_table_grow(&d_pty_table, minor + 1) < 0)
+	{
+		//No memory for a pseudoterminal this high
+		return NULL;
+	}
+	
+	d_pty_t *tptr = slab_table_get(&d_pty_table, minor);
+	if(tptr == NULL)
+	{
+		//Never opened, so not ready
+		return NULL;
+	}
+	
 	m_spl_acq(&(tptr->spl));
 	
 	if(checkready)
@@ -230,6 +247,24 @@ int d_pty_f_ioctl(int minor, int operation, void *buf, ssize_t len)
 	return retval;
 }
 
+int d_pty_f_poll (int minor, int events, int slot)
+{
+	d_pty_t *pptr = d_pty_lock(minor, true);
+	if(pptr == NULL)
+		return _SC_POLL_HUP; //Nobody serving the pseudoterminal
+	
+	pipe_t *pipe = pipe_lockid(pptr->pipe);
+	KASSERT(pipe != NULL); //Checked when locking
+	
+	int retval = 0;
+	retval |= pipe_poll(pipe, PIPE_DIR_FORWARD, events & _SC_POLL_IN, slot);
+	retval |= pipe_poll(pipe, PIPE_DIR_REVERSE, events & _SC_POLL_OUT, slot);
+	
+	pipe_unlock(pipe);
+	d_pty_unlock(pptr);
+	return retval;
+}
+
 int d_pty_b_open (int minor)
 {
 	d_pty_t *pptr = d_pty_lock(minor, false);
@@ -320,3 +355,20 @@ int d_pty_b_ioctl(int minor, int operation, void *buf, ssize_t len)
 	return retval;
 }
 
+int d_pty_b_poll (int minor, int events, int slot)
+{
+	d_pty_t *pptr = d_pty_lock(minor, true);
+	if(pptr == NULL)
+		return _SC_POLL_NVAL;
+	
+	pipe_t *pipe = pipe_lockid(pptr->pipe);
+	KASSERT(pipe != NULL); //Checked when locking
+	
+	int retval = 0;
+	retval |= pipe_poll(pipe, PIPE_DIR_REVERSE, events & _SC_POLL_IN, slot);
+	retval |= pipe_poll(pipe, PIPE_DIR_FORWARD, events & _SC_POLL_OUT, slot);
+	
+	pipe_unlock(pipe);
+	d_pty_unlock(pptr);
+	return retval;
+}
@@ -14,11 +14,13 @@ void    d_pty_f_close(int minor);
 ssize_t d_pty_f_read (int minor, void *buf, ssize_t nbytes);
 ssize_t d_pty_f_write(int minor, const void *buf, ssize_t nbytes);
 int     d_pty_f_ioctl(int minor, int operation, void *buf, ssize_t len);
+int     d_pty_f_poll (int minor, int events, int slot);
 
 int     d_pty_b_open (int minor);
 void    d_pty_b_close(int minor);
 ssize_t d_pty_b_read (int minor, void *buf, ssize_t nbytes);
 ssize_t d_pty_b_write(int minor, const void *buf, ssize_t nbytes);
 int     d_pty_b_ioctl(int minor, int operation, void *buf, ssize_t len);
+int     d_pty_b_poll (int minor, int events, int slot);
 
 #endif //D_PTY_H
@@ -8,6 +8,7 @@
 #include "m_uspc.h"
 #include "m_ident.h"
 #include "kassert.h"
+#include "kpage.h"
 
 #include <string.h>
 #include <fcntl.h>
@@ -198,13 +199,6 @@ int elf_load(file_t *file, mem_t *mem, uintptr_t *entry_out)
 		goto cleanup;
 	}
 	
-	//Make sure we track enough memory segments to map each program header with some space left.
-	if(ehdr.e_phnum + 3 > MEM_SEG_MAX)
-	{
-		retval = -ENOEXEC;
-		goto cleanup;
-	}
-	
 	//Allocate enough space for all the program headers in memory.
 	//We want to load them all at once, so they can't change underneath us.
 	//(We need to iterate them more than once.)
@@ -274,6 +268,9 @@ int elf_load(file_t *file, mem_t *mem, uintptr_t *entry_out)
 	}
 	
 	//Work through all the program headers, allocating and mapping memory for all loadable ranges.
+	//Whole pages of the file are mapped straight from the filesystem, shared with every other process running it.
+	//Writable ones are copied when first written. Anything else is loaded into memory of its own.
+	size_t shared_len[PHDR_MAX] = {0};
 	for(uint32_t pp = 0; pp < ehdr.e_phnum; pp++)
 	{		
 		elf_phdr_t *phdr = &(phdr_buffer[pp]);
@@ -290,12 +287,40 @@ int elf_load(file_t *file, mem_t *mem, uintptr_t *entry_out)
 		if(phdr->p_flags & PF_X)
 			prot |= M_USPC_PROT_X;
 		
-		int map_result = mem_add(mem, phdr->p_vaddr, phdr->p_memsz, prot);
+		//Find the frames holding whole pages of the segment in the file, if it's aligned in the file.
+		//If they can't be had, the segment is just loaded like any other.
+		size_t nshare = phdr->p_filesz / pagesize;
+		uintptr_t *frames = NULL;
+		ssize_t nframes = 0;
+		if(phdr->p_offset % pagesize == 0 && nshare > 0)
+		{
+			frames = kpage_alloc(nshare * sizeof(uintptr_t));
+			if(frames != NULL)
+				nframes = file_frames(file, phdr->p_offset, frames, nshare);
+			
+			if(nframes < 0)
+				nframes = 0;
+		}
+		
+		//Map it writable for now, so we can load the rest. Read-only segments get protected afterwards.
+		//Only the pages loaded from the file are allocated now - the rest are filled on demand.
+		int map_result = mem_share(mem, phdr->p_vaddr, phdr->p_memsz, prot | M_USPC_PROT_W, frames, nframes);
+		if(frames != NULL)
+			kpage_free(frames, nshare * sizeof(uintptr_t));
+		
 		if(map_result < 0)
 		{
 			retval = map_result;
 			goto cleanup;
 		}
+		
+		shared_len[pp] = nframes * pagesize;
+		int fill_result = mem_fill(mem, phdr->p_vaddr + shared_len[pp], phdr->p_filesz - shared_len[pp]);
+		if(fill_result < 0)
+		{
+			retval = fill_result;
+			goto cleanup;
+		}
 	}
 	
 	//Work through all the program headers and load the data from the file.
@@ -305,8 +330,8 @@ int elf_load(file_t *file, mem_t *mem, uintptr_t *entry_out)
 		if(phdr->p_type != PT_LOAD)
 			continue;
 		
-		//Load the initialized region from the data in the file
-		off_t data_seek_err = file_seek(file, phdr->p_offset, SEEK_SET);
+		//Load the initialized region from the data in the file, past whatever was mapped from it directly
+		off_t data_seek_err = file_seek(file, phdr->p_offset + shared_len[pp], SEEK_SET);
 		if(data_seek_err < 0)
 		{
 			//Failed to seek to segment data in file
@@ -319,12 +344,12 @@ int elf_load(file_t *file, mem_t *mem, uintptr_t *entry_out)
 		
 		KASSERT(phdr->p_memsz >= phdr->p_filesz);
 		
+		ssize_t data_len = phdr->p_filesz - shared_len[pp];
 		ssize_t data_read = 0;
-		if(phdr->p_filesz > 0)
-			data_read = file_read(file, (void*)(phdr->p_vaddr), phdr->p_filesz);
+		if(data_len > 0)
+			data_read = file_read(file, (void*)(phdr->p_vaddr + shared_len[pp]), data_len);
 		
-		if(phdr->p_memsz > phdr->p_filesz)
-			memset( ((uint8_t*)(phdr->p_vaddr)) + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
+		//Note that the rest of the segment is already zero - filled pages were cleared, and others will be.
 		
 		m_uspc_activate(old_uspc);
 		
@@ -335,14 +360,30 @@ int elf_load(file_t *file, mem_t *mem, uintptr_t *entry_out)
 			goto cleanup;
 		}
 		
-		if(data_read < (ssize_t)(phdr->p_filesz))
+		if(data_read < data_len)
 		{
 			//Short read of segment data
 			retval = -ENOEXEC;
 			goto cleanup;
 		}
 		
-		
+		//Now that it's loaded, the segment can have the access it asked for.
+		//Pages shared from the file are single frames, even where a segment spans a whole large page - mem_protect handles those one at a time.
+		if(!(phdr->p_flags & PF_W))
+		{
+			int prot = 0;
+			if(phdr->p_flags & PF_R)
+				prot |= M_USPC_PROT_R;
+			if(phdr->p_flags & PF_X)
+				prot |= M_USPC_PROT_X;
+			
+			int prot_err = mem_protect(mem, phdr->p_vaddr, phdr->p_memsz, prot);
+			if(prot_err < 0)
+			{
+				retval = prot_err;
+				goto cleanup;
+			}
+		}
 	}
 	
 	//Success. Write-out the entry point for the ELF, and return 0.
@@ -12,7 +12,9 @@
 #include "syscalls.h"
 #include "m_panic.h"
 #include "kassert.h"
+#include "m_uspc.h"
 #include <string.h>
+#include <signal.h>
 
 //Entered once on bootstrap core. Should set up kernel and return.
 void entry_boot(void)
@@ -22,11 +24,12 @@ void entry_boot(void)
 	fb_init();
 	ramfs_init();
 	
-	//Unpack and free the TAR file containing initial FS contents
+	//Unpack the TAR file containing initial FS contents
 	systar_unpack();
 	
 	//Make initial process to execute init
 	process_init();
+	systar_booted();
 }
 
 //Entered on all cores once entry_one returns. Should schedule threads and never return.
@@ -48,6 +51,14 @@ uintptr_t entry_syscall(uintptr_t num, uintptr_t p1, uintptr_t p2, uintptr_t p3,
 	thread_chstate(tptr, THREAD_STATE_SYSCALL);
 	m_drop_copy(&(tptr->drop), drop);
 	m_drop_retval(&(tptr->drop), 0);
+	
+	//Keep the call around in case it blocks and needs running again
+	tptr->sc_num = num;
+	tptr->sc_args[0] = p1;
+	tptr->sc_args[1] = p2;
+	tptr->sc_args[2] = p3;
+	tptr->sc_args[3] = p4;
+	tptr->sc_args[4] = p5;
 	thread_unlock(tptr);
 	tptr = NULL;
 	
@@ -69,6 +80,53 @@ uintptr_t entry_syscall(uintptr_t num, uintptr_t p1, uintptr_t p2, uintptr_t p3,
 	thread_sched();
 }
 
+//Entered when the timer interrupts a user thread. Should pick a user context to drop to and never return.
+void entry_preempt(m_drop_t *drop)
+{
+	//Save context in thread that was running, and let the scheduler decide if its time is up
+	thread_t *tptr = thread_lockcur();
+	
+	KASSERT(tptr->state == THREAD_STATE_RUN);
+	thread_chstate(tptr, THREAD_STATE_SYSCALL);
+	m_drop_copy(&(tptr->drop), drop);
+	thread_unlock(tptr);
+	tptr = NULL;
+	
+	thread_sched();
+}
+
+//Entered when a user thread faults accessing memory. Should pick a user context to drop to and never return.
+void entry_fault(m_drop_t *drop, uintptr_t addr, bool write)
+{
+	//See if the page just needs filling-in or copying, and retry the access if so.
+	if(mem_fault(process_memcur(), addr, write))
+		m_drop(drop);
+	
+	//Bad access. Save context in the thread and kill its process, as if by SIGSEGV.
+	thread_t *tptr = thread_lockcur();
+	
+	KASSERT(tptr->state == THREAD_STATE_RUN);
+	thread_chstate(tptr, THREAD_STATE_SYSCALL);
+	m_drop_copy(&(tptr->drop), drop);
+	thread_unlock(tptr);
+	tptr = NULL;
+	
+	k_sc_exit(0, SIGSEGV);
+	thread_sched();
+}
+
+//Entered when the kernel faults accessing user memory on the user's behalf. Returns if the access can be retried.
+void entry_kfault(uintptr_t addr, bool write)
+{
+	//Only the current process's memory can be fixed up here.
+	mem_t *mem = process_memcur();
+	if(mem == NULL || mem->uspc == 0 || mem->uspc != m_uspc_current())
+		m_panic("kernel page fault");
+	
+	if(!mem_fault(mem, addr, write))
+		m_panic("kernel page fault");
+}
+
 //Entered in interrupt context when a keyboard key is pressed or released.
 //Should return, to return from interrupt service.
 void entry_isr_kbd(_sc_con_scancode_t scancode, bool state)
@@ -5,8 +5,10 @@
 #include "file.h"
 #include "ramfs.h"
 #include "m_spl.h"
+#include "m_frame.h"
 #include "kassert.h"
 #include "pipe.h"
+#include "slab.h"
 #include "sc/sc.h"
 #include <errno.h>
 #include <stddef.h>
@@ -20,8 +22,7 @@
 #include "d_pty.h"
 
 //All files currently open on the system.
-#define FILE_MAX 1024
-static file_t file_table[FILE_MAX];
+static slab_t file_slab = SLAB_INIT("file", sizeof(file_t));
 
 //Character devices supported
 typedef enum file_chrdev_major_e
@@ -42,6 +43,7 @@ typedef struct file_chrdev_s
 	ssize_t (*read) (int minor, void *buf, ssize_t nbytes);
 	ssize_t (*write)(int minor, const void *buf, ssize_t nbytes);
 	int     (*ioctl)(int minor, int operation, void *buf, ssize_t len);
+	int     (*poll) (int minor, int events, int slot);
 } file_chrdev_t;
 static const file_chrdev_t file_chrdev_table[FILE_CHRDEV_MAJOR_MAX] = 
 {
@@ -69,6 +71,7 @@ static const file_chrdev_t file_chrdev_table[FILE_CHRDEV_MAJOR_MAX] =
 		.read = d_pty_f_read,
 		.write = d_pty_f_write,
 		.ioctl = d_pty_f_ioctl,
+		.poll = d_pty_f_poll,
 	},
 	[FILE_CHRDEV_MAJOR_PTY_B] = 
 	{
@@ -77,6 +80,7 @@ static const file_chrdev_t file_chrdev_table[FILE_CHRDEV_MAJOR_MAX] =
 		.read = d_pty_b_read,
 		.write = d_pty_b_write,
 		.ioctl = d_pty_b_ioctl,
+		.poll = d_pty_b_poll,
 	},
 };
 
@@ -98,28 +102,67 @@ static int file_chrdev_minor(int special)
 }
 
 
-//Gets a free entry from the file table. Returns it with the lock held.
+//Allocates a new file entry. Returns it with the lock held.
 static file_t *file_lockfree(void)
 {
-	for(int ff = 0; ff < FILE_MAX; ff++)
+	file_t *fptr = slab_alloc(&file_slab);
+	if(fptr == NULL)
+		return NULL;
+	
+	m_spl_acq(&(fptr->spl));
+	return fptr;
+}
+
+//Unlocks and frees a file entry that never got a reference.
+static void file_putfree(file_t *fptr)
+{
+	KASSERT(fptr->refs == 0);
+	m_spl_rel(&(fptr->spl));
+	slab_free(&file_slab, fptr);
+}
+
+//Fills in a new open file referring to an inode that was just looked up.
+//Called with the filesystem locked, and unlocks it. Frees the new file on failure.
+static int file_open_found(file_t *newfile, ino_t found_ino)
+{
+	//Alright, found the file. Add a reference and get its info.
+	newfile->ino = found_ino;
+	ramfs_inc(found_ino);
+	
+	//Done with filesystem at this point - we hold reference to the file, it won't go away.
+	ramfs_unlock();
+	
+	struct stat st;
+	int stat_err = ramfs_stat(found_ino, &st);
+	KASSERT(stat_err == 0);
+	
+	//If we're opening a device, make sure the device is OK with that. Close the file otherwise.
+	if(S_ISCHR(st.st_mode))
 	{
-		//Don't bother fighting over locks - a file entry already locked is already in use.
-		file_t *fptr = &(file_table[ff]);
-		if(m_spl_try(&(fptr->spl)))
+		const file_chrdev_t *major = file_chrdev_major(st.st_rdev);
+		if(major->open != NULL)
 		{
-			if(fptr->refs == 0)
+			int dev_err = (*(major->open))(file_chrdev_minor(st.st_rdev));
+			if(dev_err < 0)
 			{
-				//Got an unused file entry locked.
-				return fptr;
+				//Device said "no"
+				ramfs_lock();
+				ramfs_dec(found_ino);
+				ramfs_unlock();
+				
+				newfile->ino = 0;
+				file_putfree(newfile);
+				return dev_err;
 			}
-			
-			//File entry already used - let go of lock and keep looking
-			m_spl_rel(&(fptr->spl));
 		}
-	}	
+	}
 	
-	//Didn't find any free entries.
-	return NULL;
+	newfile->mode = st.st_mode;
+	newfile->special = st.st_rdev;
+	newfile->off = 0;
+	newfile->access = 0;
+	newfile->refs = 1;
+	return 0;
 }
 
 int file_make(file_t *dir, const char *name, mode_t mode, dev_t special, file_t **file_out)
@@ -156,7 +199,7 @@ int file_make(file_t *dir, const char *name, mode_t mode, dev_t special, file_t
 	if(make_err < 0)
 	{		
 		ramfs_unlock();
-		m_spl_rel(&(newfile->spl));
+		file_putfree(newfile);
 		return make_err;
 	}
 	
@@ -164,14 +207,14 @@ int file_make(file_t *dir, const char *name, mode_t mode, dev_t special, file_t
 	newfile->ino = ino_made;
 	ramfs_inc(ino_made);
 	
+	//Done with RAM FS at this point - our reference keeps the inode around.
+	ramfs_unlock();
+	
 	//Get status about the file we just made. NEEDED TO FIND OUT ID OF A NEW PIPE.
 	struct stat st;
 	int stat_err = ramfs_stat(ino_made, &st);
 	KASSERT(stat_err == 0);
 	
-	//Done with RAM FS at this point
-	ramfs_unlock();
-	
 	//If we're making a device node, make sure the device is OK with that. Close the file otherwise.
 	if(S_ISCHR(mode))
 	{
@@ -187,7 +230,7 @@ int file_make(file_t *dir, const char *name, mode_t mode, dev_t special, file_t
 				ramfs_unlock();
 				
 				newfile->ino = 0;
-				m_spl_rel(&(newfile->spl));
+				file_putfree(newfile);
 				return dev_err;
 			}
 		}
@@ -227,7 +270,7 @@ int file_find(file_t *dir, const char *name, file_t **file_out)
 		if(dir == NULL)
 		{
 			ramfs_unlock();
-			m_spl_rel(&(newfile->spl));
+			file_putfree(newfile);
 			return -EINVAL;
 		}
 		
@@ -248,53 +291,91 @@ int file_find(file_t *dir, const char *name, file_t **file_out)
 			if(find_err < 0)
 			{
 				ramfs_unlock();
-				m_spl_rel(&(newfile->spl));
+				file_putfree(newfile);
 				return find_err;
 			}
 		}
 	}
-		
-	//Alright, found the file. Add a reference and get its info.
-	newfile->ino = found_ino;
-	ramfs_inc(found_ino);
 	
-	struct stat st;
-	int stat_err = ramfs_stat(found_ino, &st);
-	KASSERT(stat_err == 0);
+	int open_err = file_open_found(newfile, found_ino);
+	if(open_err < 0)
+		return open_err;
 	
-	//Done with filesystem at this point - we hold reference to the file, it won't go away.
-	ramfs_unlock();
+	//If we're opening the reverse of a pipe, reverse the pipe reference.
+	if((name[0] == '~') && S_ISFIFO(dir->mode))
+		newfile->special *= -1;
 	
-	//If we're opening a device, make sure the device is OK with that. Close the file otherwise.
-	if(S_ISCHR(st.st_mode))
+	//Return the new file with one reference, still locked.
+	*file_out = newfile;
+	return 0;
+}
+
+int file_path(file_t *dir, const char *path, int flags, file_t **file_out)
+{
+	if(path == NULL)
+		return -EINVAL;
+	
+	//Absolute paths start at the root, and don't need a valid starting point.
+	if(dir == NULL && path[0] != '/')
+		return -EINVAL;
+	
+	//If we only want the directory containing the final component, stop at the last slash.
+	const char *path_end = path + strlen(path);
+	if(flags & _SC_PATH_PARENT)
 	{
-		const file_chrdev_t *major = file_chrdev_major(st.st_rdev);
-		if(major->open != NULL)
+		const char *last_slash = strrchr(path, '/');
+		path_end = (last_slash != NULL) ? last_slash : path;
+	}
+	
+	//Make sure we've got room for the new file.
+	file_t *newfile = file_lockfree();
+	if(newfile == NULL)
+		return -ENFILE;
+	
+	//Walk the whole path with the filesystem locked, so nothing disappears underneath us.
+	ramfs_lock();
+	ino_t found_ino = (path[0] == '/') ? 0 : dir->ino;
+	const char *pp = path;
+	while(pp < path_end)
+	{
+		//Skip slashes between components
+		while(pp < path_end && *pp == '/')
+			pp++;
+		
+		if(pp >= path_end)
+			break;
+		
+		//Copy out the component, up to the next slash
+		char comp[128];
+		size_t complen = 0;
+		while(pp < path_end && *pp != '/')
 		{
-			int dev_err = (*(major->open))(file_chrdev_minor(st.st_rdev));
-			if(dev_err < 0)
+			if(complen >= sizeof(comp) - 1)
 			{
-				//Device said "no"
-				ramfs_lock();
-				ramfs_dec(found_ino);
 				ramfs_unlock();
-				
-				newfile->ino = 0;
-				m_spl_rel(&(newfile->spl));
-				return dev_err;
+				file_putfree(newfile);
+				return -ENAMETOOLONG;
 			}
+			
+			comp[complen] = *pp;
+			complen++;
+			pp++;
+		}
+		comp[complen] = '\0';
+		
+		//Look it up in the directory we've reached so far
+		int find_err = ramfs_find(found_ino, comp, &found_ino);
+		if(find_err < 0)
+		{
+			ramfs_unlock();
+			file_putfree(newfile);
+			return find_err;
 		}
 	}
 	
-	newfile->mode = st.st_mode;
-	newfile->special = st.st_rdev;
-	newfile->off = 0;
-	newfile->access = 0;
-	newfile->refs = 1;
-	
-	//If we're opening the reverse of a pipe, reverse the pipe reference.
-	if((name[0] == '~') && S_ISFIFO(dir->mode))
-		newfile->special *= -1;
+	int open_err = file_open_found(newfile, found_ino);
+	if(open_err < 0)
+		return open_err;
 	
 	//Return the new file with one reference, still locked.
 	*file_out = newfile;
@@ -345,9 +426,7 @@ ssize_t file_read(file_t *file, void *buf, ssize_t nbytes)
 		return piperet;
 	}
 	
-	ramfs_lock();
 	ssize_t retval = ramfs_read(file->ino, file->off, buf, nbytes);
-	ramfs_unlock();
 	
 	if(retval < 0)
 		return retval;
@@ -385,9 +464,7 @@ ssize_t file_write(file_t *file, const void *buf, ssize_t nbytes)
 	if(S_ISDIR(file->mode))
 		return -EISDIR;
 	
-	ramfs_lock();
 	ssize_t retval = ramfs_write(file->ino, file->off, buf, nbytes);
-	ramfs_unlock();
 	
 	if(retval < 0)
 		return retval;
@@ -396,6 +473,111 @@ ssize_t file_write(file_t *file, const void *buf, ssize_t nbytes)
 	return retval;
 }
 
+//Where a splice is reading or writing a regular file
+typedef struct file_splice_pos_s
+{
+	ino_t ino;
+	off_t off;
+} file_splice_pos_t;
+
+//Where a splice is writing into another pipe
+typedef struct file_splice_pipe_s
+{
+	pipe_t *pipe;
+	pipe_dir_t dir;
+} file_splice_pipe_t;
+
+//Reads from a regular file right into a pipe's buffer, for file_splice.
+static ssize_t file_splice_fromfile(void *arg, uint8_t *data, ssize_t len)
+{
+	file_splice_pos_t *pos = (file_splice_pos_t*)arg;
+	ssize_t result = ramfs_read(pos->ino, pos->off, data, len);
+	if(result > 0)
+		pos->off += result;
+	
+	return result;
+}
+
+//Writes to a regular file right from a pipe's buffer, for file_splice.
+static ssize_t file_splice_tofile(void *arg, uint8_t *data, ssize_t len)
+{
+	file_splice_pos_t *pos = (file_splice_pos_t*)arg;
+	ssize_t result = ramfs_write(pos->ino, pos->off, data, len);
+	if(result > 0)
+		pos->off += result;
+	
+	return result;
+}
+
+//Writes to another pipe right from a pipe's buffer, for file_splice.
+static ssize_t file_splice_topipe(void *arg, uint8_t *data, ssize_t len)
+{
+	file_splice_pipe_t *dst = (file_splice_pipe_t*)arg;
+	return pipe_write(dst->pipe, dst->dir, data, len);
+}
+
+ssize_t file_splice(file_t *in, file_t *out, ssize_t nbytes)
+{
+	if(!(in->access & _SC_ACCESS_R) || !(out->access & _SC_ACCESS_W))
+		return -EBADF;
+	
+	bool in_pipe = S_ISFIFO(in->mode);
+	bool out_pipe = S_ISFIFO(out->mode);
+	if(!in_pipe && !out_pipe)
+		return -EINVAL;
+	
+	if( (!in_pipe && !S_ISREG(in->mode)) || (!out_pipe && !S_ISREG(out->mode)) )
+		return -EINVAL;
+	
+	int in_id = (in->special > 0) ? in->special : -in->special;
+	pipe_dir_t in_dir = (in->special > 0) ? PIPE_DIR_FORWARD : PIPE_DIR_REVERSE;
+	int out_id = (out->special > 0) ? out->special : -out->special;
+	pipe_dir_t out_dir = (out->special > 0) ? PIPE_DIR_FORWARD : PIPE_DIR_REVERSE;
+	
+	if(in_pipe && out_pipe)
+	{
+		//Can't hold one pipe's lock twice, and a pipe can't be spliced into itself anyway.
+		if(in_id == out_id)
+			return -EINVAL;
+		
+		//Lock the pipes in order of ID, so splices going opposite ways can't deadlock.
+		pipe_t *first = pipe_lockid((in_id < out_id) ? in_id : out_id);
+		pipe_t *second = pipe_lockid((in_id < out_id) ? out_id : in_id);
+		KASSERT(first != NULL && second != NULL);
+		
+		file_splice_pipe_t dst = { .pipe = (in_id < out_id) ? second : first, .dir = out_dir };
+		pipe_t *src = (in_id < out_id) ? first : second;
+		ssize_t result = pipe_drain(src, in_dir, nbytes, file_splice_topipe, &dst);
+		
+		pipe_unlock(second);
+		pipe_unlock(first);
+		return result;
+	}
+	
+	if(in_pipe)
+	{
+		//Pipe into file - adopted files need their own copy first, which ramfs_write takes care of.
+		file_splice_pos_t pos = { .ino = out->ino, .off = out->off };
+		pipe_t *pipe = pipe_lockid(in_id);
+		KASSERT(pipe != NULL);
+		ssize_t result = pipe_drain(pipe, in_dir, nbytes, file_splice_tofile, &pos);
+		pipe_unlock(pipe);
+		
+		out->off = pos.off;
+		return result;
+	}
+	
+	//File into pipe
+	file_splice_pos_t pos = { .ino = in->ino, .off = in->off };
+	pipe_t *pipe = pipe_lockid(out_id);
+	KASSERT(pipe != NULL);
+	ssize_t result = pipe_fill(pipe, out_dir, nbytes, file_splice_fromfile, &pos);
+	pipe_unlock(pipe);
+	
+	in->off = pos.off;
+	return result;
+}
+
 int file_trunc(file_t *file, off_t size)
 {
 	if(!(file->access & _SC_ACCESS_W))
@@ -410,19 +592,48 @@ int file_trunc(file_t *file, off_t size)
 	if(S_ISCHR(file->mode))
 		return -ENOTTY;
 	
-	ramfs_lock();
-	int retval = ramfs_trunc(file->ino, size);
-	ramfs_unlock();
+	return ramfs_trunc(file->ino, size);
+}
+
+ssize_t file_frames(file_t *file, off_t off, uintptr_t *frames, size_t max)
+{
+	if(!(file->access & _SC_ACCESS_R))
+		return -EBADF;
 	
-	return retval;
+	if(!S_ISREG(file->mode))
+		return -ENODEV;
+	
+	struct stat st;
+	int stat_err = ramfs_stat(file->ino, &st);
+	if(stat_err < 0)
+		return stat_err;
+	
+	size_t pagesize = m_frame_size();
+	if(off < 0 || (off % pagesize) != 0)
+		return -EINVAL;
+	
+	size_t count = 0;
+	while(count < max && off + (off_t)(count * pagesize) < st.st_size)
+	{
+		int map_err = ramfs_mapframe(file->ino, off + (count * pagesize), &(frames[count]));
+		if(map_err < 0)
+		{
+			//Give back what we got so far
+			for(size_t ff = 0; ff < count; ff++)
+			{
+				m_frame_free(frames[ff]);
+			}
+			return map_err;
+		}
+		count++;
+	}
+	
+	return count;
 }
 
 int file_stat(file_t *file, struct stat *st)
 {
-	ramfs_lock();
-	int retval = ramfs_stat(file->ino, st);
-	ramfs_unlock();
-	return retval;
+	return ramfs_stat(file->ino, st);
 }
 
 off_t file_seek(file_t *file, off_t offset, int whence)
@@ -446,9 +657,7 @@ off_t file_seek(file_t *file, off_t offset, int whence)
 		case SEEK_END:
 		{
 			struct stat st;
-			ramfs_lock();
 			int stat_err = ramfs_stat(file->ino, &st);
-			ramfs_unlock();
 			
 			if(stat_err < 0)
 				return stat_err;
@@ -478,9 +687,49 @@ int file_ioctl(file_t *file, int operation, void *buf, ssize_t len)
 		return (*(major->ioctl))(file_chrdev_minor(file->special), operation, buf, len);
 	}
 	
+	if(S_ISFIFO(file->mode))
+	{
+		int pipe_id = (file->special > 0) ? file->special : -file->special;
+		pipe_dir_t pipe_dir = (file->special > 0) ? PIPE_DIR_FORWARD : PIPE_DIR_REVERSE;
+		
+		pipe_t *pipe = pipe_lockid(pipe_id);
+		KASSERT(pipe != NULL);
+		int piperet = pipe_ioctl(pipe, pipe_dir, operation, buf, len);
+		pipe_unlock(pipe);
+		return piperet;
+	}
+	
 	return -ENOTTY;
 }
 
+int file_poll(file_t *file, int events, int slot)
+{
+	if(S_ISCHR(file->mode))
+	{
+		//Devices that don't say otherwise never make anyone wait.
+		const file_chrdev_t *major = file_chrdev_major(file->special);
+		if(major->poll == NULL)
+			return events & (_SC_POLL_IN | _SC_POLL_OUT);
+		
+		return (*(major->poll))(file_chrdev_minor(file->special), events, slot);
+	}
+	
+	if(S_ISFIFO(file->mode))
+	{
+		int pipe_id = (file->special > 0) ? file->special : -file->special;
+		pipe_dir_t pipe_dir = (file->special > 0) ? PIPE_DIR_FORWARD : PIPE_DIR_REVERSE;
+		
+		pipe_t *pipe = pipe_lockid(pipe_id);
+		KASSERT(pipe != NULL);
+		int piperet = pipe_poll(pipe, pipe_dir, events, slot);
+		pipe_unlock(pipe);
+		return piperet;
+	}
+	
+	//Regular files and directories are always ready.
+	return events & (_SC_POLL_IN | _SC_POLL_OUT);
+}
+
 void file_lock(file_t *file)
 {
 	m_spl_acq(&(file->spl));
@@ -510,6 +759,8 @@ void file_unlock(file_t *file)
 			if(file->access & _SC_ACCESS_W)
 				pipe->dirs[pipe_dir].refs_w--;
 			
+			//Let anyone waiting on the pipe see if it's been abandoned.
+			pipe_wakeall(pipe, pipe_dir);
 			pipe_unlock(pipe);
 		}
 		
@@ -517,10 +768,10 @@ void file_unlock(file_t *file)
 		ramfs_dec(file->ino); //Also deletes the pipe as the ino is being cleaned up - verifies no readers/writers
 		ramfs_unlock();
 		
-		file->ino = 0;
-		file->off = 0;
-		file->mode = 0;
-		file->special = 0;
+		//Nobody else can find the file without a reference - free it once unlocked.
+		m_spl_rel(&(file->spl));
+		slab_free(&file_slab, file);
+		return;
 	}
 	
 	m_spl_rel(&(file->spl));
@@ -6,8 +6,12 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include "m_spl.h"
 
+//Longest path accepted when resolving a whole path at once
+#define FILE_PATH_MAX 1024
+
 //Open file
 typedef struct file_s
 {
@@ -32,6 +36,11 @@ int file_make(file_t *dir, const char *name, mode_t mode, dev_t special, file_t
 //Returns 0 on success or a negative error number.
 int file_find(file_t *dir, const char *name, file_t **file_out);
 
+//Resolves a whole path, relative to the given directory or from the root if it begins with a slash.
+//Outputs a pointer to the new open file, with the lock held, and one reference.
+//With _SC_PATH_PARENT in flags, stops at the directory containing the final pathname component.
+int file_path(file_t *dir, const char *path, int flags, file_t **file_out);
+
 //Unlinks a file from the given directory file.
 int file_unlink(file_t *dir, const char *name, file_t *rmfile, int flags);
 
@@ -41,9 +50,18 @@ ssize_t file_read(file_t *file, void *buf, ssize_t nbytes);
 //Writes data into the open file.
 ssize_t file_write(file_t *file, const void *buf, ssize_t nbytes);
 
+//Moves data from one open file to another, straight between a pipe's buffer and the filesystem or another pipe.
+//One of the files must be a pipe, and the other a pipe or regular file. Both must be locked, and not be the same file.
+ssize_t file_splice(file_t *in, file_t *out, ssize_t nbytes);
+
 //Changes the size of the given open file.
 int file_trunc(file_t *file, off_t size);
 
+//Gets the frames holding a regular file's contents, a page at a time from the given page-aligned offset, for mapping.
+//Each frame gains a reference that the caller must drop. Stops at the end of the file.
+//Returns the number of frames output or a negative error number.
+ssize_t file_frames(file_t *file, off_t off, uintptr_t *frames, size_t max);
+
 //Returns status information about the given open file.
 int file_stat(file_t *file, struct stat *st);
 
@@ -53,6 +71,10 @@ off_t file_seek(file_t *file, off_t offset, int whence);
 //Interface to device-specific functions on device specials
 int file_ioctl(file_t *file, int operation, void *buf, ssize_t len);
 
+//Returns which of the given _SC_POLL_* conditions hold on the open file.
+//If slot is nonnegative, the current thread waits on the file for those that don't, using that polling slot and the next.
+int file_poll(file_t *file, int events, int slot);
+
 //Acquires the lock on the given file.
 void file_lock(file_t *file);
 
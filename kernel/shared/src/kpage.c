@@ -7,75 +7,300 @@
 #include "m_frame.h"
 #include "m_spl.h"
 #include "m_kspc.h"
+#include "rb.h"
 #include <string.h>
 
-//Range of usable kernel addresses
-static uintptr_t kpage_start;
-static uintptr_t kpage_end;
+//Free range of kernel addresses
+typedef struct kpage_range_s
+{
+	//Entry in the tree of free ranges, keyed by address
+	rb_item_t rb;
+	
+	//Pages in the range
+	size_t pages;
+	
+	//Links in the list of free ranges of similar size
+	struct kpage_range_s *next;
+	struct kpage_range_s *prev;
+	
+} kpage_range_t;
+
+//Number of size classes for free ranges. Class N has ranges of at least 2^N pages.
+#define KPAGE_CLASS_MAX 64
 
-//Next address we try - bump allocator!
-static uintptr_t kpage_next;
+//Free ranges by address, for merging neighbors when freeing.
+static rb_tree_t kpage_tree;
+
+//Free ranges by size class, for finding one big enough when allocating.
+static kpage_range_t *kpage_classes[KPAGE_CLASS_MAX];
+
+//Bookkeeping for free ranges that isn't in use, linked through their next pointers.
+static kpage_range_t *kpage_spare;
+
+//Bookkeeping for the initial range, before we can allocate any more.
+static kpage_range_t kpage_initial;
 
 //Spinlock protecting kernel page allocator
 static m_spl_t kpage_spl;
 
-//Finds a free region of the given number of pages.
+//How many frames we allocate at once when backing kernel pages
+#define KPAGE_ALLOC_BATCH 32
+
+//Returns the size class for a free range of the given number of pages.
+static int kpage_class(size_t pages)
+{
+	KASSERT(pages > 0);
+	int cc = 0;
+	while(pages > 1 && cc < KPAGE_CLASS_MAX - 1)
+	{
+		pages >>= 1;
+		cc++;
+	}
+	return cc;
+}
+
+//Returns the first address in a free range.
+static uintptr_t kpage_range_start(const kpage_range_t *range)
+{
+	return range->rb.key;
+}
+
+//Adds a free range to the list for its size class.
+static void kpage_class_add(kpage_range_t *range)
+{
+	int cc = kpage_class(range->pages);
+	range->prev = NULL;
+	range->next = kpage_classes[cc];
+	if(range->next != NULL)
+		range->next->prev = range;
+	
+	kpage_classes[cc] = range;
+}
+
+//Removes a free range from the list for its size class.
+static void kpage_class_remove(kpage_range_t *range)
+{
+	int cc = kpage_class(range->pages);
+	if(range->prev != NULL)
+		range->prev->next = range->next;
+	else
+		kpage_classes[cc] = range->next;
+	
+	if(range->next != NULL)
+		range->next->prev = range->prev;
+	
+	range->next = NULL;
+	range->prev = NULL;
+}
+
+//Changes the location and size of a free range, without changing its order relative to others.
+static void kpage_range_resize(kpage_range_t *range, uintptr_t start, size_t pages)
+{
+	kpage_class_remove(range);
+	range->rb.key = start;
+	range->pages = pages;
+	kpage_class_add(range);
+}
+
+//Removes a free range entirely, keeping its bookkeeping for reuse.
+static void kpage_range_remove(kpage_range_t *range)
+{
+	kpage_class_remove(range);
+	rb_remove(&kpage_tree, &(range->rb));
+	range->next = kpage_spare;
+	kpage_spare = range;
+}
+
+//Makes sure we have bookkeeping on-hand for at least one more free range.
+static void kpage_refill(void)
+{
+	if(kpage_spare != NULL)
+		return;
+	
+	//Take the first page of the biggest range we know of, and fill it with bookkeeping.
+	//Shrinking a range doesn't need bookkeeping of its own.
+	kpage_range_t *source = NULL;
+	for(int cc = KPAGE_CLASS_MAX - 1; cc >= 0 && source == NULL; cc--)
+	{
+		source = kpage_classes[cc];
+	}
+	if(source == NULL || source->pages < 2)
+		return;
+	
+	uintptr_t page = kpage_range_start(source);
+	uintptr_t frame = m_frame_alloc();
+	if(frame == 0)
+		return;
+	
+	if(!m_kspc_set(page, frame))
+	{
+		m_frame_free(frame);
+		return;
+	}
+	
+	size_t pagesize = m_frame_size();
+	kpage_range_resize(source, page + pagesize, source->pages - 1);
+	
+	kpage_range_t *newranges = (kpage_range_t*)page;
+	memset(newranges, 0, pagesize);
+	for(size_t rr = 0; rr < pagesize / sizeof(kpage_range_t); rr++)
+	{
+		newranges[rr].next = kpage_spare;
+		kpage_spare = &(newranges[rr]);
+	}
+}
+
+//Finds and takes a free region of the given number of pages.
 static uintptr_t kpage_findfree(size_t pages_needed)
 {
-	//Okay I wanted a bump allocator but I don't have a good way of freeing unneeded kernel pagetables.
-	//Probably just as wasteful either way - scanning for totally-0 PTs or starting over each time here.
-	kpage_next = 0;
+	//Any range in a class above what we need is big enough, so just take the first one we find.
+	//Only if there are none, look through the ranges in our own class.
+	kpage_range_t *found = NULL;
+	int cc_min = kpage_class(pages_needed);
+	for(int cc = cc_min + 1; cc < KPAGE_CLASS_MAX && found == NULL; cc++)
+	{
+		found = kpage_classes[cc];
+	}
+	for(kpage_range_t *rr = kpage_classes[cc_min]; rr != NULL && found == NULL; rr = rr->next)
+	{
+		if(rr->pages >= pages_needed)
+			found = rr;
+	}
+	
+	if(found == NULL)
+	{
+		//Didn't find enough free virtual kernel-space for this allocation (!?!?!?!).
+		return 0;
+	}
+	
+	//Take the beginning of the range
+	uintptr_t found_start = kpage_range_start(found);
+	if(found->pages == pages_needed)
+		kpage_range_remove(found);
+	else
+		kpage_range_resize(found, found_start + (pages_needed * m_frame_size()), found->pages - pages_needed);
+	
+	return found_start;
+}
+
+//Returns a range of pages to the free ranges, merging with its neighbors.
+static void kpage_putfree(uintptr_t start, size_t pages)
+{
+	//Get bookkeeping ready first, in case we can't merge. This might shrink a free range, but not our neighbors.
+	kpage_refill();
 	
-	//Do a stupid linear search through our kernel-space until we find that many free pages.
 	size_t pagesize = m_frame_size();
-	size_t maxattempts = (kpage_end - kpage_start) / pagesize;
-	uintptr_t found_start = 0;
-	size_t found_pages = 0;
-	for(size_t attempt = 0; attempt < maxattempts; attempt++)
-	{
-		//Search the next page, in-order.
-		//Wrap around our search point, if we hit the end of the address space
-		kpage_next += pagesize;
-		if(kpage_next < kpage_start || kpage_next >= kpage_end)
+	uintptr_t end = start + (pages * pagesize);
+	
+	rb_item_t *previtem = rb_findle(&kpage_tree, start);
+	rb_item_t *nextitem = (previtem != NULL) ? rb_next(previtem) : rb_first(&kpage_tree);
+	kpage_range_t *prev = (previtem != NULL) ? (kpage_range_t*)(previtem->userptr) : NULL;
+	kpage_range_t *next = (nextitem != NULL) ? (kpage_range_t*)(nextitem->userptr) : NULL;
+	
+	KASSERT(prev == NULL || kpage_range_start(prev) + (prev->pages * pagesize) <= start);
+	KASSERT(next == NULL || kpage_range_start(next) >= end);
+	
+	bool prev_touches = (prev != NULL) && (kpage_range_start(prev) + (prev->pages * pagesize) == start);
+	bool next_touches = (next != NULL) && (kpage_range_start(next) == end);
+	if(prev_touches && next_touches)
+	{
+		//Fills the hole between two free ranges
+		size_t total = prev->pages + pages + next->pages;
+		kpage_range_remove(next);
+		kpage_range_resize(prev, kpage_range_start(prev), total);
+	}
+	else if(prev_touches)
+	{
+		kpage_range_resize(prev, kpage_range_start(prev), prev->pages + pages);
+	}
+	else if(next_touches)
+	{
+		kpage_range_resize(next, start, next->pages + pages);
+	}
+	else
+	{
+		kpage_range_t *range = kpage_spare;
+		if(range == NULL)
 		{
-			kpage_next = kpage_start;
-			
-			//Can't span an allocation across the wraparound
-			found_start = 0;
-			found_pages = 0;
+			//No memory for bookkeeping. The space is lost, but that's better than failing.
+			return;
 		}
+		kpage_spare = range->next;
 		
-		if(m_kspc_get(kpage_next) != 0)
-		{
-			//This page isn't free. Can't use it.
-			found_start = 0;
-			found_pages = 0;
-		}
-		else
+		memset(range, 0, sizeof(*range));
+		range->pages = pages;
+		rb_insert(&kpage_tree, &(range->rb), start, range);
+		kpage_class_add(range);
+	}
+}
+
+//Finds and takes a free region of the given number of pages, with a guard page free on each side.
+//The region starts at an address congruent to phase, modulo align (a power of two no smaller than a page).
+//Returns the start of the region, or 0 if there's not enough space.
+static uintptr_t kpage_findguarded(size_t pages, uintptr_t align, uintptr_t phase)
+{
+	//Take enough extra to move the start anywhere within the alignment
+	size_t pagesize = m_frame_size();
+	size_t extra = (align / pagesize) - 1;
+	uintptr_t found = kpage_findfree(pages + 2 + extra);
+	if(found == 0)
+		return 0;
+	
+	//Skip ahead to the right alignment, and give back the extra on either side.
+	uintptr_t start = found + pagesize;
+	size_t skip = (size_t)((phase - start) & (align - 1) & ~(pagesize - 1)) / pagesize;
+	start += skip * pagesize;
+	
+	if(skip > 0)
+		kpage_putfree(found, skip);
+	
+	if(extra - skip > 0)
+		kpage_putfree(start + ((pages + 1) * pagesize), extra - skip);
+	
+	return start;
+}
+
+//Unmaps the kernel pages in the given range, freeing the frames behind them if requested.
+static void kpage_unmap(uintptr_t start, uintptr_t end, bool free_frames)
+{
+	size_t pagesize = m_frame_size();
+	size_t large = m_frame_large_size();
+	uintptr_t pp = start;
+	while(pp < end)
+	{
+		uintptr_t frame = m_kspc_get(pp);
+		KASSERT(frame != 0);
+		
+		//Large pages are only made where they fit entirely in the range, so take them out whole.
+		if(large != 0 && (pp % large) == 0 && end - pp >= large && m_kspc_set_large(pp, 0))
 		{
-			//This page is free. We can use this.
-			if(found_pages == 0)
-				found_start = kpage_next; //First usable page after unusable pages
+			for(size_t ff = 0; free_frames && ff < large; ff += pagesize)
+			{
+				m_frame_free(frame + ff);
+			}
 			
-			found_pages++;
-			if(found_pages >= pages_needed)
-				break;
+			pp += large;
+			continue;
 		}
+		
+		m_kspc_set(pp, 0);
+		if(free_frames)
+			m_frame_free(frame);
+		
+		pp += pagesize;
 	}
-	
-	if(found_pages < pages_needed)
-	{
-		//Didn't find enough free virtual kernel-space for this allocation (!?!?!?!).
-		return 0;
-	}	
-	
-	return found_start;
 }
 
 void kpage_init(void)
 {
-	//Figure out range of usable addresses
+	//Figure out range of usable addresses. Initially, it's all one free range.
+	uintptr_t kpage_start = 0;
+	uintptr_t kpage_end = 0;
 	m_kspc_range(&kpage_start, &kpage_end);
+	
+	kpage_initial.pages = (kpage_end - kpage_start) / m_frame_size();
+	rb_insert(&kpage_tree, &(kpage_initial.rb), kpage_start, &kpage_initial);
+	kpage_class_add(&kpage_initial);
 }
 
 void *kpage_alloc(size_t nbytes)
@@ -86,56 +311,83 @@ void *kpage_alloc(size_t nbytes)
 	size_t pagesize = m_frame_size();
 	size_t pages_needed = (nbytes + pagesize - 1) / pagesize;
 	
-	//We'll look for 2 more pages than that - to leave guard pages around each allocation.
-	pages_needed += 2;
+	//Allocations big enough for large pages get aligned for them.
+	size_t large = m_frame_large_size();
+	size_t align = pagesize;
+	if(large != 0 && pages_needed * pagesize >= large)
+		align = large;
 	
-	//Do a stupid linear search through our kernel-space until we find that many free pages.
-	uintptr_t found_start = kpage_findfree(pages_needed);
+	//Take a free range of that size, with guard pages around it.
+	uintptr_t found_start = kpage_findguarded(pages_needed, align, 0);
 	if(found_start == 0)
 	{
 		m_spl_rel(&kpage_spl);
 		return NULL;
 	}
 	
-	//Drop the guard pages from what we'll allocate
-	pages_needed -= 2;
-	found_start += pagesize;
-	
-	//Try to allocate frames and back this region
-	for(uintptr_t pp = found_start; pp < (found_start + (pagesize * pages_needed)); pp += pagesize)
+	//Try to allocate frames and back this region, taking frames a batch at a time
+	uintptr_t found_end = found_start + (pagesize * pages_needed);
+	uintptr_t pp = found_start;
+	while(pp < found_end)
 	{
-		uintptr_t newframe = m_frame_alloc();
-		if(newframe != 0)
+		//Back whole large pages with contiguous frames, when we can get them.
+		if(align == large && (pp % large) == 0 && found_end - pp >= large)
 		{
-			//Got a frame. Zero it and put it in kernel-space here.
-			bool mapped = m_kspc_set(pp, newframe);
-			if(mapped)
+			uintptr_t base = m_frame_alloc_contig(large / pagesize);
+			if(base != 0)
 			{
-				//Success. Keep going.
-				continue;
+				if(m_kspc_set_large(pp, base))
+				{
+					pp += large;
+					continue;
+				}
+				
+				for(size_t ff = 0; ff < large; ff += pagesize)
+				{
+					m_frame_free(base + ff);
+				}
 			}
 		}
 		
-		//Failed to allocate or map the next frame.
+		uintptr_t frames[KPAGE_ALLOC_BATCH];
+		size_t count = (found_end - pp) / pagesize;
+		if(count > KPAGE_ALLOC_BATCH)
+			count = KPAGE_ALLOC_BATCH;
+		
+		//Stop at the next large page boundary, to try a large page there.
+		if(align == large && count > (large - (pp % large)) / pagesize)
+			count = (large - (pp % large)) / pagesize;
 		
-		//Put the frame back if we allocated one
-		if(newframe != 0)
+		size_t mapped = 0;
+		if(m_frame_alloc_n(frames, count))
 		{
-			m_frame_free(newframe);
-			newframe = 0;
+			//Got the frames. Put them in kernel-space here.
+			while(mapped < count && m_kspc_set(pp, frames[mapped]))
+			{
+				mapped++;
+				pp += pagesize;
+			}
+			
+			if(mapped == count)
+			{
+				//Success. Keep going.
+				continue;
+			}
+			
+			//Put back the frames we couldn't map
+			for(size_t ff = mapped; ff < count; ff++)
+			{
+				m_frame_free(frames[ff]);
+			}
 		}
 		
+		//Failed to allocate or map the next frames.
+		
 		//Unwind any allocation we partially completed.
-		while(pp > found_start)
-		{
-			pp -= pagesize;
-			uintptr_t unwind = m_kspc_get(pp);
-			KASSERT(unwind != 0); //We just mapped this page, it should still be here
-			m_kspc_set(pp, 0);
-			m_frame_free(unwind);
-		}
+		kpage_unmap(found_start, pp, true);
 		
 		//Didn't have enough memory to complete the allocation
+		kpage_putfree(found_start - pagesize, pages_needed + 2);
 		m_spl_rel(&kpage_spl);
 		return NULL;
 	}
@@ -155,13 +407,10 @@ void kpage_free(void *ptr, size_t nbytes)
 	size_t npages = (nbytes + pagesize - 1) / pagesize;
 	
 	//Unmap and free that many frames
-	for(uintptr_t pp = (uintptr_t)ptr; pp < (uintptr_t)ptr + (npages * pagesize); pp += pagesize)
-	{
-		uintptr_t frame = m_kspc_get(pp);
-		KASSERT(frame != 0);
-		m_kspc_set(pp, 0);
-		m_frame_free(frame);
-	}
+	kpage_unmap((uintptr_t)ptr, (uintptr_t)ptr + (npages * pagesize), true);
+	
+	//Give back the space, including the guard pages around it
+	kpage_putfree((uintptr_t)ptr - pagesize, npages + 2);
 	
 	m_spl_rel(&kpage_spl);
 }
@@ -172,40 +421,48 @@ void *kpage_physadd(uintptr_t paddr, size_t nbytes)
 	
 	size_t pagesize = m_frame_size();
 	size_t pages_needed = (nbytes + pagesize - 1) / pagesize;
-	pages_needed += 2;
 	
-	uintptr_t found_start = kpage_findfree(pages_needed);
+	//Big mappings get placed so that large pages line up with the physical addresses.
+	size_t large = m_frame_large_size();
+	size_t align = pagesize;
+	if(large != 0 && pages_needed * pagesize >= large)
+		align = large;
+	
+	uintptr_t found_start = kpage_findguarded(pages_needed, align, paddr);
 	if(found_start == 0)
 	{
 		m_spl_rel(&kpage_spl);
 		return NULL;
 	}
 	
-	pages_needed -= 2;
-	found_start += pagesize;
-	
-	//Try to allocate frames and back this region
-	for(uintptr_t pp = found_start; pp < (found_start + (pagesize * pages_needed)); pp += pagesize)
+	//Try to map the physical frames into this region
+	uintptr_t found_end = found_start + (pagesize * pages_needed);
+	uintptr_t pp = found_start;
+	while(pp < found_end)
 	{
+		//Map whole large pages where they fit
+		uintptr_t target = paddr + (pp - found_start);
+		if(align == large && (pp % large) == 0 && found_end - pp >= large && m_kspc_set_large(pp, target))
+		{
+			pp += large;
+			continue;
+		}
+		
 		//Try to map the appropriate physical frame here
-		bool mapped = m_kspc_set(pp, paddr + (pp - found_start));
+		bool mapped = m_kspc_set(pp, target);
 		if(mapped)
 		{
 			//Success. Keep going.
+			pp += pagesize;
 			continue;
 		}
 		
 		//Failed to map the next frame.
 		//Unwind any allocation we partially completed.
-		while(pp > found_start)
-		{
-			pp -= pagesize;
-			uintptr_t unwind = m_kspc_get(pp);
-			KASSERT(unwind != 0); //We just mapped this page, it should still be here
-			m_kspc_set(pp, 0);
-		}
+		kpage_unmap(found_start, pp, false);
 		
 		//Didn't have enough room for paging structures (?) to complete the allocation
+		kpage_putfree(found_start - pagesize, pages_needed + 2);
 		m_spl_rel(&kpage_spl);
 		return NULL;
 	}
@@ -225,12 +482,10 @@ void kpage_physdel(void *ptr, size_t nbytes)
 	size_t npages = (nbytes + pagesize - 1) / pagesize;
 	
 	//Unmap that many frames - but don't free them
-	for(uintptr_t pp = (uintptr_t)ptr; pp < (uintptr_t)ptr + (npages * pagesize); pp++)
-	{
-		uintptr_t frame = m_kspc_get(pp);
-		KASSERT(frame != 0);
-		m_kspc_set(pp, 0);
-	}
+	kpage_unmap((uintptr_t)ptr, (uintptr_t)ptr + (npages * pagesize), false);
+	
+	//Give back the space, including the guard pages around it
+	kpage_putfree((uintptr_t)ptr - pagesize, npages + 2);
 	
 	m_spl_rel(&kpage_spl);	
 }
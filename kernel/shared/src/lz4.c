@@ -0,0 +1,90 @@
+//lz4.c
+//LZ4 block decompression
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "lz4.h"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+//Reads a length that continues into extra bytes when its 4-bit field is all ones.
+//Returns the length, or -1 if the input runs out.
+static ssize_t lz4_length(const uint8_t **in, const uint8_t *in_end, size_t nibble)
+{
+	size_t len = nibble;
+	if(nibble == 15)
+	{
+		while(1)
+		{
+			if(*in >= in_end)
+				return -1;
+			
+			uint8_t more = **in;
+			(*in)++;
+			len += more;
+			if(more != 255)
+				break;
+		}
+	}
+	return len;
+}
+
+ssize_t lz4_block(const void *src, size_t src_len, void *dst, size_t dst_max)
+{
+	const uint8_t *in = (const uint8_t*)src;
+	const uint8_t *in_end = in + src_len;
+	uint8_t *out = (uint8_t*)dst;
+	uint8_t *out_end = out + dst_max;
+	
+	//Each sequence is some literal bytes, then a match copied from earlier output.
+	//The last sequence ends after its literals.
+	while(in < in_end)
+	{
+		uint8_t token = *in;
+		in++;
+		
+		ssize_t lit_len = lz4_length(&in, in_end, token >> 4);
+		if(lit_len < 0 || lit_len > in_end - in || lit_len > out_end - out)
+			return -EINVAL;
+		
+		memcpy(out, in, lit_len);
+		in += lit_len;
+		out += lit_len;
+		
+		if(in == in_end)
+			break;
+		
+		if(in_end - in < 2)
+			return -EINVAL;
+		
+		size_t match_off = in[0] | ((size_t)(in[1]) << 8);
+		in += 2;
+		if(match_off == 0 || match_off > (size_t)(out - (uint8_t*)dst))
+			return -EINVAL;
+		
+		ssize_t match_len = lz4_length(&in, in_end, token & 0xF);
+		if(match_len < 0)
+			return -EINVAL;
+		
+		match_len += 4;
+		if(match_len > out_end - out)
+			return -EINVAL;
+		
+		//Matches can overlap what they produce - then they have to be copied a byte at a time.
+		const uint8_t *match = out - match_off;
+		if((ssize_t)match_off >= match_len)
+		{
+			memcpy(out, match, match_len);
+		}
+		else
+		{
+			for(ssize_t mm = 0; mm < match_len; mm++)
+			{
+				out[mm] = match[mm];
+			}
+		}
+		out += match_len;
+	}
+	
+	return out - (uint8_t*)dst;
+}
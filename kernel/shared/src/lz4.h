@@ -0,0 +1,14 @@
+//lz4.h
+//LZ4 block decompression
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+//Decompresses one LZ4 block, as found in an LZ4 frame with independent blocks.
+//Returns the number of bytes output, or a negative error number if the block is corrupt or won't fit.
+ssize_t lz4_block(const void *src, size_t src_len, void *dst, size_t dst_max);
+
+#endif //LZ4_H
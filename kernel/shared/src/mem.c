@@ -4,37 +4,232 @@
 
 #include "mem.h"
 #include "kassert.h"
+#include "slab.h"
 #include "m_frame.h"
 #include "m_uspc.h"
 #include <errno.h>
+#include <string.h>
 
-void mem_clear(mem_t *mem)
+//How many frames we unmap before making other cores flush them and freeing them
+#define MEM_FREE_BATCH 64
+
+//How many frames we allocate at once when filling a segment
+#define MEM_FILL_BATCH 32
+
+//Define to copy every page when copying a memory space, rather than sharing them copy-on-write.
+//Only useful for comparing the two.
+//#define MEM_COPY_EAGER
+
+//Segment bookkeeping
+static slab_t mem_seg_slab = SLAB_INIT("mem_seg", sizeof(mem_seg_t));
+
+//Returns the segment for an entry in a memory space's index, or NULL if passed NULL.
+static mem_seg_t *mem_seg_of(const rb_item_t *item)
 {
-	size_t pagesize = m_frame_size();
+	if(item == NULL)
+		return NULL;
 	
-	for(int ss = 0; ss < MEM_SEG_MAX; ss++)
+	return (mem_seg_t*)(item->userptr);
+}
+
+//Allocates bookkeeping for a segment. Returns NULL if out of memory.
+static mem_seg_t *mem_seg_alloc(void)
+{
+	return slab_alloc(&mem_seg_slab);
+}
+
+//Frees bookkeeping for a segment.
+static void mem_seg_free(mem_seg_t *sptr)
+{
+	slab_free(&mem_seg_slab, sptr);
+}
+
+//Recomputes the largest gap before any segment in an item's subtree.
+//Called by the tree whenever the item's children change - on insert, on removal, and in rotations.
+static void mem_seg_augment(rb_item_t *item)
+{
+	mem_seg_t *sptr = mem_seg_of(item);
+	sptr->gap_max = sptr->gap;
+	
+	if(item->left != NULL && mem_seg_of(item->left)->gap_max > sptr->gap_max)
+		sptr->gap_max = mem_seg_of(item->left)->gap_max;
+	
+	if(item->right != NULL && mem_seg_of(item->right)->gap_max > sptr->gap_max)
+		sptr->gap_max = mem_seg_of(item->right)->gap_max;
+}
+
+//Recomputes the unused space before a segment, after its start or the segment before it changes.
+static void mem_seg_regap(mem_t *mem, mem_seg_t *sptr)
+{
+	if(sptr == NULL)
+		return;
+	
+	uintptr_t gap_start = 0;
+	uintptr_t uspc_end = 0;
+	m_uspc_range(&gap_start, &uspc_end);
+	
+	const mem_seg_t *prev = mem_seg_of(rb_prev(&(sptr->rb)));
+	if(prev != NULL)
+		gap_start = prev->vaddr + prev->size;
+	
+	KASSERT(sptr->vaddr >= gap_start);
+	sptr->gap = sptr->vaddr - gap_start;
+	rb_update(&(mem->segs), &(sptr->rb));
+}
+
+//Adds a segment to the index of a memory space.
+static void mem_seg_insert(mem_t *mem, mem_seg_t *sptr)
+{
+	mem->segs.augment = mem_seg_augment;
+	
+	sptr->gap = 0;
+	rb_insert(&(mem->segs), &(sptr->rb), sptr->vaddr, sptr);
+	
+	//Its own gap, and that of the segment after it, depend on where it went.
+	mem_seg_regap(mem, sptr);
+	mem_seg_regap(mem, mem_seg_of(rb_next(&(sptr->rb))));
+}
+
+//Returns the segment containing the given address, or NULL if none does.
+static mem_seg_t *mem_seg_find(mem_t *mem, uintptr_t addr)
+{
+	mem_seg_t *sptr = mem_seg_of(rb_findle(&(mem->segs), addr));
+	if(sptr == NULL || addr - sptr->vaddr >= sptr->size)
+		return NULL;
+	
+	return sptr;
+}
+
+//Returns the first segment in the subtree with at least the given gap before it.
+static mem_seg_t *mem_gap_first(rb_item_t *item, size_t size)
+{
+	if(item == NULL || mem_seg_of(item)->gap_max < size)
+		return NULL;
+	
+	while(1)
 	{
-		uintptr_t start = mem->segs[ss].vaddr;
-		uintptr_t end = start + mem->segs[ss].size;
+		if(item->left != NULL && mem_seg_of(item->left)->gap_max >= size)
+			item = item->left;
+		else if(mem_seg_of(item)->gap >= size)
+			return mem_seg_of(item);
+		else
+			item = item->right;
+		
+		KASSERT(item != NULL);
+	}
+}
 
-		if(end > start)
+//Returns the last segment in the subtree with at least the given gap before it.
+static mem_seg_t *mem_gap_last(rb_item_t *item, size_t size)
+{
+	if(item == NULL || mem_seg_of(item)->gap_max < size)
+		return NULL;
+	
+	while(1)
+	{
+		if(item->right != NULL && mem_seg_of(item->right)->gap_max >= size)
+			item = item->right;
+		else if(mem_seg_of(item)->gap >= size)
+			return mem_seg_of(item);
+		else
+			item = item->left;
+		
+		KASSERT(item != NULL);
+	}
+}
+
+//Returns the first segment in the subtree starting after the given address, with at least the given gap before it.
+static mem_seg_t *mem_gap_after(rb_item_t *item, uintptr_t addr, size_t size)
+{
+	if(item == NULL || mem_seg_of(item)->gap_max < size)
+		return NULL;
+	
+	if(item->key <= addr)
+		return mem_gap_after(item->right, addr, size);
+	
+	mem_seg_t *found = mem_gap_after(item->left, addr, size);
+	if(found != NULL)
+		return found;
+	
+	if(mem_seg_of(item)->gap >= size)
+		return mem_seg_of(item);
+	
+	return mem_gap_first(item->right, size);
+}
+
+//Returns the last segment in the subtree starting at or before the given address, with at least the given gap before it.
+static mem_seg_t *mem_gap_before(rb_item_t *item, uintptr_t addr, size_t size)
+{
+	if(item == NULL || mem_seg_of(item)->gap_max < size)
+		return NULL;
+	
+	if(item->key > addr)
+		return mem_gap_before(item->left, addr, size);
+	
+	mem_seg_t *found = mem_gap_before(item->right, addr, size);
+	if(found != NULL)
+		return found;
+	
+	if(mem_seg_of(item)->gap >= size)
+		return mem_seg_of(item);
+	
+	return mem_gap_last(item->left, size);
+}
+
+//Unmaps and frees whatever pages are filled in over the given range.
+//Large pages must lie entirely within the range, and are taken out whole.
+static void mem_unmaprange(mem_t *mem, uintptr_t start, uintptr_t end)
+{
+	size_t pagesize = m_frame_size();
+	size_t large = m_frame_large_size();
+	
+	uintptr_t pp = start;
+	while(pp < end)
+	{
+		//Pages might not be filled in, if they were never touched or we failed partway through copying
+		uintptr_t frame = m_uspc_get(mem->uspc, pp);
+		if(frame == 0)
 		{
-			KASSERT(start % pagesize == 0);
-			KASSERT(end % pagesize == 0);
-			KASSERT(mem->uspc != 0);
-			
-			for(uintptr_t pp = start; pp < end; pp += pagesize)
+			pp += pagesize;
+			continue;
+		}
+		
+		if(large != 0 && (pp % large) == 0 && end - pp >= large && m_uspc_set_large(mem->uspc, pp, 0, 0))
+		{
+			for(size_t ff = 0; ff < large; ff += pagesize)
 			{
-				uintptr_t frame = m_uspc_get(mem->uspc, pp);
-				KASSERT(frame != 0);
-				m_uspc_set(mem->uspc, pp, 0, 0);
-				m_frame_free(frame);
+				m_frame_free(frame + ff);
 			}
-		}
 			
-		mem->segs[ss].vaddr = 0;
-		mem->segs[ss].size = 0;
-		mem->segs[ss].prot = 0;
+			pp += large;
+			continue;
+		}
+		
+		bool unmapped = m_uspc_set(mem->uspc, pp, 0, 0);
+		KASSERT(unmapped);
+		m_frame_free(frame);
+		pp += pagesize;
+	}
+}
+
+void mem_clear(mem_t *mem)
+{
+	size_t pagesize = m_frame_size();
+	
+	while(mem->segs.root != NULL)
+	{
+		mem_seg_t *sptr = mem_seg_of(rb_first(&(mem->segs)));
+		uintptr_t start = sptr->vaddr;
+		uintptr_t end = start + sptr->size;
+		
+		KASSERT(start % pagesize == 0);
+		KASSERT(end % pagesize == 0);
+		KASSERT(mem->uspc != 0);
+		
+		mem_unmaprange(mem, start, end);
+		
+		rb_remove(&(mem->segs), &(sptr->rb));
+		mem_seg_free(sptr);
 	}
 		
 	if(mem->uspc != 0)
@@ -44,34 +239,144 @@ void mem_clear(mem_t *mem)
 	}
 }
 
-int mem_add(mem_t *mem, uintptr_t vaddr, size_t size, int prot)
+//Allocates a zeroed frame and maps it at the given page. Returns false if out of memory.
+static bool mem_fillpage(mem_t *mem, uintptr_t page, int prot)
+{
+	uintptr_t newframe = m_frame_alloc();
+	if(newframe == 0)
+		return false;
+	
+	m_frame_zero(newframe);
+	if(!m_uspc_set(mem->uspc, page, newframe, prot))
+	{
+		m_frame_free(newframe);
+		return false;
+	}
+	
+	return true;
+}
+
+//Tries to back the large page around the given page with contiguous zeroed frames, all at once.
+//Only done if the large page lies entirely within the given limits, and nothing in it is mapped yet.
+//Returns the end of the large page if it was mapped, or 0 if not.
+static uintptr_t mem_filllarge(mem_t *mem, uintptr_t page, uintptr_t lim_start, uintptr_t lim_end, int prot)
 {
-	//Location and size must be page-aligned
 	size_t pagesize = m_frame_size();
-	if(vaddr % pagesize != 0)
-		return -EINVAL;
+	size_t large = m_frame_large_size();
+	if(large == 0)
+		return 0;
 	
-	if(size % pagesize != 0)
-		size += pagesize - (size % pagesize);
+	uintptr_t start = page - (page % large);
+	uintptr_t end = start + large;
+	if(start < lim_start || end > lim_end || end < start)
+		return 0;
 	
-	//Find place to store the segment
-	mem_seg_t *sptr = NULL;
-	int sptr_idx = -1;
-	for(int ss = 0; ss < MEM_SEG_MAX; ss++)
+	if(!m_uspc_large_ok(mem->uspc, start))
+		return 0;
+	
+	uintptr_t base = m_frame_alloc_contig(large / pagesize);
+	if(base == 0)
+		return 0;
+	
+	for(size_t ff = 0; ff < large; ff += pagesize)
 	{
-		if(mem->segs[ss].size == 0)
+		m_frame_zero(base + ff);
+	}
+	
+	if(!m_uspc_set_large(mem->uspc, start, base, prot))
+	{
+		for(size_t ff = 0; ff < large; ff += pagesize)
 		{
-			sptr = &(mem->segs[ss]);
-			sptr_idx = ss;
-			break;
+			m_frame_free(base + ff);
 		}
+		return 0;
 	}
-	if(sptr == NULL)
+	
+	return end;
+}
+
+//Allocates zeroed frames and maps them over the given range, taking frames in batches.
+//Returns the end of what was mapped, which is short of the given end if out of memory.
+static uintptr_t mem_fillrange(mem_t *mem, uintptr_t start, uintptr_t end, int prot)
+{
+	size_t pagesize = m_frame_size();
+	uintptr_t frames[MEM_FILL_BATCH];
+	
+	size_t large = m_frame_large_size();
+	
+	uintptr_t pp = start;
+	while(pp < end)
 	{
-		//No room for more segment references
-		return -EMFILE;
+		//Use large pages where they fit
+		uintptr_t large_end = (large != 0 && (pp % large) == 0) ? mem_filllarge(mem, pp, start, end, prot) : 0;
+		if(large_end != 0)
+		{
+			pp = large_end;
+			continue;
+		}
+		
+		size_t count = (end - pp) / pagesize;
+		if(count > MEM_FILL_BATCH)
+			count = MEM_FILL_BATCH;
+		
+		//Stop at the next large page boundary, to try a large page there.
+		if(large != 0 && count > (large - (pp % large)) / pagesize)
+			count = (large - (pp % large)) / pagesize;
+		
+		if(!m_frame_alloc_n(frames, count))
+			return pp;
+		
+		for(size_t ff = 0; ff < count; ff++)
+		{
+			m_frame_zero(frames[ff]);
+			if(!m_uspc_set(mem->uspc, pp, frames[ff], prot))
+			{
+				//Failed to map - give back this frame and the rest of the batch
+				for(size_t rr = ff; rr < count; rr++)
+				{
+					m_frame_free(frames[rr]);
+				}
+				return pp;
+			}
+			pp += pagesize;
+		}
 	}
 	
+	return pp;
+}
+
+//Adds a segment to a memory space, allocating all its pages now or leaving them to be filled on first access.
+static int mem_seg_new(mem_t *mem, uintptr_t vaddr, size_t size, int prot, bool fill)
+{
+	//Location and size must be page-aligned
+	size_t pagesize = m_frame_size();
+	if(vaddr % pagesize != 0)
+		return -EINVAL;
+	
+	if(size % pagesize != 0)
+		size += pagesize - (size % pagesize);
+	
+	//Must be within userspace
+	uintptr_t uspc_start = 0;
+	uintptr_t uspc_end = 0;
+	m_uspc_range(&uspc_start, &uspc_end);
+	if(size == 0 || vaddr < uspc_start || vaddr > uspc_end || size > uspc_end - vaddr)
+		return -EINVAL;
+	
+	//Make sure the virtual space is free - nothing before it runs into it, and nothing after it starts inside it
+	rb_item_t *prev = rb_findle(&(mem->segs), vaddr);
+	if(prev != NULL && mem_seg_of(prev)->vaddr + mem_seg_of(prev)->size > vaddr)
+		return -EBUSY;
+	
+	rb_item_t *next = (prev != NULL) ? rb_next(prev) : rb_first(&(mem->segs));
+	if(next != NULL && next->key < vaddr + size)
+		return -EBUSY;
+	
+	//Make bookkeeping for the segment
+	mem_seg_t *sptr = mem_seg_alloc();
+	if(sptr == NULL)
+		return -ENOMEM;
+	
 	//Make the userspace paging structures, if none exist
 	if(mem->uspc == 0)
 	{
@@ -79,93 +384,205 @@ int mem_add(mem_t *mem, uintptr_t vaddr, size_t size, int prot)
 		if(mem->uspc == 0)
 		{
 			//Failed to allocate paging structures.
+			mem_seg_free(sptr);
 			return -ENOMEM;
 		}
 	}
 	
-	//Make sure the virtual space is free
-	for(uintptr_t pp = vaddr; pp < vaddr + size; pp += pagesize)
+	//Try to fill the requested range, if we're not leaving it to be filled on demand
+	uintptr_t filled = fill ? mem_fillrange(mem, vaddr, vaddr + size, prot) : (vaddr + size);
+	if(filled != vaddr + size)
 	{
-		uintptr_t oldframe = m_uspc_get(mem->uspc, pp);
-		if(oldframe != 0)
-			return -EBUSY;
-	}
-	
-	//Try to fill the requested range
-	for(uintptr_t pp = vaddr; pp < vaddr + size; pp += pagesize)
-	{
-		uintptr_t newframe = m_frame_alloc();
-		if(newframe != 0)
-		{
-			bool mapped = m_uspc_set(mem->uspc, pp, newframe, prot);
-			if(mapped)
-			{
-				//Success - keep going
-				continue;
-			}
-		}
-		
 		//Failed to allocate or map a frame here. Unwind and fail.
-		if(newframe != 0)
-		{
-			m_frame_free(newframe);
-			newframe = 0;
-		}
-		
-		while(pp > vaddr)
-		{
-			pp -= pagesize;
-			uintptr_t unwind = m_uspc_get(mem->uspc, pp);
-			KASSERT(unwind != 0);
-			m_uspc_set(mem->uspc, pp, 0, 0);
-			m_frame_free(unwind);
-		}
+		mem_unmaprange(mem, vaddr, filled);
 		
+		mem_seg_free(sptr);
 		return -ENOMEM;
 	}
 	
-	//Success. Insert into the free index.
+	//Success. Insert into the index.
 	sptr->vaddr = vaddr;
 	sptr->size = size;
 	sptr->prot = prot;
+	mem_seg_insert(mem, sptr);
+	return 0;
+}
+
+int mem_add(mem_t *mem, uintptr_t vaddr, size_t size, int prot)
+{
+	m_spl_acq(&(mem->spl));
+	int retval = mem_seg_new(mem, vaddr, size, prot, true);
+	m_spl_rel(&(mem->spl));
+	return retval;
+}
+
+int mem_reserve(mem_t *mem, uintptr_t vaddr, size_t size, int prot)
+{
+	m_spl_acq(&(mem->spl));
+	int retval = mem_seg_new(mem, vaddr, size, prot, false);
+	m_spl_rel(&(mem->spl));
+	return retval;
+}
+
+int mem_share(mem_t *mem, uintptr_t vaddr, size_t size, int prot, const uintptr_t *frames, size_t nframes)
+{
+	size_t pagesize = m_frame_size();
+	size_t nmap = (size + pagesize - 1) / pagesize;
+	if(nmap > nframes)
+		nmap = nframes;
 	
-	//Bubble-sort with the other indexes, to keep them in-order.
-	while(1)
+	m_spl_acq(&(mem->spl));
+	
+	//Pages past the frames given are filled on demand.
+	int retval = mem_seg_new(mem, vaddr, size, prot, false);
+	bool made = (retval >= 0);
+	
+	//The frames are never written through this mapping. Writable pages are copied on the first write.
+	int share_prot = prot;
+	if(share_prot & M_USPC_PROT_W)
+		share_prot = (share_prot & ~M_USPC_PROT_W) | M_USPC_PROT_COW;
+	
+	size_t mapped = 0;
+	while(retval >= 0 && mapped < nmap)
+	{
+		if(!m_uspc_set(mem->uspc, vaddr + (mapped * pagesize), frames[mapped], share_prot))
+			retval = -ENOMEM;
+		else
+			mapped++;
+	}
+	
+	m_spl_rel(&(mem->spl));
+	
+	//If we couldn't map them all, take the segment back out. That drops the references of the ones we mapped.
+	if(retval < 0 && made)
+		mem_free(mem, vaddr, size);
+	
+	//Drop the references of frames we never mapped
+	for(size_t ff = mapped; ff < nframes; ff++)
 	{
-		if(sptr_idx > 0)
+		m_frame_free(frames[ff]);
+	}
+	
+	return retval;
+}
+
+int mem_fill(mem_t *mem, uintptr_t vaddr, size_t size)
+{
+	size_t pagesize = m_frame_size();
+	uintptr_t start = vaddr - (vaddr % pagesize);
+	uintptr_t end = vaddr + size;
+	if(end < vaddr)
+		return -EINVAL;
+	
+	m_spl_acq(&(mem->spl));
+	
+	int retval = 0;
+	for(uintptr_t pp = start; pp < end; pp += pagesize)
+	{
+		const mem_seg_t *sptr = mem_seg_find(mem, pp);
+		if(sptr == NULL)
 		{
-			if((mem->segs[sptr_idx-1].size == 0) || (mem->segs[sptr_idx].vaddr < mem->segs[sptr_idx-1].vaddr))
-			{
-				mem_seg_t temp = mem->segs[sptr_idx];
-				mem->segs[sptr_idx] = mem->segs[sptr_idx - 1];
-				mem->segs[sptr_idx - 1] = temp;
-				sptr_idx--;
-				continue;
-			}
+			retval = -EFAULT;
+			break;
 		}
 		
-		if(sptr_idx < MEM_SEG_MAX - 1)
+		if(m_uspc_get(mem->uspc, pp) != 0)
+			continue;
+		
+		//Fill a whole large page at once if we can
+		uintptr_t large_end = mem_filllarge(mem, pp, sptr->vaddr, sptr->vaddr + sptr->size, sptr->prot);
+		if(large_end != 0)
 		{
-			if((mem->segs[sptr_idx+1].size != 0) && (mem->segs[sptr_idx].vaddr > mem->segs[sptr_idx+1].vaddr))
-			{
-				mem_seg_t temp = mem->segs[sptr_idx];
-				mem->segs[sptr_idx] = mem->segs[sptr_idx + 1];
-				mem->segs[sptr_idx + 1] = temp;
-				sptr_idx++;
-				continue;
-			}
+			pp = large_end - pagesize;
+			continue;
 		}
 		
-		break;
+		if(!mem_fillpage(mem, pp, sptr->prot))
+		{
+			//Pages filled so far are left in place - they'd be filled on demand anyway.
+			retval = -ENOMEM;
+			break;
+		}
 	}
 	
-	return 0;
+	m_spl_rel(&(mem->spl));
+	return retval;
+}
+
+bool mem_fault(mem_t *mem, uintptr_t addr, bool write)
+{
+	size_t pagesize = m_frame_size();
+	uintptr_t page = addr - (addr % pagesize);
+	
+	m_spl_acq(&(mem->spl));
+	
+	bool retval = false;
+	const mem_seg_t *sptr = mem_seg_find(mem, page);
+	if(sptr == NULL)
+	{
+		//Not in any segment
+		retval = false;
+	}
+	else if(m_uspc_get(mem->uspc, page) != 0)
+	{
+		//Already backed. Only writes can be fixed, if the page is copy-on-write.
+		retval = write && m_uspc_fault(mem->uspc, page, true);
+	}
+	else if( (sptr->prot == 0) || (write && !(sptr->prot & M_USPC_PROT_W)) )
+	{
+		//Segment doesn't allow the access
+		retval = false;
+	}
+	else
+	{
+		//First access to a page that was reserved - back it with cleared frames now.
+		//If the whole large page around it is in the segment and untouched, fill all of it at once.
+		retval = (mem_filllarge(mem, page, sptr->vaddr, sptr->vaddr + sptr->size, sptr->prot) != 0);
+		if(!retval)
+			retval = mem_fillpage(mem, page, sptr->prot);
+	}
+	
+	m_spl_rel(&(mem->spl));
+	return retval;
+}
+
+//Considers placing a region of the given size in a gap, and keeps it if it's closer to the requested address.
+static void mem_avail_gap(uintptr_t gap_start, uintptr_t gap_end, uintptr_t around, size_t size, uintptr_t *best_start, uintptr_t *best_diff)
+{
+	//Check if the gap is big enough for the proposed region at all
+	if(gap_end < gap_start || gap_end - gap_start < size)
+		return;
+	
+	//See what placement would be closest to the proposed address
+	uintptr_t best_start_in_gap = 0;
+	if(around < gap_start)
+	{
+		//Wanted an address before the gap - closest we'll get is the beginning
+		best_start_in_gap = gap_start;
+	}
+	else if(around > gap_end - size)
+	{
+		//Wanted a range that ends after the gap - closest we'll get is the end
+		best_start_in_gap = gap_end - size;
+	}
+	else
+	{
+		//Can satisfy exactly the request in this gap
+		best_start_in_gap = around;
+	}
+	
+	uintptr_t diff = (best_start_in_gap > around) ? (best_start_in_gap - around) : (around - best_start_in_gap);
+	if(diff < *best_diff)
+	{
+		*best_start = best_start_in_gap;
+		*best_diff = diff;
+	}
 }
 
 intptr_t mem_avail(mem_t *mptr, uintptr_t around, size_t size)
 {
 	if(size <= 0)
-		return EINVAL;
+		return -EINVAL;
 	
 	size_t pagesize = m_frame_size();
 	if(size % pagesize != 0)
@@ -180,14 +597,10 @@ intptr_t mem_avail(mem_t *mptr, uintptr_t around, size_t size)
 	KASSERT((uspc_start % pagesize) == 0);
 	KASSERT((uspc_end % pagesize) == 0);
 	
-	//Segments are stored in-order.
-	//This implies that the free spaces can be found in the gaps between them as stored.
-	//Search the free regions for a region of at least the given size, closest to the given address.
-	
 	//If there's nothing at all mapped, then we have a trivial problem
-	if((mptr->segs[0].vaddr + mptr->segs[0].size) == 0)
+	if(mptr->segs.root == NULL)
 	{
-		if( (around >= uspc_start) && ((around + size) <= uspc_end) )
+		if( (around >= uspc_start) && (around <= uspc_end) && (size <= uspc_end - around) )
 			return around;
 		else if(size <= uspc_end - uspc_start)
 			return uspc_start;
@@ -196,86 +609,350 @@ intptr_t mem_avail(mem_t *mptr, uintptr_t around, size_t size)
 	}
 	
 	//Okay, we have at least one segment mapped already.
-	//There's more than one place we might put this. Search for the area closest to the requested address.
+	//Each segment knows the gap before it, and each subtree knows the largest gap in it.
+	//The closest placement is in the gap containing the requested address, the first big-enough gap after that,
+	//the last big-enough gap before it, or the space after the last segment.
 	uintptr_t best_start = 0;
 	uintptr_t best_diff = ~0ul;
 	
-	//Consider the gaps around each segment
-	for(int gg = 0; gg < MEM_SEG_MAX + 1; gg++)
+	const mem_seg_t *last = mem_seg_of(rb_last(&(mptr->segs)));
+	mem_avail_gap(last->vaddr + last->size, uspc_end, around, size, &best_start, &best_diff);
+	
+	const rb_item_t *containing = rb_findle(&(mptr->segs), around);
+	containing = (containing != NULL) ? rb_next(containing) : rb_first(&(mptr->segs));
+	if(containing != NULL)
 	{
-		//Gap gg is the space between memory segments gg-1 and gg
-		//If gg is 0 then it's the space from the beginning to segment gg (the first segment)
-		//If gg is MEM_SEG_MAX then it's the space from segment gg-1 (the last segment) to the end
-		uintptr_t gap_start = (gg == 0) ? uspc_start : ((mptr->segs[gg-1].vaddr) + (mptr->segs[gg-1].size));
-		uintptr_t gap_end = ( (gg == MEM_SEG_MAX) || (mptr->segs[gg].size == 0) ) ? uspc_end : (mptr->segs[gg].vaddr);
+		const mem_seg_t *sptr = mem_seg_of(containing);
+		mem_avail_gap(sptr->vaddr - sptr->gap, sptr->vaddr, around, size, &best_start, &best_diff);
 		
-		//Check if the gap is big enough for the proposed region at all
-		if(gap_end - gap_start >= size)
+		const mem_seg_t *after = mem_gap_after(mptr->segs.root, sptr->vaddr, size);
+		if(after != NULL)
+			mem_avail_gap(after->vaddr - after->gap, after->vaddr, around, size, &best_start, &best_diff);
+	}
+	
+	const mem_seg_t *before = mem_gap_before(mptr->segs.root, around, size);
+	if(before != NULL)
+		mem_avail_gap(before->vaddr - before->gap, before->vaddr, around, size, &best_start, &best_diff);
+	
+	if(best_start == 0)
+		return -ENOMEM;
+	
+	return (intptr_t)best_start;
+}
+
+int mem_protect(mem_t *mem, uintptr_t vaddr, size_t size, int prot)
+{
+	size_t pagesize = m_frame_size();
+	if(size % pagesize != 0)
+		size += pagesize - (size % pagesize);
+	
+	m_spl_acq(&(mem->spl));
+	
+	//Only whole segments can be changed, for now
+	mem_seg_t *sptr = mem_seg_of(rb_findle(&(mem->segs), vaddr));
+	if(sptr == NULL || sptr->vaddr != vaddr || sptr->size != size)
+	{
+		m_spl_rel(&(mem->spl));
+		return -EINVAL;
+	}
+	
+	sptr->prot = prot;
+	
+	int retval = 0;
+	size_t large = m_frame_large_size();
+	uintptr_t pp = vaddr;
+	while(pp < vaddr + size)
+	{
+		uintptr_t frame = m_uspc_get(mem->uspc, pp);
+		if(frame == 0)
 		{
-			//See what placement would be closest to the proposed address
-			uintptr_t best_start_in_gap = 0;
-			if(around < gap_start)
+			pp += pagesize;
+			continue;
+		}
+		
+		//Large pages are never shared, so they change all at once.
+		//Only where one's mapped already, though - single frames can sit at large-aligned addresses too.
+		bool islarge = large != 0 && (pp % large) == 0 && (frame % large) == 0 && m_uspc_large_ok(mem->uspc, pp);
+		if(islarge && vaddr + size - pp >= large && m_uspc_set_large(mem->uspc, pp, frame, prot))
+		{
+			pp += large;
+			continue;
+		}
+		
+		//Frames still shared with another space can't be written until they're copied
+		int page_prot = prot;
+		if((page_prot & M_USPC_PROT_W) && m_frame_refs(frame) > 1)
+			page_prot = (page_prot & ~M_USPC_PROT_W) | M_USPC_PROT_COW;
+		
+		//This only fails if breaking up a large page, and out of memory.
+		if(!m_uspc_set(mem->uspc, pp, frame, page_prot))
+		{
+			retval = -ENOMEM;
+			break;
+		}
+		
+		pp += pagesize;
+	}
+	
+	//Removed permissions may linger in TLBs until flushed
+	m_uspc_flush(mem->uspc);
+	m_spl_rel(&(mem->spl));
+	return retval;
+}
+
+int mem_free(mem_t *mem, uintptr_t vaddr, size_t size)
+{
+	//Location and size must be page-aligned
+	size_t pagesize = m_frame_size();
+	if(vaddr % pagesize != 0)
+		return -EINVAL;
+	
+	if(size % pagesize != 0)
+		size += pagesize - (size % pagesize);
+	
+	uintptr_t end = vaddr + size;
+	if(size == 0 || end < vaddr)
+		return -EINVAL;
+	
+	m_spl_acq(&(mem->spl));
+	
+	//Find the first segment that overlaps the range
+	rb_item_t *first = rb_findle(&(mem->segs), vaddr);
+	if(first == NULL)
+		first = rb_first(&(mem->segs));
+	else if(mem_seg_of(first)->vaddr + mem_seg_of(first)->size <= vaddr)
+		first = rb_next(first);
+	
+	//Freeing from the middle of a segment splits it in two, which needs more bookkeeping.
+	mem_seg_t *split = NULL;
+	if(first != NULL && mem_seg_of(first)->vaddr < vaddr && mem_seg_of(first)->vaddr + mem_seg_of(first)->size > end)
+	{
+		split = mem_seg_alloc();
+		if(split == NULL)
+		{
+			m_spl_rel(&(mem->spl));
+			return -ENOMEM;
+		}
+	}
+	
+	//Unmap any pages that were filled in.
+	//Other cores might still reach the frames until they flush, so we only free them in batches afterwards.
+	//Large pages inside the range are unmapped whole. Ones that stick out of it are broken up first.
+	size_t large = m_frame_large_size();
+	bool broken = false;
+	uintptr_t batch[MEM_FREE_BATCH];
+	int batch_count = 0;
+	for(rb_item_t *item = first; item != NULL && item->key < end && !broken; item = rb_next(item))
+	{
+		const mem_seg_t *sptr = mem_seg_of(item);
+		uintptr_t start_in_seg = (sptr->vaddr > vaddr) ? sptr->vaddr : vaddr;
+		uintptr_t end_in_seg = (sptr->vaddr + sptr->size < end) ? (sptr->vaddr + sptr->size) : end;
+		uintptr_t pp = start_in_seg;
+		while(pp < end_in_seg)
+		{
+			uintptr_t frame = m_uspc_get(mem->uspc, pp);
+			if(frame == 0)
 			{
-				//Wanted an address before the gap - closest we'll get is the beginning
-				best_start_in_gap = gap_start;
+				pp += pagesize;
+				continue;
 			}
-			else if(around > gap_end - size)
+			
+			if(large != 0 && (pp % large) == 0 && end_in_seg - pp >= large && m_uspc_set_large(mem->uspc, pp, 0, 0))
 			{
-				//Wanted a range that ends after the gap - closest we'll get is the end
-				best_start_in_gap = gap_end - size;
+				//Took out a whole large page - flush it along with anything else waiting, and free it now.
+				m_uspc_flush(mem->uspc);
+				for(int ff = 0; ff < batch_count; ff++)
+				{
+					m_frame_free(batch[ff]);
+				}
+				batch_count = 0;
+				
+				for(size_t ff = 0; ff < large; ff += pagesize)
+				{
+					m_frame_free(frame + ff);
+				}
+				
+				pp += large;
+				continue;
 			}
-			else
+			
+			if(!m_uspc_set(mem->uspc, pp, 0, 0))
 			{
-				//Can satisfy exactly the request in this gap
-				best_start_in_gap = around;
+				//Out of memory breaking up a large page. What we unmapped already is filled again on demand.
+				broken = true;
+				break;
 			}
 			
-			uintptr_t diff = (best_start_in_gap > around) ? (best_start_in_gap - around) : (around - best_start_in_gap);
-			if(diff < best_diff)
+			batch[batch_count] = frame;
+			batch_count++;
+			pp += pagesize;
+			
+			if(batch_count == MEM_FREE_BATCH)
 			{
-				best_start = best_start_in_gap;
-				best_diff = diff;
+				m_uspc_flush(mem->uspc);
+				for(int ff = 0; ff < batch_count; ff++)
+				{
+					m_frame_free(batch[ff]);
+				}
+				batch_count = 0;
 			}
 		}
-		
-		if(mptr->segs[gg].size == 0)
-			break;
 	}
 	
-	if(best_start == 0)
+	if(batch_count > 0)
+	{
+		m_uspc_flush(mem->uspc);
+		for(int ff = 0; ff < batch_count; ff++)
+		{
+			m_frame_free(batch[ff]);
+		}
+		batch_count = 0;
+	}
+	
+	if(broken)
+	{
+		//Leave the segments as they were
+		if(split != NULL)
+			mem_seg_free(split);
+		
+		m_spl_rel(&(mem->spl));
 		return -ENOMEM;
+	}
 	
-	return (intptr_t)best_start;
+	//Trim or remove the segments that overlapped the range.
+	rb_item_t *item = first;
+	while(item != NULL && item->key < end)
+	{
+		rb_item_t *next = rb_next(item);
+		mem_seg_t *sptr = mem_seg_of(item);
+		uintptr_t seg_end = sptr->vaddr + sptr->size;
+		
+		if(sptr->vaddr >= vaddr && seg_end <= end)
+		{
+			//Entirely freed
+			rb_remove(&(mem->segs), item);
+			mem_seg_free(sptr);
+		}
+		else if(sptr->vaddr >= vaddr)
+		{
+			//Freed from its beginning. It stays in the same order, so it can keep its place in the index.
+			sptr->vaddr = end;
+			sptr->size = seg_end - end;
+			item->key = end;
+			mem_seg_regap(mem, sptr);
+		}
+		else if(seg_end <= end)
+		{
+			//Freed to its end
+			sptr->size = vaddr - sptr->vaddr;
+		}
+		else
+		{
+			//Freed from the middle - keep the beginning, and make a new segment for the end.
+			KASSERT(split != NULL);
+			sptr->size = vaddr - sptr->vaddr;
+			split->vaddr = end;
+			split->size = seg_end - end;
+			split->prot = sptr->prot;
+			mem_seg_insert(mem, split);
+			split = NULL;
+		}
+		
+		item = next;
+	}
+	
+	//Whatever follows the range now has more space before it.
+	mem_seg_regap(mem, mem_seg_of(item));
+	
+	KASSERT(split == NULL);
+	m_spl_rel(&(mem->spl));
+	return 0;
 }
 
-int mem_copy(mem_t *dst, const mem_t *src)
+int mem_copy(mem_t *dst, mem_t *src)
 {
 	size_t pagesize = m_frame_size();
 	
-	for(int ss = 0; ss < MEM_SEG_MAX; ss++)
+	//Destination should be empty. It gets the same segments as the source.
+	KASSERT(dst->uspc == 0);
+	KASSERT(dst->segs.root == NULL);
+	
+	dst->uspc = m_uspc_new();
+	if(dst->uspc == 0)
+		return -ENOMEM;
+	
+	//Hold the source still, so other threads can't fill in pages while we're sharing them.
+	m_spl_acq(&(src->spl));
+	
+	int retval = 0;
+	
+	for(rb_item_t *item = rb_first(&(src->segs)); item != NULL; item = rb_next(item))
 	{
-		const mem_seg_t *sptr = &(src->segs[ss]);
-		if(sptr->size <= 0)
-			continue;
+		const mem_seg_t *sptr = mem_seg_of(item);
 		
-		int alloc_err = mem_add(dst, sptr->vaddr, sptr->size, sptr->prot);
-		if(alloc_err < 0)
+		//Copy the bookkeeping. The gaps are the same in the copy.
+		mem_seg_t *newseg = mem_seg_alloc();
+		if(newseg == NULL)
 		{
-			mem_clear(dst);
-			return alloc_err;
-		}	
+			retval = -ENOMEM;
+			goto cleanup;
+		}
+		
+		newseg->vaddr = sptr->vaddr;
+		newseg->size = sptr->size;
+		newseg->prot = sptr->prot;
+		newseg->gap = sptr->gap;
+		dst->segs.augment = mem_seg_augment;
+		rb_insert(&(dst->segs), &(newseg->rb), newseg->vaddr, newseg);
+		
+		//Both spaces share the same frames. Writable ones get copied when either side writes.
+		int share_prot = sptr->prot;
+		if(share_prot & M_USPC_PROT_W)
+			share_prot = (share_prot & ~M_USPC_PROT_W) | M_USPC_PROT_COW;
 		
 		for(uintptr_t ff = sptr->vaddr; ff < sptr->vaddr + sptr->size; ff += pagesize)
 		{
+			//Pages never touched in the source are left to be filled on demand in the destination, too.
 			uintptr_t old_frame = m_uspc_get(src->uspc, ff);
-			uintptr_t new_frame = m_uspc_get(dst->uspc, ff);
+			if(old_frame == 0)
+				continue;
 			
-			KASSERT(old_frame != 0);
-			KASSERT(new_frame != 0);
+			#ifndef MEM_COPY_EAGER
+			//Downgrade the source first. That breaks up large pages, as sharing is tracked per frame, and can fail.
+			bool downgraded = (share_prot == sptr->prot) || m_uspc_set(src->uspc, ff, old_frame, share_prot);
+			if(downgraded && m_uspc_set(dst->uspc, ff, old_frame, share_prot))
+			{
+				m_frame_ref(old_frame);
+				continue;
+			}
+			#endif
+			
+			//Couldn't share the frame - copy it now instead.
+			uintptr_t new_frame = m_frame_alloc();
+			if(new_frame == 0)
+			{
+				retval = -ENOMEM;
+				goto cleanup;
+			}
 			
 			m_frame_copy(new_frame, old_frame);
+			if(!m_uspc_set(dst->uspc, ff, new_frame, sptr->prot))
+			{
+				m_frame_free(new_frame);
+				retval = -ENOMEM;
+				goto cleanup;
+			}
 		}
 	}
 	
-	return 0;
+cleanup:
+	//Pages downgraded in the source may still be writable in TLBs - on this core, and any running the source's threads.
+	//Flush them before anyone writes to frames now shared with the copy.
+	m_uspc_flush(src->uspc);
+	m_spl_rel(&(src->spl));
+	
+	if(retval < 0)
+		mem_clear(dst);
+	
+	return retval;
 }
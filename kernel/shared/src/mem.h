@@ -7,22 +7,38 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "m_uspc.h"
+#include "m_spl.h"
+#include "rb.h"
+#include <stdbool.h>
 
 //One segment of memory allocated in a memory space
 typedef struct mem_seg_s
 {
+	//Entry in the memory space's index of segments, keyed by address
+	rb_item_t rb;
+	
 	uintptr_t vaddr;
 	size_t size;
 	int prot;
 	
+	//Unused space between the previous segment (or the beginning of userspace) and this one
+	size_t gap;
+	
+	//Largest gap before any segment in this one's subtree of the index.
+	//The tree recomputes it on insert, removal, and rotation, and mem_seg_regap when a gap changes.
+	size_t gap_max;
+	
 } mem_seg_t;
 
 //Memory space
 typedef struct mem_s
 {
-	//Kernel-side tracking of which segments are allocated
-	#define MEM_SEG_MAX 32
-	mem_seg_t segs[MEM_SEG_MAX];
+	//Spinlock protecting the segments and paging structures.
+	//Page faults take this without the process lock, so it must never be held while touching user memory.
+	m_spl_t spl;
+	
+	//Kernel-side tracking of which segments are allocated, in order of address
+	rb_tree_t segs;
 	
 	//Machine-specific paging structures
 	m_uspc_t uspc;
@@ -31,13 +47,37 @@ typedef struct mem_s
 //Frees all memory in a memory space. The memory space can then be zeroed.
 void mem_clear(mem_t *mem);
 
-//Allocates new memory and adds it to a memory space.
+//Allocates new memory and adds it to a memory space. The memory is cleared.
 int mem_add(mem_t *mem, uintptr_t vaddr, size_t size, int prot);
 
+//Reserves a range in a memory space without allocating any memory.
+//Each page is allocated and cleared when first accessed.
+int mem_reserve(mem_t *mem, uintptr_t vaddr, size_t size, int prot);
+
+//Adds a segment to a memory space backed by existing frames, one per page from the start.
+//Takes over one reference to each frame, even on failure. Pages past the frames given are filled on demand.
+//The frames are only ever read through the mapping - writable pages are copied when first written.
+int mem_share(mem_t *mem, uintptr_t vaddr, size_t size, int prot, const uintptr_t *frames, size_t nframes);
+
+//Allocates memory for any pages in the given range that haven't been accessed yet.
+int mem_fill(mem_t *mem, uintptr_t vaddr, size_t size);
+
+//Handles a fault accessing the given address - fills in a reserved page, or copies a copy-on-write one.
+//Returns true if the access can be retried.
+bool mem_fault(mem_t *mem, uintptr_t addr, bool write);
+
+//Removes a range from a memory space, freeing any memory that was allocated there.
+//The range may cover parts of segments, which are trimmed or split. Parts that weren't in use are ignored.
+int mem_free(mem_t *mem, uintptr_t vaddr, size_t size);
+
 //Returns a free address where the given amount of bytes could be mapped.
 intptr_t mem_avail(mem_t *mem, uintptr_t around, size_t size);
 
-//Copies a memory space.
-int mem_copy(mem_t *dst, const mem_t *src);
+//Changes the access allowed to a segment of a memory space.
+int mem_protect(mem_t *mem, uintptr_t vaddr, size_t size, int prot);
+
+//Copies a memory space into an empty one.
+//Pages are shared between the two, and writable pages are copied when first written in either space.
+int mem_copy(mem_t *dst, mem_t *src);
 
 #endif //MEM_H
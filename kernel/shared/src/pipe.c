@@ -4,47 +4,27 @@
 
 #include "pipe.h"
 #include "kpage.h"
+#include "slab.h"
 #include "kassert.h"
 #include "thread.h"
+#include "process.h"
+#include "m_frame.h"
 #include <string.h>
 #include <sc.h>
 #include <errno.h>
 
-//All pipes in the system
-#define PIPE_MAX 1024
-static pipe_t pipe_table[PIPE_MAX];
+//All pipes in the system. Grows in chunks as needed, up to the maximum. IDs map to a slot modulo the maximum.
+#define PIPE_CHUNK 64
+#define PIPE_MAX 16384
+static void *pipe_chunks[PIPE_MAX / PIPE_CHUNK];
+static slab_table_t pipe_table = SLAB_TABLE_INIT("pipe", pipe_t, PIPE_CHUNK, PIPE_MAX, pipe_chunks);
 
-//Puts the current thread on the list of waiters. Unpauses one to take its place if necessary.
-static void pipe_addwaiter(id_t waiters[])
-{
-	id_t curtid = thread_curtid();
-	
-	for(int ww = 0; ww < PIPE_WAITING_MAX; ww++)
-	{
-		if(waiters[ww] == 0 || waiters[ww] == curtid)
-		{
-			waiters[ww] = curtid;
-			return;
-		}
-	}
-	
-	//Ugly but technically correct. They'll waste some CPU cycles and re-pause. It'll thrash.
-	thread_unpause(waiters[0]);
-	waiters[0] = curtid;
-	return;
-}
+//Size of pipe buffers when made, and the smallest they shrink to
+#define PIPE_BUF_MIN 4096
 
-//Unpauses all threads on the list of those waiting.
-static void pipe_kickwaiters(id_t waiters[])
-{
-	for(int ww = 0; ww < PIPE_WAITING_MAX; ww++)
-	{
-		if(waiters[ww])
-			thread_unpause(waiters[ww]);
-		
-		waiters[ww] = 0;
-	}
-}
+//Size pipe buffers may grow to by default, and the most that can be asked for
+#define PIPE_BUF_DEF (64 * 1024)
+#define PIPE_BUF_LIM (1024 * 1024)
 
 //Returns how many more bytes can be read from the given pipe's buffer before it is empty.
 static ssize_t pipe_canread(const pipe_t *p, pipe_dir_t dir)
@@ -86,46 +66,76 @@ static ssize_t pipe_canwrite_single(const pipe_t *p, pipe_dir_t dir)
 	return (to_rptr < to_buf) ? to_rptr : to_buf;
 }
 
+//Moves the data in the given pipe direction into a new buffer of the given size, which must hold it.
+static int pipe_resize(pipe_t *p, pipe_dir_t dir, size_t newlen)
+{
+	ssize_t used = pipe_canread(p, dir);
+	KASSERT((ssize_t)newlen > used);
+	
+	uint8_t *newbuf = kpage_alloc(newlen);
+	if(newbuf == NULL)
+		return -ENOMEM;
+	
+	//Straighten out the data while we copy it, so it starts at the beginning of the new buffer.
+	ssize_t first = pipe_canread_single(p, dir);
+	memcpy(newbuf, p->dirs[dir].buf_ptr + p->dirs[dir].rptr, first);
+	memcpy(newbuf + first, p->dirs[dir].buf_ptr, used - first);
+	
+	kpage_free(p->dirs[dir].buf_ptr, p->dirs[dir].buf_len);
+	p->dirs[dir].buf_ptr = newbuf;
+	p->dirs[dir].buf_len = newlen;
+	p->dirs[dir].rptr = 0;
+	p->dirs[dir].wptr = used;
+	return 0;
+}
+
 int pipe_new(pipe_t **pipe_out)
 {
 	//Find a spot for the pipe in the pipe table
 	pipe_t *pptr = NULL;
-	for(int pp = 0; pp < PIPE_MAX; pp++)
+	while(pptr == NULL)
 	{
-		if(m_spl_try(&(pipe_table[pp].spl)))
+		size_t count = slab_table_count(&pipe_table);
+		for(size_t pp = 0; pp < count; pp++)
 		{
-			if(pipe_table[pp].dirs[PIPE_DIR_FORWARD].buf_len == 0)
+			pipe_t *candidate = slab_table_get(&pipe_table, pp);
+			if(m_spl_try(&(candidate->spl)))
 			{
-				//Found a free spot.
-				pptr = &(pipe_table[pp]);
+				if(candidate->dirs[PIPE_DIR_FORWARD].buf_len == 0)
+				{
+					//Found a free spot.
+					pptr = candidate;
+					
+					//Make sure the pipe has a valid ID that maps to its location in the table.
+					//Advance IDs each time we use a slot.
+					pptr->id += PIPE_MAX;
+					if( (pptr->id <= 0) || ((pptr->id % PIPE_MAX) != (int)pp) )
+						pptr->id = pp;
+		
+					break;
+				}
 				
-				//Make sure the pipe has a valid ID that maps to its location in the table.
-				//Advance IDs each time we use a slot.
-				pptr->id += PIPE_MAX;
-				if( (pptr->id <= 0) || ((pptr->id % PIPE_MAX) != pp) )
-					pptr->id = pp;
-	
-				break;
+				//Not free, keep looking.
+				m_spl_rel(&(candidate->spl));
 			}
-			
-			//Not free, keep looking.
-			m_spl_rel(&(pipe_table[pp].spl));
 		}
-	}
-	
-	if(pptr == NULL)
-	{
-		//No free spots
-		return -ENFILE;
+		
+		if(pptr == NULL && slab_table_grow(&pipe_table, count + 1) < 0)
+		{
+			//No free spots
+			return -ENFILE;
+		}
 	}
 	
 	//Allocate buffers for all pipe dimensions.
-	size_t pipebuf = 4096;
+	size_t pipebuf = PIPE_BUF_MIN;
 	for(int dir = PIPE_DIR_NONE + 1; dir < PIPE_DIR_MAX; dir++)
 	{
-		//Shouldn't have leftover buffer; clear old structure
+		//Shouldn't have leftover buffer or waiters; clear old structure
 		KASSERT(pptr->dirs[dir].buf_ptr == NULL);
 		KASSERT(pptr->dirs[dir].buf_len == 0);
+		KASSERT(pptr->dirs[dir].waitq_w.head == NULL);
+		KASSERT(pptr->dirs[dir].waitq_r.head == NULL);
 		memset(&(pptr->dirs[dir]), 0, sizeof(pptr->dirs[dir]));
 		
 		//Allocate buffer for this direction
@@ -147,6 +157,7 @@ int pipe_new(pipe_t **pipe_out)
 			return -ENOMEM;
 		}
 		pptr->dirs[dir].buf_len = pipebuf;
+		pptr->dirs[dir].buf_max = PIPE_BUF_DEF;
 	}
 	
 	KASSERT(pptr->id > 0);
@@ -161,6 +172,9 @@ void pipe_delete(pipe_t *pipe)
 		KASSERT(pipe->dirs[dd].refs_r == 0);
 		KASSERT(pipe->dirs[dd].refs_w == 0);
 		
+		//Anyone still queued stopped waiting already - they can't have the pipe open. Just flush them out.
+		pipe_wakeall(pipe, dd);
+		
 		kpage_free(pipe->dirs[dd].buf_ptr, pipe->dirs[dd].buf_len);
 		memset(&(pipe->dirs[dd]), 0, sizeof(pipe->dirs[dd]));
 	}
@@ -172,7 +186,10 @@ pipe_t *pipe_lockid(int id)
 	if(id <= 0)
 		return NULL;
 	
-	pipe_t *pptr = &(pipe_table[id % PIPE_MAX]);
+	pipe_t *pptr = slab_table_get(&pipe_table, id % PIPE_MAX);
+	if(pptr == NULL)
+		return NULL;
+	
 	m_spl_acq(&(pptr->spl));
 	if((pptr->dirs[PIPE_DIR_FORWARD].buf_len == 0) || pptr->id != id)
 	{
@@ -190,8 +207,99 @@ void pipe_unlock(pipe_t *pptr)
 	m_spl_rel(&(pptr->spl));
 }
 
-ssize_t pipe_write(pipe_t *pptr, pipe_dir_t dir, const void *buf, ssize_t nbytes)
+void pipe_wakeall(pipe_t *pptr, pipe_dir_t dir)
+{
+	thread_wake_all(&(pptr->dirs[dir].waitq_w));
+	thread_wake_all(&(pptr->dirs[dir].waitq_r));
+}
+
+int pipe_ioctl(pipe_t *pptr, pipe_dir_t dir, int operation, void *buf, ssize_t len)
+{
+	if(operation == _SC_IOCTL_GETPIPESZ)
+	{
+		return pptr->dirs[dir].buf_max;
+	}
+	
+	if(operation == _SC_IOCTL_SETPIPESZ)
+	{
+		int newmax = 0;
+		
+		if(len != sizeof(newmax))
+			return -EINVAL;
+		
+		int copy_err = process_memget(&newmax, buf, sizeof(newmax));
+		if(copy_err < 0)
+			return copy_err;
+		
+		if(newmax <= 0 || newmax > PIPE_BUF_LIM)
+			return -EINVAL;
+		
+		//Round up to whole pages, and don't go below what we start with.
+		size_t pagesize = m_frame_size();
+		size_t rounded = ((newmax + pagesize - 1) / pagesize) * pagesize;
+		if(rounded < PIPE_BUF_MIN)
+			rounded = PIPE_BUF_MIN;
+		
+		//If the buffer is already bigger than that, bring it down now if its data still fits.
+		//Otherwise it comes down as it drains.
+		if(pptr->dirs[dir].buf_len > rounded && pipe_canread(pptr, dir) < (ssize_t)rounded)
+			pipe_resize(pptr, dir, rounded);
+		
+		pptr->dirs[dir].buf_max = rounded;
+		return rounded;
+	}
+	
+	return -ENOTTY;
+}
+
+int pipe_poll(pipe_t *pptr, pipe_dir_t dir, int events, int slot)
+{
+	int revents = 0;
+	
+	if(events & _SC_POLL_IN)
+	{
+		//Reads would return data, or EPIPE if nobody's left to write.
+		if(pipe_canread(pptr, dir) > 0)
+			revents |= _SC_POLL_IN;
+		
+		if(pptr->dirs[dir].refs_w == 0)
+			revents |= _SC_POLL_HUP;
+		
+		if(revents == 0 && slot >= 0)
+			thread_pollwait(&(pptr->dirs[dir].waitq_r), slot);
+	}
+	
+	if(events & _SC_POLL_OUT)
+	{
+		//Writes go through if there's room for an atomic write already, or the buffer can grow to make it.
+		if(pptr->dirs[dir].refs_r == 0)
+			revents |= _SC_POLL_ERR;
+		else if(pipe_canwrite(pptr, dir) >= 512 || pptr->dirs[dir].buf_len < pptr->dirs[dir].buf_max)
+			revents |= _SC_POLL_OUT;
+		else if(slot >= 0)
+			thread_pollwait(&(pptr->dirs[dir].waitq_w), slot + 1);
+	}
+	
+	return revents;
+}
+
+ssize_t pipe_fill(pipe_t *pptr, pipe_dir_t dir, ssize_t nbytes, pipe_xfer_t *xfer, void *arg)
 {		
+	//If the write won't fit, grow the buffer - doubling, up to its limit.
+	//We don't need it all to fit, so if we can't allocate, just write what we can.
+	ssize_t used = pipe_canread(pptr, dir);
+	if(pipe_canwrite(pptr, dir) < nbytes && pptr->dirs[dir].buf_len < pptr->dirs[dir].buf_max)
+	{
+		size_t newlen = pptr->dirs[dir].buf_len;
+		while(newlen < pptr->dirs[dir].buf_max && (ssize_t)newlen <= used + nbytes)
+			newlen *= 2;
+		
+		if(newlen > pptr->dirs[dir].buf_max)
+			newlen = pptr->dirs[dir].buf_max;
+		
+		pipe_resize(pptr, dir, newlen);
+	}
+	
 	//POSIX requires that writes of 512 bytes or less can complete atomically.
 	//So just don't allow writing to pipes with less than 512 bytes in their buffer.
 	if(pipe_canwrite(pptr, dir) < 512)
@@ -199,7 +307,7 @@ ssize_t pipe_write(pipe_t *pptr, pipe_dir_t dir, const void *buf, ssize_t nbytes
 		if(pptr->dirs[dir].refs_r)
 		{
 			//No room in the pipe, but someone has it open to read and could drain it.
-			pipe_addwaiter(pptr->dirs[dir].waiting_to_w);
+			thread_wait(&(pptr->dirs[dir].waitq_w));
 			return -EAGAIN;
 		}
 		
@@ -207,8 +315,8 @@ ssize_t pipe_write(pipe_t *pptr, pipe_dir_t dir, const void *buf, ssize_t nbytes
 	}
 		
 	//Write as much as we can
-	const char *buf_bytes = (const char*)buf;
 	ssize_t written = 0;
+	ssize_t err = 0;
 	while(1)
 	{
 		ssize_t copylen = pipe_canwrite_single(pptr, dir);
@@ -218,28 +326,46 @@ ssize_t pipe_write(pipe_t *pptr, pipe_dir_t dir, const void *buf, ssize_t nbytes
 		if(copylen == 0)
 			break;
 		
-		memcpy(pptr->dirs[dir].buf_ptr + pptr->dirs[dir].wptr, buf_bytes, copylen);
-		pptr->dirs[dir].wptr = (pptr->dirs[dir].wptr + copylen) % (pptr->dirs[dir].buf_len);
+		ssize_t moved = (*xfer)(arg, pptr->dirs[dir].buf_ptr + pptr->dirs[dir].wptr, copylen);
+		if(moved < 0)
+		{
+			err = moved;
+			break;
+		}
 		
-		buf_bytes += copylen;
-		written += copylen;
-		nbytes -= copylen;
+		pptr->dirs[dir].wptr = (pptr->dirs[dir].wptr + moved) % (pptr->dirs[dir].buf_len);
+		written += moved;
+		nbytes -= moved;
+		
+		if(moved < copylen)
+			break; //Source ran dry
 	}
 	
-	//Unpause anyone waiting to read from this pipe, if we just wrote
-	pipe_kickwaiters(pptr->dirs[dir].waiting_to_r);
+	if(written == 0)
+		return err;
+	
+	//Track how much of the buffer actually gets used, for deciding when to shrink it.
+	used = pipe_canread(pptr, dir);
+	if((size_t)used > pptr->dirs[dir].buf_peak)
+		pptr->dirs[dir].buf_peak = used;
+	
+	//Wake a reader for what we just wrote.
+	//If there's still room, pass that along to another writer, too.
+	thread_wake_one(&(pptr->dirs[dir].waitq_r));
+	if(pipe_canwrite(pptr, dir) >= 512)
+		thread_wake_one(&(pptr->dirs[dir].waitq_w));
 	
 	return written;
 }
 
-ssize_t pipe_read(pipe_t *pptr, pipe_dir_t dir, void *buf, ssize_t nbytes)
+ssize_t pipe_drain(pipe_t *pptr, pipe_dir_t dir, ssize_t nbytes, pipe_xfer_t *xfer, void *arg)
 {	
 	if(pipe_canread(pptr, dir) < 1)
 	{
 		if(pptr->dirs[dir].refs_w)
 		{
 			//Pipe empty, but has writers who could fill it.
-			pipe_addwaiter(pptr->dirs[dir].waiting_to_r);
+			thread_wait(&(pptr->dirs[dir].waitq_r));
 			return -EAGAIN;
 		}
 		
@@ -247,8 +373,8 @@ ssize_t pipe_read(pipe_t *pptr, pipe_dir_t dir, void *buf, ssize_t nbytes)
 	}
 	
 	//Read as much as we can
-	char *buf_bytes = (char*)buf;
 	ssize_t nread = 0;
+	ssize_t err = 0;
 	while(1)
 	{
 		ssize_t copylen = pipe_canread_single(pptr, dir);
@@ -258,16 +384,78 @@ ssize_t pipe_read(pipe_t *pptr, pipe_dir_t dir, void *buf, ssize_t nbytes)
 		if(copylen == 0)
 			break;
 		
-		memcpy(buf_bytes, pptr->dirs[dir].buf_ptr + pptr->dirs[dir].rptr, copylen);
-		pptr->dirs[dir].rptr = (pptr->dirs[dir].rptr + copylen) % (pptr->dirs[dir].buf_len);
+		ssize_t moved = (*xfer)(arg, pptr->dirs[dir].buf_ptr + pptr->dirs[dir].rptr, copylen);
+		if(moved < 0)
+		{
+			err = moved;
+			break;
+		}
 		
-		buf_bytes += copylen;
-		nread += copylen;
-		nbytes -= copylen;
+		pptr->dirs[dir].rptr = (pptr->dirs[dir].rptr + moved) % (pptr->dirs[dir].buf_len);
+		nread += moved;
+		nbytes -= moved;
+		
+		if(moved < copylen)
+			break; //Destination filled up
 	}
 	
-	//Unpause anyone waiting to write to this pipe, if we just read
-	pipe_kickwaiters(pptr->dirs[dir].waiting_to_w);
+	if(nread == 0)
+		return err;
+	
+	//If we emptied the buffer, and it's been mostly unused since it last emptied, halve it.
+	//A pipe that's streaming data keeps its big buffer; one that's gone quiet gives it back a bit at a time.
+	//Also bring it within its limit, if that was lowered while it was full.
+	if(pipe_canread(pptr, dir) == 0)
+	{
+		size_t newlen = pptr->dirs[dir].buf_len;
+		if(pptr->dirs[dir].buf_peak <= newlen / 4)
+			newlen /= 2;
+		if(newlen > pptr->dirs[dir].buf_max)
+			newlen = pptr->dirs[dir].buf_max;
+		if(newlen < PIPE_BUF_MIN)
+			newlen = PIPE_BUF_MIN;
+		
+		if(newlen != pptr->dirs[dir].buf_len)
+			pipe_resize(pptr, dir, newlen);
+		
+		pptr->dirs[dir].buf_peak = 0;
+	}
+	
+	//Wake a writer for the room we just made.
+	//If there's still data, pass that along to another reader, too.
+	thread_wake_one(&(pptr->dirs[dir].waitq_w));
+	if(pipe_canread(pptr, dir) > 0)
+		thread_wake_one(&(pptr->dirs[dir].waitq_r));
 	
 	return nread;
 }
+
+//Copies from a caller's buffer into a pipe, for pipe_write. Advances the buffer pointer.
+static ssize_t pipe_copyin(void *arg, uint8_t *data, ssize_t len)
+{
+	const uint8_t **src = (const uint8_t**)arg;
+	memcpy(data, *src, len);
+	*src += len;
+	return len;
+}
+
+//Copies from a pipe into a caller's buffer, for pipe_read. Advances the buffer pointer.
+static ssize_t pipe_copyout(void *arg, uint8_t *data, ssize_t len)
+{
+	uint8_t **dst = (uint8_t**)arg;
+	memcpy(*dst, data, len);
+	*dst += len;
+	return len;
+}
+
+ssize_t pipe_write(pipe_t *pptr, pipe_dir_t dir, const void *buf, ssize_t nbytes)
+{
+	const uint8_t *src = (const uint8_t*)buf;
+	return pipe_fill(pptr, dir, nbytes, pipe_copyin, &src);
+}
+
+ssize_t pipe_read(pipe_t *pptr, pipe_dir_t dir, void *buf, ssize_t nbytes)
+{
+	uint8_t *dst = (uint8_t*)buf;
+	return pipe_drain(pptr, dir, nbytes, pipe_copyout, &dst);
+}
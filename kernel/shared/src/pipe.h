@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include "m_spl.h"
+#include "thread.h"
 
 //Our pipes are a bit more complex than a typical *NIX.
 //We use them to implement pseudoterminals for our graphical terminal.
@@ -30,6 +31,12 @@ typedef struct pipe_dirinfo_s
 	uint8_t *buf_ptr;
 	size_t buf_len;
 	
+	//Size the buffer may grow to
+	size_t buf_max;
+	
+	//Most data held at once since the buffer last emptied
+	size_t buf_peak;
+	
 	//Next read location in buffer
 	int rptr;
 	
@@ -40,10 +47,9 @@ typedef struct pipe_dirinfo_s
 	int refs_w;
 	int refs_r;
 	
-	//Threads that get unblocked on another thread accessing the pipe
-	#define PIPE_WAITING_MAX 8
-	id_t waiting_to_w[PIPE_WAITING_MAX];
-	id_t waiting_to_r[PIPE_WAITING_MAX];
+	//Threads waiting for room to write, and for data to read
+	thread_waitq_t waitq_w;
+	thread_waitq_t waitq_r;
 	
 } pipe_dirinfo_t;
 
@@ -74,6 +80,28 @@ pipe_t *pipe_lockid(int id);
 //Unlocks the given pipe.
 void pipe_unlock(pipe_t *pptr);
 
+//Wakes everyone waiting on the given direction of the pipe, as when its readers or writers go away.
+void pipe_wakeall(pipe_t *pptr, pipe_dir_t dir);
+
+//Handles device-specific IO operations on one direction of the given pipe.
+int pipe_ioctl(pipe_t *pptr, pipe_dir_t dir, int operation, void *buf, ssize_t len);
+
+//Returns which of the given _SC_POLL_* conditions hold on one direction of the pipe - reading for IN, writing for OUT.
+//If slot is nonnegative, the current thread waits on the pipe for those that don't, using that polling slot and the next.
+int pipe_poll(pipe_t *pptr, pipe_dir_t dir, int events, int slot);
+
+//Moves data into or out of a pipe's buffer, at the given location, for pipe_fill or pipe_drain.
+//Returns how many bytes were moved, or a negative error number.
+typedef ssize_t (pipe_xfer_t)(void *arg, uint8_t *data, ssize_t len);
+
+//Tries to put data into the given pipe, as produced by the given function right into the pipe's buffer.
+//Returns the number of bytes written, or a negative error number.
+ssize_t pipe_fill(pipe_t *pptr, pipe_dir_t dir, ssize_t nbytes, pipe_xfer_t *xfer, void *arg);
+
+//Tries to take data out of the given pipe, as consumed by the given function right from the pipe's buffer.
+//Returns the number of bytes read, or a negative error number.
+ssize_t pipe_drain(pipe_t *pptr, pipe_dir_t dir, ssize_t nbytes, pipe_xfer_t *xfer, void *arg);
+
 //Tries to write into the given pipe. Returns the number of bytes written, or a negative error number.
 ssize_t pipe_write(pipe_t *pptr, pipe_dir_t dir, const void *buf, ssize_t len);
 
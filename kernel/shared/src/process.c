@@ -9,16 +9,21 @@
 #include "argenv.h"
 #include "thread.h"
 #include "m_tls.h"
+#include "m_frame.h"
 #include <errno.h>
 #include <string.h>
 #include <stddef.h>
 
-process_t process_table[PROCESS_MAX];
+static void *process_chunks[PROCESS_MAX / PROCESS_CHUNK];
+slab_table_t process_table = SLAB_TABLE_INIT("process", process_t, PROCESS_CHUNK, PROCESS_MAX, process_chunks);
 
 void process_init(void)
 {
 	//Make initial process entry
-	process_t *pptr = &(process_table[1]);
+	int grow_err = slab_table_grow(&process_table, 2);
+	KASSERT(grow_err == 0);
+	
+	process_t *pptr = slab_table_get(&process_table, 1);
 	m_spl_acq(&(pptr->spl));
 	
 	pptr->pid = 1;
@@ -72,28 +77,33 @@ void process_init(void)
 
 process_t *process_lockfree(void)
 {
-	for(int pp = 1; pp < PROCESS_MAX; pp++)
+	while(1)
 	{
-		process_t *pptr = &(process_table[pp]);
-		if(m_spl_try(&(pptr->spl)))
+		size_t count = slab_table_count(&process_table);
+		for(size_t pp = 1; pp < count; pp++)
 		{
-			if(pptr->state == PROCESS_STATE_NONE)
+			process_t *pptr = slab_table_get(&process_table, pp);
+			if(m_spl_try(&(pptr->spl)))
 			{
-				//Found a free slot. Make sure it's got a new, valid ID corresponding to its place in the table.
-				pptr->pid += PROCESS_MAX;
-				if((pptr->pid <= 0) || ((pptr->pid % PROCESS_MAX) != pp))
-					pptr->pid = pp;
+				if(pptr->state == PROCESS_STATE_NONE)
+				{
+					//Found a free slot. Make sure it's got a new, valid ID corresponding to its place in the table.
+					pptr->pid += PROCESS_MAX;
+					if((pptr->pid <= 0) || ((pptr->pid % PROCESS_MAX) != (pid_t)pp))
+						pptr->pid = pp;
+					
+					return pptr; //Still locked
+				}
 				
-				return pptr; //Still locked
+				//In use - keep looking
+				m_spl_rel(&(pptr->spl));
 			}
-			
-			//In use - keep looking
-			m_spl_rel(&(pptr->spl));
 		}
+		
+		//No room - make more and look again
+		if(slab_table_grow(&process_table, count + 1) < 0)
+			return NULL;
 	}
-	
-	//No room
-	return NULL;
 }
 
 process_t *process_lockpid(pid_t pid)
@@ -102,7 +112,10 @@ process_t *process_lockpid(pid_t pid)
 		return NULL;
 	
 	//Processes are ID'd based on their array index, so we know where this ID must be.
-	process_t *pptr = &(process_table[pid % PROCESS_MAX]);
+	process_t *pptr = slab_table_get(&process_table, pid % PROCESS_MAX);
+	if(pptr == NULL)
+		return NULL;
+	
 	m_spl_acq(&(pptr->spl));
 	
 	if((pptr->state == PROCESS_STATE_NONE) || (pptr->pid != pid))
@@ -125,6 +138,15 @@ process_t *process_lockcur(void)
 	return pptr;
 }
 
+mem_t *process_memcur(void)
+{
+	thread_t *tptr = (thread_t*)(m_tls_get());
+	if(tptr == NULL)
+		return NULL;
+	
+	return &(tptr->process->mem);
+}
+
 void process_unlock(process_t *process)
 {
 	m_spl_rel(&(process->spl));
@@ -183,16 +205,52 @@ int process_strget(char *kbufptr, const char *uptr, size_t kbuflen)
 	return 0;
 }
 
+int process_memcheck(const void *ubufptr, size_t len, bool write)
+{
+	if(len == 0)
+		return 0;
+	
+	uintptr_t start = (uintptr_t)ubufptr;
+	uintptr_t end = start + len;
+	
+	uintptr_t uspc_start = 0;
+	uintptr_t uspc_end = 0;
+	m_uspc_range(&uspc_start, &uspc_end);
+	if(end < start || start < uspc_start || end > uspc_end)
+		return -EFAULT;
+	
+	//Check each page. This also fills in reserved pages, and copies copy-on-write pages for writing,
+	//rather than taking a fault on them later.
+	size_t pagesize = m_frame_size();
+	mem_t *mem = process_memcur();
+	for(uintptr_t pp = start - (start % pagesize); pp < end; pp += pagesize)
+	{
+		if(!write && m_uspc_get(mem->uspc, pp) != 0)
+			continue;
+		
+		if(!mem_fault(mem, pp, write))
+			return -EFAULT;
+	}
+	
+	return 0;
+}
+
 int process_memput(void *ubufptr, const void *kbufptr, size_t len)
 {
-	//Todo - validate buffer
+	int check_err = process_memcheck(ubufptr, len, true);
+	if(check_err < 0)
+		return check_err;
+	
 	memcpy(ubufptr, kbufptr, len);
 	return 0;
 }
 
 int process_memget(void *kbufptr, const void *ubufptr, size_t len)
 {
-	//Todo - validate buffer
+	int check_err = process_memcheck(ubufptr, len, false);
+	if(check_err < 0)
+		return check_err;
+	
 	memcpy(kbufptr, ubufptr, len);
 	return 0;
 }
@@ -9,6 +9,7 @@
 #include "file.h"
 #include "mem.h"
 #include "fb.h"
+#include "slab.h"
 #include <sys/types.h>
 #include <stdint.h>
 
@@ -84,9 +85,10 @@ typedef struct process_s
 	
 } process_t;
 
-//All processes on system
-#define PROCESS_MAX 64
-extern process_t process_table[PROCESS_MAX];
+//All processes on system. Grows in chunks as needed, up to the maximum. PIDs map to a slot modulo the maximum.
+#define PROCESS_CHUNK 16
+#define PROCESS_MAX 4096
+extern slab_table_t process_table;
 
 //Sets up process tracking and initial process entry.
 void process_init(void);
@@ -100,6 +102,10 @@ process_t *process_lockpid(pid_t pid);
 //Locks the current process and returns a pointer to it.
 process_t *process_lockcur(void);
 
+//Returns the memory space of the current process, without locking the process.
+//Only the memory space's own lock should be used to access it.
+mem_t *process_memcur(void);
+
 //Releases the lock on the given process.
 void process_unlock(process_t *process);
 
@@ -115,6 +121,10 @@ int process_addfd(file_t *newfile);
 //Attempts to copy a string from the current process into the kernel.
 int process_strget(char *kbufptr, const char *uptr, size_t kbuflen);
 
+//Checks that a buffer in the current process can be accessed, and can be written if specified.
+//Returns 0 if so, or a negative error number.
+int process_memcheck(const void *ubufptr, size_t len, bool write);
+
 //Attempts to copy a buffer from the kernel into the current process.
 int process_memput(void *ubufptr, const void *kbufptr, size_t len);
 
@@ -5,12 +5,16 @@
 #include "ramfs.h"
 #include "kpage.h"
 #include "kassert.h"
+#include "slab.h"
 #include "pipe.h"
 #include "m_spl.h"
 #include "m_panic.h"
+#include "m_kspc.h"
+#include "m_frame.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
@@ -23,12 +27,35 @@ typedef struct ramfs_ino_s
 	dev_t special; //Device number if this is a device special
 	off_t size; //Total size in bytes
 	
-	//Reference counts
+	//Spinlock protecting the size and contents. Taken after ramfs_spl, when both are held.
+	m_spl_t spl;
+	
+	//Reference counts, protected by ramfs_spl.
+	//The link count is changed holding the inode's spinlock too, so stat can read it with just that.
 	int64_t nfiles; //Number of open files (file_t) that refer to this inode
 	int64_t nlinks; //Number of directory entries in the filesystem that refer to this inode
 	
-	//Blocks holding pointers to data blocks
+	//Index of directory entries by name, if this is a directory that's been searched. Not stored in the filesystem.
+	//Protected by ramfs_spl, like the rest of the directory structure.
+	struct ramfs_dirhash_s *dirhash;
+	
+	//Whether the contents are in data blocks, referenced through dtables.
+	//Small files start with their contents stored right in the inode, instead.
+	bool tabled;
+	
+	//Memory outside the filesystem holding the contents, if the file was adopted and hasn't been changed since.
+	//Changing the file copies the contents into the filesystem first, then gives the memory back with the release function.
+	const uint8_t *adopted;
+	ramfs_release_t *release;
+	
+	//Whether data blocks of the file have been mapped into user memory.
+	//Then blocks freed from the file might still be in use there.
+	bool mapped;
+	
+	//Blocks holding pointers to data blocks.
+	//When the file isn't tabled, this space holds its contents instead.
 	#define RAMFS_DTABLE_MAX 1000
+	#define RAMFS_INLINE_MAX (RAMFS_DTABLE_MAX * sizeof(int))
 	int dtables[RAMFS_DTABLE_MAX];
 	
 } ramfs_ino_t;
@@ -48,19 +75,45 @@ typedef union ramfs_block_u
 {
 	ramfs_ino_t ino;
 	ramfs_dtable_t dtable;
-	int nextfree;
+	struct { int next; int prev; } freelink;
 	uint8_t data[RAMFS_BLOCK_SIZE];
 	
 } ramfs_block_t;
 
-//Space pre-allocated from kernel for storing the RAM filesystem
-#define RAMFS_BLOCK_MAX ((64*1024*1024) / RAMFS_BLOCK_SIZE)
-static ramfs_block_t *ramfs_blocks;
+//Blocks come from the kernel a chunk at a time as the filesystem grows, and go back when a chunk is entirely free.
+//Chunks are found by block number through a two-level table. The second level is allocated as needed.
+#define RAMFS_CHUNK_BLOCKS 512
+#define RAMFS_RADIX_LEAF 64
+#define RAMFS_RADIX_ROOT 512
+#define RAMFS_BLOCK_MAX (RAMFS_RADIX_ROOT * RAMFS_RADIX_LEAF * RAMFS_CHUNK_BLOCKS)
+
+//Chunk of blocks in the filesystem
+typedef struct ramfs_chunk_s
+{
+	ramfs_block_t *blocks; //Memory holding the blocks, or NULL if we don't have this chunk
+	int nfree; //Number of the blocks on the free-list
+	uint64_t freebits[RAMFS_CHUNK_BLOCKS / 64]; //Which of the blocks are on the free-list
+	uint64_t heldbits[RAMFS_CHUNK_BLOCKS / 64]; //Which of the blocks were freed while still mapped in user memory
+} ramfs_chunk_t;
+
+//Table of chunks, by block number. Entries are only ever added, so blocks can be found without locking.
+static ramfs_chunk_t *ramfs_radix[RAMFS_RADIX_ROOT];
 
 //Free-list of FS blocks
 static int ramfs_freehead;
+static int ramfs_freecount;
 
-//Spinlock protecting the filesystem
+//Number of blocks in the chunks we have
+static int ramfs_poolcount;
+
+//Number of blocks freed from files while still mapped in user memory.
+//They stay off the free-list, untouched, until the last mapping goes away.
+static int ramfs_heldcount;
+
+//Spinlock protecting the free-list. Taken last, after any inode.
+static m_spl_t ramfs_free_spl;
+
+//Spinlock protecting the directory structure and reference counts. Taken before any inode.
 static m_spl_t ramfs_spl;
 
 //Directory entry as stored in filesystem
@@ -70,33 +123,521 @@ typedef struct ramfs_dirent_s
 	char name[120];
 } ramfs_dirent_t;
 
-//Allocates a block in the filesystem. Returns its block number.
-static int ramfs_alloc(void)
+//Entry in the index of a directory, locating one directory entry
+typedef struct ramfs_dhent_s
+{
+	struct ramfs_dhent_s *next; //Next entry in the same bucket
+	uint32_t hash; //Hash of the name
+	uint32_t slot; //Which directory entry it is, counting from the start of the directory
+} ramfs_dhent_t;
+
+//Index of a directory's entries by name, kept in memory alongside the directory
+typedef struct ramfs_dirhash_s
+{
+	ramfs_dhent_t **buckets; //Chains of entries, by hash
+	size_t nbuckets; //Number of buckets - a power of two
+	size_t count; //Number of entries in the index
+} ramfs_dirhash_t;
+
+//Directories are only indexed once they have this many entries - smaller ones are just scanned.
+#define RAMFS_DIRHASH_MIN 32
+
+static slab_t ramfs_dirhash_slab = SLAB_INIT("ramfs_dirhash", sizeof(ramfs_dirhash_t));
+static slab_t ramfs_dhent_slab = SLAB_INIT("ramfs_dhent", sizeof(ramfs_dhent_t));
+
+//Entry in the cache of recent lookups, by directory and name. Remembers names that weren't found, too.
+typedef struct ramfs_dcent_s
+{
+	ino_t dir; //Directory searched
+	ino_t ino; //Inode found, if the name was found
+	bool valid; //Whether this entry holds a lookup
+	bool negative; //Whether the name wasn't found
+	char name[120]; //Name searched for
+} ramfs_dcent_t;
+
+//Number of entries in the lookup cache - each directory and name can only go in one place.
+#define RAMFS_DCACHE_MAX 1024
+static ramfs_dcent_t *ramfs_dcache;
+
+//How well the lookup cache is doing
+static uint64_t ramfs_dcache_hits;
+static uint64_t ramfs_dcache_neghits;
+static uint64_t ramfs_dcache_misses;
+
+//Operations on an inode whose lock is already held
+static ssize_t ramfs_read_locked(ino_t ino, off_t off, void *buf, ssize_t len);
+static ssize_t ramfs_write_locked(ino_t ino, off_t off, const void *buf, ssize_t len);
+static int ramfs_trunc_locked(ino_t ino, off_t size);
+static int ramfs_unadopt(ino_t ino, off_t keep);
+
+//Returns the chunk holding the given block number.
+static ramfs_chunk_t *ramfs_chunk(int blknum)
+{
+	int cc = blknum / RAMFS_CHUNK_BLOCKS;
+	KASSERT(ramfs_radix[cc / RAMFS_RADIX_LEAF] != NULL);
+	return &(ramfs_radix[cc / RAMFS_RADIX_LEAF][cc % RAMFS_RADIX_LEAF]);
+}
+
+//Returns the block with the given number.
+static ramfs_block_t *ramfs_block(int blknum)
+{
+	KASSERT(blknum >= 0 && blknum < RAMFS_BLOCK_MAX);
+	ramfs_chunk_t *chunk = ramfs_chunk(blknum);
+	KASSERT(chunk->blocks != NULL);
+	return &(chunk->blocks[blknum % RAMFS_CHUNK_BLOCKS]);
+}
+
+//Puts a block on the free-list. Called with the free-list locked.
+static void ramfs_free_locked(int blknum)
+{
+	ramfs_chunk_t *chunk = ramfs_chunk(blknum);
+	int bb = blknum % RAMFS_CHUNK_BLOCKS;
+	KASSERT(!(chunk->freebits[bb / 64] & (1ull << (bb % 64))));
+	
+	ramfs_block(blknum)->freelink.next = ramfs_freehead;
+	ramfs_block(blknum)->freelink.prev = 0;
+	if(ramfs_freehead != 0)
+		ramfs_block(ramfs_freehead)->freelink.prev = blknum;
+	
+	ramfs_freehead = blknum;
+	chunk->freebits[bb / 64] |= (1ull << (bb % 64));
+	chunk->nfree++;
+	ramfs_freecount++;
+}
+
+//Takes a block off the free-list. Called with the free-list locked.
+static void ramfs_unfree_locked(int blknum)
+{
+	ramfs_chunk_t *chunk = ramfs_chunk(blknum);
+	int bb = blknum % RAMFS_CHUNK_BLOCKS;
+	KASSERT(chunk->freebits[bb / 64] & (1ull << (bb % 64)));
+	
+	int next = ramfs_block(blknum)->freelink.next;
+	int prev = ramfs_block(blknum)->freelink.prev;
+	if(prev != 0)
+		ramfs_block(prev)->freelink.next = next;
+	else
+		ramfs_freehead = next;
+	if(next != 0)
+		ramfs_block(next)->freelink.prev = prev;
+	
+	chunk->freebits[bb / 64] &= ~(1ull << (bb % 64));
+	chunk->nfree--;
+	ramfs_freecount--;
+}
+
+//Gets another chunk of blocks from the kernel and puts them on the free-list. Called with the free-list locked.
+//Returns 0 on success or a negative error number.
+static int ramfs_grow_locked(void)
+{
+	//Use the lowest chunk number we don't have, to keep block numbers small.
+	for(int cc = 0; cc < RAMFS_RADIX_ROOT * RAMFS_RADIX_LEAF; cc++)
+	{
+		if(ramfs_radix[cc / RAMFS_RADIX_LEAF] == NULL)
+		{
+			ramfs_chunk_t *leaf = kpage_alloc(RAMFS_RADIX_LEAF * sizeof(ramfs_chunk_t));
+			if(leaf == NULL)
+				return -ENOSPC;
+			
+			memset(leaf, 0, RAMFS_RADIX_LEAF * sizeof(ramfs_chunk_t));
+			ramfs_radix[cc / RAMFS_RADIX_LEAF] = leaf;
+		}
+		
+		ramfs_chunk_t *chunk = &(ramfs_radix[cc / RAMFS_RADIX_LEAF][cc % RAMFS_RADIX_LEAF]);
+		if(chunk->blocks != NULL)
+			continue;
+		
+		chunk->blocks = kpage_alloc(RAMFS_CHUNK_BLOCKS * RAMFS_BLOCK_SIZE);
+		if(chunk->blocks == NULL)
+			return -ENOSPC;
+		
+		ramfs_poolcount += RAMFS_CHUNK_BLOCKS;
+		
+		//Free them in reverse, so they're handed out in ascending order.
+		//Block 0 holds the root directory and is never free.
+		for(int bb = RAMFS_CHUNK_BLOCKS - 1; bb >= 0; bb--)
+		{
+			int blknum = (cc * RAMFS_CHUNK_BLOCKS) + bb;
+			if(blknum != 0)
+				ramfs_free_locked(blknum);
+		}
+		
+		return 0;
+	}
+	
+	return -ENOSPC;
+}
+
+//Gives the chunk holding the given block back to the kernel, if all its blocks are free.
+//Keeps a chunk's worth of free blocks around, so we don't go back and forth. Called with the free-list locked.
+static void ramfs_shrink_locked(int blknum)
 {
-	if(ramfs_freehead == 0)
-		return -ENOSPC;
+	ramfs_chunk_t *chunk = ramfs_chunk(blknum);
+	if(chunk->nfree < RAMFS_CHUNK_BLOCKS)
+		return;
+	
+	if(ramfs_freecount - RAMFS_CHUNK_BLOCKS < RAMFS_CHUNK_BLOCKS)
+		return;
 	
-	int64_t retval = ramfs_freehead;
-	ramfs_freehead = ramfs_blocks[ramfs_freehead].nextfree;
+	int first = blknum - (blknum % RAMFS_CHUNK_BLOCKS);
+	for(int bb = 0; bb < RAMFS_CHUNK_BLOCKS; bb++)
+	{
+		ramfs_unfree_locked(first + bb);
+	}
+	
+	kpage_free(chunk->blocks, RAMFS_CHUNK_BLOCKS * RAMFS_BLOCK_SIZE);
+	chunk->blocks = NULL;
+	ramfs_poolcount -= RAMFS_CHUNK_BLOCKS;
+}
+
+//Returns whether a block is mapped in user memory, besides being in the filesystem.
+static bool ramfs_shared(int blknum)
+{
+	uintptr_t frame = m_kspc_get((uintptr_t)ramfs_block(blknum));
+	KASSERT(frame != 0);
+	return m_frame_refs(frame) > 1;
+}
+
+//Puts blocks that were held for user mappings back on the free-list, if they're no longer mapped.
+//Called with the free-list locked. Returns how many were freed.
+static int ramfs_reclaim_locked(void)
+{
+	int reclaimed = 0;
+	for(int cc = 0; ramfs_heldcount > 0 && cc < RAMFS_RADIX_ROOT * RAMFS_RADIX_LEAF; cc++)
+	{
+		ramfs_chunk_t *leaf = ramfs_radix[cc / RAMFS_RADIX_LEAF];
+		if(leaf == NULL)
+		{
+			cc += RAMFS_RADIX_LEAF - 1;
+			continue;
+		}
+		
+		ramfs_chunk_t *chunk = &(leaf[cc % RAMFS_RADIX_LEAF]);
+		for(int bb = 0; chunk->blocks != NULL && bb < RAMFS_CHUNK_BLOCKS; bb++)
+		{
+			if(!(chunk->heldbits[bb / 64] & (1ull << (bb % 64))))
+				continue;
+			
+			int blknum = (cc * RAMFS_CHUNK_BLOCKS) + bb;
+			if(ramfs_shared(blknum))
+				continue;
+			
+			chunk->heldbits[bb / 64] &= ~(1ull << (bb % 64));
+			ramfs_heldcount--;
+			ramfs_free_locked(blknum);
+			reclaimed++;
+		}
+	}
+	return reclaimed;
+}
+
+//Allocates a block in the filesystem, preferring the given block if it's free. Returns its block number.
+//Data blocks ask for the one after the previous block in the file, so files end up contiguous where possible.
+static int ramfs_alloc_near(int hint)
+{
+	m_spl_acq(&ramfs_free_spl);
+	int retval = 0;
+	if(hint > 0 && hint < RAMFS_BLOCK_MAX)
+	{
+		//Take the first free block at or after the hint, if there's one in the same chunk.
+		int cc = hint / RAMFS_CHUNK_BLOCKS;
+		ramfs_chunk_t *leaf = ramfs_radix[cc / RAMFS_RADIX_LEAF];
+		ramfs_chunk_t *chunk = (leaf != NULL) ? &(leaf[cc % RAMFS_RADIX_LEAF]) : NULL;
+		int hint_bb = hint % RAMFS_CHUNK_BLOCKS;
+		for(int ww = hint_bb / 64; chunk != NULL && chunk->blocks != NULL && ww < RAMFS_CHUNK_BLOCKS / 64; ww++)
+		{
+			uint64_t bits = chunk->freebits[ww];
+			if(ww == hint_bb / 64)
+				bits &= ~((1ull << (hint_bb % 64)) - 1);
+			
+			if(bits != 0)
+			{
+				retval = (cc * RAMFS_CHUNK_BLOCKS) + (ww * 64);
+				while(!(bits & 1))
+				{
+					bits >>= 1;
+					retval++;
+				}
+				break;
+			}
+		}
+	}
+	
+	if(retval == 0)
+	{
+		//Nothing near the hint - take any free block, getting more from the kernel if we're out.
+		//Blocks that were held for mappings might be free by now.
+		if(ramfs_freehead == 0 && ramfs_heldcount > 0)
+			ramfs_reclaim_locked();
+		
+		if(ramfs_freehead == 0)
+		{
+			int grow_err = ramfs_grow_locked();
+			if(grow_err < 0)
+			{
+				m_spl_rel(&ramfs_free_spl);
+				return grow_err;
+			}
+		}
+		
+		retval = ramfs_freehead;
+	}
 	
 	KASSERT(retval > 0 && retval < RAMFS_BLOCK_MAX);
-	memset(&(ramfs_blocks[retval]), 0, sizeof(ramfs_blocks[retval]));
+	ramfs_unfree_locked(retval);
+	m_spl_rel(&ramfs_free_spl);
+	
+	memset(ramfs_block(retval), 0, sizeof(ramfs_block_t));
 	return retval;
 }
 
+//Allocates a block in the filesystem. Returns its block number.
+static int ramfs_alloc(void)
+{
+	return ramfs_alloc_near(0);
+}
+
 //Frees a block in the filesystem, putting it back on the free-list.
 static void ramfs_free(int blknum)
 {
-	KASSERT(blknum != 0);
-	ramfs_blocks[blknum].nextfree = ramfs_freehead;
-	ramfs_freehead = blknum;
+	KASSERT(blknum > 0 && blknum < RAMFS_BLOCK_MAX);
+	m_spl_acq(&ramfs_free_spl);
+	ramfs_free_locked(blknum);
+	ramfs_shrink_locked(blknum);
+	m_spl_rel(&ramfs_free_spl);
+}
+
+//Returns the hash of a name in a directory.
+static uint32_t ramfs_namehash(const char *name)
+{
+	//FNV-1a
+	uint32_t hash = 2166136261u;
+	for(const char *cc = name; *cc != '\0'; cc++)
+	{
+		hash ^= (uint8_t)(*cc);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//Discards the index of a directory, if it has one.
+static void ramfs_dirhash_free(ramfs_ino_t *dptr)
+{
+	ramfs_dirhash_t *dh = dptr->dirhash;
+	if(dh == NULL)
+		return;
+	
+	for(size_t bb = 0; bb < dh->nbuckets; bb++)
+	{
+		while(dh->buckets[bb] != NULL)
+		{
+			ramfs_dhent_t *ent = dh->buckets[bb];
+			dh->buckets[bb] = ent->next;
+			slab_free(&ramfs_dhent_slab, ent);
+		}
+	}
+	
+	kpage_free(dh->buckets, dh->nbuckets * sizeof(dh->buckets[0]));
+	slab_free(&ramfs_dirhash_slab, dh);
+	dptr->dirhash = NULL;
+}
+
+//Changes the number of buckets in an index, moving entries to their new buckets.
+//Returns 0 on success or a negative error number.
+static int ramfs_dirhash_resize(ramfs_dirhash_t *dh, size_t nbuckets)
+{
+	ramfs_dhent_t **buckets = kpage_alloc(nbuckets * sizeof(buckets[0]));
+	if(buckets == NULL)
+		return -ENOMEM;
+	
+	memset(buckets, 0, nbuckets * sizeof(buckets[0]));
+	
+	for(size_t bb = 0; bb < dh->nbuckets; bb++)
+	{
+		while(dh->buckets[bb] != NULL)
+		{
+			ramfs_dhent_t *ent = dh->buckets[bb];
+			dh->buckets[bb] = ent->next;
+			ent->next = buckets[ent->hash % nbuckets];
+			buckets[ent->hash % nbuckets] = ent;
+		}
+	}
+	
+	if(dh->buckets != NULL)
+		kpage_free(dh->buckets, dh->nbuckets * sizeof(dh->buckets[0]));
+	
+	dh->buckets = buckets;
+	dh->nbuckets = nbuckets;
+	return 0;
+}
+
+//Adds a directory entry to an index.
+//Returns 0 on success or a negative error number.
+static int ramfs_dirhash_add(ramfs_dirhash_t *dh, const char *name, uint32_t slot)
+{
+	//Keep chains short by growing as entries are added. If we can't, longer chains still work.
+	if(dh->count >= dh->nbuckets)
+		ramfs_dirhash_resize(dh, dh->nbuckets * 2);
+	
+	ramfs_dhent_t *ent = slab_alloc(&ramfs_dhent_slab);
+	if(ent == NULL)
+		return -ENOMEM;
+	
+	ent->hash = ramfs_namehash(name);
+	ent->slot = slot;
+	ent->next = dh->buckets[ent->hash % dh->nbuckets];
+	dh->buckets[ent->hash % dh->nbuckets] = ent;
+	dh->count++;
+	return 0;
+}
+
+//Finds the entry in an index that locates the given slot, with the given name. Returns a pointer to the link to it.
+static ramfs_dhent_t **ramfs_dirhash_link(ramfs_dirhash_t *dh, const char *name, uint32_t slot)
+{
+	uint32_t hash = ramfs_namehash(name);
+	for(ramfs_dhent_t **link = &(dh->buckets[hash % dh->nbuckets]); *link != NULL; link = &((*link)->next))
+	{
+		if((*link)->slot == slot)
+			return link;
+	}
+	
+	return NULL;
+}
+
+//Returns the index of the given directory, building it if the directory is big enough to need one.
+//Returns NULL if the directory should just be scanned.
+static ramfs_dirhash_t *ramfs_dirhash_get(ino_t dir)
+{
+	ramfs_ino_t *dptr = &(ramfs_block(dir)->ino);
+	if(dptr->dirhash != NULL)
+		return dptr->dirhash;
+	
+	size_t nents = dptr->size / sizeof(ramfs_dirent_t);
+	if(nents < RAMFS_DIRHASH_MIN)
+		return NULL;
+	
+	ramfs_dirhash_t *dh = slab_alloc(&ramfs_dirhash_slab);
+	if(dh == NULL)
+		return NULL;
+	
+	dptr->dirhash = dh;
+	
+	//Start with about one bucket per entry
+	size_t nbuckets = RAMFS_BLOCK_SIZE / sizeof(dh->buckets[0]);
+	while(nbuckets < nents)
+	{
+		nbuckets *= 2;
+	}
+	
+	if(ramfs_dirhash_resize(dh, nbuckets) < 0)
+	{
+		slab_free(&ramfs_dirhash_slab, dh);
+		dptr->dirhash = NULL;
+		return NULL;
+	}
+	
+	for(size_t ee = 0; ee < nents; ee++)
+	{
+		ramfs_dirent_t de;
+		ssize_t read = ramfs_read(dir, ee * sizeof(de), &de, sizeof(de));
+		if(read != sizeof(de) || ramfs_dirhash_add(dh, de.name, ee) < 0)
+		{
+			//Couldn't index the whole directory - we'll have to scan it.
+			ramfs_dirhash_free(dptr);
+			return NULL;
+		}
+	}
+	
+	return dh;
+}
+
+//Looks for the directory entry with the given name, using the directory's index if it has one.
+//Outputs the entry and its offset. Returns 0 on success or a negative error number.
+static int ramfs_lookup(ino_t dir, const char *name, ramfs_dirent_t *de_out, off_t *off_out)
+{
+	ramfs_ino_t *dptr = &(ramfs_block(dir)->ino);
+	ramfs_dirhash_t *dh = ramfs_dirhash_get(dir);
+	if(dh != NULL)
+	{
+		//Only need to look at entries with the same hash.
+		uint32_t hash = ramfs_namehash(name);
+		for(ramfs_dhent_t *ent = dh->buckets[hash % dh->nbuckets]; ent != NULL; ent = ent->next)
+		{
+			if(ent->hash != hash)
+				continue;
+			
+			off_t off = ent->slot * sizeof(*de_out);
+			ssize_t read = ramfs_read(dir, off, de_out, sizeof(*de_out));
+			if(read < 0)
+				return read;
+			if(read != sizeof(*de_out))
+				return -EIO;
+			
+			if(!strcmp(de_out->name, name))
+			{
+				*off_out = off;
+				return 0;
+			}
+		}
+		
+		return -ENOENT;
+	}
+	
+	//Read all directory entries and look for this name.
+	off_t nextoff = 0;
+	while(nextoff < dptr->size)
+	{
+		ssize_t read = ramfs_read(dir, nextoff, de_out, sizeof(*de_out));
+		if(read < 0)
+			return read;
+		if(read != sizeof(*de_out))
+			return -EIO;
+		
+		if(!strcmp(de_out->name, name))
+		{
+			*off_out = nextoff;
+			return 0;
+		}
+		
+		//Not the file we were looking for.
+		nextoff += read;
+	}
+	
+	//Didn't find an entry with this name
+	return -ENOENT;
+}
+
+//Returns where the given directory and name go in the lookup cache.
+static ramfs_dcent_t *ramfs_dcache_slot(ino_t dir, const char *name)
+{
+	uint32_t hash = ramfs_namehash(name) ^ ((uint32_t)dir * 2654435761u);
+	return &(ramfs_dcache[hash % RAMFS_DCACHE_MAX]);
+}
+
+//Removes the given directory and name from the lookup cache, if present.
+static void ramfs_dcache_forget(ino_t dir, const char *name)
+{
+	ramfs_dcent_t *dc = ramfs_dcache_slot(dir, name);
+	if(dc->valid && dc->dir == dir && !strcmp(dc->name, name))
+		dc->valid = false;
+}
+
+//Removes everything referring to the given inode from the lookup cache, as it's being freed.
+static void ramfs_dcache_purge(ino_t ino)
+{
+	for(int dd = 0; dd < RAMFS_DCACHE_MAX; dd++)
+	{
+		ramfs_dcent_t *dc = &(ramfs_dcache[dd]);
+		if(dc->dir == ino || (!dc->negative && dc->ino == ino))
+			dc->valid = false;
+	}
 }
 
 //Checks if any references remain to the given inode.
 //If not, frees it.
 static void ramfs_checkrefs(ino_t ino)
 {
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
 	if(iptr->nfiles > 0)
 		return;
 	if(iptr->nlinks > 0)
@@ -113,12 +654,35 @@ static void ramfs_checkrefs(ino_t ino)
 		iptr->special = 0;
 	}
 	
+	//Directory numbers get reused - don't let old lookups in this one apply to the next.
+	if(S_ISDIR(iptr->mode))
+		ramfs_dcache_purge(ino);
+	
+	ramfs_dirhash_free(iptr);
 	ramfs_trunc(ino, 0);
 	iptr->mode = -1; //Poison
 	iptr->size = -1; //Poison
 	ramfs_free(ino);
 }
 
+//Frees a data block of a file.
+//If the file was mapped and the block still is, it's held aside until it isn't, rather than reused.
+static void ramfs_free_data(ramfs_ino_t *iptr, int blknum)
+{
+	if(iptr->mapped && ramfs_shared(blknum))
+	{
+		m_spl_acq(&ramfs_free_spl);
+		ramfs_chunk_t *chunk = ramfs_chunk(blknum);
+		int bb = blknum % RAMFS_CHUNK_BLOCKS;
+		chunk->heldbits[bb / 64] |= (1ull << (bb % 64));
+		ramfs_heldcount++;
+		m_spl_rel(&ramfs_free_spl);
+		return;
+	}
+	
+	ramfs_free(blknum);
+}
+
 //Returns the block number of the data-block for the given offset in the given inode.
 //Optionally tries to allocate blocks to back the given location.
 static int ramfs_getblock(ino_t ino, off_t off, int alloc)
@@ -126,7 +690,8 @@ static int ramfs_getblock(ino_t ino, off_t off, int alloc)
 	if(off < 0)
 		return -EINVAL;
 	
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	KASSERT(iptr->tabled);
 	
 	off_t block_num = off / RAMFS_BLOCK_SIZE;
 	
@@ -147,13 +712,20 @@ static int ramfs_getblock(ino_t ino, off_t off, int alloc)
 		iptr->dtables[table_idx] = newtable;
 	}
 	
-	ramfs_dtable_t *dptr = &(ramfs_blocks[iptr->dtables[table_idx]].dtable);
+	ramfs_dtable_t *dptr = &(ramfs_block(iptr->dtables[table_idx])->dtable);
 	if(dptr->blocks[block_idx] == 0)
 	{
 		if(!alloc)
 			return 0;
 		
-		int newblock = ramfs_alloc();
+		//Try to put the block right after the one before it in the file
+		int prevblock = 0;
+		if(block_idx > 0)
+			prevblock = dptr->blocks[block_idx - 1];
+		else if(block_num > 0)
+			prevblock = ramfs_getblock(ino, off - RAMFS_BLOCK_SIZE, 0);
+		
+		int newblock = ramfs_alloc_near((prevblock > 0) ? (prevblock + 1) : 0);
 		if(newblock < 0)
 			return newblock;
 		
@@ -163,24 +735,138 @@ static int ramfs_getblock(ino_t ino, off_t off, int alloc)
 	return dptr->blocks[block_idx];
 }
 
+//Returns the data-block for the given offset in the given inode, like ramfs_getblock without allocating.
+//Also outputs how many blocks, up to max, starting there are stored one after another in the pool.
+//These can be copied all at once. For holes, outputs a run of 1.
+static int ramfs_getrun(ino_t ino, off_t off, size_t max, size_t *run_out)
+{
+	*run_out = 1;
+	int first = ramfs_getblock(ino, off, 0);
+	if(first <= 0)
+		return first;
+	
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	size_t block_num = off / RAMFS_BLOCK_SIZE;
+	size_t run = 1;
+	while(run < max)
+	{
+		size_t next_num = block_num + run;
+		size_t table_idx = next_num / RAMFS_DBLOCK_MAX;
+		if(table_idx >= RAMFS_DTABLE_MAX || iptr->dtables[table_idx] == 0)
+			break;
+		
+		//Blocks in different chunks aren't next to each other in memory
+		if((first + (int)run) % RAMFS_CHUNK_BLOCKS == 0)
+			break;
+		
+		const ramfs_dtable_t *dptr = &(ramfs_block(iptr->dtables[table_idx])->dtable);
+		if(dptr->blocks[next_num % RAMFS_DBLOCK_MAX] != first + (int)run)
+			break;
+		
+		run++;
+	}
+	
+	*run_out = run;
+	return first;
+}
+
+//Returns the contents of a file stored in its inode, when it's not tabled.
+static uint8_t *ramfs_inline(ramfs_ino_t *iptr)
+{
+	return (uint8_t*)(iptr->dtables);
+}
+
+//Moves the contents of an inode out of the inode itself, into data blocks, so it can grow larger.
+//Returns 0 on success or a negative error number.
+static int ramfs_uninline(ino_t ino)
+{
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	KASSERT(!iptr->tabled);
+	
+	if(iptr->size == 0)
+	{
+		//Nothing to move. Inline area is all zeroes, so it's also an empty table.
+		iptr->tabled = true;
+		return 0;
+	}
+	
+	int dtable = ramfs_alloc();
+	if(dtable < 0)
+		return dtable;
+	
+	int data = ramfs_alloc_near(dtable + 1);
+	if(data < 0)
+	{
+		ramfs_free(dtable);
+		return data;
+	}
+	
+	memcpy(ramfs_block(data)->data, ramfs_inline(iptr), iptr->size);
+	memset(ramfs_inline(iptr), 0, RAMFS_INLINE_MAX);
+	ramfs_block(dtable)->dtable.blocks[0] = data;
+	iptr->dtables[0] = dtable;
+	iptr->tabled = true;
+	return 0;
+}
+
+//Stops using the adopted memory behind an inode, copying the first keep bytes of it into the filesystem.
+//The file is left holding just those bytes. Returns 0 on success or a negative error number.
+static int ramfs_unadopt(ino_t ino, off_t keep)
+{
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	KASSERT(iptr->adopted != NULL);
+	KASSERT(!iptr->tabled);
+	
+	const uint8_t *adopted = iptr->adopted;
+	ramfs_release_t *release = iptr->release;
+	off_t adopted_size = iptr->size;
+	if(keep > adopted_size)
+		keep = adopted_size;
+	
+	//Make the file empty and write the kept part back into it, like any other file
+	iptr->adopted = NULL;
+	iptr->release = NULL;
+	iptr->size = 0;
+	if(keep > 0)
+	{
+		ssize_t written = ramfs_write_locked(ino, 0, adopted, keep);
+		if(written != keep)
+		{
+			//Couldn't copy it all - go back to using the adopted memory
+			ramfs_trunc_locked(ino, 0);
+			iptr->adopted = adopted;
+			iptr->release = release;
+			iptr->size = adopted_size;
+			return (written < 0) ? written : -ENOSPC;
+		}
+	}
+	
+	//Done with the adopted memory
+	release(adopted, adopted_size);
+	return 0;
+}
+
 void ramfs_init(void)
 {
 	//Make sure we didn't botch the block size definition...
 	KASSERT(sizeof(ramfs_block_t) == RAMFS_BLOCK_SIZE);
 	
-	ramfs_blocks = kpage_alloc(RAMFS_BLOCK_MAX * RAMFS_BLOCK_SIZE);
-	if(ramfs_blocks == NULL)
-		m_panic("ramfs_init no memory");
+	ramfs_dcache = kpage_alloc(RAMFS_DCACHE_MAX * sizeof(ramfs_dcache[0]));
+	if(ramfs_dcache == NULL)
+		m_panic("ramfs_init no memory for lookup cache");
 	
-	//Build the initial free-list of all blocks except 0.
-	for(int bb = 1; bb < RAMFS_BLOCK_MAX; bb++)
-	{
-		ramfs_free(bb);
-	}
+	memset(ramfs_dcache, 0, RAMFS_DCACHE_MAX * sizeof(ramfs_dcache[0]));
+	
+	//Get the first chunk of blocks. The rest come as the filesystem fills.
+	m_spl_acq(&ramfs_free_spl);
+	int grow_err = ramfs_grow_locked();
+	m_spl_rel(&ramfs_free_spl);
+	if(grow_err < 0)
+		m_panic("ramfs_init no memory");
 	
 	//Make the inode for the root directory in block 0
-	memset(&(ramfs_blocks[0]), 0, sizeof(ramfs_blocks[0]));
-	ramfs_blocks[0].ino.mode = S_IFDIR | 0777;	
+	memset(ramfs_block(0), 0, sizeof(ramfs_block_t));
+	ramfs_block(0)->ino.mode = S_IFDIR | 0777;	
 	
 	//Write "." and ".." into root directory
 	ramfs_dirent_t dot = { .ino = 0, .name = "." };
@@ -194,7 +880,24 @@ void ramfs_init(void)
 		m_panic("ramfs_init failed making root dir");
 	
 	//Give root directory a phony reference-count that can (should) never be removed
-	ramfs_blocks[0].ino.nlinks++;
+	ramfs_block(0)->ino.nlinks++;
+}
+
+void ramfs_info(_sc_fsinfo_t *info)
+{
+	ramfs_lock();
+	info->dcache_size = RAMFS_DCACHE_MAX;
+	info->dcache_hits = ramfs_dcache_hits;
+	info->dcache_neghits = ramfs_dcache_neghits;
+	info->dcache_misses = ramfs_dcache_misses;
+	ramfs_unlock();
+	
+	m_spl_acq(&ramfs_free_spl);
+	info->block_size = RAMFS_BLOCK_SIZE;
+	info->blocks = ramfs_poolcount;
+	info->blocks_free = ramfs_freecount;
+	info->blocks_held = ramfs_heldcount;
+	m_spl_rel(&ramfs_free_spl);
 }
 
 void ramfs_lock(void)
@@ -240,7 +943,7 @@ int ramfs_make(ino_t dir, const char *name, mode_t mode, dev_t special, ino_t *i
 		special = pipe_id;
 	}
 	
-	ramfs_ino_t *newino = &(ramfs_blocks[inoblock].ino);
+	ramfs_ino_t *newino = &(ramfs_block(inoblock)->ino);
 	newino->mode = mode;
 	newino->special = special;
 	newino->size = 0;
@@ -293,16 +996,26 @@ int ramfs_make(ino_t dir, const char *name, mode_t mode, dev_t special, ino_t *i
 	
 	//Write into the directory containing the file.
 	//Do this last so we don't need to un-do it on failure.
-	ramfs_ino_t *dirino = &(ramfs_blocks[dir].ino);
-	ssize_t firstlink_written = ramfs_write(dir, dirino->size, &firstlink, sizeof(firstlink));
+	ramfs_ino_t *dirino = &(ramfs_block(dir)->ino);
+	off_t firstlink_off = dirino->size;
+	ssize_t firstlink_written = ramfs_write(dir, firstlink_off, &firstlink, sizeof(firstlink));
 	if(firstlink_written != sizeof(firstlink))
 	{
 		err_ret = (firstlink_written < 0) ? firstlink_written : -EIO;
 		goto failure;
 	}
 	
+	//Anyone who looked for this name before didn't find it.
+	ramfs_dcache_forget(dir, firstlink.name);
+	
+	//Keep the directory's index up to date, if it has one. If we can't, it's rebuilt when next needed.
+	if(dirino->dirhash != NULL && ramfs_dirhash_add(dirino->dirhash, firstlink.name, firstlink_off / sizeof(firstlink)) < 0)
+		ramfs_dirhash_free(dirino);
+	
 	//The new file starts with one link in the filesystem.
+	m_spl_acq(&(newino->spl));
 	newino->nlinks = 1;
+	m_spl_rel(&(newino->spl));
 	*ino_out = inoblock;
 	return 0;
 	
@@ -337,34 +1050,46 @@ int ramfs_find(ino_t dir, const char *name, ino_t *ino_out)
 		return 0;
 	}
 	
-	ramfs_ino_t *dptr = &(ramfs_blocks[dir].ino);
+	ramfs_ino_t *dptr = &(ramfs_block(dir)->ino);
 	if(!S_ISDIR(dptr->mode))
 		return -ENOTDIR;
 	
-	//Read all directory entries and look for this name.
-	off_t nextoff = 0;
-	while(nextoff < dptr->size)
+	//See if we've done this lookup recently
+	ramfs_dcent_t *dc = ramfs_dcache_slot(dir, name);
+	if(dc->valid && dc->dir == dir && !strcmp(dc->name, name))
 	{
-		ramfs_dirent_t de;
-		ssize_t read = ramfs_read(dir, nextoff, &de, sizeof(de));
-		if(read < 0)
-			return read;
-		if(read != sizeof(de))
-			return -EIO;
-		
-		if(!strcmp(de.name, name))
+		if(dc->negative)
 		{
-			//Found it - output the inode and give it another file reference.
-			*ino_out = de.ino;
-			return 0;
+			ramfs_dcache_neghits++;
+			return -ENOENT;
 		}
 		
-		//Not the file we were looking for.
-		nextoff += read;
+		ramfs_dcache_hits++;
+		*ino_out = dc->ino;
+		return 0;
 	}
 	
-	//Didn't find an entry with this name
-	return -ENOENT;
+	ramfs_dcache_misses++;
+	
+	ramfs_dirent_t de;
+	off_t off = 0;
+	int lookup_err = ramfs_lookup(dir, name, &de, &off);
+	
+	//Remember the result, whether it was found or not, if the name could be in a directory at all.
+	if((lookup_err == 0 || lookup_err == -ENOENT) && strlen(name) < sizeof(dc->name))
+	{
+		dc->valid = true;
+		dc->negative = (lookup_err == -ENOENT);
+		dc->dir = dir;
+		dc->ino = (lookup_err == 0) ? de.ino : 0;
+		strncpy(dc->name, name, sizeof(dc->name));
+	}
+	
+	if(lookup_err < 0)
+		return lookup_err;
+	
+	*ino_out = de.ino;
+	return 0;
 }
 
 int ramfs_unlink(ino_t dir, const char *name, ino_t rmino, int flags)
@@ -373,107 +1098,141 @@ int ramfs_unlink(ino_t dir, const char *name, ino_t rmino, int flags)
 		return -EINVAL;
 	
 	KASSERT(dir < RAMFS_BLOCK_MAX);
-	ramfs_ino_t *dptr = &(ramfs_blocks[dir].ino);
+	ramfs_ino_t *dptr = &(ramfs_block(dir)->ino);
 	if(!S_ISDIR(dptr->mode))
 		return -ENOTDIR;
 	
 	//Search for the directory entry with this name.
-	off_t nextoff = 0;
-	while(nextoff < dptr->size)
+	ramfs_dirent_t de;
+	off_t off = 0;
+	int lookup_err = ramfs_lookup(dir, name, &de, &off);
+	if(lookup_err < 0)
+		return lookup_err;
+	
+	//Are we trying to unlink a specific ino too?
+	if(rmino != 0 && rmino != de.ino)
 	{
-		ramfs_dirent_t de;
-		ssize_t read = ramfs_read(dir, nextoff, &de, sizeof(de));
-		if(read < 0)
-			return read;
-		if(read != sizeof(de))
-			return -EIO;
+		//The link no longer refers to the file we're trying to remove.
+		return -EDEADLK; //Like FreeBSD funlinkat
+	}
+	
+	KASSERT(de.ino < RAMFS_BLOCK_MAX);
+	ramfs_ino_t *unlinked = &(ramfs_block(de.ino)->ino);
+	
+	//Are we intending to remove a directory?
+	if(flags & AT_REMOVEDIR)
+	{
+		if(!S_ISDIR(unlinked->mode))
+		{
+			//Wanted to remove a directory but this isn't
+			return -ENOTDIR;
+		}
+	}
+	else
+	{
+		if(S_ISDIR(unlinked->mode))
+		{
+			//Didn't want to remove a directory, but this is one
+			return -EISDIR;
+		}
+	}
+	
+	//Copy the last directory entry over the one being removed. Then truncate by one directory entry.
+	//Hold the directory's lock throughout, so anyone reading it sees the entries before or after.
+	m_spl_acq(&(dptr->spl));
+	
+	ramfs_dirent_t lastde;
+	off_t lastoff = dptr->size - sizeof(lastde);
+	ssize_t lastread = ramfs_read_locked(dir, lastoff, &lastde, sizeof(lastde));
+	KASSERT(lastread == sizeof(lastde));
+	
+	ssize_t overwritten = ramfs_write_locked(dir, off, &lastde, sizeof(lastde));
+	KASSERT(overwritten == sizeof(lastde));
+	
+	off_t trunced = ramfs_trunc_locked(dir, lastoff);
+	KASSERT(trunced >= 0);
+	KASSERT((size_t)dptr->size >= 2 * sizeof(ramfs_dirent_t)); //Always have "." and ".."
+	
+	m_spl_rel(&(dptr->spl));
+	
+	//Same in the index - drop the removed entry, and the last entry now lives where it was.
+	ramfs_dirhash_t *dh = dptr->dirhash;
+	if(dh != NULL)
+	{
+		ramfs_dhent_t **removed = ramfs_dirhash_link(dh, name, off / sizeof(de));
+		KASSERT(removed != NULL);
+		ramfs_dhent_t *ent = *removed;
+		*removed = ent->next;
+		slab_free(&ramfs_dhent_slab, ent);
+		dh->count--;
 		
-		if(!strcmp(de.name, name))
+		if(lastoff != off)
 		{
-			//Found the name we want to unlink.
-			//Are we trying to unlink a specific ino too?
-			if(rmino != 0 && rmino != de.ino)
-			{
-				//The link no longer refers to the file we're trying to remove.
-				return -EDEADLK; //Like FreeBSD funlinkat
-			}
-			
-			KASSERT(de.ino < RAMFS_BLOCK_MAX);
-			ramfs_ino_t *unlinked = &(ramfs_blocks[de.ino].ino);
-			
-			//Are we intending to remove a directory?
-			if(flags & AT_REMOVEDIR)
-			{
-				if(!S_ISDIR(unlinked->mode))
-				{
-					//Wanted to remove a directory but this isn't
-					return -ENOTDIR;
-				}
-			}
-			else
-			{
-				if(S_ISDIR(unlinked->mode))
-				{
-					//Didn't want to remove a directory, but this is one
-					return -EISDIR;
-				}
-			}			
-			
-			//Copy the last directory entry over the one being removed. Then truncate by one directory entry.
-			ramfs_dirent_t lastde;
-			ssize_t lastread = ramfs_read(dir, dptr->size - sizeof(lastde), &lastde, sizeof(lastde));
-			KASSERT(lastread == sizeof(lastde));
-			
-			ssize_t overwritten = ramfs_write(dir, nextoff, &lastde, sizeof(lastde));
-			KASSERT(overwritten == sizeof(lastde));
-			
-			off_t trunced = ramfs_trunc(dir, dptr->size - sizeof(lastde));
-			KASSERT(trunced >= 0);
-			KASSERT((size_t)dptr->size >= 2 * sizeof(ramfs_dirent_t)); //Always have "." and ".."
-			
-			//File being referred to, now has one less reference.
-			unlinked->nlinks--;
-			ramfs_checkrefs(de.ino);
-			
-			//Success
-			return 0;
+			ramfs_dhent_t **moved = ramfs_dirhash_link(dh, lastde.name, lastoff / sizeof(lastde));
+			KASSERT(moved != NULL);
+			(*moved)->slot = off / sizeof(lastde);
 		}
-
-		//Not the name we wanted to unlink
-		nextoff += sizeof(de);
 	}
 	
-	//Didn't find the file to unlink
-	return -ENOENT;
+	//Lookups of this name won't find the same thing anymore.
+	ramfs_dcache_forget(dir, name);
+	
+	//File being referred to, now has one less reference.
+	m_spl_acq(&(unlinked->spl));
+	unlinked->nlinks--;
+	m_spl_rel(&(unlinked->spl));
+	ramfs_checkrefs(de.ino);
+	
+	//Success
+	return 0;
 }
 
-ssize_t ramfs_read(ino_t ino, off_t off, void *buf, ssize_t len)
+//Reads from an inode, with the inode already locked.
+static ssize_t ramfs_read_locked(ino_t ino, off_t off, void *buf, ssize_t len)
 {
 	if(off < 0)
 		return -EINVAL;
 	
-	KASSERT(ino < RAMFS_BLOCK_MAX);
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
 	
-	//Handle a block at a time
+	//Small files are right in the inode, and adopted files are wherever they were adopted from
+	if(!iptr->tabled)
+	{
+		if(off >= iptr->size)
+			return 0;
+		
+		ssize_t read_len = len;
+		if(read_len > iptr->size - off)
+			read_len = iptr->size - off;
+		
+		const uint8_t *src = (iptr->adopted != NULL) ? iptr->adopted : ramfs_inline(iptr);
+		memcpy(buf, src + off, read_len);
+		return read_len;
+	}
+	
+	//Handle a run of contiguous blocks at a time
 	uint8_t *buf_bytes = (uint8_t*)buf;
 	ssize_t completed = 0;
 	while(len > 0 && off < iptr->size)
 	{
-		//Cannot read past the end of the block, nor the end of the file in bytes, nor the requested length.
-		ssize_t left_in_block = RAMFS_BLOCK_SIZE - (off % RAMFS_BLOCK_SIZE);
+		//Cannot read past the end of the file in bytes, nor the requested length.
 		ssize_t left_in_file = iptr->size - off;
 		ssize_t read_len = len;
-		if(read_len > left_in_block)
-			read_len = left_in_block;
 		if(read_len > left_in_file)
 			read_len = left_in_file;
 		
 		//Find where the data for this block is - or return 0s if it's a hole (no data yet).
-		int dataloc = ramfs_getblock(ino, off, 0);
+		size_t run = 1;
+		size_t run_max = ((off % RAMFS_BLOCK_SIZE) + read_len + RAMFS_BLOCK_SIZE - 1) / RAMFS_BLOCK_SIZE;
+		int dataloc = ramfs_getrun(ino, off, run_max, &run);
 		if(dataloc < 0)
 			return (completed > 0) ? completed : dataloc;
 		
+		//Cannot read past the end of the run of blocks.
+		ssize_t left_in_run = (run * RAMFS_BLOCK_SIZE) - (off % RAMFS_BLOCK_SIZE);
+		if(read_len > left_in_run)
+			read_len = left_in_run;
+		
 		if(dataloc == 0)
 		{
 			//No data here - read zeroes.
@@ -482,7 +1241,7 @@ ssize_t ramfs_read(ino_t ino, off_t off, void *buf, ssize_t len)
 		else
 		{
 			//Data here - copy it out
-			memcpy(buf_bytes, ramfs_blocks[dataloc].data + (off % RAMFS_BLOCK_SIZE), read_len);
+			memcpy(buf_bytes, ramfs_block(dataloc)->data + (off % RAMFS_BLOCK_SIZE), read_len);
 		}
 		
 		completed += read_len;
@@ -495,33 +1254,70 @@ ssize_t ramfs_read(ino_t ino, off_t off, void *buf, ssize_t len)
 	return completed;
 }
 
-ssize_t ramfs_write(ino_t ino, off_t off, const void *buf, ssize_t len)
+//Writes into an inode, with the inode already locked.
+static ssize_t ramfs_write_locked(ino_t ino, off_t off, const void *buf, ssize_t len)
 {
 	if(off < 0)
 		return -EINVAL;
 	
-	KASSERT(ino < RAMFS_BLOCK_MAX);
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
 	
-	//Handle a block at a time
+	//Adopted files get their own copy before changing
+	if(iptr->adopted != NULL && len > 0)
+	{
+		int unadopt_err = ramfs_unadopt(ino, iptr->size);
+		if(unadopt_err < 0)
+			return unadopt_err;
+	}
+	
+	//Small files are right in the inode, until they outgrow it.
+	if(!iptr->tabled)
+	{
+		if(len <= 0)
+			return 0;
+		
+		if(off + len <= (off_t)RAMFS_INLINE_MAX)
+		{
+			//Beyond the end of the file is kept zeroed, so holes read back as zeroes.
+			memcpy(ramfs_inline(iptr) + off, buf, len);
+			if(off + len > iptr->size)
+				iptr->size = off + len;
+			
+			return len;
+		}
+		
+		int untable_err = ramfs_uninline(ino);
+		if(untable_err < 0)
+			return untable_err;
+	}
+	
+	//Handle a run of contiguous blocks at a time
 	const uint8_t *buf_bytes = (uint8_t*)buf;
 	ssize_t completed = 0;
 	while(len > 0)
 	{
-		ssize_t left_in_block = RAMFS_BLOCK_SIZE - (off % RAMFS_BLOCK_SIZE);
-		ssize_t write_len = len;
-		if(write_len > left_in_block)
-			write_len = left_in_block;
+		//Find where the data for this block is, if there's any yet
+		size_t run = 1;
+		size_t run_max = ((off % RAMFS_BLOCK_SIZE) + len + RAMFS_BLOCK_SIZE - 1) / RAMFS_BLOCK_SIZE;
+		int dataloc = ramfs_getrun(ino, off, run_max, &run);
+		if(dataloc == 0)
+		{
+			//Allocate new data block if there's none here yet
+			dataloc = ramfs_getblock(ino, off, 1);
+		}
 		
-		//Allocate new data block if there's none here yet
-		int dataloc = ramfs_getblock(ino, off, 1);
 		if(dataloc < 0)
 			return (completed > 0) ? completed : dataloc;
 		
 		KASSERT(dataloc > 0);
+		
+		ssize_t left_in_run = (run * RAMFS_BLOCK_SIZE) - (off % RAMFS_BLOCK_SIZE);
+		ssize_t write_len = len;
+		if(write_len > left_in_run)
+			write_len = left_in_run;
 
 		//Copy the data in
-		memcpy(ramfs_blocks[dataloc].data + (off % RAMFS_BLOCK_SIZE), buf_bytes, write_len);
+		memcpy(ramfs_block(dataloc)->data + (off % RAMFS_BLOCK_SIZE), buf_bytes, write_len);
 		
 		completed += write_len;
 		buf_bytes += write_len;
@@ -537,7 +1333,8 @@ ssize_t ramfs_write(ino_t ino, off_t off, const void *buf, ssize_t len)
 	return completed;	
 }
 
-int ramfs_trunc(ino_t ino, off_t size)
+//Truncates an inode, with the inode already locked.
+static int ramfs_trunc_locked(ino_t ino, off_t size)
 {	
 	if(size < 0)
 		return -EINVAL;
@@ -545,9 +1342,43 @@ int ramfs_trunc(ino_t ino, off_t size)
 	if(size > (off_t)(1ul * RAMFS_DTABLE_MAX * RAMFS_DBLOCK_MAX * RAMFS_BLOCK_SIZE))
 		return -EFBIG;
 	
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	
+	//Adopted files get their own copy of whatever part is kept
+	if(iptr->adopted != NULL)
+	{
+		int unadopt_err = ramfs_unadopt(ino, size);
+		if(unadopt_err < 0)
+			return unadopt_err;
+	}
+	
+	//Small files are right in the inode, until they outgrow it.
+	if(!iptr->tabled)
+	{
+		if(size <= (off_t)RAMFS_INLINE_MAX)
+		{
+			//Keep everything past the end zeroed
+			if(size < iptr->size)
+				memset(ramfs_inline(iptr) + size, 0, iptr->size - size);
+			
+			iptr->size = size;
+			return 0;
+		}
+		
+		int untable_err = ramfs_uninline(ino);
+		if(untable_err < 0)
+			return untable_err;
+	}
+	
+	//Zero the end of the last block we keep, so it doesn't come back if the file grows again.
+	if(size < iptr->size && (size % RAMFS_BLOCK_SIZE) != 0)
+	{
+		int lastblock = ramfs_getblock(ino, size, 0);
+		if(lastblock > 0)
+			memset(ramfs_block(lastblock)->data + (size % RAMFS_BLOCK_SIZE), 0, RAMFS_BLOCK_SIZE - (size % RAMFS_BLOCK_SIZE));
+	}
+	
 	//Change size of file
-	KASSERT(ino < RAMFS_BLOCK_MAX);
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
 	iptr->size = size;
 	
 	//Ditch any tables that are totally off the end of the file
@@ -558,13 +1389,13 @@ int ramfs_trunc(ino_t ino, off_t size)
 		if(iptr->dtables[tt] == 0)
 			continue;
 		
-		ramfs_dtable_t *dptr = &(ramfs_blocks[iptr->dtables[tt]].dtable);
+		ramfs_dtable_t *dptr = &(ramfs_block(iptr->dtables[tt])->dtable);
 		for(size_t bb = 0; bb < RAMFS_DBLOCK_MAX; bb++)
 		{
 			if(dptr->blocks[bb] == 0)
 				continue;
 			
-			ramfs_free(dptr->blocks[bb]);
+			ramfs_free_data(iptr, dptr->blocks[bb]);
 			dptr->blocks[bb] = 0;
 		}
 		
@@ -580,48 +1411,179 @@ int ramfs_trunc(ino_t ino, off_t size)
 		size_t first_block = partial_table * RAMFS_DBLOCK_MAX;
 		if(iptr->dtables[partial_table] != 0)
 		{
-			ramfs_dtable_t *dptr = &(ramfs_blocks[iptr->dtables[partial_table]].dtable);
+			ramfs_dtable_t *dptr = &(ramfs_block(iptr->dtables[partial_table])->dtable);
 			for(size_t bb = blocks_needed - first_block; bb < RAMFS_DBLOCK_MAX; bb++)
 			{
 				if(dptr->blocks[bb] == 0)
 					continue;
 				
-				ramfs_free(dptr->blocks[bb]);
+				ramfs_free_data(iptr, dptr->blocks[bb]);
 				dptr->blocks[bb] = 0;
 			}
 		}
 	}
 	
 	//If we truncated to zero, we should have no blocks referenced from this inode.
+	//Then the file can go back to being stored in the inode.
 	if(size == 0)
 	{
 		for(int tt = 0; tt < RAMFS_DTABLE_MAX; tt++)
 		{
 			KASSERT(iptr->dtables[tt] == 0);
 		}
+		
+		iptr->tabled = false;
 	}
 	
 	return 0;
 }
 
+ssize_t ramfs_read(ino_t ino, off_t off, void *buf, ssize_t len)
+{
+	KASSERT(ino < RAMFS_BLOCK_MAX);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	
+	m_spl_acq(&(iptr->spl));
+	ssize_t retval = ramfs_read_locked(ino, off, buf, len);
+	m_spl_rel(&(iptr->spl));
+	return retval;
+}
+
+ssize_t ramfs_write(ino_t ino, off_t off, const void *buf, ssize_t len)
+{
+	KASSERT(ino < RAMFS_BLOCK_MAX);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	
+	m_spl_acq(&(iptr->spl));
+	ssize_t retval = ramfs_write_locked(ino, off, buf, len);
+	m_spl_rel(&(iptr->spl));
+	return retval;
+}
+
+int ramfs_trunc(ino_t ino, off_t size)
+{
+	KASSERT(ino < RAMFS_BLOCK_MAX);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	
+	m_spl_acq(&(iptr->spl));
+	int retval = ramfs_trunc_locked(ino, size);
+	m_spl_rel(&(iptr->spl));
+	return retval;
+}
+
+int ramfs_adopt(ino_t ino, const void *data, off_t size, ramfs_release_t *release)
+{
+	KASSERT(ino < RAMFS_BLOCK_MAX);
+	KASSERT(release != NULL);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	
+	if(size <= 0)
+		return -EINVAL;
+	
+	m_spl_acq(&(iptr->spl));
+	
+	//Only take over files with nothing in them yet
+	if(!S_ISREG(iptr->mode) || iptr->size != 0 || iptr->tabled || iptr->adopted != NULL)
+	{
+		m_spl_rel(&(iptr->spl));
+		return -EBUSY;
+	}
+	
+	iptr->adopted = (const uint8_t*)data;
+	iptr->release = release;
+	iptr->size = size;
+	
+	m_spl_rel(&(iptr->spl));
+	return 0;
+}
+
+int ramfs_mapframe(ino_t ino, off_t off, uintptr_t *frame_out)
+{
+	KASSERT(ino < RAMFS_BLOCK_MAX);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
+	
+	//Blocks can only be mapped if they're whole pages
+	if(m_frame_size() != RAMFS_BLOCK_SIZE)
+		return -ENOTSUP;
+	
+	if(off < 0 || (off % RAMFS_BLOCK_SIZE) != 0)
+		return -EINVAL;
+	
+	m_spl_acq(&(iptr->spl));
+	
+	int err = 0;
+	if(!S_ISREG(iptr->mode))
+	{
+		err = -ENODEV;
+		goto failure;
+	}
+	
+	if(off >= iptr->size)
+	{
+		err = -ENXIO;
+		goto failure;
+	}
+	
+	//Contents have to be in data blocks of their own to be mapped
+	if(iptr->adopted != NULL)
+	{
+		err = ramfs_unadopt(ino, iptr->size);
+		if(err < 0)
+			goto failure;
+	}
+	
+	if(!iptr->tabled)
+	{
+		err = ramfs_uninline(ino);
+		if(err < 0)
+			goto failure;
+	}
+	
+	//Holes get a block of zeroes, so there's something to map.
+	int blknum = ramfs_getblock(ino, off, 1);
+	if(blknum < 0)
+	{
+		err = blknum;
+		goto failure;
+	}
+	
+	KASSERT(blknum > 0);
+	uintptr_t frame = m_kspc_get((uintptr_t)ramfs_block(blknum));
+	KASSERT(frame != 0);
+	m_frame_ref(frame);
+	iptr->mapped = true;
+	
+	m_spl_rel(&(iptr->spl));
+	*frame_out = frame;
+	return 0;
+	
+failure:
+	m_spl_rel(&(iptr->spl));
+	return err;
+}
+
 int ramfs_stat(ino_t ino, struct stat *st)
 {
 	KASSERT(ino < RAMFS_BLOCK_MAX);
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
 	
 	memset(st, 0, sizeof(*st));
 	st->st_ino = ino;
+	
+	m_spl_acq(&(iptr->spl));
 	st->st_mode = iptr->mode;
 	st->st_rdev = iptr->special;
 	st->st_size = iptr->size;
 	st->st_nlink = iptr->nlinks;
+	m_spl_rel(&(iptr->spl));
+	
 	return 0;
 }
 
 void ramfs_inc(ino_t ino)
 {
 	KASSERT(ino < RAMFS_BLOCK_MAX);
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
 	iptr->nfiles++;
 	KASSERT(iptr->nfiles > 0);
 }
@@ -629,7 +1591,7 @@ void ramfs_inc(ino_t ino)
 void ramfs_dec(ino_t ino)
 {
 	KASSERT(ino < RAMFS_BLOCK_MAX);
-	ramfs_ino_t *iptr = &(ramfs_blocks[ino].ino);
+	ramfs_ino_t *iptr = &(ramfs_block(ino)->ino);
 	iptr->nfiles--;
 	KASSERT(iptr->nfiles >= 0);	
 	ramfs_checkrefs(ino);
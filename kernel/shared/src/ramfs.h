@@ -6,15 +6,23 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <sc.h>
 
 //Initializes in-memory filesystem
 void ramfs_init(void);
 
+//Returns usage information about the filesystem.
+void ramfs_info(_sc_fsinfo_t *info);
 
-//Locks the filesystem. Do this before operating on it on your thread.
+
+//Locks the directory structure of the filesystem.
+//Hold this around making, finding, and unlinking entries, and changing reference counts.
+//Reading, writing, truncating, and stat lock the inode internally and don't need this.
+//Lock order is this lock, then inode locks, then the block free-list.
 void ramfs_lock(void);
 
-//Unlocks the filesystem. Do this after operating on it on your thread.
+//Unlocks the directory structure of the filesystem.
 void ramfs_unlock(void);
 
 
@@ -38,6 +46,22 @@ ssize_t ramfs_write(ino_t ino, off_t off, const void *buf, ssize_t len);
 //Truncates the given file to the given length.
 int ramfs_trunc(ino_t ino, off_t size);
 
+//Function called to give back memory adopted by a file, once the file stops using it.
+//Called with the file's inode locked.
+typedef void (ramfs_release_t)(const void *data, off_t size);
+
+//Makes an empty regular file use the given memory as its contents, without copying it.
+//The memory must stay mapped and unchanged until it's given back with the release function.
+//The contents are copied into the filesystem if the file is changed.
+//Returns 0 on success or a negative error number.
+int ramfs_adopt(ino_t ino, const void *data, off_t size, ramfs_release_t *release);
+
+//Returns the physical frame holding the page of a regular file at the given offset, for mapping it in user memory.
+//The frame gains a reference that the caller must drop. The mapping sees later writes to the file.
+//Contents stored in the inode or adopted are moved into data blocks first, and holes are filled.
+//Returns 0 on success or a negative error number.
+int ramfs_mapframe(ino_t ino, off_t off, uintptr_t *frame_out);
+
 //Returns status information about the given file.
 int ramfs_stat(ino_t ino, struct stat *st);
 
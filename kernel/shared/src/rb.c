@@ -0,0 +1,405 @@
+//rb.c
+//Red-Black Tree for kernel indexes
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "rb.h"
+#include "kassert.h"
+#include <stddef.h>
+
+//Recomputes summary data for a single item, if the tree has any.
+static void rb_augment(rb_tree_t *tree, rb_item_t *item)
+{
+	if(tree->augment != NULL)
+		tree->augment(item);
+}
+
+//Puts the given item in place of another, under the other's parent.
+static void rb_replace(rb_tree_t *tree, rb_item_t *olditem, rb_item_t *newitem)
+{
+	rb_item_t *parent = olditem->parent;
+	if(parent == NULL)
+	{
+		KASSERT(tree->root == olditem);
+		tree->root = newitem;
+	}
+	else if(parent->left == olditem)
+	{
+		parent->left = newitem;
+	}
+	else
+	{
+		KASSERT(parent->right == olditem);
+		parent->right = newitem;
+	}
+	
+	if(newitem != NULL)
+		newitem->parent = parent;
+}
+
+//Performs a "left rotation" on the item. The item's right child takes the place of the item. The item becomes its left child.
+static void rb_rotleft(rb_tree_t *tree, rb_item_t *item)
+{
+	rb_item_t *oldright = item->right;
+	KASSERT(oldright != NULL);
+	
+	item->right = oldright->left;
+	if(item->right != NULL)
+		item->right->parent = item;
+	
+	rb_replace(tree, item, oldright);
+	oldright->left = item;
+	item->parent = oldright;
+	
+	//The old right child now covers the same items the rotated item used to. Only the rotated item changed.
+	rb_augment(tree, item);
+	rb_augment(tree, oldright);
+}
+
+//Performs a "right rotation" on the item. The item's left child takes the place of the item. The item becomes its right child.
+static void rb_rotright(rb_tree_t *tree, rb_item_t *item)
+{
+	rb_item_t *oldleft = item->left;
+	KASSERT(oldleft != NULL);
+	
+	item->left = oldleft->right;
+	if(item->left != NULL)
+		item->left->parent = item;
+	
+	rb_replace(tree, item, oldleft);
+	oldleft->right = item;
+	item->parent = oldleft;
+	
+	rb_augment(tree, item);
+	rb_augment(tree, oldleft);
+}
+
+void rb_update(rb_tree_t *tree, rb_item_t *item)
+{
+	if(tree->augment == NULL)
+		return;
+	
+	while(item != NULL)
+	{
+		tree->augment(item);
+		item = item->parent;
+	}
+}
+
+void rb_insert(rb_tree_t *tree, rb_item_t *item, uintptr_t key, void *userptr)
+{
+	item->key = key;
+	item->userptr = userptr;
+	item->red = true;
+	item->left = NULL;
+	item->right = NULL;
+	
+	//Find the leaf where the item belongs, and put it there.
+	rb_item_t *parent = NULL;
+	rb_item_t **link = &(tree->root);
+	while(*link != NULL)
+	{
+		parent = *link;
+		link = (key < parent->key) ? &(parent->left) : &(parent->right);
+	}
+	item->parent = parent;
+	*link = item;
+	
+	//Fix up summaries on the way to the root now. Rotations while rebalancing keep them correct.
+	rb_update(tree, item);
+	
+	//Restore Red-Black properties - no red item can have a red parent.
+	while(item->parent != NULL && item->parent->red)
+	{
+		parent = item->parent;
+		rb_item_t *grandparent = parent->parent;
+		KASSERT(grandparent != NULL); //Root is always black, so a red parent isn't the root.
+		
+		if(parent == grandparent->left)
+		{
+			rb_item_t *uncle = grandparent->right;
+			if(uncle != NULL && uncle->red)
+			{
+				//Red uncle - push the blackness down from the grandparent, and continue from there.
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				item = grandparent;
+				continue;
+			}
+			
+			if(item == parent->right)
+			{
+				//Item is on the inside - rotate it to the outside first.
+				item = parent;
+				rb_rotleft(tree, item);
+				parent = item->parent;
+			}
+			
+			parent->red = false;
+			grandparent->red = true;
+			rb_rotright(tree, grandparent);
+		}
+		else
+		{
+			rb_item_t *uncle = grandparent->left;
+			if(uncle != NULL && uncle->red)
+			{
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				item = grandparent;
+				continue;
+			}
+			
+			if(item == parent->left)
+			{
+				item = parent;
+				rb_rotright(tree, item);
+				parent = item->parent;
+			}
+			
+			parent->red = false;
+			grandparent->red = true;
+			rb_rotleft(tree, grandparent);
+		}
+	}
+	
+	tree->root->red = false;
+}
+
+//Restores Red-Black properties after removing a black item.
+//The given item (possibly NULL) under the given parent is short one black item on its paths.
+static void rb_remove_fixup(rb_tree_t *tree, rb_item_t *item, rb_item_t *parent)
+{
+	while(item != tree->root && (item == NULL || !item->red))
+	{
+		//The sibling must exist, as its side of the parent has more black items than ours.
+		if(item == parent->left)
+		{
+			rb_item_t *sibling = parent->right;
+			KASSERT(sibling != NULL);
+			if(sibling->red)
+			{
+				sibling->red = false;
+				parent->red = true;
+				rb_rotleft(tree, parent);
+				sibling = parent->right;
+			}
+			
+			bool near_red = (sibling->left != NULL) && sibling->left->red;
+			bool far_red = (sibling->right != NULL) && sibling->right->red;
+			if(!near_red && !far_red)
+			{
+				//Take a black item off the sibling's side too, and push the problem up.
+				sibling->red = true;
+				item = parent;
+				parent = item->parent;
+				continue;
+			}
+			
+			if(!far_red)
+			{
+				sibling->left->red = false;
+				sibling->red = true;
+				rb_rotright(tree, sibling);
+				sibling = parent->right;
+			}
+			
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rb_rotleft(tree, parent);
+			item = tree->root;
+			break;
+		}
+		else
+		{
+			rb_item_t *sibling = parent->left;
+			KASSERT(sibling != NULL);
+			if(sibling->red)
+			{
+				sibling->red = false;
+				parent->red = true;
+				rb_rotright(tree, parent);
+				sibling = parent->left;
+			}
+			
+			bool near_red = (sibling->right != NULL) && sibling->right->red;
+			bool far_red = (sibling->left != NULL) && sibling->left->red;
+			if(!near_red && !far_red)
+			{
+				sibling->red = true;
+				item = parent;
+				parent = item->parent;
+				continue;
+			}
+			
+			if(!far_red)
+			{
+				sibling->right->red = false;
+				sibling->red = true;
+				rb_rotleft(tree, sibling);
+				sibling = parent->left;
+			}
+			
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rb_rotright(tree, parent);
+			item = tree->root;
+			break;
+		}
+	}
+	
+	if(item != NULL)
+		item->red = false;
+}
+
+void rb_remove(rb_tree_t *tree, rb_item_t *item)
+{
+	//Item (possibly NULL) that moves up into the place of whatever is unlinked, and its new parent
+	rb_item_t *child = NULL;
+	rb_item_t *parent = NULL;
+	
+	//Whether the item unlinked from its place was black, making the tree unbalanced.
+	bool removed_black = false;
+	
+	if(item->left != NULL && item->right != NULL)
+	{
+		//Two children. Its successor, with no left child, gets unlinked and takes its place.
+		rb_item_t *successor = item->right;
+		while(successor->left != NULL)
+		{
+			successor = successor->left;
+		}
+		
+		child = successor->right;
+		removed_black = !successor->red;
+		if(successor->parent == item)
+		{
+			//Successor is the right child - it keeps its own right subtree.
+			parent = successor;
+		}
+		else
+		{
+			parent = successor->parent;
+			parent->left = child;
+			if(child != NULL)
+				child->parent = parent;
+			
+			successor->right = item->right;
+			successor->right->parent = successor;
+		}
+		
+		successor->left = item->left;
+		successor->left->parent = successor;
+		rb_replace(tree, item, successor);
+		successor->red = item->red;
+	}
+	else
+	{
+		//At most one child, which takes the place of the item.
+		child = (item->left != NULL) ? item->left : item->right;
+		parent = item->parent;
+		removed_black = !item->red;
+		rb_replace(tree, item, child);
+	}
+	
+	item->parent = NULL;
+	item->left = NULL;
+	item->right = NULL;
+	
+	//Fix up summaries from where the tree changed. Rotations while rebalancing keep them correct.
+	rb_update(tree, parent);
+	
+	if(removed_black)
+		rb_remove_fixup(tree, child, parent);
+}
+
+rb_item_t *rb_findle(rb_tree_t *tree, uintptr_t key)
+{
+	rb_item_t *best = NULL;
+	rb_item_t *item = tree->root;
+	while(item != NULL)
+	{
+		if(item->key <= key)
+		{
+			//Could be the one - but look for a higher one that still works
+			best = item;
+			item = item->right;
+		}
+		else
+		{
+			item = item->left;
+		}
+	}
+	return best;
+}
+
+rb_item_t *rb_first(rb_tree_t *tree)
+{
+	rb_item_t *item = tree->root;
+	if(item == NULL)
+		return NULL;
+	
+	while(item->left != NULL)
+	{
+		item = item->left;
+	}
+	return item;
+}
+
+rb_item_t *rb_last(rb_tree_t *tree)
+{
+	rb_item_t *item = tree->root;
+	if(item == NULL)
+		return NULL;
+	
+	while(item->right != NULL)
+	{
+		item = item->right;
+	}
+	return item;
+}
+
+rb_item_t *rb_next(const rb_item_t *item)
+{
+	if(item->right != NULL)
+	{
+		//Leftmost item in the right subtree
+		rb_item_t *next = item->right;
+		while(next->left != NULL)
+		{
+			next = next->left;
+		}
+		return next;
+	}
+	
+	//First ancestor that we're on the left side of
+	while(item->parent != NULL && item->parent->right == item)
+	{
+		item = item->parent;
+	}
+	return item->parent;
+}
+
+rb_item_t *rb_prev(const rb_item_t *item)
+{
+	if(item->left != NULL)
+	{
+		//Rightmost item in the left subtree
+		rb_item_t *prev = item->left;
+		while(prev->right != NULL)
+		{
+			prev = prev->right;
+		}
+		return prev;
+	}
+	
+	//First ancestor that we're on the right side of
+	while(item->parent != NULL && item->parent->left == item)
+	{
+		item = item->parent;
+	}
+	return item->parent;
+}
@@ -0,0 +1,69 @@
+//rb.h
+//Red-Black Tree for kernel indexes
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef RB_H
+#define RB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//Entry in a Red-Black tree - store in structures that participate.
+typedef struct rb_item_s
+{
+	//Key that orders this item in the tree
+	uintptr_t key;
+	
+	//Pointer to the structure containing the item
+	void *userptr;
+	
+	//Data below is internal, and other modules shouldn't depend on it.
+	
+	//Color of the node
+	bool red;
+	
+	//Parent node
+	struct rb_item_s *parent;
+	
+	//Child nodes
+	struct rb_item_s *left;
+	struct rb_item_s *right;
+	
+} rb_item_t;
+
+//Structure for holding a Red-Black tree
+typedef struct rb_tree_s
+{
+	//Item at the root of the tree.
+	rb_item_t *root;
+	
+	//Optional callback that recomputes data summarizing an item's subtree, from the item and its children.
+	//Called whenever an item's children change - on insert, on removal, and in rotations. Lets the user search the tree by something besides the key.
+	void (*augment)(rb_item_t *item);
+	
+} rb_tree_t;
+
+//Inserts the given item into the tree with the given key and user-pointer. Duplicate keys go after existing ones.
+void rb_insert(rb_tree_t *tree, rb_item_t *item, uintptr_t key, void *userptr);
+
+//Removes the given item from the tree.
+void rb_remove(rb_tree_t *tree, rb_item_t *item);
+
+//Recomputes summary data for the given item and all its ancestors, after the user changes what it's based on.
+void rb_update(rb_tree_t *tree, rb_item_t *item);
+
+//Returns the item with the highest key less-than-or-equal to the given key. Returns NULL if there's none.
+rb_item_t *rb_findle(rb_tree_t *tree, uintptr_t key);
+
+//Returns the lowest item in the tree. Returns NULL if the tree is empty.
+rb_item_t *rb_first(rb_tree_t *tree);
+
+//Returns the highest item in the tree. Returns NULL if the tree is empty.
+rb_item_t *rb_last(rb_tree_t *tree);
+
+//Returns the successor of the given item. Returns NULL if it's the last.
+rb_item_t *rb_next(const rb_item_t *item);
+
+//Returns the predecessor of the given item. Returns NULL if it's the first.
+rb_item_t *rb_prev(const rb_item_t *item);
+
+#endif //RB_H
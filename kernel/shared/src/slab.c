@@ -0,0 +1,228 @@
+//slab.c
+//Object caches for small kernel allocations
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "slab.h"
+#include "kpage.h"
+#include "kassert.h"
+#include "m_cpu.h"
+#include "m_frame.h"
+#include <errno.h>
+#include <string.h>
+
+//Least amount of memory to take from the kernel page allocator at once.
+#define SLAB_GROW_MIN 65536
+
+//All caches that have been used, for reporting usage.
+static slab_t *slab_list;
+
+//Spinlock protecting the list of caches.
+static m_spl_t slab_list_spl;
+
+//Returns the size of each object as stored - big enough to link free objects, and aligned.
+static size_t slab_stride(const slab_t *slab)
+{
+	size_t stride = slab->objsize;
+	if(stride < sizeof(void*))
+		stride = sizeof(void*);
+	
+	return (stride + 15) & ~(size_t)15;
+}
+
+//Adds more objects to the shared pool of the given cache. Called with the cache locked.
+//Returns 0 on success or a negative error number.
+static int slab_grow(slab_t *slab)
+{
+	size_t stride = slab_stride(slab);
+	size_t pagesize = m_frame_size();
+	
+	//Big objects get pages of their own, wasting at most the remainder of their last page.
+	size_t nbytes = SLAB_GROW_MIN;
+	if(nbytes < stride)
+		nbytes = stride;
+	
+	nbytes = (nbytes + pagesize - 1) & ~(pagesize - 1);
+	
+	uint8_t *mem = kpage_alloc(nbytes);
+	if(mem == NULL)
+		return -ENOMEM;
+	
+	for(size_t oo = 0; oo + stride <= nbytes; oo += stride)
+	{
+		void **obj = (void**)(mem + oo);
+		*obj = slab->depot;
+		slab->depot = obj;
+		slab->objs++;
+	}
+	slab->pages += nbytes / pagesize;
+	
+	//Make the cache show up in usage information once it has memory
+	if(!slab->listed)
+	{
+		m_spl_acq(&slab_list_spl);
+		slab->next = slab_list;
+		slab_list = slab;
+		slab->listed = true;
+		m_spl_rel(&slab_list_spl);
+	}
+	
+	return 0;
+}
+
+//Returns the magazine used by the current CPU for the given cache, locked.
+static slab_mag_t *slab_mag_lock(slab_t *slab)
+{
+	slab_mag_t *mag = &(slab->mags[(unsigned int)m_cpu_num() % SLAB_CPU_MAX]);
+	m_spl_acq(&(mag->spl));
+	return mag;
+}
+
+void *slab_alloc(slab_t *slab)
+{
+	KASSERT(slab->objsize > 0);
+	
+	slab_mag_t *mag = slab_mag_lock(slab);
+	if(mag->count == 0)
+	{
+		//Magazine is empty - fill half of it from the shared pool, so a following free doesn't send them right back.
+		m_spl_acq(&(slab->spl));
+		mag->refills++;
+		while(mag->count < SLAB_MAG_SIZE / 2)
+		{
+			if(slab->depot == NULL && slab_grow(slab) < 0)
+				break;
+			
+			void **obj = slab->depot;
+			slab->depot = *obj;
+			mag->objs[mag->count] = obj;
+			mag->count++;
+		}
+		m_spl_rel(&(slab->spl));
+		
+		if(mag->count == 0)
+		{
+			//Out of memory
+			m_spl_rel(&(mag->spl));
+			return NULL;
+		}
+	}
+	
+	mag->count--;
+	void *obj = mag->objs[mag->count];
+	mag->allocs++;
+	m_spl_rel(&(mag->spl));
+	
+	memset(obj, 0, slab->objsize);
+	return obj;
+}
+
+void slab_free(slab_t *slab, void *obj)
+{
+	KASSERT(obj != NULL);
+	
+	slab_mag_t *mag = slab_mag_lock(slab);
+	if(mag->count == SLAB_MAG_SIZE)
+	{
+		//Magazine is full - give half of it back to the shared pool.
+		m_spl_acq(&(slab->spl));
+		mag->flushes++;
+		while(mag->count > SLAB_MAG_SIZE / 2)
+		{
+			mag->count--;
+			void **flushed = mag->objs[mag->count];
+			*flushed = slab->depot;
+			slab->depot = flushed;
+		}
+		m_spl_rel(&(slab->spl));
+	}
+	
+	mag->objs[mag->count] = obj;
+	mag->count++;
+	mag->frees++;
+	m_spl_rel(&(mag->spl));
+}
+
+int slab_info(int index, _sc_slabinfo_t *info)
+{
+	if(index < 0)
+		return -EINVAL;
+	
+	m_spl_acq(&slab_list_spl);
+	slab_t *slab = slab_list;
+	for(int ii = 0; ii < index && slab != NULL; ii++)
+	{
+		slab = slab->next;
+	}
+	m_spl_rel(&slab_list_spl);
+	
+	if(slab == NULL)
+		return -ENOENT;
+	
+	//Caches are never removed from the list, so we can look at this one without holding the list lock.
+	memset(info, 0, sizeof(*info));
+	strncpy(info->name, slab->name, sizeof(info->name) - 1);
+	info->objsize = slab->objsize;
+	
+	m_spl_acq(&(slab->spl));
+	info->pages = slab->pages;
+	info->total = slab->objs;
+	m_spl_rel(&(slab->spl));
+	
+	for(int mm = 0; mm < SLAB_CPU_MAX; mm++)
+	{
+		slab_mag_t *mag = &(slab->mags[mm]);
+		m_spl_acq(&(mag->spl));
+		info->used += mag->allocs - mag->frees;
+		info->cached += mag->count;
+		info->refills += mag->refills;
+		info->flushes += mag->flushes;
+		m_spl_rel(&(mag->spl));
+	}
+	
+	return 0;
+}
+
+size_t slab_table_count(slab_table_t *table)
+{
+	return (size_t)(table->count);
+}
+
+void *slab_table_get(slab_table_t *table, size_t index)
+{
+	if(index >= slab_table_count(table))
+		return NULL;
+	
+	uint8_t *chunk = table->chunks[index / table->chunk];
+	KASSERT(chunk != NULL);
+	return chunk + ((index % table->chunk) * table->objsize);
+}
+
+int slab_table_grow(slab_table_t *table, size_t count)
+{
+	if(count > table->max)
+		return -ENOSPC;
+	
+	m_spl_acq(&(table->spl));
+	
+	int retval = 0;
+	while(slab_table_count(table) < count)
+	{
+		m_atomic_t oldcount = table->count;
+		KASSERT(oldcount % table->chunk == 0);
+		
+		void *chunk = slab_alloc(&(table->slab));
+		if(chunk == NULL)
+		{
+			retval = -ENOMEM;
+			break;
+		}
+		
+		//Put the chunk in place before advancing the count, so nobody looks for objects before they're there.
+		table->chunks[oldcount / table->chunk] = chunk;
+		bool advanced = m_atomic_cmpxchg(&(table->count), oldcount, oldcount + table->chunk);
+		KASSERT(advanced);
+	}
+	
+	m_spl_rel(&(table->spl));
+	return retval;
+}
@@ -0,0 +1,124 @@
+//slab.h
+//Object caches for small kernel allocations
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sc.h>
+#include "m_spl.h"
+#include "m_atomic.h"
+
+//Number of free objects each CPU can hold on to, without going to the shared pool.
+#define SLAB_MAG_SIZE 16
+
+//Number of CPUs with their own magazines. CPUs beyond this number share them.
+#define SLAB_CPU_MAX 64
+
+//Free objects cached for one CPU
+typedef struct slab_mag_s
+{
+	//Spinlock protecting the magazine. Only contended if CPUs share magazines.
+	m_spl_t spl;
+	
+	//Free objects in the magazine
+	int count;
+	void *objs[SLAB_MAG_SIZE];
+	
+	//Number of objects allocated and freed through this magazine
+	uint64_t allocs;
+	uint64_t frees;
+	
+	//Number of times the magazine was refilled from, or flushed to, the shared pool
+	uint64_t refills;
+	uint64_t flushes;
+
+} slab_mag_t;
+
+//Cache of same-sized objects, carved out of kernel pages
+typedef struct slab_s
+{
+	//Name reported in usage information
+	const char *name;
+	
+	//Size of each object
+	size_t objsize;
+	
+	//Spinlock protecting the shared pool
+	m_spl_t spl;
+	
+	//Free objects not held by any CPU, linked through their first word
+	void *depot;
+	
+	//Pages taken from the kernel page allocator, and how many objects were carved out of them
+	size_t pages;
+	size_t objs;
+	
+	//Whether the cache is on the list of all caches, and the next one on that list
+	bool listed;
+	struct slab_s *next;
+	
+	//Free objects cached per-CPU
+	slab_mag_t mags[SLAB_CPU_MAX];
+
+} slab_t;
+
+//Static initializer for an object cache.
+#define SLAB_INIT(n, size) { .name = (n), .objsize = (size) }
+
+//Allocates a zeroed object from the given cache. Returns NULL if out of memory.
+void *slab_alloc(slab_t *slab);
+
+//Returns an object to the cache it was allocated from.
+void slab_free(slab_t *slab, void *obj);
+
+//Returns usage information about one of the caches that has been used, by index.
+//Returns 0 on success or a negative error number.
+int slab_info(int index, _sc_slabinfo_t *info);
+
+//Table of objects that grows in chunks, up to a fixed maximum.
+//Objects never move or get freed, so they can be found by index without holding any lock.
+typedef struct slab_table_s
+{
+	//Cache that chunks of objects come from
+	slab_t slab;
+	
+	//Size of each object, objects per chunk, and the most objects the table can hold
+	size_t objsize;
+	size_t chunk;
+	size_t max;
+	
+	//Spinlock held while growing the table
+	m_spl_t spl;
+	
+	//Chunks allocated so far - storage for (max / chunk) pointers, supplied by the user
+	void **chunks;
+	
+	//Number of objects available. Only grows, after their chunk is in place.
+	m_atomic_t count;
+
+} slab_table_t;
+
+//Static initializer for a table. Maximum must be a multiple of the chunk size.
+#define SLAB_TABLE_INIT(n, type, nchunk, nmax, chunkarray) { \
+	.slab = SLAB_INIT((n), sizeof(type) * (nchunk)), \
+	.objsize = sizeof(type), \
+	.chunk = (nchunk), \
+	.max = (nmax), \
+	.chunks = (chunkarray), \
+}
+
+//Returns the number of objects currently in the table.
+size_t slab_table_count(slab_table_t *table);
+
+//Returns the object at the given index in the table, or NULL if the table hasn't grown that far.
+void *slab_table_get(slab_table_t *table, size_t index);
+
+//Grows the table to hold at least the given number of objects. New objects are zeroed.
+//Returns 0 on success or a negative error number.
+int slab_table_grow(slab_table_t *table, size_t count);
+
+#endif //SLAB_H
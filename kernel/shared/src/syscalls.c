@@ -12,6 +12,9 @@
 #include "thread.h"
 #include "file.h"
 #include "pipe.h"
+#include "slab.h"
+#include "ramfs.h"
+#include "systar.h"
 #include "elf.h"
 #include "m_time.h"
 #include "con.h"
@@ -372,6 +375,55 @@ int k_sc_find(int dirfd, const char *name)
 	return newfd;
 }
 
+//Buffers for whole paths, which are too big for the stack. Cached per CPU, so lookups don't need the page allocator.
+static slab_t k_sc_path_slab = SLAB_INIT("path", FILE_PATH_MAX);
+
+int k_sc_path(int dirfd, const char *path, int flags)
+{
+	if(flags & ~_SC_PATH_PARENT)
+		return -EINVAL;
+	
+	//Get path string into kernel safely
+	char *pathbuf = slab_alloc(&k_sc_path_slab);
+	if(pathbuf == NULL)
+		return -ENOMEM;
+	
+	int path_err = process_strget(pathbuf, path, FILE_PATH_MAX);
+	if(path_err < 0)
+	{
+		slab_free(&k_sc_path_slab, pathbuf);
+		return path_err;
+	}
+	
+	//Get directory reference - not needed for absolute paths
+	file_t *dptr = process_lockfd(dirfd, true);
+	if(dptr == NULL && pathbuf[0] != '/')
+	{
+		slab_free(&k_sc_path_slab, pathbuf);
+		return -EBADF;
+	}
+	
+	//Walk the path
+	file_t *found = NULL;
+	int path_result = file_path(dptr, pathbuf, flags, &found);
+	
+	if(dptr != NULL)
+		file_unlock(dptr);
+	
+	slab_free(&k_sc_path_slab, pathbuf);
+	
+	if(path_result < 0)
+		return path_result;
+	
+	//Try to insert into FDs for this process
+	int newfd = process_addfd(found);
+	if(newfd < 0)
+		found->refs = 0;
+	
+	file_unlock(found);
+	return newfd;
+}
+
 int k_sc_make(int dirfd, const char *name, mode_t mode, int rdev)
 {
 	//Get name string into kernel safely
@@ -434,6 +486,8 @@ int k_sc_access(int fd, int gain, int lose)
 		if(fptr->access & _SC_ACCESS_W)
 			pipe->dirs[pipe_dir].refs_w++;
 		
+		//Let anyone waiting on the pipe see if it's been abandoned.
+		pipe_wakeall(pipe, pipe_dir);
 		pipe_unlock(pipe);
 	}
 	
@@ -443,14 +497,35 @@ int k_sc_access(int fd, int gain, int lose)
 	return retval;
 }
 
+//Returns whether reads and writes on the given descriptor should wait until they can make progress.
+static bool k_sc_fdblocks(int fd)
+{
+	process_t *pptr = process_lockcur();
+	bool retval = (pptr->fds[fd].flags & _SC_FLAG_BLOCK) != 0;
+	process_unlock(pptr);
+	return retval;
+}
+
 ssize_t k_sc_read(int fd, void *buf, ssize_t len)
 {
 	file_t *fptr = process_lockfd(fd, false);
 	if(fptr == NULL)
 		return -EBADF;
 	
-	ssize_t result = file_read(fptr, buf, len); //Todo - validate buffer
+	int buf_err = process_memcheck(buf, (len > 0) ? len : 0, true);
+	if(buf_err < 0)
+	{
+		file_unlock(fptr);
+		return buf_err;
+	}
+	
+	ssize_t result = file_read(fptr, buf, len);
 	file_unlock(fptr);
+	
+	//The file put us on its list of waiters if it returned EAGAIN - sleep here rather than bouncing to userspace.
+	if(result == -EAGAIN && k_sc_fdblocks(fd))
+		thread_block();
+	
 	return result;
 }
 
@@ -462,9 +537,124 @@ ssize_t k_sc_write(int fd, const void *buf, ssize_t len)
 	
 	ssize_t result = file_write(fptr, buf, len); //Todo - validate buffer
 	file_unlock(fptr);
+	
+	if(result == -EAGAIN && k_sc_fdblocks(fd))
+		thread_block();
+	
 	return result;
 }
 
+ssize_t k_sc_splice(int fd_in, int fd_out, ssize_t len)
+{
+	if(fd_in < 0 || fd_in >= PROCESS_FD_MAX || fd_out < 0 || fd_out >= PROCESS_FD_MAX)
+		return -EBADF;
+	
+	if(len < 0)
+		return -EINVAL;
+	
+	process_t *pptr = process_lockcur();
+	file_t *in = pptr->fds[fd_in].file;
+	file_t *out = pptr->fds[fd_out].file;
+	if(in == NULL || out == NULL)
+	{
+		process_unlock(pptr);
+		return -EBADF;
+	}
+	
+	if(in == out)
+	{
+		process_unlock(pptr);
+		return -EINVAL;
+	}
+	
+	//Lock the two files in order of address, so splices going opposite ways can't deadlock.
+	file_lock((in < out) ? in : out);
+	file_lock((in < out) ? out : in);
+	process_unlock(pptr);
+	
+	ssize_t result = file_splice(in, out, len);
+	file_unlock(in);
+	file_unlock(out);
+	
+	//Wait in the kernel like read and write do, if both descriptors want that.
+	if(result == -EAGAIN && k_sc_fdblocks(fd_in) && k_sc_fdblocks(fd_out))
+		thread_block();
+	
+	return result;
+}
+
+int k_sc_poll(_sc_poll_t *fds, ssize_t count, int64_t timeout)
+{
+	if(count < 0 || count > _SC_POLL_MAX)
+		return -EINVAL;
+	
+	//There are no kernel timers to end a wait early, so only polling without waiting, or waiting forever, works.
+	if(timeout > 0)
+		return -ENOTSUP;
+	
+	_sc_poll_t kfds[_SC_POLL_MAX];
+	int mem_err = process_memget(kfds, fds, count * sizeof(kfds[0]));
+	if(mem_err < 0)
+		return mem_err;
+	
+	//If we're back after waiting, look at everything again from scratch.
+	thread_pollclear();
+	
+	bool wait = (timeout < 0);
+	
+	//Check each file, waiting on it as we go in case none turn out to be ready.
+	//Each file checks and puts us in its wait queues under the same lock, so a wakeup in between isn't missed.
+	int nready = 0;
+	for(ssize_t ff = 0; ff < count; ff++)
+	{
+		int fd = kfds[ff].fd;
+		int events = kfds[ff].events & (_SC_POLL_IN | _SC_POLL_OUT);
+		int slot = (wait && nready == 0) ? (int)(2 * ff) : -1;
+		kfds[ff].revents = 0;
+		
+		if(fd == _SC_POLL_CON)
+		{
+			//Console input unpauses the console thread directly, so there's no queue to wait on.
+			process_t *pptr = process_lockcur();
+			if(pptr->hascon && con_ready())
+				kfds[ff].revents = events & _SC_POLL_IN;
+			
+			process_unlock(pptr);
+		}
+		else if(fd >= 0)
+		{
+			file_t *fptr = process_lockfd(fd, false);
+			if(fptr == NULL)
+			{
+				kfds[ff].revents = _SC_POLL_NVAL;
+			}
+			else
+			{
+				kfds[ff].revents = file_poll(fptr, events, slot);
+				file_unlock(fptr);
+			}
+		}
+		
+		if(kfds[ff].revents != 0)
+			nready++;
+	}
+	
+	if(nready == 0 && wait)
+	{
+		thread_block();
+		return 0;
+	}
+	
+	//Not waiting after all, so don't stay in any queues.
+	thread_pollclear();
+	
+	mem_err = process_memput(fds, kfds, count * sizeof(kfds[0]));
+	if(mem_err < 0)
+		return mem_err;
+	
+	return nready;
+}
+
 off_t k_sc_seek(int fd, off_t off, int whence)
 {
 	file_t *fptr = process_lockfd(fd, false);
@@ -722,27 +912,59 @@ int k_sc_mem_anon(uintptr_t addr, ssize_t size, int access)
 {
 	process_t *pptr = process_lockcur();
 	
-	int retval = mem_add(&(pptr->mem), addr, size, access);
-	if(retval >= 0)
+	//Only reserve the space - pages are allocated and cleared as they're touched.
+	int retval = mem_reserve(&(pptr->mem), addr, size, access);
+	
+	process_unlock(pptr);
+	return retval;
+}
+
+int k_sc_mem_file(uintptr_t addr, ssize_t size, int access, int fd, off_t off)
+{
+	if(size <= 0)
+		return -EINVAL;
+	
+	//Find the frames holding the file, page by page, as far as the mapping or the file goes.
+	size_t pagesize = m_frame_size();
+	size_t npages = (size + pagesize - 1) / pagesize;
+	size_t frames_size = npages * sizeof(uintptr_t);
+	uintptr_t *frames = kpage_alloc(frames_size);
+	if(frames == NULL)
+		return -ENOMEM;
+	
+	file_t *fptr = process_lockfd(fd, false);
+	if(fptr == NULL)
 	{
-		size_t pagesize = m_frame_size();
-		size_t clear_size = size;
-		if(clear_size % pagesize)
-			clear_size += pagesize - (clear_size % pagesize);
-		
-		memset((void*)addr, 0, clear_size);
+		kpage_free(frames, frames_size);
+		return -EBADF;
+	}
+	
+	ssize_t nframes = file_frames(fptr, off, frames, npages);
+	file_unlock(fptr);
+	if(nframes < 0)
+	{
+		kpage_free(frames, frames_size);
+		return nframes;
 	}
 	
+	//Map them. Past the end of the file, the mapping is zeroes.
+	process_t *pptr = process_lockcur();
+	int retval = mem_share(&(pptr->mem), addr, size, access, frames, nframes);
 	process_unlock(pptr);
+	
+	kpage_free(frames, frames_size);
 	return retval;
 }
 
 int k_sc_mem_free(uintptr_t addr, ssize_t size)
 {
-	(void)addr;
-	(void)size;
-	KASSERT(0);
-	return -ENOSYS;
+	if(size <= 0)
+		return -EINVAL;
+	
+	process_t *pptr = process_lockcur();
+	int retval = mem_free(&(pptr->mem), addr, size);
+	process_unlock(pptr);
+	return retval;
 }
 
 ssize_t k_sc_wait(int idtype, pid_t id, int options, _sc_wait_t *buf, ssize_t len)
@@ -771,9 +993,10 @@ ssize_t k_sc_wait(int idtype, pid_t id, int options, _sc_wait_t *buf, ssize_t le
 	//Caller should use _sc_pause and try again if we tell them so.
 	//Anyone currently in the process of posting status will poke their parent after unlocking.
 	bool any_match = false;
-	for(int pp = 0; pp < PROCESS_MAX; pp++)
+	size_t nprocs = slab_table_count(&process_table);
+	for(size_t pp = 0; pp < nprocs; pp++)
 	{
-		process_t *otherproc = &(process_table[pp]);
+		process_t *otherproc = slab_table_get(&process_table, pp);
 		m_spl_acq(&(otherproc->spl));
 		
 		if((otherproc->state == PROCESS_STATE_NONE) || (otherproc->ppid != ourpid))
@@ -892,22 +1115,48 @@ int64_t k_sc_getrtc(void)
 	return m_time_tsc() / 4096;
 }
 
-void k_sc_pause(void)
+ssize_t k_sc_slabinfo(int index, _sc_slabinfo_t *buf, ssize_t len)
 {
-	thread_t *tptr = thread_lockcur();
+	if(len < 1)
+		return -EINVAL;
 	
-	//Unpauses gets incremented atomically without holding the thread's lock.
-	//So, capture it while we work with it.
-	m_atomic_t unpauses_now = (volatile m_atomic_t)(tptr->unpauses);
+	if(len > (ssize_t)sizeof(_sc_slabinfo_t))
+		len = sizeof(_sc_slabinfo_t);
 	
-	//Each time we call pause, we require at least one corresponding unpause.
-	//But if we've got an excess of unpauses, consume them all at once.
-	tptr->unpauses_req++;
-	if(tptr->unpauses_req < unpauses_now)
-		tptr->unpauses_req = unpauses_now;
-		
-	thread_unlock(tptr);
-	return;
+	_sc_slabinfo_t info = {0};
+	int info_err = slab_info(index, &info);
+	if(info_err < 0)
+		return info_err;
+	
+	int copy_err = process_memput(buf, &info, len);
+	if(copy_err < 0)
+		return copy_err;
+	
+	return len;
+}
+
+ssize_t k_sc_fsinfo(_sc_fsinfo_t *buf, ssize_t len)
+{
+	if(len < 1)
+		return -EINVAL;
+	
+	if(len > (ssize_t)sizeof(_sc_fsinfo_t))
+		len = sizeof(_sc_fsinfo_t);
+	
+	_sc_fsinfo_t info = {0};
+	ramfs_info(&info);
+	systar_info(&info);
+	
+	int copy_err = process_memput(buf, &info, len);
+	if(copy_err < 0)
+		return copy_err;
+	
+	return len;
+}
+
+void k_sc_pause(void)
+{
+	thread_pause();
 }
 
 int k_sc_con_init(const _sc_con_init_t *buf_ptr, ssize_t buf_len)
@@ -1014,6 +1263,13 @@ ssize_t k_sc_con_input(_sc_con_input_t *buf_ptr, ssize_t each_bytes, ssize_t buf
 		return 0;
 	}
 	
+	int buf_err = process_memcheck(buf_ptr, (buf_bytes > 0) ? buf_bytes : 0, true);
+	if(buf_err < 0)
+	{
+		process_unlock(pptr);
+		return buf_err;
+	}
+	
 	ssize_t retval = con_input(buf_ptr, buf_bytes);
 	process_unlock(pptr);
 	return retval;
@@ -1029,9 +1285,10 @@ int k_sc_con_pass(pid_t next)
 		if(con_steal_check())
 		{
 			//Take console away from previous holder
-			for(int pp = 0; pp < PROCESS_MAX; pp++)
+			size_t nprocs = slab_table_count(&process_table);
+			for(size_t pp = 0; pp < nprocs; pp++)
 			{
-				process_t *from_pptr = &(process_table[pp]);
+				process_t *from_pptr = slab_table_get(&process_table, pp);
 				if(from_pptr == pptr)
 					continue;
 				
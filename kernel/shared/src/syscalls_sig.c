@@ -93,9 +93,10 @@ int k_sc_sig_send(int idtype, int id, int sig)
 		return -EINVAL;
 	
 	bool any_signal = false;
-	for(int tt = 0; tt < THREAD_MAX; tt++)
+	size_t nthreads = slab_table_count(&thread_table);
+	for(size_t tt = 0; tt < nthreads; tt++)
 	{
-		thread_t *tptr = &(thread_table[tt]);
+		thread_t *tptr = slab_table_get(&thread_table, tt);
 		m_spl_acq(&(tptr->spl));
 		
 		if(tptr->state == THREAD_STATE_NONE)
@@ -6,11 +6,16 @@
 #include "kpage.h"
 #include "kassert.h"
 #include "file.h"
+#include "ramfs.h"
 #include "m_kspc.h"
 #include "m_frame.h"
+#include "m_spl.h"
+#include "m_time.h"
+#include "lz4.h"
 
 #include <sys/stat.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 
 //USTAR header block
@@ -55,22 +60,317 @@ uint64_t systar_ustar_octstr(const char *str, size_t len)
 extern uint8_t _SYSTAR_START[];
 extern uint8_t _SYSTAR_END[];
 
+//Regular files at least this big are adopted by the filesystem where they lie in the image, rather than copied.
+//Smaller ones are copied, so they don't hold onto a whole page of the image.
+#define SYSTAR_ADOPT_MIN 4096
+
+//Number of files using each page of the image. Pages are freed when no files use them.
+static uint16_t *systar_pagerefs;
+
+//Spinlock protecting the page reference counts. Taken after the inode of any file being released.
+static m_spl_t systar_spl;
+
+//Measurements of unpacking, for systar_info
+static size_t systar_adopted; //Bytes of file contents adopted rather than copied
+static size_t systar_kept; //Bytes of the image still in use
+static size_t systar_unpacked; //Bytes of TAR in the image, after decompressing
+static int64_t systar_tsc; //Cycles spent unpacking
+static int64_t systar_boot_tsc; //Cycles since boot when boot finished
+
+//Header block of the TAR being unpacked, copied out of the image. Kept off the small kernel stack.
+static uint8_t systar_hdr_block[512];
+
+//Returns the pages of the image covered by the given range of bytes.
+static void systar_pages(const void *data, off_t size, size_t *first_out, size_t *last_out)
+{
+	size_t pagesize = m_frame_size();
+	const uint8_t *bytes = (const uint8_t*)data;
+	KASSERT(size > 0);
+	KASSERT(bytes >= _SYSTAR_START && bytes + size <= _SYSTAR_END);
+	*first_out = (size_t)(bytes - _SYSTAR_START) / pagesize;
+	*last_out = (size_t)(bytes + size - 1 - _SYSTAR_START) / pagesize;
+}
+
+//Unmaps and frees one page of the image, with systar_spl held.
+static void systar_freepage(size_t page)
+{
+	size_t pagesize = m_frame_size();
+	uintptr_t vaddr = (uintptr_t)_SYSTAR_START + (page * pagesize);
+	uintptr_t paddr = m_kspc_get(vaddr);
+	KASSERT(paddr != 0);
+	m_kspc_set(vaddr, 0);
+	m_frame_free(paddr);
+	systar_kept -= pagesize;
+}
+
+//Gives back image pages adopted by a file, once the file no longer uses them.
+static void systar_release(const void *data, off_t size)
+{
+	size_t first, last;
+	systar_pages(data, size, &first, &last);
+	
+	m_spl_acq(&systar_spl);
+	for(size_t pp = first; pp <= last; pp++)
+	{
+		KASSERT(systar_pagerefs[pp] > 0);
+		systar_pagerefs[pp]--;
+		if(systar_pagerefs[pp] == 0)
+			systar_freepage(pp);
+	}
+	m_spl_rel(&systar_spl);
+}
+
+//Magic numbers starting LZ4 frames, little-endian
+#define SYSTAR_LZ4_MAGIC 0x184D2204u
+#define SYSTAR_LZ4_SKIP_MAGIC 0x184D2A50u //Skippable frames, low 4 bits are any value
+
+//Source of TAR contents being unpacked - either the image as linked, or decompressed from it as we go.
+typedef struct systar_src_s
+{
+	const uint8_t *in; //Next byte of the image
+	const uint8_t *in_end; //End of the image
+	
+	bool lz4; //Whether the image is an LZ4 frame, rather than a plain TAR
+	bool blocksum; //Whether blocks in the current frame are followed by checksums
+	bool contentsum; //Whether the current frame ends with a checksum
+	uint8_t *buf; //Buffer of decompressed data
+	size_t buf_size; //Size of the buffer, enough for the largest block of the current frame
+	size_t buf_len; //Bytes decompressed into the buffer
+	size_t buf_pos; //Bytes of the buffer already used
+	size_t total; //Bytes of TAR produced so far
+} systar_src_t;
+
+//Reads a little-endian 32-bit value from the image and advances past it
+static uint32_t systar_src_le32(systar_src_t *src)
+{
+	KASSERT(src->in_end - src->in >= 4);
+	uint32_t val = src->in[0] | (src->in[1] << 8) | (src->in[2] << 16) | ((uint32_t)(src->in[3]) << 24);
+	src->in += 4;
+	return val;
+}
+
+//Reads the header of an LZ4 frame from the image, skipping any skippable frames first.
+//Returns false if the image ends instead.
+static bool systar_src_frame(systar_src_t *src)
+{
+	while(1)
+	{
+		//Image is padded out to a page, so it can end in zeroes
+		if(src->in_end - src->in < 4 || (src->in[0] | src->in[1] | src->in[2] | src->in[3]) == 0)
+			return false;
+		
+		uint32_t magic = systar_src_le32(src);
+		if((magic & 0xFFFFFFF0u) == SYSTAR_LZ4_SKIP_MAGIC)
+		{
+			uint32_t skip = systar_src_le32(src);
+			KASSERT(skip <= (size_t)(src->in_end - src->in));
+			src->in += skip;
+			continue;
+		}
+		
+		KASSERT(magic == SYSTAR_LZ4_MAGIC);
+		break;
+	}
+	
+	//Frame descriptor - flags, block size, optional content size and dictionary ID, and header checksum.
+	KASSERT(src->in_end - src->in >= 3);
+	uint8_t flg = src->in[0];
+	uint8_t bd = src->in[1];
+	src->in += 2;
+	
+	KASSERT((flg >> 6) == 1); //Version 1
+	KASSERT(flg & 0x20); //Blocks don't refer to earlier blocks - we only keep one at a time
+	KASSERT(!(flg & 0x01)); //No dictionary
+	src->blocksum = (flg & 0x10) != 0;
+	src->contentsum = (flg & 0x04) != 0;
+	if(flg & 0x08)
+		src->in += 8; //Content size - we find the end from the TAR itself
+	
+	src->in += 1; //Header checksum
+	KASSERT(src->in <= src->in_end);
+	
+	//Make sure our buffer can hold the largest block this frame has
+	int bsid = (bd >> 4) & 0x7;
+	KASSERT(bsid >= 4);
+	size_t block_max = 1ul << (8 + (2 * bsid));
+	if(src->buf_size < block_max)
+	{
+		if(src->buf != NULL)
+			kpage_free(src->buf, src->buf_size);
+		
+		src->buf = kpage_alloc(block_max);
+		KASSERT(src->buf != NULL);
+		src->buf_size = block_max;
+	}
+	
+	return true;
+}
+
+//Decompresses the next block of the image into the buffer. Returns false at the end of the image.
+static bool systar_src_fill(systar_src_t *src)
+{
+	while(1)
+	{
+		uint32_t block_hdr = systar_src_le32(src);
+		if(block_hdr == 0)
+		{
+			//End of frame. There may be another after it.
+			if(src->contentsum)
+				src->in += 4;
+			
+			if(!systar_src_frame(src))
+				return false;
+			
+			continue;
+		}
+		
+		//Top bit marks blocks that weren't compressible and are stored as-is
+		size_t block_len = block_hdr & 0x7FFFFFFFu;
+		KASSERT(block_len <= (size_t)(src->in_end - src->in));
+		if(block_hdr & 0x80000000u)
+		{
+			KASSERT(block_len <= src->buf_size);
+			memcpy(src->buf, src->in, block_len);
+			src->buf_len = block_len;
+		}
+		else
+		{
+			ssize_t decomp = lz4_block(src->in, block_len, src->buf, src->buf_size);
+			KASSERT(decomp >= 0);
+			src->buf_len = decomp;
+		}
+		
+		src->in += block_len;
+		if(src->blocksum)
+			src->in += 4;
+		
+		src->buf_pos = 0;
+		if(src->buf_len > 0)
+			return true;
+	}
+}
+
+//Starts reading the system image, checking whether it's compressed.
+static void systar_src_init(systar_src_t *src)
+{
+	memset(src, 0, sizeof(*src));
+	src->in = _SYSTAR_START;
+	src->in_end = _SYSTAR_END;
+	
+	if(src->in_end - src->in >= 4 && src->in[0] == 0x04 && src->in[1] == 0x22 && src->in[2] == 0x4D && src->in[3] == 0x18)
+	{
+		src->lz4 = true;
+		bool started = systar_src_frame(src);
+		KASSERT(started);
+	}
+}
+
+//Returns a pointer to the next bytes of the TAR, up to the given length, and advances past them.
+//Outputs how many bytes are there, which is less than requested only when the image is compressed.
+//Returns NULL at the end of the TAR.
+static const uint8_t *systar_src_get(systar_src_t *src, size_t len, size_t *len_out)
+{
+	const uint8_t *retval = NULL;
+	if(!src->lz4)
+	{
+		//Uncompressed image - just point into it
+		if(len > (size_t)(src->in_end - src->in))
+			len = src->in_end - src->in;
+		
+		if(len == 0)
+		{
+			*len_out = 0;
+			return NULL;
+		}
+		
+		retval = src->in;
+		src->in += len;
+	}
+	else
+	{
+		//Compressed image - hand out what's left of the last block decompressed, or decompress another
+		if(src->buf_pos >= src->buf_len && !systar_src_fill(src))
+		{
+			*len_out = 0;
+			return NULL;
+		}
+		
+		if(len > src->buf_len - src->buf_pos)
+			len = src->buf_len - src->buf_pos;
+		
+		retval = src->buf + src->buf_pos;
+		src->buf_pos += len;
+	}
+	
+	src->total += len;
+	*len_out = len;
+	return retval;
+}
+
+//Copies the next bytes of the TAR into the given buffer. Returns false if the TAR ends first.
+static bool systar_src_read(systar_src_t *src, void *dst, size_t len)
+{
+	uint8_t *dst_bytes = (uint8_t*)dst;
+	while(len > 0)
+	{
+		size_t got = 0;
+		const uint8_t *bytes = systar_src_get(src, len, &got);
+		if(bytes == NULL)
+			return false;
+		
+		memcpy(dst_bytes, bytes, got);
+		dst_bytes += got;
+		len -= got;
+	}
+	return true;
+}
+
+//Writes the next bytes of the TAR into the given file, or skips them if the file is NULL.
+static void systar_src_copy(systar_src_t *src, file_t *file, size_t len)
+{
+	while(len > 0)
+	{
+		size_t got = 0;
+		const uint8_t *bytes = systar_src_get(src, len, &got);
+		KASSERT(bytes != NULL);
+		
+		if(file != NULL)
+		{
+			ssize_t written = file_write(file, bytes, got);
+			KASSERT(written == (ssize_t)got);
+		}
+		
+		len -= got;
+	}
+}
+
 void systar_unpack(void)
 {
 	//System image as linked should be page-aligned so we can free it
 	size_t systar_size = (size_t)(_SYSTAR_END - _SYSTAR_START);
 	KASSERT((uintptr_t)_SYSTAR_END % m_frame_size() == 0);
 	KASSERT((uintptr_t)_SYSTAR_START % m_frame_size() == 0);
+	int64_t tsc_start = m_time_tsc();
+	
+	//Keep track of which pages of the image end up used by files
+	size_t npages = systar_size / m_frame_size();
+	systar_pagerefs = kpage_alloc(npages * sizeof(systar_pagerefs[0]));
+	KASSERT(systar_pagerefs != NULL);
+	memset(systar_pagerefs, 0, npages * sizeof(systar_pagerefs[0]));
+	systar_kept = systar_size;
 	
 	//Work through TAR one block at a time
 	KASSERT(systar_size % 512 == 0);
-	const uint8_t *block_bytes = _SYSTAR_START;
+	systar_src_t src;
+	systar_src_init(&src);
 	int zero_blocks = 0;
-	while(block_bytes < _SYSTAR_END)
+	while(1)
 	{
-		//Read block header and advance past
-		const systar_ustar_hdr_t *hdr = (systar_ustar_hdr_t*)(block_bytes);
-		block_bytes += 512;
+		//Read block header
+		if(!systar_src_read(&src, systar_hdr_block, sizeof(systar_hdr_block)))
+			break;
+		
+		const systar_ustar_hdr_t *hdr = (systar_ustar_hdr_t*)(systar_hdr_block);
 		
 		//Make sure it's a USTAR header or empty - two empty blocks mean end-of-file
 		if(hdr->filename[0] == '\0')
@@ -172,48 +472,90 @@ void systar_unpack(void)
 		KASSERT(strchr(path_remain, '/') == NULL);
 		
 		//Directories in TAR files can end with a "/", in which case, we're already done.
+		file_t *file = NULL;
 		if(strlen(path_remain) > 0)
 		{
-			file_t *file;
 			int file_result = file_make(dir_file, path_remain, mode, spec, &file);
 			KASSERT(file_result >= 0);
 			file->access = 7;
 			
-			//Write the contents into the file
-			if(S_ISREG(mode))
-			{
-				ssize_t written = file_write(file, block_bytes, file_size);
-				KASSERT(written == file_size);
-			}
-			else if(S_ISLNK(mode))
+			if(S_ISLNK(mode))
 			{
 				ssize_t written = file_write(file, hdr->linked, strlen(hdr->linked));
 				KASSERT(written == (ssize_t)strlen(hdr->linked));
 			}
+		}
+		
+		//Adopt the contents right where they are in the image, if it's not compressed and they're not small.
+		//Otherwise write them into the file as they're read.
+		size_t padding = ((file_size + 511) / 512 * 512) - file_size;
+		if(file != NULL && S_ISREG(mode) && !src.lz4 && file_size >= SYSTAR_ADOPT_MIN)
+		{
+			size_t got = 0;
+			const uint8_t *contents = systar_src_get(&src, file_size, &got);
+			KASSERT(contents != NULL && got == (size_t)file_size);
 			
-			//Close the file
+			size_t first, last;
+			systar_pages(contents, file_size, &first, &last);
+			for(size_t pp = first; pp <= last; pp++)
+			{
+				KASSERT(systar_pagerefs[pp] < UINT16_MAX);
+				systar_pagerefs[pp]++;
+			}
+			
+			int adopt_err = ramfs_adopt(file->ino, contents, file_size, &systar_release);
+			KASSERT(adopt_err >= 0);
+			systar_adopted += file_size;
+		}
+		else
+		{
+			systar_src_copy(&src, S_ISREG(mode) ? file : NULL, file_size);
+		}
+		
+		//Skip to the next header
+		systar_src_copy(&src, NULL, padding);
+		
+		//Close the file and the directory where we made it
+		if(file != NULL)
+		{
 			file->refs = 0;
 			file_unlock(file);
 		}
 		
-		//Close the directory where we made the file
 		dir_file->refs = 0;
 		file_unlock(dir_file);
-		
-		//Advance past the file contents in the TAR
-		size_t file_blocks = (file_size + 511) / 512;
-		block_bytes += file_blocks * 512;
 	}
 	
-	//Unmap and free the file as-loaded, now that the contents are in our in-memory filesystem.
-	uintptr_t vaddr_start = (uintptr_t)_SYSTAR_START;
-	uintptr_t vaddr_end = (uintptr_t)_SYSTAR_END;
-	size_t pagesize = m_frame_size();
-	for(uintptr_t vaddr = vaddr_start; vaddr < vaddr_end; vaddr += pagesize)
+	//Done decompressing
+	systar_unpacked = src.total;
+	if(src.buf != NULL)
+		kpage_free(src.buf, src.buf_size);
+	
+	//Unmap and free the parts of the image that no file adopted - headers and small files that were copied.
+	m_spl_acq(&systar_spl);
+	for(size_t pp = 0; pp < npages; pp++)
 	{
-		uintptr_t paddr = m_kspc_get(vaddr);
-		KASSERT(paddr != 0);
-		m_kspc_set(vaddr, 0);
-		m_frame_free(paddr);
+		if(systar_pagerefs[pp] == 0)
+			systar_freepage(pp);
 	}
+	m_spl_rel(&systar_spl);
+	
+	systar_tsc = m_time_tsc() - tsc_start;
+}
+
+void systar_booted(void)
+{
+	systar_boot_tsc = m_time_tsc();
+}
+
+void systar_info(_sc_fsinfo_t *info)
+{
+	m_spl_acq(&systar_spl);
+	info->image_size = (size_t)(_SYSTAR_END - _SYSTAR_START);
+	info->image_unpacked = systar_unpacked;
+	info->image_adopted = systar_adopted;
+	info->image_kept = systar_kept;
+	info->image_tsc = systar_tsc;
+	info->boot_tsc = systar_boot_tsc;
+	m_spl_rel(&systar_spl);
 }
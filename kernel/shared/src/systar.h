@@ -4,7 +4,16 @@
 #ifndef SYSTAR_H
 #define SYSTAR_H
 
-//Unpacks and frees the system TAR
+#include <sc.h>
+
+//Unpacks the system TAR into the filesystem.
+//Files adopt their contents where they lie in the image. The rest of the image is freed.
 void systar_unpack(void);
 
+//Notes that boot has finished and init is ready to run.
+void systar_booted(void);
+
+//Returns measurements of unpacking the system TAR and booting.
+void systar_info(_sc_fsinfo_t *info);
+
 #endif //SYSTAR_H
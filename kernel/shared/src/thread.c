@@ -6,44 +6,133 @@
 #include "m_intr.h"
 #include "m_tls.h"
 #include "m_time.h"
+#include "m_cpu.h"
 #include "kassert.h"
 #include "con.h"
 #include "kpage.h"
+#include "syscalls.h"
 #include <errno.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/wait.h>
 
-thread_t thread_table[THREAD_MAX];
+static void *thread_chunks[THREAD_MAX / THREAD_CHUNK];
+slab_table_t thread_table = SLAB_TABLE_INIT("thread", thread_t, THREAD_CHUNK, THREAD_MAX, thread_chunks);
+
+thread_runq_t thread_runq_table[THREAD_RUNQ_MAX];
+
+//Links the given thread onto the end of the given run queue.
+static void thread_runq_append(thread_runq_t *rq, thread_t *thread)
+{
+	m_spl_acq(&(rq->spl));
+	
+	thread->runq_next = NULL;
+	if(rq->tail != NULL)
+		rq->tail->runq_next = thread;
+	else
+		rq->head = thread;
+	
+	rq->tail = thread;
+	
+	m_spl_rel(&(rq->spl));
+}
+
+//Puts the given thread on the run queue of its CPU, unless it's already in a queue.
+//Doesn't need the thread's lock - the scheduler checks if the thread is really runnable when it's taken off.
+static void thread_runq_push(thread_t *thread)
+{
+	if(!m_atomic_cmpxchg(&(thread->runq_queued), 0, 1))
+	{
+		//Already queued - the scheduler will look at it soon enough.
+		return;
+	}
+	
+	thread_runq_append(&(thread_runq_table[thread->runq_cpu % THREAD_RUNQ_MAX]), thread);
+}
+
+//Takes the first thread off the given run queue.
+//Returns the thread, locked, if it's ready to run. Returns NULL otherwise.
+//Sets *more if anything was in the queue, i.e. if it's worth looking again before halting.
+static thread_t *thread_runq_take(thread_runq_t *rq, bool *more)
+{
+	m_spl_acq(&(rq->spl));
+	
+	thread_t *tptr = rq->head;
+	if(tptr != NULL)
+	{
+		rq->head = tptr->runq_next;
+		if(rq->head == NULL)
+			rq->tail = NULL;
+		
+		tptr->runq_next = NULL;
+	}
+	
+	m_spl_rel(&(rq->spl));
+	
+	if(tptr == NULL)
+	{
+		//Queue was empty.
+		return NULL;
+	}
+	
+	*more = true;
+	
+	if(!m_spl_try(&(tptr->spl)))
+	{
+		//Somebody's working with the thread - put it back and look again later.
+		thread_runq_append(rq, tptr);
+		return NULL;
+	}
+	
+	//The thread is no longer queued. Mark it so before checking if it's runnable.
+	//Then anyone who unpauses it after we look will queue it again.
+	bool dequeued = m_atomic_cmpxchg(&(tptr->runq_queued), 1, 0);
+	KASSERT(dequeued);
+	
+	if(tptr->state == THREAD_STATE_SUSPEND && tptr->unpauses >= tptr->unpauses_req)
+	{
+		//Ready to run - return it, still locked.
+		return tptr;
+	}
+	
+	//Not actually runnable. It'll get queued again when that changes.
+	m_spl_rel(&(tptr->spl));
+	return NULL;
+}
 
 thread_t *thread_lockfree(void)
 {
-	for(int tt = 1; tt < THREAD_MAX; tt++)
+	while(1)
 	{
-		//Don't bother fighting over a lock - locked thread is necessarily in use.
-		thread_t *tptr = &(thread_table[tt]);
-		if(m_spl_try(&(tptr->spl)))
+		size_t count = slab_table_count(&thread_table);
+		for(size_t tt = 1; tt < count; tt++)
 		{
-			if(tptr->state == THREAD_STATE_NONE)
+			//Don't bother fighting over a lock - locked thread is necessarily in use.
+			thread_t *tptr = slab_table_get(&thread_table, tt);
+			if(m_spl_try(&(tptr->spl)))
 			{
-				//Found a free spot. 
-				
-				//Make sure it's got a valid ID
-				tptr->tid += THREAD_MAX;
-				if( (tptr->tid <= 0) || ((tptr->tid % THREAD_MAX) != tt) )
-					tptr->tid = tt;
+				if(tptr->state == THREAD_STATE_NONE)
+				{
+					//Found a free spot. 
+					
+					//Make sure it's got a valid ID
+					tptr->tid += THREAD_MAX;
+					if( (tptr->tid <= 0) || ((tptr->tid % THREAD_MAX) != (id_t)tt) )
+						tptr->tid = tt;
+					
+					//Return it, still locked.
+					return tptr;
+				}
 				
-				//Return it, still locked.
-				return tptr;
+				//Not free. Unlock and keep looking.
+				m_spl_rel(&(tptr->spl));
 			}
-			
-			//Not free. Unlock and keep looking.
-			m_spl_rel(&(tptr->spl));
 		}
+		
+		//Didn't find a spot. Make more room and look again.
+		if(slab_table_grow(&thread_table, count + 1) < 0)
+			return NULL;
 	}
-	
-	//Didn't find a spot.
-	return NULL;
 }
 
 int thread_new(process_t *process, uintptr_t entry, thread_t **thread_out)
@@ -66,6 +155,12 @@ int thread_new(process_t *process, uintptr_t entry, thread_t **thread_out)
 	
 	process->nthreads++;
 	
+	//New threads are ready to run, starting on this CPU.
+	//The scheduler can't take it until the caller unlocks it.
+	tptr->runq_cpu = m_cpu_num();
+	thread_runq_push(tptr);
+	m_intr_wake();
+	
 	//Success
 	*thread_out = tptr;
 	return 0;
@@ -77,7 +172,10 @@ thread_t *thread_locktid(id_t tid)
 		return NULL;
 	
 	//Array index corresponds to ID
-	thread_t *tptr = &(thread_table[tid % THREAD_MAX]);
+	thread_t *tptr = slab_table_get(&thread_table, tid % THREAD_MAX);
+	if(tptr == NULL)
+		return NULL;
+	
 	m_spl_acq(&(tptr->spl));
 	
 	if( (tptr->state == THREAD_STATE_NONE) || (tptr->tid != tid) )
@@ -124,7 +222,15 @@ void thread_unpause(id_t tid)
 	//This kinda races but we don't care.
 	//If the thread was cleaned-up or replaced then whatever, there's no harm in unpausing someone else.
 	KASSERT(tid >= 0);
-	m_atomic_increment_and_fetch(&(thread_table[tid % THREAD_MAX].unpauses));
+	thread_t *tptr = slab_table_get(&thread_table, tid % THREAD_MAX);
+	if(tptr == NULL)
+		return;
+	
+	m_atomic_increment_and_fetch(&(tptr->unpauses));
+	
+	//Queue the thread after incrementing the unpauses count.
+	//Whoever takes it off the queue will see the new count.
+	thread_runq_push(tptr);
 	
 	//Send interprocessor interrupt after incrementing the unpauses count.
 	//This way, anyone who saw the old count will receive a pending interrupt after they see it.
@@ -132,6 +238,166 @@ void thread_unpause(id_t tid)
 	m_intr_wake();
 }
 
+void thread_pause(void)
+{
+	thread_t *tptr = thread_lockcur();
+	
+	//Unpauses gets incremented atomically without holding the thread's lock.
+	//So, capture it while we work with it.
+	m_atomic_t unpauses_now = (volatile m_atomic_t)(tptr->unpauses);
+	
+	//Each time we call pause, we require at least one corresponding unpause.
+	//But if we've got an excess of unpauses, consume them all at once.
+	tptr->unpauses_req++;
+	if(tptr->unpauses_req < unpauses_now)
+		tptr->unpauses_req = unpauses_now;
+		
+	thread_unlock(tptr);
+}
+
+void thread_block(void)
+{
+	//Anyone who unpauses us after the caller checked for progress will satisfy this pause.
+	thread_pause();
+	
+	thread_t *tptr = thread_lockcur();
+	KASSERT(tptr->state == THREAD_STATE_SYSCALL);
+	tptr->sc_restart = true;
+	thread_unlock(tptr);
+}
+
+//Takes the given wait queue entry off whatever queue it's in.
+static void thread_unwait(thread_waitent_t *ent)
+{
+	//Only the thread itself puts its entries in a queue. Others can only take them off.
+	//So if it's in a queue, it's this one or none at all, by the time we've locked the queue.
+	thread_waitq_t *wq = *(thread_waitq_t * volatile *)&(ent->waitq);
+	if(wq == NULL)
+		return;
+	
+	m_spl_acq(&(wq->spl));
+	if(ent->waitq == wq)
+	{
+		thread_waitent_t *prev = NULL;
+		thread_waitent_t *cur = wq->head;
+		while(cur != ent)
+		{
+			KASSERT(cur != NULL);
+			prev = cur;
+			cur = cur->next;
+		}
+		
+		if(prev != NULL)
+			prev->next = ent->next;
+		else
+			wq->head = ent->next;
+		
+		if(wq->tail == ent)
+			wq->tail = prev;
+		
+		ent->waitq = NULL;
+		ent->next = NULL;
+	}
+	m_spl_rel(&(wq->spl));
+}
+
+//Puts the given entry of the current thread at the end of the given wait queue, if it's not there already.
+static void thread_waitent(thread_waitq_t *wq, int ent_idx)
+{
+	thread_t *tptr = m_tls_get();
+	thread_waitent_t *ent = &(tptr->waitents[ent_idx]);
+	if(ent->waitq == wq)
+		return;
+	
+	//Each entry only waits on one thing at a time.
+	thread_unwait(ent);
+	
+	m_spl_acq(&(wq->spl));
+	ent->thread = tptr;
+	ent->waitq = wq;
+	ent->next = NULL;
+	if(wq->tail != NULL)
+		wq->tail->next = ent;
+	else
+		wq->head = ent;
+	
+	wq->tail = ent;
+	m_spl_rel(&(wq->spl));
+}
+
+void thread_wait(thread_waitq_t *wq)
+{
+	thread_waitent(wq, 0);
+}
+
+void thread_pollwait(thread_waitq_t *wq, int slot)
+{
+	KASSERT(slot >= 0 && slot < THREAD_WAITENT_MAX - 1);
+	thread_waitent(wq, slot + 1);
+}
+
+void thread_pollclear(void)
+{
+	thread_t *tptr = m_tls_get();
+	for(int ee = 1; ee < THREAD_WAITENT_MAX; ee++)
+	{
+		thread_unwait(&(tptr->waitents[ee]));
+	}
+}
+
+//Takes the first entry off the given wait queue and unpauses its thread.
+//Returns whether the thread was blocked in a system call waiting for just this - not polling.
+//Sets *empty if there was nobody to wake.
+static bool thread_wake_first(thread_waitq_t *wq, bool *empty)
+{
+	m_spl_acq(&(wq->spl));
+	
+	thread_waitent_t *ent = wq->head;
+	if(ent == NULL)
+	{
+		m_spl_rel(&(wq->spl));
+		*empty = true;
+		return false;
+	}
+	
+	wq->head = ent->next;
+	if(wq->head == NULL)
+		wq->tail = NULL;
+	
+	ent->waitq = NULL;
+	ent->next = NULL;
+	
+	//Racy, but only errs toward waking more threads than needed.
+	thread_t *tptr = ent->thread;
+	id_t tid = tptr->tid;
+	bool blocked = (ent == &(tptr->waitents[0])) && *(volatile bool*)&(tptr->sc_restart);
+	
+	m_spl_rel(&(wq->spl));
+	
+	thread_unpause(tid);
+	*empty = false;
+	return blocked;
+}
+
+void thread_wake_one(thread_waitq_t *wq)
+{
+	bool empty = false;
+	while(!empty)
+	{
+		if(thread_wake_first(wq, &empty))
+			return;
+	}
+}
+
+void thread_wake_all(thread_waitq_t *wq)
+{
+	bool empty = false;
+	while(!empty)
+	{
+		thread_wake_first(wq, &empty);
+	}
+}
+
 id_t thread_curtid(void)
 {
 	thread_t *tptr = m_tls_get();
@@ -153,6 +419,11 @@ void thread_cleanup(thread_t *tptr)
 	tptr->sigpend = 0;
 	tptr->unpauses = 0;
 	tptr->unpauses_req = 0;
+	tptr->sc_restart = false;
+	for(int ee = 0; ee < THREAD_WAITENT_MAX; ee++)
+	{
+		thread_unwait(&(tptr->waitents[ee]));
+	}
 	thread_unlock(tptr);
 	
 	//Reduce the thread-count of the process that the thread was a part of.
@@ -195,7 +466,7 @@ void thread_cleanup(thread_t *tptr)
 		hadcon = pptr->hascon;
 		pptr->hascon = false;
 		pptr->contid = 0;
-
+		
 		if(pptr->fb.bufptr != NULL)
 			kpage_free(pptr->fb.bufptr, pptr->fb.buflen);
 		
@@ -213,18 +484,20 @@ void thread_cleanup(thread_t *tptr)
 		pptr = NULL;
 		
 		//Unpause all threads in the parent process, so one can wait on the now-dead child process
-		for(int tt = 0; tt < THREAD_MAX; tt++)
+		size_t nthreads = slab_table_count(&thread_table);
+		for(size_t tt = 0; tt < nthreads; tt++)
 		{
-			m_spl_acq(&(thread_table[tt].spl));
-			if(thread_table[tt].state != THREAD_STATE_NONE)
+			thread_t *other = slab_table_get(&thread_table, tt);
+			m_spl_acq(&(other->spl));
+			if(other->state != THREAD_STATE_NONE)
 			{
-				if(thread_table[tt].process->pid == ppid)
+				if(other->process->pid == ppid)
 				{
-					thread_table[tt].sigpend |= (1u << SIGCHLD);
-					thread_unpause(thread_table[tt].tid);
+					other->sigpend |= (1u << SIGCHLD);
+					thread_unpause(other->tid);
 				}
 			}
-			m_spl_rel(&(thread_table[tt].spl));
+			m_spl_rel(&(other->spl));
 		}
 		
 		//If the process with the console just died, the console returns to PID 1.
@@ -238,133 +511,199 @@ void thread_cleanup(thread_t *tptr)
 	}
 }
 
-void thread_sched(void)
+//Runs the current thread's blocked system call again. Called with the thread locked; returns with it unlocked.
+static void thread_restart(thread_t *tptr)
 {
-	//If we just serviced a thread, see if there's any cleanup to be done on it.
-	if(m_tls_get() != NULL)
+	KASSERT(tptr->state == THREAD_STATE_SYSCALL);
+	KASSERT(tptr->sc_restart);
+	
+	//If the call blocks again, it'll ask to be restarted again.
+	tptr->sc_restart = false;
+	
+	//Don't bother if the thread is on its way out - it'll be cleaned up when we go back around.
+	if(tptr->process->state != PROCESS_STATE_ALIVE)
 	{
-		//Check the state of the process containing the thread.
-		//If it's trying to clean up, the thread dies too.
-		thread_t *tptr = thread_lockcur();
-		KASSERT(tptr->state == THREAD_STATE_SYSCALL);
-		
-		if(tptr->process->state != PROCESS_STATE_ALIVE)
-			thread_chstate(tptr, THREAD_STATE_DEAD);
-		
-		//If the thread has a pending signal it can handle, scoot it into the signal handler.
-		int64_t triggered = tptr->sigpend & ~(tptr->sigmask);
-		if(triggered)
-		{
-			//Figure out which signal to trigger.
-			int signum = -1;
-			for(int bb = 0; bb < 64; bb++)
-			{
-				if(triggered & (1 << bb))
-				{
-					signum = bb;
-					break;
-				}
-			}
-			KASSERT(signum >= 0 && signum < 63);
-			tptr->siginfo.signum = signum;
-			
-			//Set aside info about thread at the time it was signalled
-			m_drop_copy(&(tptr->sigdrop), &(tptr->drop));
-			tptr->siginfo.mask = tptr->sigmask;
-			
-			//Mask further signals
-			tptr->sigmask = 0x7FFFFFFFFFFFFFFFul;
-			
-			//Continue at specified signal handler address
-			m_drop_signal(&(tptr->drop), tptr->sigpc, tptr->sigsp);
-
-			//Thread unpauses when signalled, of course
-			tptr->unpauses++;
-			
-			//Signal is no longer pending
-			tptr->sigpend &= ~(1u << signum);
-		}
-		
-		//Short-circuit - if a thread made a system call and it's not blocked, keep running it.
-		//Todo - some limited leniency with the scheduler.
-		//This avoids bouncing between user-spaces unnecessarily.
-		if(tptr->state == THREAD_STATE_SYSCALL && tptr->unpauses >= tptr->unpauses_req && tptr->tsc_resched > m_time_tsc())
-		{
-			thread_chstate(tptr, THREAD_STATE_RUN);
-			thread_unlock(tptr);
-			m_drop(&(tptr->drop));
-		}
-		
-		//If we're going to be leaving the thread, we can't keep using its process's memory space.
-		//If the thread gets killed on another CPU and they clean up the process, it can disappear.
-		m_uspc_activate(0);
-		
-		//If the thread has died, clean it up. Otherwise, it suspends.
-		if(tptr->state == THREAD_STATE_DEAD)
-		{
-			thread_cleanup(tptr);
-		}
-		else
-		{
-			thread_chstate(tptr, THREAD_STATE_SUSPEND);
-			thread_unlock(tptr);
-		}
+		thread_unlock(tptr);
+		return;
 	}
-		
-	//Look for some other thread to run.
+	
+	uintptr_t num = tptr->sc_num;
+	uintptr_t args[5];
+	memcpy(args, tptr->sc_args, sizeof(args));
+	m_drop_retval(&(tptr->drop), 0);
+	thread_unlock(tptr);
+	tptr = NULL;
+	
+	//Same as on entry - only change the return value if the call gives one.
+	uintptr_t result = syscalls_handle(num, args[0], args[1], args[2], args[3], args[4]);
+	if(result != 0)
+	{
+		tptr = thread_lockcur();
+		m_drop_retval(&(tptr->drop), result);
+		thread_unlock(tptr);
+	}
+}
+
+void thread_sched(void)
+{
 	while(1)
 	{
-		//Disable interrupts while trying to schedule.
-		//If a thread becomes runnable while we search, then, the resulting interrupt will be waiting for us.
-		m_intr_ei(false);
-		
-		//Look for threads to run
-		thread_t *tptr = NULL;
-		for(int tt = 0; tt < THREAD_MAX; tt++)
+		//If we just serviced a thread, see if there's any cleanup to be done on it.
+		if(m_tls_get() != NULL)
 		{
-			if(m_spl_try(&(thread_table[tt].spl)))
+			//Check the state of the process containing the thread.
+			//If it's trying to clean up, the thread dies too.
+			thread_t *tptr = thread_lockcur();
+			KASSERT(tptr->state == THREAD_STATE_SYSCALL);
+			
+			if(tptr->process->state != PROCESS_STATE_ALIVE)
+				thread_chstate(tptr, THREAD_STATE_DEAD);
+			
+			//If the thread has a pending signal it can handle, scoot it into the signal handler.
+			int64_t triggered = tptr->sigpend & ~(tptr->sigmask);
+			if(triggered)
 			{
-				if(thread_table[tt].state == THREAD_STATE_SUSPEND)
+				//Figure out which signal to trigger.
+				int signum = -1;
+				for(int bb = 0; bb < 64; bb++)
 				{
-					if(thread_table[tt].unpauses >= thread_table[tt].unpauses_req)
+					if(triggered & (1 << bb))
 					{
-						tptr = &(thread_table[tt]);
+						signum = bb;
 						break;
 					}
 				}
+				KASSERT(signum >= 0 && signum < 63);
+				tptr->siginfo.signum = signum;
+				
+				//A blocked system call is interrupted by the signal, rather than run again.
+				//It returns EINTR once the handler is done.
+				if(tptr->sc_restart)
+				{
+					tptr->sc_restart = false;
+					m_drop_retval(&(tptr->drop), -EINTR);
+				}
+				
+				//Set aside info about thread at the time it was signalled
+				m_drop_copy(&(tptr->sigdrop), &(tptr->drop));
+				tptr->siginfo.mask = tptr->sigmask;
+				
+				//Mask further signals
+				tptr->sigmask = 0x7FFFFFFFFFFFFFFFul;
+				
+				//Continue at specified signal handler address
+				m_drop_signal(&(tptr->drop), tptr->sigpc, tptr->sigsp);
+				
+				//Thread unpauses when signalled, of course
+				tptr->unpauses++;
+				
+				//Signal is no longer pending
+				tptr->sigpend &= ~(1u << signum);
+			}
+			
+			//Short-circuit - if a thread made a system call and it's not blocked, keep running it.
+			//Todo - some limited leniency with the scheduler.
+			//This avoids bouncing between user-spaces unnecessarily.
+			if(tptr->state == THREAD_STATE_SYSCALL && tptr->unpauses >= tptr->unpauses_req && tptr->tsc_resched > m_time_tsc())
+			{
+				//If the system call blocked but can already make progress, just run it again.
+				if(tptr->sc_restart)
+				{
+					thread_restart(tptr);
+					continue;
+				}
+				
+				thread_chstate(tptr, THREAD_STATE_RUN);
+				thread_unlock(tptr);
+				m_intr_timer(tptr->tsc_resched);
+				m_drop(&(tptr->drop));
+			}
+			
+			//If we're going to be leaving the thread, we can't keep using its process's memory space.
+			//If the thread gets killed on another CPU and they clean up the process, it can disappear.
+			m_uspc_activate(0);
+			
+			//If the thread has died, clean it up. Otherwise, it suspends.
+			if(tptr->state == THREAD_STATE_DEAD)
+			{
+				thread_cleanup(tptr);
+			}
+			else
+			{
+				//If the thread is still runnable, it goes back on the queue for this CPU.
+				thread_chstate(tptr, THREAD_STATE_SUSPEND);
+				if(tptr->unpauses >= tptr->unpauses_req)
+					thread_runq_push(tptr);
 				
-				m_spl_rel(&(thread_table[tt].spl));
+				thread_unlock(tptr);
 			}
 		}
-		
-		if(tptr == NULL)
+			
+		//Look for some other thread to run.
+		while(1)
 		{
-			//No threads runnable right now.
-			//Wait for an interprocessor interrupt that might indicate something to do.
-			m_intr_halt();
+			//Disable interrupts while trying to schedule.
+			//If a thread becomes runnable while we search, then, the resulting interrupt will be waiting for us.
+			m_intr_ei(false);
+			
+			//Look for threads to run - first in our own queue, then steal from other CPUs' queues.
+			int cpu = m_cpu_num();
+			int nqueues = m_cpu_count();
+			if(nqueues > THREAD_RUNQ_MAX)
+				nqueues = THREAD_RUNQ_MAX;
 			
-			//Try again to find a runnable thread.
-			continue;
+			thread_t *tptr = NULL;
+			bool more = false;
+			for(int qq = 0; qq < nqueues && tptr == NULL; qq++)
+			{
+				tptr = thread_runq_take(&(thread_runq_table[(cpu + qq) % THREAD_RUNQ_MAX]), &more);
+			}
+			
+			if(tptr == NULL)
+			{
+				//No threads runnable right now.
+				//If all the queues were empty, wait for an interprocessor interrupt that might indicate something to do.
+				if(!more)
+					m_intr_halt();
+				
+				//Try again to find a runnable thread.
+				continue;
+			}
+			
+			//Got a thread, it's ready, and we've locked it.
+			
+			//Note which thread we'll be running on this core, as its kernel stack/context is about to be clobbered.
+			m_tls_set(tptr);
+			
+			//It goes back on this CPU's queue when it becomes runnable again
+			tptr->runq_cpu = cpu;
+			
+			//Note when we should kick the thread off the CPU, and have the timer interrupt us then
+			tptr->tsc_resched = m_time_tsc() + THREAD_QUANTUM;
+			m_intr_timer(tptr->tsc_resched);
+			
+			KASSERT(tptr->state == THREAD_STATE_SUSPEND);
+			
+			//If the thread blocked in a system call, run the call again instead of returning to userspace.
+			//Then go back around, as if the thread had just made the call.
+			if(tptr->sc_restart)
+			{
+				thread_chstate(tptr, THREAD_STATE_SYSCALL);
+				m_uspc_activate(tptr->process->mem.uspc);
+				thread_restart(tptr);
+				break;
+			}
+			
+			//Mark the thread as running, and resume its userspace.
+			//(Assume nobody's messing with this, if the thread is marked "running", even though we release the lock)
+			thread_chstate(tptr, THREAD_STATE_RUN);
+			thread_unlock(tptr);
+			
+			m_uspc_activate(tptr->process->mem.uspc);
+			m_drop(&(tptr->drop));
+			
+			//m_drop doesn't return.
+			//When we re-enter the kernel, though, we'll know which thread triggered it, thanks to the TLS pointer.
 		}
-		
-		//Got a thread, it's ready, and we've locked it.
-		
-		//Note which thread we'll be running on this core, as its kernel stack/context is about to be clobbered.
-		m_tls_set(tptr);
-		
-		//Note when we should consider kicking the thread off the CPU
-		tptr->tsc_resched = m_time_tsc() + 100000000l;
-		
-		//Mark the thread as running, and resume its userspace.
-		//(Assume nobody's messing with this, if the thread is marked "running", even though we release the lock)
-		KASSERT(tptr->state == THREAD_STATE_SUSPEND);
-		thread_chstate(tptr, THREAD_STATE_RUN);
-		thread_unlock(tptr);
-		
-		m_uspc_activate(tptr->process->mem.uspc);
-		m_drop(&(tptr->drop));
-		
-		//m_drop doesn't return.
-		//When we re-enter the kernel, though, we'll know which thread triggered it, thanks to the TLS pointer.
 	}
-}
\ No newline at end of file
+}
@@ -8,7 +8,9 @@
 #include "m_drop.h"
 #include "m_atomic.h"
 #include "process.h"
+#include "slab.h"
 
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sc.h>
 
@@ -26,6 +28,22 @@ typedef enum thread_state_e
 	
 } thread_state_t;
 
+//Link from a thread into a wait queue.
+//Threads have several, so they can wait on more than one queue at once when polling.
+typedef struct thread_waitent_s
+{
+	//Thread that's waiting
+	struct thread_s *thread;
+	
+	//Queue the entry is linked into, if any, and the next entry in it. Changed with the queue's lock held.
+	struct thread_waitq_s *waitq;
+	struct thread_waitent_s *next;
+	
+} thread_waitent_t;
+
+//Wait queue entries in each thread - one for blocking reads and writes, and two per file being polled.
+#define THREAD_WAITENT_MAX (1 + (2 * _SC_POLL_MAX))
+
 //Thread control block
 typedef struct thread_s
 {
@@ -80,13 +98,69 @@ typedef struct thread_s
 	
 	//What value of "unpauses" is sufficient to continue executing the thread
 	m_atomic_t unpauses_req;
-
+	
+	
+	//System call being serviced, kept so it can be run again if it blocks
+	uintptr_t sc_num;
+	uintptr_t sc_args[5];
+	
+	//Whether the system call blocked, and should run again once the thread is unpaused
+	bool sc_restart;
+	
+	
+	//Entries linking the thread into wait queues
+	thread_waitent_t waitents[THREAD_WAITENT_MAX];
+	
+	
+	//Whether the thread is linked into a run queue (0 or 1). Changed atomically, without the thread's lock.
+	m_atomic_t runq_queued;
+	
+	//Next thread in the run queue containing this thread
+	struct thread_s *runq_next;
+	
+	//Which CPU's run queue the thread goes back on when it becomes runnable
+	int runq_cpu;
 	
 } thread_t;
 
-//All threads in the system
-#define THREAD_MAX 1024
-extern thread_t thread_table[THREAD_MAX];
+//How long a thread may run before it's preempted, in m_time_tsc ticks
+#ifndef THREAD_QUANTUM
+#define THREAD_QUANTUM 20000000l
+#endif
+
+//All threads in the system. Grows in chunks as needed, up to the maximum. TIDs map to a slot modulo the maximum.
+#define THREAD_CHUNK 64
+#define THREAD_MAX 16384
+extern slab_table_t thread_table;
+
+//Queue of threads that might be runnable, kept per-CPU
+typedef struct thread_runq_s
+{
+	//Spinlock protecting the queue
+	m_spl_t spl;
+	
+	//First and last threads in the queue
+	thread_t *head;
+	thread_t *tail;
+	
+} thread_runq_t;
+
+//Run queues for each CPU. CPUs beyond this number share queues.
+#define THREAD_RUNQ_MAX 64
+extern thread_runq_t thread_runq_table[THREAD_RUNQ_MAX];
+
+//Queue of threads waiting for something, like room or data in a pipe.
+//Threads take themselves off the queue only by being woken, by dying, or when they're done polling.
+typedef struct thread_waitq_s
+{
+	//Spinlock protecting the queue
+	m_spl_t spl;
+	
+	//First and last entries in the queue
+	thread_waitent_t *head;
+	thread_waitent_t *tail;
+	
+} thread_waitq_t;
 
 //Makes a new thread. Outputs a pointer to it, still locked.
 //Returns 0 on success or a negative error number.
@@ -112,6 +186,31 @@ void thread_chstate(thread_t *thread, thread_state_t newstate);
 //CAN BE CALLED FROM ISR.
 void thread_unpause(id_t tid);
 
+//Requires at least one more unpause before the current thread continues past its system call.
+void thread_pause(void);
+
+//Pauses the current thread, and runs its system call again once it's unpaused, instead of returning.
+//The system call should have put the thread somewhere it'll be unpaused when it can make progress.
+void thread_block(void);
+
+//Puts the current thread at the end of the given wait queue, if it's not there already.
+//Do this before giving up on a system call and blocking, so a wakeup in between isn't missed.
+void thread_wait(thread_waitq_t *wq);
+
+//Puts the current thread at the end of the given wait queue, using the given one of its polling entries.
+//A thread can wait on several queues at once this way, and gets unpaused by whichever wakes first.
+void thread_pollwait(thread_waitq_t *wq, int slot);
+
+//Takes the current thread off every wait queue it's in from polling.
+void thread_pollclear(void);
+
+//Unpauses threads at the front of the given wait queue, taking them off, until one that was blocked in a system call.
+//Threads that only wait from userspace, are polling, or have stopped waiting, get unpaused along the way, so they can look again.
+void thread_wake_one(thread_waitq_t *wq);
+
+//Unpauses and takes off every thread in the given wait queue.
+void thread_wake_all(thread_waitq_t *wq);
+
 //Returns the thread ID of the current thread.
 id_t thread_curtid(void);
 
@@ -62,6 +62,13 @@ intptr_t _sc_exec(int fd, char *const argv[], char *const envp[]);
 //Opens a file descriptor referring to the given existing file.
 int _sc_find(int dirfd, const char *name);
 
+//Flags for resolving paths.
+#define _SC_PATH_PARENT 1 //Stop at the directory containing the final pathname component
+
+//Opens a file descriptor referring to the file at the given path, relative to dirfd unless it begins with a slash.
+//Resolves all components in one call, rather than a find per component.
+int _sc_path(int dirfd, const char *path, int flags);
+
 //Opens a file descriptor referring to a new file with the given name.
 int _sc_make(int dirfd, const char *name, mode_t mode, int rdev);
 
@@ -79,6 +86,10 @@ ssize_t _sc_read(int fd, void *buf, ssize_t len);
 //Writes to a file.
 ssize_t _sc_write(int fd, const void *buf, ssize_t len);
 
+//Moves data from one file to another without passing it through userspace. One of them must be a pipe.
+//Regular files are read or written at their file pointer. Returns the number of bytes moved.
+ssize_t _sc_splice(int fd_in, int fd_out, ssize_t len);
+
 //Changes file pointer in an open file.
 off_t _sc_seek(int fd, off_t off, int whence);
 
@@ -90,6 +101,7 @@ int _sc_unlink(int dirfd, const char *name, int rmfd, int flags);
 
 //Flags exposed by the kernel about file descriptors
 #define _SC_FLAG_KEEPEXEC 1 //Keep the descriptor open across exec
+#define _SC_FLAG_BLOCK    2 //Reads and writes wait in the kernel until they can proceed, rather than returning EAGAIN
 
 //Sets and returns flags on the given file descriptor.
 int _sc_flag(int fd, int set, int clear);
@@ -131,10 +143,39 @@ ssize_t _sc_stat(int fd, _sc_stat_t *buf, ssize_t len);
 #define _SC_IOCTL_GETPGRP 4
 #define _SC_IOCTL_SETPGRP 5
 #define _SC_IOCTL_ISATTY  6
+#define _SC_IOCTL_GETPIPESZ 7 //Returns the size a pipe's buffer may grow to
+#define _SC_IOCTL_SETPIPESZ 8 //Sets the size a pipe's buffer may grow to, from an int, and returns it
 
 //Performs device-specific IO operations on a file descriptor.
 int _sc_ioctl(int fd, int operation, void *buf, ssize_t len);
 
+//File descriptor to check for readiness, and what was found.
+typedef struct _sc_poll_s
+{
+	int fd; //File descriptor, or _SC_POLL_CON for console input. Other negative values are skipped.
+	short events; //Conditions of interest
+	short revents; //Conditions that hold, output by the kernel
+} _sc_poll_t;
+
+//Conditions checked for by _sc_poll. HUP is reported along with IN, ERR along with OUT.
+#define _SC_POLL_IN   0x01 //Reading won't wait
+#define _SC_POLL_OUT  0x04 //Writing won't wait
+#define _SC_POLL_ERR  0x08 //Nobody's reading, so writes will fail
+#define _SC_POLL_HUP  0x10 //Nobody's writing anymore
+#define _SC_POLL_NVAL 0x20 //File descriptor isn't open
+
+//Stand-in for a file descriptor, to check for console input, when the caller holds the console.
+//Also ready once just after the console is handed over, so the new holder can draw. Only wakes the thread set by _sc_con_init.
+#define _SC_POLL_CON (-2)
+
+//Most file descriptors checked by one call to _sc_poll.
+#define _SC_POLL_MAX 16
+
+//Checks the given file descriptors, waiting until one is ready if the timeout is negative, or not at all if it's 0.
+//Positive timeouts aren't supported yet and return -ENOTSUP.
+//Fills in revents, and returns how many entries have any set - 0 if none were ready.
+int _sc_poll(_sc_poll_t *fds, ssize_t count, int64_t timeout);
+
 //Sleeps for the given number of nanoseconds.
 int _sc_nanosleep(int64_t nsec);
 
@@ -166,5 +207,43 @@ int _sc_priority(int idtype, int id, int priority);
 //Returns real-time clock value, in microseconds of the GPS epoch.
 int64_t _sc_getrtc(void);
 
+//Usage information about one of the kernel's object caches.
+typedef struct _sc_slabinfo_s
+{
+	char name[16]; //Name of the cache
+	size_t objsize; //Size of each object
+	size_t pages; //Pages of memory holding objects
+	size_t total; //Objects that fit in those pages
+	size_t used; //Objects currently allocated
+	size_t cached; //Free objects held by CPUs
+	uint64_t refills; //Times a CPU took objects from the shared pool
+	uint64_t flushes; //Times a CPU gave objects back to the shared pool
+} _sc_slabinfo_t;
+
+//Returns usage information about one of the kernel's object caches, by index. Returns -ENOENT past the last one.
+ssize_t _sc_slabinfo(int index, _sc_slabinfo_t *buf, ssize_t len);
+
+//Usage information about the kernel's filesystem.
+typedef struct _sc_fsinfo_s
+{
+	size_t dcache_size; //Entries in the cache of directory lookups
+	uint64_t dcache_hits; //Lookups answered by the cache with a file
+	uint64_t dcache_neghits; //Lookups answered by the cache with "not found"
+	uint64_t dcache_misses; //Lookups that had to search the directory
+	size_t block_size; //Size of each block of storage
+	size_t blocks; //Blocks of storage the filesystem has from the kernel right now
+	size_t blocks_free; //Blocks not holding any inode or data
+	size_t blocks_held; //Blocks removed from files but still mapped by processes
+	size_t image_size; //Size of the system image unpacked at boot, as linked into the kernel
+	size_t image_unpacked; //Size of the TAR in the system image, after decompressing if it was compressed
+	size_t image_adopted; //Bytes of files used right where they were in the image, rather than copied
+	size_t image_kept; //Bytes of the image still held by files that haven't changed
+	int64_t image_tsc; //Cycles spent unpacking the system image
+	int64_t boot_tsc; //Cycles from reset until init was ready to run
+} _sc_fsinfo_t;
+
+//Returns usage information about the kernel's filesystem.
+ssize_t _sc_fsinfo(_sc_fsinfo_t *buf, ssize_t len);
+
 
 #endif //_SC_H
@@ -13,6 +13,12 @@ intptr_t _sc_mem_avail(intptr_t around, ssize_t size);
 //Adds new, private, zeroed memory to the calling process's memory space.
 int _sc_mem_anon(uintptr_t addr, ssize_t size, int access);
 
+//Maps a file into the calling process's memory space, starting at the given page-aligned offset in the file.
+//Read-only mappings share the file's memory and see later changes to it.
+//Writable mappings are private - pages are copied when first written, and changes never reach the file.
+//Past the end of the file, the mapping is zeroes.
+int _sc_mem_file(uintptr_t addr, ssize_t size, int access, int fd, off_t off);
+
 //Removes memory from the calling process's memory space.
 int _sc_mem_free(uintptr_t addr, ssize_t size);
 
@@ -31,12 +31,17 @@ SYSCALL1R(0x15, int,      _sc_chdir,      int)
 SYSCALL3R(0x16, int,      _sc_dup,        int, int, bool)
 SYSCALL3R(0x17, ssize_t,  _sc_stat,       int, _sc_stat_t *, ssize_t)
 SYSCALL4R(0x18, int,      _sc_ioctl,      int, int, void *, ssize_t)
+SYSCALL3R(0x19, int,      _sc_path,       int, const char *, int)
+SYSCALL3R(0x1A, ssize_t,  _sc_splice,     int, int, ssize_t)
+SYSCALL3R(0x1B, int,      _sc_poll,       _sc_poll_t *, ssize_t, int64_t)
 
 SYSCALL1R(0x24, int,      _sc_nanosleep,  int64_t)
 SYSCALL3R(0x25, int,      _sc_rusage,     int, _sc_rusage_t *, ssize_t)
 SYSCALL5R(0x29, ssize_t,  _sc_wait,       int, pid_t, int, _sc_wait_t *, ssize_t)
 SYSCALL3R(0x2a, int,      _sc_priority,   int, int, int)
 SYSCALL0R(0x2b, int64_t,  _sc_getrtc      )
+SYSCALL3R(0x2c, ssize_t,  _sc_slabinfo,   int, _sc_slabinfo_t *, ssize_t)
+SYSCALL2R(0x2d, ssize_t,  _sc_fsinfo,     _sc_fsinfo_t *, ssize_t)
 
 SYSCALL0V(0x50, void,     _sc_pause       )
 
@@ -48,6 +53,7 @@ SYSCALL1R(0x63, int,      _sc_con_pass,   pid_t)
 SYSCALL2R(0x70, intptr_t, _sc_mem_avail,  intptr_t, ssize_t)
 SYSCALL3R(0x71, int,      _sc_mem_anon,   uintptr_t, ssize_t, int)
 SYSCALL2R(0x72, int,      _sc_mem_free,   uintptr_t, ssize_t)
+SYSCALL5R(0x73, int,      _sc_mem_file,   uintptr_t, ssize_t, int, int, off_t)
 
 SYSCALL2V(0x80, void,     _sc_sig_entry,   uintptr_t, uintptr_t)
 SYSCALL2R(0x81, int64_t,  _sc_sig_mask,    int, int64_t)
@@ -16,5 +16,7 @@
 #define F_SETLKW 7
 #define F_GETOWN 9
 #define F_SETOWN 8
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
 
 #endif //_DEFINE_FCNTL_CMDS_H
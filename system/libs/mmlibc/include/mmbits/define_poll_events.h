@@ -0,0 +1,19 @@
+//mmlibc/include/mmbits/define_poll_events.h
+//Fragment for building C standard headers.
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef _DEFINE_POLL_EVENTS_H
+#define _DEFINE_POLL_EVENTS_H
+
+//Defined like Linux
+#define POLLIN     0x001
+#define POLLPRI    0x002
+#define POLLOUT    0x004
+#define POLLERR    0x008
+#define POLLHUP    0x010
+#define POLLNVAL   0x020
+#define POLLRDNORM 0x040
+#define POLLRDBAND 0x080
+#define POLLWRNORM 0x100
+#define POLLWRBAND 0x200
+
+#endif //_DEFINE_POLL_EVENTS_H
@@ -0,0 +1,14 @@
+//mmlibc/include/mmbits/struct_pollfd.h
+//Fragment for building C standard headers.
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef _STRUCT_POLLFD_H
+#define _STRUCT_POLLFD_H
+
+struct pollfd
+{
+	int fd;
+	short events;
+	short revents;
+};
+
+#endif //_STRUCT_POLLFD_H
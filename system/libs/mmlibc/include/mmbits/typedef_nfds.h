@@ -0,0 +1,9 @@
+//mmlibc/include/mmbits/typedef_nfds.h
+//Fragment for building C standard headers.
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef _TYPEDEF_NFDS_H
+#define _TYPEDEF_NFDS_H
+
+typedef unsigned int nfds_t;
+
+#endif //_TYPEDEF_NFDS_H
@@ -0,0 +1,13 @@
+//mmlibc/include/poll.h
+//Declarations for polling file descriptors in MMK's libc.
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef _POLL_H
+#define _POLL_H
+
+#include <mmbits/struct_pollfd.h>
+#include <mmbits/typedef_nfds.h>
+#include <mmbits/define_poll_events.h>
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout);
+
+#endif //_POLL_H
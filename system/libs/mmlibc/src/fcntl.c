@@ -56,115 +56,36 @@ mode_t umask(mode_t modeclr)
 //Returns the file descriptor or a negative error number.
 int _path(int fd, const char *path, const char **path_remain)
 {
-	//Check if we have an absolute path.
-	//If so, consume the leading slashes, and do a relative resolution from the root dir.
-	if(*path == '/')
-	{
-		while(*path == '/')
-			path++;
-		
-		fd = _sc_find(-1, "/");
-		if(fd < 0)
-			return fd;
-		
-		int result = _path(fd, path, path_remain);
-		_sc_close(fd);
-		return result;
-	}
-	
-	//Handle "cwd" case by finding "" in the working directory, which simply returns it.
-	//Do a normal search starting there.
+	//The kernel takes -1 to mean the working directory.
 	if(fd == AT_FDCWD)
-	{
-		fd = _sc_find(-1, "");
-		if(fd < 0)
-			return fd;
-		
-		int result = _path(fd, path, path_remain);
-		_sc_close(fd);
-		return result;
-	}
-	
-	//Okay, we've handled absolute and working-dir cases.
-	//We now have a file descriptor to start with, and a relative path from it.
-	
-	//Make a copy of the caller's file descriptor to start.
-	int work_fd = _sc_find(fd, "");
-	if(work_fd < 0)
-		return work_fd;
+		fd = -1;
 	
 	//Todo - this needs to handle symlinks if requested.
 	
-	//Iterate through and look up all non-final pathname components.
+	//Have the kernel look up all non-final pathname components at once.
 	//These must exist in all cases - even if we're creating a file.
-	while(strchr(path, '/') != NULL)
-	{
-		//We've already skipped leading slashes.
-		//Copy out the pathname component, up to the next slash.
-		char comp[256] = {0};
-		size_t complen = 0;
-		while(*path != '\0' && *path != '/' && complen < sizeof(comp))
-		{
-			comp[complen] = *path;
-			path++;
-			complen++;
-		}
-		
-		if(complen >= sizeof(comp))
-		{
-			//Overlong pathname component (need at least one NUL in our comp buffer at the end)
-			_sc_close(work_fd);
-			return -ENAMETOOLONG;
-		}
-		
-		//Try to find that pathname component in the previous directory.
-		int next_fd = _sc_find(work_fd, comp);
-		if(next_fd < 0)
-		{
-			//Failed to find the non-final pathname component
-			_sc_close(work_fd);
-			return next_fd;
-		}
-		
-		//We no longer need our reference to the previous directory.
-		//We'll look up following the component we just found.
-		_sc_close(work_fd);
-		work_fd = next_fd;
-		
-		//Advance past slashes, and then continue to examine the remaining path.
-		while(*path == '/')
-			path++;
-	}
+	int work_fd = _sc_path(fd, path, _SC_PATH_PARENT);
+	if(work_fd < 0)
+		return work_fd;
 	
 	//Alright, got the directory open.
 	//Output the location of the final pathname component and return the directory.
-	*path_remain = path;
+	const char *last_slash = strrchr(path, '/');
+	*path_remain = (last_slash != NULL) ? (last_slash + 1) : path;
 	return work_fd;
 }
 
 //Non-variadic version of openat.
 int _openatm(int fd, const char *path, int flags, mode_t mode)
 {
-	//Look up nonfinal pathname components.
-	int work_fd = _path(fd, path, &path);
-	if(work_fd < 0)
+	int create_result = -ENOSYS;
+	int find_result = -ENOSYS;
+	if(!(flags & O_CREAT))
 	{
-		errno = -work_fd;
-		return -1;
+		//Not creating anything - have the kernel resolve the whole path in one go.
+		find_result = _sc_path((fd == AT_FDCWD) ? -1 : fd, path, 0);
 	}
-		
-	//Alright, we've resolved all but the last pathname component.
-	//We have a file descriptor that references the directory where it should be made or found.
-	//Try to get as much access as we can on that.
-	int dir_access_err = _sc_access(work_fd, _SC_ACCESS_R | _SC_ACCESS_W | _SC_ACCESS_X, 0);
-	(void)dir_access_err;
-	
-	//Try to create the file first, if creating it is permitted.
-	//This will fail if it already exists, but we'll then try to open it.
-	//If we tried to open the existing file first, we would have a race-condition with someone else also trying that.
-	
-	int create_result = -ENOSYS;
-	if(flags & O_CREAT)
+	else
 	{
 		if( (flags & O_DIRECTORY) && !S_ISDIR(mode) )
 		{
@@ -173,24 +94,41 @@ int _openatm(int fd, const char *path, int flags, mode_t mode)
 			return -1;
 		}
 		
+		//Look up nonfinal pathname components.
+		int work_fd = _path(fd, path, &path);
+		if(work_fd < 0)
+		{
+			errno = -work_fd;
+			return -1;
+		}
+		
+		//Alright, we've resolved all but the last pathname component.
+		//We have a file descriptor that references the directory where it should be made or found.
+		//Try to get as much access as we can on that.
+		int dir_access_err = _sc_access(work_fd, _SC_ACCESS_R | _SC_ACCESS_W | _SC_ACCESS_X, 0);
+		(void)dir_access_err;
+		
+		//Try to create the file first.
+		//This will fail if it already exists, but we'll then try to open it.
+		//If we tried to open the existing file first, we would have a race-condition with someone else also trying that.
+		
 		//If they didn't specify a type of file, default to a "regular file" mode.
 		if((mode & S_IFMT) == 0)
 			mode |= S_IFREG;
 		
 		create_result = _sc_make(work_fd, path, mode & ~_umask_get(), 0);
+		
+		//If we didn't create the file, and don't want only to create the file, try getting the existing one.
+		if((create_result < 0) && !(flags & O_EXCL))
+		{
+			find_result = _sc_find(work_fd, path);
+		}
+		
+		//Whether successful or not, we're done with the directory.
+		_sc_close(work_fd);
+		work_fd = -1;
 	}
 	
-	//If we didn't create the file (or didn't try), and don't want only to create the file, try getting the existing one.
-	int find_result = -ENOSYS;
-	if((create_result < 0) && !((flags & O_CREAT) && (flags & O_EXCL)))
-	{
-		find_result = _sc_find(work_fd, path);
-	}
-	
-	//Whether successful or not, we're done with the directory.
-	_sc_close(work_fd);
-	work_fd = -1;
-
 	if(create_result < 0 && find_result < 0)
 	{
 		if(create_result != -ENOSYS)
@@ -246,6 +184,10 @@ int _openatm(int fd, const char *path, int flags, mode_t mode)
 	//This is the opposite of the conventional behavior. Set keep-through-exec unless asked for close-on-exec.
 	if((fd_ret >= 0) && !(flags & O_CLOEXEC))
 		_sc_flag(fd_ret, _SC_FLAG_KEEPEXEC, 0);
+	
+	//The kernel also returns EAGAIN rather than waiting, unless asked to wait. Ask, unless we were asked not to.
+	if((fd_ret >= 0) && !(flags & O_NONBLOCK))
+		_sc_flag(fd_ret, _SC_FLAG_BLOCK, 0);
 			
 	int access_desired = 0;
 	if(flags & O_RDONLY)
@@ -307,43 +249,36 @@ int openat(int fd, const char *path, int flags, ...)
 
 ssize_t write(int fd, const void *buf, size_t nbytes)
 {
-	//Kernel doesn't handle blocking on write. Try as long as it says so.
-	//Todo - nonblocking if the user asks for it.
-	while(1)
+	//Kernel waits for room itself, unless the descriptor was made nonblocking.
+	ssize_t result = _sc_write(fd, buf, nbytes);
+	if(result < 0)
 	{
-		ssize_t result = _sc_write(fd, buf, nbytes);
-		if(result == -EAGAIN)
-		{
-			_sc_pause();
-			continue;
-		}
-		if(result < 0)
-		{
-			errno = -result;
-			return -1;
-		}
-		return result;
+		errno = -result;
+		return -1;
 	}
+	return result;
 }
 
 ssize_t read(int fd, void *buf, size_t nbytes)
 {
 	//Similar to synchronization of write.
-	while(1)
+	ssize_t result = _sc_read(fd, buf, nbytes);
+	if(result < 0)
 	{
-		ssize_t result = _sc_read(fd, buf, nbytes);
-		if(result == -EAGAIN)
-		{
-			_sc_pause();
-			continue;
-		}
-		if(result < 0)
-		{
-			errno = -result;
-			return -1;
-		}
-		return result;
+		errno = -result;
+		return -1;
 	}
+	return result;
+}
+
+//Returns the kernel's blocking flag on the given descriptor, to carry over to duplicates of it.
+static int _fd_block(int fd)
+{
+	int k_flags = _sc_flag(fd, 0, 0);
+	if(k_flags < 0)
+		return 0;
+	
+	return k_flags & _SC_FLAG_BLOCK;
 }
 
 
@@ -355,7 +290,7 @@ int dup(int oldfd)
 		errno = -result;
 		return -1;
 	}
-	_sc_flag(result, _SC_FLAG_KEEPEXEC, 0);
+	_sc_flag(result, _SC_FLAG_KEEPEXEC | _fd_block(oldfd), 0);
 	return result;
 }
 
@@ -368,7 +303,7 @@ int dup2(int oldfd, int newfd)
 		return -1;
 	}
 	assert(result == newfd);
-	_sc_flag(result, _SC_FLAG_KEEPEXEC, 0);
+	_sc_flag(result, _SC_FLAG_KEEPEXEC | _fd_block(oldfd), 0);
 	return result;
 }
 
@@ -385,6 +320,7 @@ int fcntl(int fd, int cmd, ...)
 		case F_SETFD:		
 		case F_SETFL:	
 		case F_SETOWN:			
+		case F_SETPIPE_SZ:
 			va_start(ap, cmd);
 			arg_int = va_arg(ap, int);
 			va_end(ap);
@@ -401,6 +337,7 @@ int fcntl(int fd, int cmd, ...)
 		case F_GETOWN:
 		case F_GETFL:
 		case F_GETFD:
+		case F_GETPIPE_SZ:
 			break;
 		
 		default:
@@ -420,7 +357,7 @@ int fcntl(int fd, int cmd, ...)
 				return -1;
 			}
 			//Set keep-through-exec flag if we weren't asked to close-on-exec.
-			_sc_flag(result, _SC_FLAG_KEEPEXEC, 0);
+			_sc_flag(result, _SC_FLAG_KEEPEXEC | _fd_block(fd), 0);
 			return result;
 		}
 		case F_DUPFD_CLOEXEC:
@@ -432,6 +369,7 @@ int fcntl(int fd, int cmd, ...)
 				return -1;
 			}
 			//Asked to close-on-exec - don't set keep-through-exec flag.
+			_sc_flag(dup_result, _fd_block(fd), 0);
 			return dup_result;
 		}
 		case F_GETFD:
@@ -463,6 +401,68 @@ int fcntl(int fd, int cmd, ...)
 			}
 			return result;
 		}
+		case F_GETFL:
+		{
+			int k_flags = _sc_flag(fd, 0, 0);
+			if(k_flags < 0)
+			{
+				errno = -k_flags;
+				return -1;
+			}
+			
+			int k_access = _sc_access(fd, 0, 0);
+			if(k_access < 0)
+			{
+				errno = -k_access;
+				return -1;
+			}
+			
+			int result = 0;
+			if(k_access & _SC_ACCESS_R)
+				result |= O_RDONLY;
+			if(k_access & _SC_ACCESS_W)
+				result |= O_WRONLY;
+			if(!(k_flags & _SC_FLAG_BLOCK))
+				result |= O_NONBLOCK;
+			
+			return result;
+		}
+		case F_SETFL:
+		{
+			//Only nonblocking-ness can be changed on an open file.
+			int result = 0;
+			if(arg_int & O_NONBLOCK)
+				result = _sc_flag(fd, 0, _SC_FLAG_BLOCK);
+			else
+				result = _sc_flag(fd, _SC_FLAG_BLOCK, 0);
+			
+			if(result < 0)
+			{
+				errno = -result;
+				return -1;
+			}
+			return 0;
+		}
+		case F_GETPIPE_SZ:
+		{
+			int result = _sc_ioctl(fd, _SC_IOCTL_GETPIPESZ, NULL, 0);
+			if(result < 0)
+			{
+				errno = -result;
+				return -1;
+			}
+			return result;
+		}
+		case F_SETPIPE_SZ:
+		{
+			int result = _sc_ioctl(fd, _SC_IOCTL_SETPIPESZ, &arg_int, sizeof(arg_int));
+			if(result < 0)
+			{
+				errno = -result;
+				return -1;
+			}
+			return result;
+		}
 		default:
 			(void)arg_ptr;
 			errno = -EINVAL;
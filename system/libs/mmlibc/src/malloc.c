@@ -46,6 +46,12 @@ typedef struct _malloc_used_item_s
 //Magic number stored in used-item bookkeeping.
 #define MALLOC_USED_MAGIC 0x737564656d5f6d65 //used_mem
 
+//Free regions with at least this much page-aligned space in them are given back to the kernel.
+#define MALLOC_RELEASE_MIN (256*1024)
+
+//Alignment of space given back to the kernel - a multiple of the page size on any machine we support.
+#define MALLOC_RELEASE_ALIGN 65536
+
 //Returns the user-visible pointer for the given used-item bookkeeping.
 static void *_malloc_userptr_for_item(_malloc_used_item_t *item)
 {
@@ -79,6 +85,39 @@ static void _malloc_unlock(void)
 	_spl_unlock(&_malloc_spl);
 }
 
+//Gives the whole pages in a free region back to the kernel, if there are enough of them to bother.
+static void _malloc_release(_malloc_free_item_t *item)
+{
+	uintptr_t region_addr = item->addr_item.id;
+	uintptr_t region_end = region_addr + item->size_item.id;
+	
+	//The free-region bookkeeping at the beginning stays, and anything left at the end needs room for its own.
+	uintptr_t release_start = region_addr + sizeof(_malloc_free_item_t);
+	release_start += (MALLOC_RELEASE_ALIGN - (release_start % MALLOC_RELEASE_ALIGN)) % MALLOC_RELEASE_ALIGN;
+	uintptr_t release_end = region_end - (region_end % MALLOC_RELEASE_ALIGN);
+	if(region_end > release_end && region_end - release_end < sizeof(_malloc_free_item_t))
+		release_end -= MALLOC_RELEASE_ALIGN;
+	
+	if(release_end <= release_start || release_end - release_start < MALLOC_RELEASE_MIN)
+		return;
+	
+	if(_sc_mem_free(release_start, release_end - release_start) < 0)
+		return;
+	
+	//Shrink the region to what's before the released space
+	_rb_remove(&_malloc_size_tree, &(item->size_item));
+	_rb_insert(&_malloc_size_tree, &(item->size_item), release_start - region_addr, item);
+	
+	//Make a new region for whatever's left after it
+	if(region_end > release_end)
+	{
+		_malloc_free_item_t *tail_item = (_malloc_free_item_t*)(release_end);
+		memset(tail_item, 0, sizeof(*tail_item));
+		_rb_insert(&_malloc_addr_tree, &(tail_item->addr_item), release_end, tail_item);
+		_rb_insert(&_malloc_size_tree, &(tail_item->size_item), region_end - release_end, tail_item);
+	}
+}
+
 void *malloc(size_t size)
 {	
 	_malloc_lock();
@@ -227,7 +266,9 @@ void free(void *addr)
 	uintptr_t freeing_addr = (uintptr_t)(item_ptr);
 	
 	//For security, poison the whole region being freed.
-	memset((void*)freeing_addr, 0xBA, freeing_size);
+	//Large regions are mostly given back to the kernel instead - don't touch pages that might never have been.
+	if(freeing_size < MALLOC_RELEASE_MIN)
+		memset((void*)freeing_addr, 0xBA, freeing_size);
 	
 	//Make a new free-region bookkeeping structure for the region freed.
 	//(We never allocate less space than it takes to hold this bookkeeping.)
@@ -240,7 +281,6 @@ void free(void *addr)
 	
 	//We may have freed a region that is adjacent to another free region.
 	//Coalesce free regions that are adjacent in memory, representing a larger region that is all free.
-	/*
 	while(1)
 	{
 		//See if the freed range has a previous range that touches it.
@@ -305,7 +345,10 @@ void free(void *addr)
 		
 		//If we weren't able to coalesce any regions, stop looking.
 		break;
-	}*/
+	}
+	
+	//If that made a big enough free region, give back what we can.
+	_malloc_release(free_item);
 	
 	_malloc_unlock();
 }
@@ -0,0 +1,62 @@
+//mman.c
+//Memory mapping in libc
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sc.h>
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
+{
+	if(len == 0 || !((flags & MAP_SHARED) || (flags & MAP_PRIVATE)))
+	{
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	
+	//Shared mappings can't change the file - writable ones are always private copies.
+	if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !(flags & MAP_ANONYMOUS))
+	{
+		errno = ENOTSUP;
+		return MAP_FAILED;
+	}
+	
+	//Put it where asked if it's fixed, or else wherever there's room near there
+	intptr_t where = (intptr_t)addr;
+	if(!(flags & MAP_FIXED))
+	{
+		where = _sc_mem_avail((intptr_t)addr, len);
+		if(where < 0)
+		{
+			errno = -where;
+			return MAP_FAILED;
+		}
+	}
+	
+	int err = 0;
+	if(flags & MAP_ANONYMOUS)
+		err = _sc_mem_anon(where, len, prot);
+	else
+		err = _sc_mem_file(where, len, prot, fildes, off);
+	
+	if(err < 0)
+	{
+		errno = -err;
+		return MAP_FAILED;
+	}
+	
+	return (void*)where;
+}
+
+int munmap(void *addr, size_t len)
+{
+	int err = _sc_mem_free((uintptr_t)addr, len);
+	if(err < 0)
+	{
+		errno = -err;
+		return -1;
+	}
+	
+	return 0;
+}
@@ -40,7 +40,7 @@ int pipe2(int fildes[2], int flags)
 		break;
 	}
 	
-	//Open a second file descriptor and set its close-on-exec flag appropriately
+	//Open a second file descriptor and set its close-on-exec and nonblocking flags appropriately
 	fildes[1] = _sc_find(fildes[0], "");
 	if(fildes[1] < 0)
 	{
@@ -48,12 +48,18 @@ int pipe2(int fildes[2], int flags)
 		goto failure;
 	}
 	
+	int fd_flags = 0;
 	if(!(flags & O_CLOEXEC))
+		fd_flags |= _SC_FLAG_KEEPEXEC;
+	if(!(flags & O_NONBLOCK))
+		fd_flags |= _SC_FLAG_BLOCK;
+	
+	if(fd_flags != 0)
 	{
-		int keep_err = _sc_flag(fildes[1], _SC_FLAG_KEEPEXEC, 0);
-		if(keep_err < 0)
+		int flag_err = _sc_flag(fildes[1], fd_flags, 0);
+		if(flag_err < 0)
 		{
-			errno = -keep_err;
+			errno = -flag_err;
 			goto failure;
 		}
 	}
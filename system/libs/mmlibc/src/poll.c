@@ -0,0 +1,57 @@
+//poll.c
+//Polling file descriptors in libc
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include <poll.h>
+#include <errno.h>
+#include <sc.h>
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout)
+{
+	//Kernel only looks at so many at once
+	if(nfds > _SC_POLL_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	
+	_sc_poll_t kfds[_SC_POLL_MAX];
+	for(nfds_t ff = 0; ff < nfds; ff++)
+	{
+		//Negative descriptors are skipped - don't let them alias the console.
+		kfds[ff].fd = (fds[ff].fd >= 0) ? fds[ff].fd : -1;
+		kfds[ff].events = 0;
+		kfds[ff].revents = 0;
+		
+		if(fds[ff].events & (POLLIN | POLLRDNORM))
+			kfds[ff].events |= _SC_POLL_IN;
+		if(fds[ff].events & (POLLOUT | POLLWRNORM))
+			kfds[ff].events |= _SC_POLL_OUT;
+	}
+	
+	//Kernel takes nanoseconds
+	int64_t timeout_ns = (timeout < 0) ? -1 : (int64_t)timeout * 1000000;
+	int result = _sc_poll(kfds, nfds, timeout_ns);
+	if(result < 0)
+	{
+		errno = -result;
+		return -1;
+	}
+	
+	for(nfds_t ff = 0; ff < nfds; ff++)
+	{
+		fds[ff].revents = 0;
+		if(kfds[ff].revents & _SC_POLL_IN)
+			fds[ff].revents |= fds[ff].events & (POLLIN | POLLRDNORM);
+		if(kfds[ff].revents & _SC_POLL_OUT)
+			fds[ff].revents |= fds[ff].events & (POLLOUT | POLLWRNORM);
+		if(kfds[ff].revents & _SC_POLL_ERR)
+			fds[ff].revents |= POLLERR;
+		if(kfds[ff].revents & _SC_POLL_HUP)
+			fds[ff].revents |= POLLHUP;
+		if(kfds[ff].revents & _SC_POLL_NVAL)
+			fds[ff].revents |= POLLNVAL;
+	}
+	
+	return result;
+}
@@ -6,11 +6,45 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sc.h>
 
 char buf[4096];
 
+//Has the kernel move the data straight across, if it can for these files, rather than copying it through our buffer.
+//Returns false if the rest has to be copied instead - what was spliced so far stays in order ahead of it.
+bool do_splice(int fd)
+{
+	while(1)
+	{
+		ssize_t nspliced = _sc_splice(fd, STDOUT_FILENO, 64 * 1024);
+		if(nspliced == 0 || nspliced == -EPIPE)
+		{
+			//Done, or nobody left on the other end
+			return true;
+		}
+		
+		if(nspliced == -EINVAL || nspliced == -ENOSYS || nspliced == -EAGAIN)
+		{
+			//Neither is a pipe, one is something we can't splice, or one won't wait in the kernel
+			return false;
+		}
+		
+		if(nspliced < 0)
+		{
+			errno = -nspliced;
+			perror("splice");
+			exit(-1);
+		}
+	}
+}
+
 void do_fd(int fd)
 {
+	if(do_splice(fd))
+		return;
+	
 	while(1)
 	{
 		ssize_t nread = read(fd, buf, sizeof(buf));
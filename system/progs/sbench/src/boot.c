@@ -0,0 +1,29 @@
+//boot.c
+//Report of how long the kernel took to boot and unpack the system image, raw or compressed
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <sc.h>
+
+int sbench_boot(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	
+	_sc_fsinfo_t info = {0};
+	ssize_t result = _sc_fsinfo(&info, sizeof(info));
+	if(result < 0)
+	{
+		printf("sbench: _sc_fsinfo failed (%zd)\n", result);
+		return -1;
+	}
+	
+	printf("boot init_cycles=%lld unpack_cycles=%lld\n", (long long)info.boot_tsc, (long long)info.image_tsc);
+	printf("image size=%zu unpacked=%zu adopted=%zu kept=%zu\n", info.image_size, info.image_unpacked, info.image_adopted, info.image_kept);
+	
+	//The image is compressed if it unpacked into more than was linked in
+	if(info.image_unpacked > info.image_size)
+		printf("image compressed ratio=%zu%%\n", 100 * info.image_size / info.image_unpacked);
+	return 0;
+}
@@ -0,0 +1,97 @@
+//dcache.c
+//Report of the kernel's lookup cache, and a benchmark of probing PATH for commands
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sc.h>
+
+//Prints the lookup cache counters, less those in "since" if given.
+static void dcache_print(const _sc_fsinfo_t *info, const _sc_fsinfo_t *since)
+{
+	_sc_fsinfo_t zero = {0};
+	if(since == NULL)
+		since = &zero;
+	
+	unsigned long long hits = info->dcache_hits - since->dcache_hits;
+	unsigned long long neghits = info->dcache_neghits - since->dcache_neghits;
+	unsigned long long misses = info->dcache_misses - since->dcache_misses;
+	unsigned long long total = hits + neghits + misses;
+	
+	printf("dcache size=%zu hits=%llu neghits=%llu misses=%llu hitrate=%llu%%\n", info->dcache_size,
+		hits, neghits, misses, (total > 0) ? (100 * (hits + neghits) / total) : 0);
+}
+
+int sbench_dcache(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	
+	_sc_fsinfo_t info = {0};
+	ssize_t result = _sc_fsinfo(&info, sizeof(info));
+	if(result < 0)
+	{
+		printf("sbench: _sc_fsinfo failed (%zd)\n", result);
+		return -1;
+	}
+	
+	dcache_print(&info, NULL);
+	return 0;
+}
+
+int sbench_pathprobe(int argc, char **argv)
+{
+	int rounds = 1000;
+	if(argc >= 2)
+		rounds = atoi(argv[1]);
+	
+	const char *path = getenv("PATH");
+	if(path == NULL || path[0] == '\0')
+		path = "/bin";
+	
+	_sc_fsinfo_t before = {0};
+	_sc_fsinfo(&before, sizeof(before));
+	
+	//Look for a command that isn't anywhere, like a shell does before saying "not found".
+	int64_t total = 0;
+	int64_t worst = 0;
+	for(int rr = 0; rr < rounds; rr++)
+	{
+		int64_t start = sbench_now();
+		
+		const char *dir = path;
+		while(*dir != '\0')
+		{
+			size_t dirlen = strcspn(dir, ":");
+			
+			char probe[256];
+			snprintf(probe, sizeof(probe), "%.*s/sbench-nonexistent", (int)dirlen, dir);
+			
+			struct stat st;
+			if(stat(probe, &st) == 0)
+			{
+				printf("sbench: %s exists\n", probe);
+				return -1;
+			}
+			
+			dir += dirlen;
+			if(*dir == ':')
+				dir++;
+		}
+		
+		int64_t elapsed = sbench_now() - start;
+		total += elapsed;
+		if(elapsed > worst)
+			worst = elapsed;
+	}
+	
+	_sc_fsinfo_t after = {0};
+	_sc_fsinfo(&after, sizeof(after));
+	
+	sbench_report("pathprobe", path, rounds, total, worst);
+	dcache_print(&after, &before);
+	return 0;
+}
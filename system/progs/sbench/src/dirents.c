@@ -0,0 +1,115 @@
+//dirents.c
+//Benchmark of creating, finding, and removing many files in one directory
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+//Phases of the benchmark, each run over every file in turn
+typedef enum dirents_phase_e
+{
+	DIRENTS_CREATE,
+	DIRENTS_LOOKUP,
+	DIRENTS_MISS,
+	DIRENTS_UNLINK,
+	DIRENTS_PHASE_MAX
+} dirents_phase_t;
+
+static const char *dirents_phase_names[DIRENTS_PHASE_MAX] = { "create", "lookup", "miss", "unlink" };
+
+//Does one phase of the benchmark on one file - or on a name that isn't there, for misses. Returns 0 on success or -1 on failure.
+static int dirents_op(dirents_phase_t phase, const char *path)
+{
+	switch(phase)
+	{
+		case DIRENTS_CREATE:
+		{
+			int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if(fd < 0)
+				return -1;
+			
+			close(fd);
+			return 0;
+		}
+		case DIRENTS_LOOKUP:
+		{
+			struct stat st;
+			return stat(path, &st);
+		}
+		case DIRENTS_MISS:
+		{
+			//Names that aren't there have to come back ENOENT, from lookup and from unlink.
+			struct stat st;
+			if(stat(path, &st) == 0 || errno != ENOENT)
+				return -1;
+			
+			if(unlink(path) == 0 || errno != ENOENT)
+				return -1;
+			
+			return 0;
+		}
+		case DIRENTS_UNLINK:
+		{
+			return unlink(path);
+		}
+		default:
+			return -1;
+	}
+}
+
+int sbench_dirents(int argc, char **argv)
+{
+	int nfiles = 10000;
+	if(argc >= 2)
+		nfiles = atoi(argv[1]);
+	
+	const char *dir = "/sbench.dirents";
+	if(argc >= 3)
+		dir = argv[2];
+	
+	if(mkdir(dir, 0755) < 0)
+	{
+		perror(dir);
+		return -1;
+	}
+	
+	for(int pp = 0; pp < DIRENTS_PHASE_MAX; pp++)
+	{
+		int64_t total = 0;
+		int64_t worst = 0;
+		for(int ff = 0; ff < nfiles; ff++)
+		{
+			char path[256];
+			snprintf(path, sizeof(path), "%s/%c%d", dir, (pp == DIRENTS_MISS) ? 'm' : 'f', ff);
+			
+			int64_t start = sbench_now();
+			if(dirents_op(pp, path) < 0)
+			{
+				perror(path);
+				return -1;
+			}
+			
+			int64_t elapsed = sbench_now() - start;
+			total += elapsed;
+			if(elapsed > worst)
+				worst = elapsed;
+		}
+		
+		char param[32];
+		snprintf(param, sizeof(param), "%s/%d", dirents_phase_names[pp], nfiles);
+		sbench_report("dirents", param, nfiles, total, worst);
+	}
+	
+	if(rmdir(dir) < 0)
+	{
+		perror(dir);
+		return -1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,214 @@
+//fileio.c
+//Benchmarks of file storage - space used by small files, sequential bandwidth of large ones, and mapping files
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sc.h>
+
+//Returns the number of blocks in use in the filesystem, or -1 on failure.
+static int64_t fileio_blocks_used(void)
+{
+	_sc_fsinfo_t info = {0};
+	if(_sc_fsinfo(&info, sizeof(info)) < 0)
+		return -1;
+	
+	return info.blocks - info.blocks_free;
+}
+
+int sbench_smallfiles(int argc, char **argv)
+{
+	int nfiles = 1000;
+	if(argc >= 2)
+		nfiles = atoi(argv[1]);
+	
+	int fsize = 20;
+	if(argc >= 3)
+		fsize = atoi(argv[2]);
+	
+	const char *dir = "/sbench.smallfiles";
+	if(mkdir(dir, 0755) < 0)
+	{
+		perror(dir);
+		return -1;
+	}
+	
+	char contents[4096];
+	memset(contents, 'x', sizeof(contents));
+	if(fsize > (int)sizeof(contents))
+		fsize = sizeof(contents);
+	
+	int64_t used_before = fileio_blocks_used();
+	for(int ff = 0; ff < nfiles; ff++)
+	{
+		char path[256];
+		snprintf(path, sizeof(path), "%s/f%d", dir, ff);
+		int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if(fd < 0 || write(fd, contents, fsize) != fsize)
+		{
+			perror(path);
+			return -1;
+		}
+		close(fd);
+	}
+	int64_t used_after = fileio_blocks_used();
+	
+	printf("smallfiles n=%d size=%d blocks=%lld blocks/file=%lld.%02lld\n", nfiles, fsize, (long long)(used_after - used_before),
+		(long long)((used_after - used_before) / nfiles), (long long)(((used_after - used_before) * 100 / nfiles) % 100));
+	
+	for(int ff = 0; ff < nfiles; ff++)
+	{
+		char path[256];
+		snprintf(path, sizeof(path), "%s/f%d", dir, ff);
+		unlink(path);
+	}
+	
+	if(rmdir(dir) < 0)
+	{
+		perror(dir);
+		return -1;
+	}
+	
+	return 0;
+}
+
+int sbench_seqread(int argc, char **argv)
+{
+	int megs = 16;
+	if(argc >= 2)
+		megs = atoi(argv[1]);
+	
+	int chunk = 64 * 1024;
+	if(argc >= 3)
+		chunk = atoi(argv[2]);
+	
+	char *buf = malloc(chunk);
+	if(buf == NULL)
+	{
+		perror("malloc");
+		return -1;
+	}
+	memset(buf, 0x5A, chunk);
+	
+	const char *path = "/sbench.seqread";
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	
+	//Write the file sequentially, then read it back the same way, a few times.
+	int64_t nchunks = ((int64_t)megs * 1024 * 1024) / chunk;
+	int64_t wstart = sbench_now();
+	for(int64_t cc = 0; cc < nchunks; cc++)
+	{
+		if(write(fd, buf, chunk) != chunk)
+		{
+			perror(path);
+			return -1;
+		}
+	}
+	sbench_report("seqread", "write", nchunks, sbench_now() - wstart, 0);
+	
+	int64_t total = 0;
+	int64_t worst = 0;
+	int passes = 8;
+	for(int pp = 0; pp < passes; pp++)
+	{
+		lseek(fd, 0, SEEK_SET);
+		int64_t start = sbench_now();
+		for(int64_t cc = 0; cc < nchunks; cc++)
+		{
+			if(read(fd, buf, chunk) != chunk)
+			{
+				perror(path);
+				return -1;
+			}
+		}
+		
+		int64_t elapsed = sbench_now() - start;
+		total += elapsed;
+		if(elapsed > worst)
+			worst = elapsed;
+	}
+	
+	char param[32];
+	snprintf(param, sizeof(param), "read/%dM", megs);
+	sbench_report("seqread", param, passes, total, worst);
+	
+	close(fd);
+	unlink(path);
+	free(buf);
+	return 0;
+}
+
+int sbench_mapfile(int argc, char **argv)
+{
+	const char *path = "/bin/sbench";
+	if(argc >= 2)
+		path = argv[1];
+	
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size <= 0)
+	{
+		perror(path);
+		return -1;
+	}
+	
+	//Read the whole file into allocated memory, like a program loading its data
+	int64_t rstart = sbench_now();
+	unsigned char *copy = malloc(st.st_size);
+	if(copy == NULL || read(fd, copy, st.st_size) != st.st_size)
+	{
+		perror(path);
+		return -1;
+	}
+	
+	unsigned long long rsum = 0;
+	for(off_t bb = 0; bb < st.st_size; bb += 4096)
+	{
+		rsum += copy[bb];
+	}
+	sbench_report("mapfile", "read", 1, sbench_now() - rstart, 0);
+	free(copy);
+	
+	//Map it instead, and touch every page
+	int64_t mstart = sbench_now();
+	unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+	
+	unsigned long long msum = 0;
+	for(off_t bb = 0; bb < st.st_size; bb += 4096)
+	{
+		msum += map[bb];
+	}
+	sbench_report("mapfile", "mmap", 1, sbench_now() - mstart, 0);
+	
+	if(msum != rsum)
+	{
+		printf("sbench: mapped contents differ from read contents\n");
+		return -1;
+	}
+	
+	munmap(map, st.st_size);
+	close(fd);
+	return 0;
+}
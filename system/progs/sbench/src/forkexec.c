@@ -0,0 +1,77 @@
+//forkexec.c
+//Benchmark of fork+exec latency
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+//Sizes of memory touched in the parent before forking
+static const size_t forkexec_sizes[] = { 0, 1024*1024, 8*1024*1024, 32*1024*1024 };
+
+int sbench_forkexec(int argc, char **argv)
+{
+	int iterations = 50;
+	if(argc >= 2)
+		iterations = atoi(argv[1]);
+	
+	for(size_t ss = 0; ss < sizeof(forkexec_sizes) / sizeof(forkexec_sizes[0]); ss++)
+	{
+		//Dirty some memory, so the parent has something that fork has to deal with
+		char *mem = NULL;
+		if(forkexec_sizes[ss] > 0)
+		{
+			mem = malloc(forkexec_sizes[ss]);
+			if(mem == NULL)
+			{
+				perror("malloc");
+				return -1;
+			}
+			memset(mem, 0x55, forkexec_sizes[ss]);
+		}
+		
+		int64_t total = 0;
+		int64_t worst = 0;
+		for(int ii = 0; ii < iterations; ii++)
+		{
+			int64_t start = sbench_now();
+			
+			pid_t pid = fork();
+			if(pid < 0)
+			{
+				perror("fork");
+				return -1;
+			}
+			
+			if(pid == 0)
+			{
+				char *child_argv[] = { "sbench", "-x", NULL };
+				execv("/bin/sbench", child_argv);
+				_exit(-1);
+			}
+			
+			int wstatus = 0;
+			if(waitpid(pid, &wstatus, 0) != pid)
+			{
+				perror("waitpid");
+				return -1;
+			}
+			
+			int64_t elapsed = sbench_now() - start;
+			total += elapsed;
+			if(elapsed > worst)
+				worst = elapsed;
+		}
+		
+		char param[32];
+		snprintf(param, sizeof(param), "%zuK", forkexec_sizes[ss] / 1024);
+		sbench_report("forkexec", param, iterations, total, worst);
+		
+		free(mem);
+	}
+	
+	return 0;
+}
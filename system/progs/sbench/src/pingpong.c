@@ -0,0 +1,108 @@
+//pingpong.c
+//Benchmark of pipe round-trip latency between two processes
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sc.h>
+
+//Reads or writes one byte, retrying from userspace like we used to, if the descriptor doesn't block.
+static int pingpong_xfer(int fd, char *byte, bool wr)
+{
+	while(1)
+	{
+		ssize_t result = wr ? _sc_write(fd, byte, 1) : _sc_read(fd, byte, 1);
+		if(result == -EAGAIN)
+		{
+			_sc_pause();
+			continue;
+		}
+		return (result == 1) ? 0 : -1;
+	}
+}
+
+//Bounces a byte back and forth with a child process, with the pipes opened using the given flags.
+static int pingpong_run(const char *param, int pipeflags, int iterations)
+{
+	int to_child[2];
+	int to_parent[2];
+	if(pipe2(to_child, pipeflags) < 0 || pipe2(to_parent, pipeflags) < 0)
+	{
+		perror("pipe");
+		return -1;
+	}
+	
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		perror("fork");
+		return -1;
+	}
+	
+	if(pid == 0)
+	{
+		//Child echoes each byte until the parent closes its end.
+		close(to_child[1]);
+		close(to_parent[0]);
+		char byte = 0;
+		while(pingpong_xfer(to_child[0], &byte, false) == 0)
+		{
+			if(pingpong_xfer(to_parent[1], &byte, true) < 0)
+				break;
+		}
+		_exit(0);
+	}
+	
+	close(to_child[0]);
+	close(to_parent[1]);
+	
+	int64_t total = 0;
+	int64_t worst = 0;
+	for(int ii = 0; ii < iterations; ii++)
+	{
+		char byte = (char)ii;
+		int64_t start = sbench_now();
+		
+		if(pingpong_xfer(to_child[1], &byte, true) < 0 || pingpong_xfer(to_parent[0], &byte, false) < 0)
+		{
+			perror("pingpong");
+			return -1;
+		}
+		
+		int64_t elapsed = sbench_now() - start;
+		total += elapsed;
+		if(elapsed > worst)
+			worst = elapsed;
+	}
+	
+	close(to_child[1]);
+	close(to_parent[0]);
+	
+	int wstatus = 0;
+	waitpid(pid, &wstatus, 0);
+	
+	sbench_report("pingpong", param, iterations, total, worst);
+	return 0;
+}
+
+int sbench_pingpong(int argc, char **argv)
+{
+	int iterations = 1000;
+	if(argc >= 2)
+		iterations = atoi(argv[1]);
+	
+	//Sleeping in the kernel, versus getting EAGAIN and pausing from userspace
+	if(pingpong_run("block", 0, iterations) < 0)
+		return -1;
+	
+	if(pingpong_run("retry", O_NONBLOCK, iterations) < 0)
+		return -1;
+	
+	return 0;
+}
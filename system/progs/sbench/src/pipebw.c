@@ -0,0 +1,94 @@
+//pipebw.c
+//Benchmark of bulk pipe throughput between two processes
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+//Limits on the pipe's buffer to try, with 0 leaving the default
+static const int pipebw_sizes[] = { 4096, 0, 1024*1024 };
+
+int sbench_pipebw(int argc, char **argv)
+{
+	int megs = 16;
+	if(argc >= 2)
+		megs = atoi(argv[1]);
+	
+	const size_t chunk = 64 * 1024;
+	char *buf = malloc(chunk);
+	if(buf == NULL)
+	{
+		perror("malloc");
+		return -1;
+	}
+	
+	for(size_t ss = 0; ss < sizeof(pipebw_sizes) / sizeof(pipebw_sizes[0]); ss++)
+	{
+		int fds[2];
+		if(pipe(fds) < 0)
+		{
+			perror("pipe");
+			return -1;
+		}
+		
+		if(pipebw_sizes[ss] != 0 && fcntl(fds[1], F_SETPIPE_SZ, pipebw_sizes[ss]) < 0)
+		{
+			perror("F_SETPIPE_SZ");
+			return -1;
+		}
+		
+		int limit = fcntl(fds[0], F_GETPIPE_SZ);
+		int64_t start = sbench_now();
+		
+		pid_t pid = fork();
+		if(pid < 0)
+		{
+			perror("fork");
+			return -1;
+		}
+		
+		if(pid == 0)
+		{
+			//Child writes the data in big chunks, like cat would.
+			//Writes can come up short, so count only what went in and retry the rest.
+			close(fds[0]);
+			int64_t left = (int64_t)megs * 1024 * 1024;
+			while(left > 0)
+			{
+				size_t towrite = ((int64_t)chunk < left) ? chunk : (size_t)left;
+				ssize_t written = write(fds[1], buf, towrite);
+				if(written <= 0)
+					_exit(-1);
+				
+				left -= written;
+			}
+			_exit(0);
+		}
+		
+		close(fds[1]);
+		
+		//Read until the child is done and the pipe runs dry
+		while(1)
+		{
+			if(read(fds[0], buf, chunk) <= 0)
+				break;
+		}
+		
+		close(fds[0]);
+		
+		int wstatus = 0;
+		waitpid(pid, &wstatus, 0);
+		
+		//Report time per megabyte
+		char param[32];
+		snprintf(param, sizeof(param), "%dK", limit / 1024);
+		sbench_report("pipebw", param, megs, sbench_now() - start, 0);
+	}
+	
+	free(buf);
+	return 0;
+}
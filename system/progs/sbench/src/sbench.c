@@ -0,0 +1,78 @@
+//sbench.c
+//Benchmarks for kernel performance work
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sc.h>
+
+//Table of benchmarks we know how to run
+typedef struct sbench_test_s
+{
+	const char *name;
+	int (*func)(int argc, char **argv);
+	const char *desc;
+} sbench_test_t;
+
+static const sbench_test_t sbench_tests[] = 
+{
+	{ "forkexec", sbench_forkexec, "fork+exec+wait latency, with various amounts of memory in the parent" },
+	{ "slabs",    sbench_slabs,    "usage counters of kernel object caches" },
+	{ "dirents",  sbench_dirents,  "create, lookup, missed lookup, and unlink of many files in one directory" },
+	{ "dcache",   sbench_dcache,   "hit and miss counters of the kernel's lookup cache" },
+	{ "pathprobe", sbench_pathprobe, "looking for a missing command in every PATH directory" },
+	{ "smallfiles", sbench_smallfiles, "filesystem blocks used by many small files" },
+	{ "seqread",  sbench_seqread,  "sequential write and read bandwidth of one large file" },
+	{ "mapfile",  sbench_mapfile,  "reading a whole file into memory versus mapping it" },
+	{ "boot",     sbench_boot,     "cycles taken to boot and unpack the system image" },
+	{ "pingpong", sbench_pingpong, "round-trip latency of a byte bounced between two processes over pipes" },
+	{ "pipebw",   sbench_pipebw,   "time per megabyte streamed through a pipe, with various buffer limits" },
+	{ NULL, NULL, NULL }
+};
+
+int64_t sbench_now(void)
+{
+	return _sc_getrtc();
+}
+
+void sbench_report(const char *test, const char *param, int64_t iterations, int64_t total, int64_t worst)
+{
+	if(iterations <= 0)
+		iterations = 1;
+	
+	printf("%-10s %-12s n=%-6lld mean=%-10lld worst=%-10lld\n", test, param, (long long)iterations, (long long)(total / iterations), (long long)worst);
+}
+
+static void sbench_usage(void)
+{
+	printf("usage: sbench <test> [args...]\n");
+	printf("times are in realtime-clock units\n");
+	for(int tt = 0; sbench_tests[tt].name != NULL; tt++)
+	{
+		printf("  %-10s %s\n", sbench_tests[tt].name, sbench_tests[tt].desc);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	//Used as a do-nothing child by benchmarks that exec us
+	if(argc >= 2 && strcmp(argv[1], "-x") == 0)
+		return 0;
+	
+	if(argc < 2)
+	{
+		sbench_usage();
+		return -1;
+	}
+	
+	for(int tt = 0; sbench_tests[tt].name != NULL; tt++)
+	{
+		if(strcmp(argv[1], sbench_tests[tt].name) == 0)
+			return (*(sbench_tests[tt].func))(argc - 1, argv + 1);
+	}
+	
+	sbench_usage();
+	return -1;
+}
@@ -0,0 +1,28 @@
+//sbench.h
+//Benchmarks for kernel performance work
+//Bryan E. Topp <betopp@betopp.com> 2021
+#ifndef SBENCH_H
+#define SBENCH_H
+
+#include <stdint.h>
+
+//Returns the current time, in units of the kernel's realtime clock.
+int64_t sbench_now(void);
+
+//Prints a result line for a benchmark.
+void sbench_report(const char *test, const char *param, int64_t iterations, int64_t total, int64_t worst);
+
+//Benchmarks, each run with the remaining command-line arguments.
+int sbench_forkexec(int argc, char **argv);
+int sbench_slabs(int argc, char **argv);
+int sbench_dirents(int argc, char **argv);
+int sbench_dcache(int argc, char **argv);
+int sbench_pathprobe(int argc, char **argv);
+int sbench_smallfiles(int argc, char **argv);
+int sbench_seqread(int argc, char **argv);
+int sbench_mapfile(int argc, char **argv);
+int sbench_boot(int argc, char **argv);
+int sbench_pingpong(int argc, char **argv);
+int sbench_pipebw(int argc, char **argv);
+
+#endif //SBENCH_H
@@ -0,0 +1,27 @@
+//slabs.c
+//Report of kernel object cache usage
+//Bryan E. Topp <betopp@betopp.com> 2021
+
+#include "sbench.h"
+#include <stdio.h>
+#include <sc.h>
+
+int sbench_slabs(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	
+	printf("%-10s %8s %8s %8s %8s %8s %10s %10s\n", "cache", "objsize", "pages", "total", "used", "cached", "refills", "flushes");
+	for(int ii = 0; ; ii++)
+	{
+		_sc_slabinfo_t info = {0};
+		ssize_t result = _sc_slabinfo(ii, &info, sizeof(info));
+		if(result < 0)
+			break;
+		
+		printf("%-10s %8zu %8zu %8zu %8zu %8zu %10llu %10llu\n", info.name, info.objsize, info.pages, info.total, info.used, info.cached,
+			(unsigned long long)info.refills, (unsigned long long)info.flushes);
+	}
+	
+	return 0;
+}
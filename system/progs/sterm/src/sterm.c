@@ -51,6 +51,9 @@ int32_t conswitch_pid = 0;
 //File descriptor for back of pseudoterminal - that we hold onto
 int pty_fd;
 
+//Another descriptor for the back of the pseudoterminal, that waits when writing - used for keyboard input
+int pty_wfd;
+
 //File descriptor for front of pseudoterminal - that we give to the shell
 int tty_fd;
 
@@ -292,6 +295,27 @@ static void coutc(int ch)
 }
 
 //Handles a keyboard input.
+//Sends keyboard input to the shell, waiting if the pseudoterminal is full.
+static void kbd_send(const void *buf, size_t len)
+{
+	const uint8_t *bytes = (const uint8_t*)buf;
+	while(len > 0)
+	{
+		ssize_t written = write(pty_wfd, bytes, len);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			
+			//Nobody to read it, so drop it
+			return;
+		}
+		
+		bytes += written;
+		len -= written;
+	}
+}
+
 void kbd(_sc_con_scancode_t scancode, bool press)
 {
 	//Check if a modifier key is being changed
@@ -333,26 +357,26 @@ void kbd(_sc_con_scancode_t scancode, bool press)
 					return;
 				}
 				
-				write(pty_fd, &ctrlchar, 1);
+				kbd_send(&ctrlchar, 1);
 			}
 		}
 		else
 		{
 			if(scancode == _SC_CON_SCANCODE_UP)
 			{
-				write(pty_fd, (uint8_t[]){0x1b, 0x5b, 0x41}, 3);
+				kbd_send((uint8_t[]){0x1b, 0x5b, 0x41}, 3);
 			}
 			else if(scancode == _SC_CON_SCANCODE_DOWN)
 			{
-				write(pty_fd, (uint8_t[]){0x1b, 0x5b, 0x42}, 3);
+				kbd_send((uint8_t[]){0x1b, 0x5b, 0x42}, 3);
 			}
 			else if(scancode == _SC_CON_SCANCODE_LEFT)
 			{
-				write(pty_fd, (uint8_t[]){0x1b, 0x5b, 0x44}, 3);
+				kbd_send((uint8_t[]){0x1b, 0x5b, 0x44}, 3);
 			}
 			else if(scancode == _SC_CON_SCANCODE_RIGHT)
 			{
-				write(pty_fd, (uint8_t[]){0x1b, 0x5b, 0x43}, 3);
+				kbd_send((uint8_t[]){0x1b, 0x5b, 0x43}, 3);
 			}
 			else
 			{
@@ -362,7 +386,7 @@ void kbd(_sc_con_scancode_t scancode, bool press)
 				
 				uint8_t keyval = keymap_usa[scancode][keymap_set];
 				if(keyval != 0)
-					write(pty_fd, &keyval, 1);
+					kbd_send(&keyval, 1);
 			}
 		}
 	}
@@ -377,8 +401,9 @@ int main(int argc, const char **argv, const char **envp)
 	(void)envp;
 	
 	//Open the back of the pseudoterminal for our side of communications
+	//We poll it alongside the console, so don't let reads wait on it.
 	char *pty_name_buf = "/dev/pty";
-	pty_fd = open("/dev/pty", O_RDWR);
+	pty_fd = open("/dev/pty", O_RDWR | O_NONBLOCK);
 	if(pty_fd < 0)
 	{
 		perror("open /dev/pty");
@@ -392,6 +417,14 @@ int main(int argc, const char **argv, const char **envp)
 		abort();
 	}
 	
+	//Keyboard input is written to its own descriptor that does wait, so none of it is lost when the pseudoterminal is full.
+	pty_wfd = dup(pty_fd);
+	if(pty_wfd < 0 || fcntl(pty_wfd, F_SETFL, 0) < 0)
+	{
+		perror("dup /dev/pty");
+		abort();
+	}
+	
 	//Make sure we can open the front of the pseudoterminal, to hand it over to the shell
 	tty_fd = open("/dev/tty", O_RDWR);
 	if(tty_fd < 0)
@@ -474,6 +507,7 @@ int main(int argc, const char **argv, const char **envp)
 	{
 		//Child process
 		close(pty_fd);
+		close(pty_wfd);
 		dup2(tty_fd, STDIN_FILENO);
 		dup2(tty_fd, STDOUT_FILENO);
 		dup2(tty_fd, STDERR_FILENO);
@@ -551,7 +585,13 @@ int main(int argc, const char **argv, const char **envp)
 			abort();
 		}
 		
-		//Wait if nothing happened
-		_sc_pause();
+		//Wait until the shell or the console has something for us.
+		//If the shell dies, SIGCHLD interrupts this, and we go around to reap it.
+		_sc_poll_t waitfor[2] = 
+		{
+			{ .fd = pty_fd, .events = _SC_POLL_IN },
+			{ .fd = _SC_POLL_CON, .events = _SC_POLL_IN },
+		};
+		_sc_poll(waitfor, 2, -1);
 	}
 }
\ No newline at end of file